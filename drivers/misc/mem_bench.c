@@ -0,0 +1,653 @@
+/* drivers/misc/mem_bench.c
+ *
+ * Microbenchmark and stress test for the pmem allocators and ashmem
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Writing to a file in /sys/kernel/debug/mem-bench/ runs its test in the
+ * context of the writing process, reading it returns the report of the
+ * last run:
+ *
+ *   pmem    for each pmem allocator type, latency percentiles of the
+ *           allocate, mmap, munmap and free steps of a buffer, then a
+ *           random allocate/free stress pass that samples the free space
+ *           and fragmentation of the region every sample_interval ops.
+ *   ashmem  latency percentiles of pin and unpin for several patterns.
+ *
+ * The pmem tests run against simulated carve-outs, physically contiguous
+ * pages handed to pmem_setup() on the first run. pmem devices can not be
+ * unregistered, so they stay around until reboot. The devices are opened
+ * through /dev, which devtmpfs or ueventd has to populate, as is the case
+ * in a QEMU guest booted with devtmpfs mounted.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/android_pmem.h>
+#include <linux/ashmem.h>
+#include <asm/io.h>
+
+#define DEFAULT_ITERATIONS 1000
+#define REPORT_SIZE (4 * PAGE_SIZE)
+
+/* buffers kept allocated at once by the pmem stress pass */
+#define PMEM_STRESS_MAX_LIVE 64
+
+static int iterations = DEFAULT_ITERATIONS;
+static int carveout_kb = 4096;
+static int stress_ops = 10000;
+static int sample_interval = 1000;
+static int ashmem_pages = 256;
+
+module_param(iterations, int, 0644);
+MODULE_PARM_DESC(iterations, " Operations timed per test, default is 1000");
+module_param(carveout_kb, int, 0444);
+MODULE_PARM_DESC(carveout_kb, " Size of each simulated pmem carve-out in KB, "\
+				"default is 4096");
+module_param(stress_ops, int, 0644);
+MODULE_PARM_DESC(stress_ops, " Allocations and frees of the pmem stress "\
+				"pass, default is 10000");
+module_param(sample_interval, int, 0644);
+MODULE_PARM_DESC(sample_interval, " Stress ops between fragmentation "\
+				"samples, default is 1000");
+module_param(ashmem_pages, int, 0644);
+MODULE_PARM_DESC(ashmem_pages, " Size of the ashmem area in pages, "\
+				"default is 256");
+
+/* serializes runs and protects the report */
+static DEFINE_MUTEX(bench_mutex);
+static char *report;
+static int report_len;
+
+static void report_printf(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static void report_printf(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	report_len += vscnprintf(report + report_len, REPORT_SIZE - report_len,
+				 fmt, args);
+	va_end(args);
+}
+
+struct bench_samples {
+	u64 *ns;
+	int nr;
+	int max;
+};
+
+static int samples_init(struct bench_samples *s, int max)
+{
+	s->ns = vmalloc(max * sizeof(*s->ns));
+	s->nr = 0;
+	s->max = max;
+	return s->ns ? 0 : -ENOMEM;
+}
+
+static void samples_free(struct bench_samples *s)
+{
+	vfree(s->ns);
+}
+
+static inline void samples_add(struct bench_samples *s, ktime_t start,
+			       ktime_t end)
+{
+	if (s->nr < s->max)
+		s->ns[s->nr++] = ktime_to_ns(ktime_sub(end, start));
+}
+
+static int samples_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+#define PERCENTILE(s, p) ((unsigned long long)(s)->ns[((s)->nr - 1) * (p) / 100])
+
+static void samples_report_header(void)
+{
+	report_printf("%-16s %8s %10s %10s %10s %10s\n",
+		      "op", "count", "p50(ns)", "p90(ns)", "p99(ns)", "max(ns)");
+}
+
+static void samples_report(const char *name, struct bench_samples *s)
+{
+	if (!s->nr) {
+		report_printf("%-16s %8d\n", name, 0);
+		return;
+	}
+
+	sort(s->ns, s->nr, sizeof(*s->ns), samples_cmp, NULL);
+	report_printf("%-16s %8d %10llu %10llu %10llu %10llu\n", name, s->nr,
+		      PERCENTILE(s, 50), PERCENTILE(s, 90), PERCENTILE(s, 99),
+		      PERCENTILE(s, 100));
+}
+
+/* pmem and ashmem ioctls take user pointers, ours are kernel ones */
+static long bench_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	mm_segment_t old_fs = get_fs();
+	long ret;
+
+	set_fs(KERNEL_DS);
+	ret = file->f_op->unlocked_ioctl(file, cmd, arg);
+	set_fs(old_fs);
+
+	return ret;
+}
+
+static unsigned long bench_mmap(struct file *file, unsigned long len)
+{
+	unsigned long addr;
+
+	down_write(&current->mm->mmap_sem);
+	addr = do_mmap(file, 0, len, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+	up_write(&current->mm->mmap_sem);
+
+	return addr;
+}
+
+static void bench_munmap(unsigned long addr, unsigned long len)
+{
+	down_write(&current->mm->mmap_sem);
+	do_munmap(current->mm, addr, len);
+	up_write(&current->mm->mmap_sem);
+}
+
+#ifdef CONFIG_ANDROID_PMEM
+
+struct pmem_bench_region {
+	const char *name;		/* at most PMEM_NAME_SIZE - 1 chars */
+	enum pmem_allocator_type type;
+	void *carveout;
+	int ready;
+	int failed;		/* pmem_setup() failed, don't retry */
+};
+
+static struct pmem_bench_region pmem_regions[] = {
+	{ "pmbench_bitmap", PMEM_ALLOCATORTYPE_BITMAP },
+	{ "pmbench_buddy", PMEM_ALLOCATORTYPE_BUDDYBESTFIT },
+	{ "pmbench_aon", PMEM_ALLOCATORTYPE_ALLORNOTHING },
+	{ "pmbench_region", PMEM_ALLOCATORTYPE_REGION },
+	{ "pmbench_system", PMEM_ALLOCATORTYPE_SYSTEM },
+};
+
+/* buffer sizes of the stress pass, in 1/64ths of the carve-out */
+static const int pmem_stress_sizes[] = { 1, 1, 2, 2, 4, 6, 8, 12 };
+
+static unsigned long pmem_carveout_size(void)
+{
+	unsigned long size = PAGE_ALIGN((unsigned long)carveout_kb << 10);
+
+	/* alloc_pages_exact() is limited to the largest buddy order */
+	return clamp_t(unsigned long, size, 64 * PAGE_SIZE,
+		       PAGE_SIZE << (MAX_ORDER - 1));
+}
+
+static int pmem_bench_setup(struct pmem_bench_region *r)
+{
+	struct android_pmem_platform_data pdata = {
+		.name = r->name,
+		.allocator_type = r->type,
+		.size = pmem_carveout_size(),
+		.cached = 1,
+	};
+
+	if (r->ready)
+		return 0;
+	/* every pmem_setup() call uses up one of the PMEM_MAX_DEVICES ids */
+	if (r->failed)
+		return -ENODEV;
+
+	/* the system allocator uses kmalloc(), size is only its quota */
+	if (r->type != PMEM_ALLOCATORTYPE_SYSTEM) {
+		r->carveout = alloc_pages_exact(pdata.size,
+						GFP_KERNEL | __GFP_NOWARN);
+		if (!r->carveout)
+			return -ENOMEM;
+		pdata.start = virt_to_phys(r->carveout);
+	}
+
+	if (pmem_setup(&pdata, NULL, NULL)) {
+		if (r->carveout)
+			free_pages_exact(r->carveout, pdata.size);
+		r->carveout = NULL;
+		r->failed = 1;
+		return -ENODEV;
+	}
+
+	r->ready = 1;
+	return 0;
+}
+
+static struct file *pmem_bench_open(struct pmem_bench_region *r)
+{
+	char path[32];
+
+	snprintf(path, sizeof(path), "/dev/%s", r->name);
+	return filp_open(path, O_RDWR, 0);
+}
+
+static void pmem_bench_latency(struct pmem_bench_region *r,
+			       unsigned long len)
+{
+	struct bench_samples alloc = {}, map = {}, unmap = {}, free = {};
+	ktime_t t0, t1, t2, t3, t4;
+	struct file *file;
+	unsigned long addr;
+	int i, failures = 0;
+
+	if (samples_init(&alloc, iterations) ||
+	    samples_init(&map, iterations) ||
+	    samples_init(&unmap, iterations) ||
+	    samples_init(&free, iterations)) {
+		report_printf("out of memory for samples\n");
+		goto out;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		t0 = ktime_get();
+		file = pmem_bench_open(r);
+		if (IS_ERR(file)) {
+			report_printf("can't open /dev/%s: %ld\n",
+				      r->name, PTR_ERR(file));
+			goto out;
+		}
+		if (bench_ioctl(file, PMEM_ALLOCATE, len) < 0) {
+			filp_close(file, NULL);
+			failures++;
+			continue;
+		}
+		t1 = ktime_get();
+		addr = bench_mmap(file, len);
+		t2 = ktime_get();
+		if (IS_ERR_VALUE(addr)) {
+			filp_close(file, NULL);
+			failures++;
+			continue;
+		}
+		bench_munmap(addr, len);
+		t3 = ktime_get();
+		/* the buffer is freed on the last close */
+		filp_close(file, NULL);
+		t4 = ktime_get();
+
+		samples_add(&alloc, t0, t1);
+		samples_add(&map, t1, t2);
+		samples_add(&unmap, t2, t3);
+		samples_add(&free, t3, t4);
+	}
+
+	report_printf("latency, %lu KB buffers, %d failures\n",
+		      len >> 10, failures);
+	samples_report_header();
+	samples_report("allocate", &alloc);
+	samples_report("mmap", &map);
+	samples_report("munmap", &unmap);
+	samples_report("free", &free);
+out:
+	samples_free(&alloc);
+	samples_free(&map);
+	samples_free(&unmap);
+	samples_free(&free);
+}
+
+static void pmem_bench_stress(struct pmem_bench_region *r)
+{
+	unsigned long unit = pmem_carveout_size() / 64, len, frag;
+	struct file *live[PMEM_STRESS_MAX_LIVE], *probe, *file;
+	int i, op, nr_live = 0, failures = 0;
+	struct pmem_freespace fs;
+
+	/* a file without an allocation, to ask for the free space */
+	probe = pmem_bench_open(r);
+	if (IS_ERR(probe))
+		return;
+
+	report_printf("stress, %d ops\n%8s %6s %10s %10s %5s %8s\n",
+		      stress_ops, "ops", "live", "free", "largest", "frag",
+		      "failures");
+
+	for (op = 1; op <= stress_ops; op++) {
+		if (nr_live && (nr_live == PMEM_STRESS_MAX_LIVE ||
+				random32() & 1)) {
+			i = random32() % nr_live;
+			filp_close(live[i], NULL);
+			live[i] = live[--nr_live];
+		} else {
+			i = random32() % ARRAY_SIZE(pmem_stress_sizes);
+			len = PAGE_ALIGN(unit * pmem_stress_sizes[i]);
+			file = pmem_bench_open(r);
+			if (IS_ERR(file))
+				break;
+			if (bench_ioctl(file, PMEM_ALLOCATE, len) < 0) {
+				filp_close(file, NULL);
+				failures++;
+			} else {
+				live[nr_live++] = file;
+			}
+		}
+
+		if (sample_interval > 0 && !(op % sample_interval)) {
+			if (bench_ioctl(probe, PMEM_GET_FREE_SPACE,
+					(unsigned long)&fs))
+				continue;
+			/* share of the free space outside the largest hole */
+			frag = fs.total ? 100 - fs.largest * 100 / fs.total : 0;
+			report_printf("%8d %6d %10lu %10lu %4lu%% %8d\n",
+				      op, nr_live, fs.total, fs.largest, frag,
+				      failures);
+		}
+	}
+
+	while (nr_live)
+		filp_close(live[--nr_live], NULL);
+	filp_close(probe, NULL);
+}
+
+static void pmem_bench_run(void)
+{
+	struct pmem_bench_region *r;
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(pmem_regions); i++) {
+		r = &pmem_regions[i];
+
+		report_printf("== %s, %lu KB\n", r->name,
+			      pmem_carveout_size() >> 10);
+		ret = pmem_bench_setup(r);
+		if (ret) {
+			report_printf("setup failed: %d\n\n", ret);
+			continue;
+		}
+
+		/* a typical preview buffer, all of it for all or nothing */
+		pmem_bench_latency(r, r->type == PMEM_ALLOCATORTYPE_ALLORNOTHING ?
+				   pmem_carveout_size() :
+				   PAGE_ALIGN(pmem_carveout_size() / 16));
+		pmem_bench_stress(r);
+		report_printf("\n");
+	}
+}
+
+#else
+
+static void pmem_bench_run(void)
+{
+	report_printf("pmem is not enabled\n");
+}
+
+#endif /* CONFIG_ANDROID_PMEM */
+
+#ifdef CONFIG_ASHMEM
+
+static long ashmem_bench_pin(struct file *file, unsigned int cmd,
+			     size_t pgstart, size_t npages)
+{
+	struct ashmem_pin pin = {
+		.offset = pgstart * PAGE_SIZE,
+		.len = npages * PAGE_SIZE,
+	};
+
+	return bench_ioctl(file, cmd, (unsigned long)&pin);
+}
+
+/* times one pin or unpin, counting the pins that found pages purged */
+static void ashmem_bench_op(struct file *file, unsigned int cmd,
+			    size_t pgstart, size_t npages,
+			    struct bench_samples *s, int *purged)
+{
+	ktime_t start = ktime_get();
+	long ret = ashmem_bench_pin(file, cmd, pgstart, npages);
+
+	samples_add(s, start, ktime_get());
+	if (ret == ASHMEM_WAS_PURGED)
+		(*purged)++;
+}
+
+enum ashmem_pattern {
+	ASHMEM_SEQUENTIAL,	/* page by page, unpin all then pin all */
+	ASHMEM_RANDOM,		/* random ranges of up to 16 pages */
+	ASHMEM_HOLES,		/* every other page, then pin it all back */
+	ASHMEM_PURGED,		/* unpin all, purge, pin all back */
+};
+
+static const char * const ashmem_pattern_names[] = {
+	"sequential", "random", "holes", "purged",
+};
+
+static void ashmem_bench_pattern(struct file *file, unsigned long addr,
+				 size_t pages, enum ashmem_pattern pattern)
+{
+	struct bench_samples pin = {}, unpin = {};
+	int i, n, purged = 0;
+	size_t start, len;
+
+	if (samples_init(&pin, iterations) ||
+	    samples_init(&unpin, iterations)) {
+		report_printf("out of memory for samples\n");
+		goto out;
+	}
+
+	switch (pattern) {
+	case ASHMEM_SEQUENTIAL:
+		for (n = 0; n < iterations; n += pages) {
+			for (i = 0; i < pages; i++)
+				ashmem_bench_op(file, ASHMEM_UNPIN, i, 1,
+						&unpin, &purged);
+			for (i = 0; i < pages; i++)
+				ashmem_bench_op(file, ASHMEM_PIN, i, 1,
+						&pin, &purged);
+		}
+		break;
+	case ASHMEM_RANDOM:
+		for (n = 0; n < iterations; n++) {
+			len = 1 + random32() % min_t(size_t, pages, 16);
+			start = random32() % (pages - len + 1);
+			ashmem_bench_op(file, ASHMEM_UNPIN, start, len,
+					&unpin, &purged);
+			ashmem_bench_op(file, ASHMEM_PIN, start, len,
+					&pin, &purged);
+		}
+		break;
+	case ASHMEM_HOLES:
+		for (n = 0; n < iterations; n++) {
+			for (i = 0; i < pages; i += 2)
+				ashmem_bench_op(file, ASHMEM_UNPIN, i, 1,
+						&unpin, &purged);
+			ashmem_bench_op(file, ASHMEM_PIN, 0, pages,
+					&pin, &purged);
+		}
+		break;
+	case ASHMEM_PURGED:
+		/* purging drops every unpinned ashmem page in the system */
+		if (!capable(CAP_SYS_ADMIN)) {
+			report_printf("%s needs CAP_SYS_ADMIN\n",
+				      ashmem_pattern_names[pattern]);
+			goto out;
+		}
+		for (n = 0; n < max(iterations / 64, 1); n++) {
+			if (clear_user((void __user *)addr, pages * PAGE_SIZE))
+				break;
+			ashmem_bench_op(file, ASHMEM_UNPIN, 0, pages,
+					&unpin, &purged);
+			bench_ioctl(file, ASHMEM_PURGE_ALL_CACHES, 0);
+			ashmem_bench_op(file, ASHMEM_PIN, 0, pages,
+					&pin, &purged);
+		}
+		break;
+	}
+
+	report_printf("%s, %d of %d pins found pages purged\n",
+		      ashmem_pattern_names[pattern], purged, pin.nr);
+	samples_report_header();
+	samples_report("unpin", &unpin);
+	samples_report("pin", &pin);
+	report_printf("\n");
+out:
+	samples_free(&pin);
+	samples_free(&unpin);
+}
+
+static void ashmem_bench_run(void)
+{
+	size_t pages = max(ashmem_pages, 2);
+	unsigned long addr;
+	struct file *file;
+	long ret;
+	int i;
+
+	file = filp_open("/dev/ashmem", O_RDWR, 0);
+	if (IS_ERR(file)) {
+		report_printf("can't open /dev/ashmem: %ld\n", PTR_ERR(file));
+		return;
+	}
+
+	report_printf("== ashmem, %zu pages\n", pages);
+
+	/* the backing shmem file is only created on mmap */
+	ret = bench_ioctl(file, ASHMEM_SET_SIZE, pages * PAGE_SIZE);
+	if (ret < 0) {
+		report_printf("can't set the ashmem size: %ld\n", ret);
+		goto out;
+	}
+	addr = bench_mmap(file, pages * PAGE_SIZE);
+	if (IS_ERR_VALUE(addr)) {
+		report_printf("can't mmap ashmem: %ld\n", (long)addr);
+		goto out;
+	}
+
+	/* populate the area so the unpinned pages have something to drop */
+	if (clear_user((void __user *)addr, pages * PAGE_SIZE))
+		report_printf("can't populate ashmem\n");
+
+	for (i = ASHMEM_SEQUENTIAL; i <= ASHMEM_PURGED; i++)
+		ashmem_bench_pattern(file, addr, pages, i);
+
+	bench_munmap(addr, pages * PAGE_SIZE);
+out:
+	filp_close(file, NULL);
+}
+
+#else
+
+static void ashmem_bench_run(void)
+{
+	report_printf("ashmem is not enabled\n");
+}
+
+#endif /* CONFIG_ASHMEM */
+
+/* Reading any of our files returns the report of the last run */
+static ssize_t bench_debugfs_read(struct file *f, char __user *user_buf,
+		size_t count, loff_t *off)
+{
+	ssize_t ret;
+
+	mutex_lock(&bench_mutex);
+	ret = simple_read_from_buffer(user_buf, count, off, report, report_len);
+	mutex_unlock(&bench_mutex);
+
+	return ret;
+}
+
+static ssize_t do_bench(void (*run)(void), size_t count)
+{
+	if (iterations <= 0)
+		return -EINVAL;
+
+	mutex_lock(&bench_mutex);
+	report_len = 0;
+	run();
+	mutex_unlock(&bench_mutex);
+
+	return count;
+}
+
+static ssize_t pmem_bench_write(struct file *f, const char __user *buf,
+		size_t count, loff_t *off)
+{
+	return do_bench(pmem_bench_run, count);
+}
+
+static ssize_t ashmem_bench_write(struct file *f, const char __user *buf,
+		size_t count, loff_t *off)
+{
+	return do_bench(ashmem_bench_run, count);
+}
+
+struct bench_entry {
+	char *name;
+	const struct file_operations fops;
+};
+
+static const struct bench_entry bench_entries[] = {
+	{"pmem", {.read = bench_debugfs_read,
+		  .write = pmem_bench_write} },
+	{"ashmem", {.read = bench_debugfs_read,
+		    .write = ashmem_bench_write} },
+};
+
+static struct dentry *bench_debugfs_root;
+
+static int __init mem_bench_init(void)
+{
+	int i;
+
+	report = kzalloc(REPORT_SIZE, GFP_KERNEL);
+	if (!report)
+		return -ENOMEM;
+
+	bench_debugfs_root = debugfs_create_dir("mem-bench", NULL);
+	if (!bench_debugfs_root) {
+		printk(KERN_ERR "mem_bench: creating root dir failed\n");
+		goto out_err;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(bench_entries); i++) {
+		const struct bench_entry *cur = &bench_entries[i];
+
+		if (!debugfs_create_file(cur->name, 0600, bench_debugfs_root,
+					 NULL, &cur->fops)) {
+			printk(KERN_ERR "mem_bench: could not create %s\n",
+			       cur->name);
+			goto out_remove;
+		}
+	}
+
+	return 0;
+
+out_remove:
+	debugfs_remove_recursive(bench_debugfs_root);
+out_err:
+	kfree(report);
+	return -ENODEV;
+}
+
+module_init(mem_bench_init);
+
+MODULE_LICENSE("GPL");
@@ -24,6 +24,7 @@
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/kobject.h>
+#include <linux/rbtree.h>
 #ifdef CONFIG_MEMORY_HOTPLUG
 #include <linux/memory.h>
 #include <linux/memory_hotplug.h>
@@ -70,6 +71,14 @@
  */
 #define PMEM_FLAGS_SUBMAP 0x1 << 3
 #define PMEM_FLAGS_UNSUBMAP 0x1 << 4
+/* indicates the physical address of the allocation was handed out or that
+ * other files are connected to it, so it can not be moved by defrag */
+#define PMEM_FLAGS_EXPOSED 0x1 << 5
+
+/* an allocation with none of these flags can be moved by defrag */
+#define PMEM_FLAGS_NOMOVE_MASK (PMEM_FLAGS_BUSY | PMEM_FLAGS_CONNECTED | \
+	PMEM_FLAGS_MASTERMAP | PMEM_FLAGS_SUBMAP | PMEM_FLAGS_UNSUBMAP | \
+	PMEM_FLAGS_EXPOSED)
 
 struct pmem_data {
 	/* in alloc mode: an index into the bitmap
@@ -110,6 +119,19 @@ struct pmem_region_node {
 	struct list_head list;
 };
 
+/* a run of quanta in the region allocator, free or allocated */
+struct pmem_extent {
+	/* in the free_by_addr tree if free, in the allocated tree if not */
+	struct rb_node addr_node;
+	/* in the free_by_size tree, free extents only */
+	struct rb_node size_node;
+	/* first quantum, counted from the start of the pmem space */
+	unsigned long start;
+	unsigned long quanta;
+	/* alignment the allocation was made with, kept by defrag */
+	unsigned int align;
+};
+
 #define PMEM_DEBUG_MSGS 0
 #if PMEM_DEBUG_MSGS
 #define DLOG(fmt,args...) \
@@ -179,6 +201,7 @@ struct pmem_info {
 	unsigned long (*len)(int, struct pmem_data *);
 	unsigned long (*start_addr)(int, struct pmem_data *);
 	int (*kapi_free_index)(const int32_t, int);
+	int (*defrag)(int);
 
 	/* actual size of memory element, e.g.: (4 << 10) is 4K */
 	unsigned int quantum;
@@ -218,6 +241,20 @@ struct pmem_info {
 			unsigned long used;      /* Bytes currently allocated */
 			struct list_head alist;  /* List of allocations       */
 		} system_mem;
+
+		struct {
+			/* free extents sorted by start, used to coalesce,
+			 * and by size then start, used for the best fit */
+			struct rb_root free_by_addr;
+			struct rb_root free_by_size;
+			/* allocated extents sorted by start */
+			struct rb_root allocated;
+			unsigned long free_quanta;
+			unsigned int free_extents;
+			unsigned int allocations;
+			unsigned long failed_allocs;
+			unsigned long defrag_moves;
+		} region;
 	} allocator;
 
 	int id;
@@ -282,6 +319,7 @@ static struct kset *pmem_kset;
 	(PMEM_OFFSET(id, index) + pmem[id].vbase)
 #define PMEM_END_VADDR(id, index) \
 	(PMEM_START_VADDR(id, index) + PMEM_LEN(id, index))
+#define PMEM_REGION(id) (pmem[id].allocator.region)
 #define PMEM_REVOKED(data) (data->flags & PMEM_FLAGS_REVOKED)
 #define PMEM_IS_PAGE_ALIGNED(addr) (!((addr) & (~PAGE_MASK)))
 #define PMEM_IS_SUBMAP(data) \
@@ -370,6 +408,8 @@ static ssize_t show_pmem_allocator_type(int id, char *buf)
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "Bitmap");
 	case PMEM_ALLOCATORTYPE_SYSTEM:
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "System heap");
+	case PMEM_ALLOCATORTYPE_REGION:
+		return scnprintf(buf, PAGE_SIZE, "%s\n", "Region");
 	default:
 		return scnprintf(buf, PAGE_SIZE,
 			"??? Invalid allocator type (%d) for this region! "
@@ -550,6 +590,137 @@ static struct attribute *pmem_system_attrs[] = {
 	NULL
 };
 
+static ssize_t show_pmem_free_bytes(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "%lu\n",
+		PMEM_REGION(id).free_quanta * pmem[id].quantum);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(free_bytes);
+
+static unsigned long region_largest_free(int id);
+
+static ssize_t show_pmem_largest_free_bytes(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "%lu\n",
+		region_largest_free(id) * pmem[id].quantum);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(largest_free_bytes);
+
+static ssize_t show_pmem_free_extents(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "%u\n", PMEM_REGION(id).free_extents);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(free_extents);
+
+static ssize_t show_pmem_allocations(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "%u\n", PMEM_REGION(id).allocations);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(allocations);
+
+static ssize_t show_pmem_failed_allocations(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "%lu\n",
+		PMEM_REGION(id).failed_allocs);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(failed_allocations);
+
+/* percentage of the free space that is not in the largest free extent */
+static ssize_t show_pmem_fragmentation(int id, char *buf)
+{
+	unsigned long total, largest;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	total = PMEM_REGION(id).free_quanta;
+	largest = region_largest_free(id);
+	mutex_unlock(&pmem[id].arena_mutex);
+
+	return scnprintf(buf, PAGE_SIZE, "%lu\n",
+		total ? 100 - largest * 100 / total : 0);
+}
+RO_PMEM_ATTR(fragmentation);
+
+static ssize_t show_pmem_defrag(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "%lu\n",
+		PMEM_REGION(id).defrag_moves);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+
+/* writing anything moves idle allocations to close the holes */
+static ssize_t store_pmem_defrag(int id, const char *buf, size_t count)
+{
+	pmem[id].defrag(id);
+	return count;
+}
+RW_PMEM_ATTR(defrag);
+
+static ssize_t show_pmem_free_extents_dump(int id, char *buf)
+{
+	struct rb_node *node;
+	int ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "index\tlength\n");
+	for (node = rb_first(&PMEM_REGION(id).free_by_addr);
+			node && (PAGE_SIZE - ret); node = rb_next(node)) {
+		struct pmem_extent *ext =
+			rb_entry(node, struct pmem_extent, addr_node);
+
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret, "%lu\t%lu\n",
+			ext->start, ext->quanta * pmem[id].quantum);
+	}
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(free_extents_dump);
+
+static struct attribute *pmem_region_attrs[] = {
+	PMEM_COMMON_SYSFS_ATTRS,
+
+	PMEM_BITMAP_BUDDY_BESTFIT_COMMON_SYSFS_ATTRS,
+
+	&pmem_attr_free_bytes.attr,
+	&pmem_attr_largest_free_bytes.attr,
+	&pmem_attr_free_extents.attr,
+	&pmem_attr_allocations.attr,
+	&pmem_attr_failed_allocations.attr,
+	&pmem_attr_fragmentation.attr,
+	&pmem_attr_defrag.attr,
+	&pmem_attr_free_extents_dump.attr,
+
+	NULL
+};
+
 static struct kobj_type pmem_bitmap_ktype = {
 	.sysfs_ops = &pmem_ops,
 	.default_attrs = pmem_bitmap_attrs,
@@ -560,6 +731,11 @@ static struct kobj_type pmem_system_ktype = {
 	.default_attrs = pmem_system_attrs,
 };
 
+static struct kobj_type pmem_region_ktype = {
+	.sysfs_ops = &pmem_ops,
+	.default_attrs = pmem_region_attrs,
+};
+
 static int get_id(struct file *file)
 {
 	return MINOR(file->f_dentry->d_inode->i_rdev);
@@ -837,6 +1013,163 @@ static int pmem_free_space_system(int id, struct pmem_freespace *fs)
 	return 0;
 }
 
+static void region_insert_addr(struct rb_root *root, struct pmem_extent *ext)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct pmem_extent *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct pmem_extent, addr_node);
+		if (ext->start < entry->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&ext->addr_node, parent, p);
+	rb_insert_color(&ext->addr_node, root);
+}
+
+static struct pmem_extent *region_find(struct rb_root *root,
+		unsigned long start)
+{
+	struct rb_node *node = root->rb_node;
+	struct pmem_extent *ext;
+
+	while (node) {
+		ext = rb_entry(node, struct pmem_extent, addr_node);
+		if (start < ext->start)
+			node = node->rb_left;
+		else if (start > ext->start)
+			node = node->rb_right;
+		else
+			return ext;
+	}
+	return NULL;
+}
+
+/* returns the free extent closest to 'start', before it or after it */
+static struct pmem_extent *region_free_neighbour(int id,
+		unsigned long start, int after)
+{
+	struct rb_node *node = PMEM_REGION(id).free_by_addr.rb_node;
+	struct pmem_extent *ext, *found = NULL;
+
+	while (node) {
+		ext = rb_entry(node, struct pmem_extent, addr_node);
+		if (after ? ext->start > start : ext->start >= start) {
+			if (after)
+				found = ext;
+			node = node->rb_left;
+		} else {
+			if (!after)
+				found = ext;
+			node = node->rb_right;
+		}
+	}
+	return found;
+}
+
+static void region_free_insert(int id, struct pmem_extent *ext)
+{
+	struct rb_node **p = &PMEM_REGION(id).free_by_size.rb_node;
+	struct rb_node *parent = NULL;
+	struct pmem_extent *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct pmem_extent, size_node);
+		if (ext->quanta < entry->quanta ||
+				(ext->quanta == entry->quanta &&
+				 ext->start < entry->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&ext->size_node, parent, p);
+	rb_insert_color(&ext->size_node, &PMEM_REGION(id).free_by_size);
+	region_insert_addr(&PMEM_REGION(id).free_by_addr, ext);
+
+	PMEM_REGION(id).free_quanta += ext->quanta;
+	PMEM_REGION(id).free_extents++;
+}
+
+static void region_free_erase(int id, struct pmem_extent *ext)
+{
+	rb_erase(&ext->size_node, &PMEM_REGION(id).free_by_size);
+	rb_erase(&ext->addr_node, &PMEM_REGION(id).free_by_addr);
+
+	PMEM_REGION(id).free_quanta -= ext->quanta;
+	PMEM_REGION(id).free_extents--;
+}
+
+static unsigned long region_largest_free(int id)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct rb_node *node = rb_last(&PMEM_REGION(id).free_by_size);
+
+	return node ? rb_entry(node, struct pmem_extent, size_node)->quanta
+		: 0;
+}
+
+/* returns 'ext' to the free trees, merging it with its free neighbours */
+static void region_release(int id, struct pmem_extent *ext)
+{
+	struct pmem_extent *prev, *next;
+
+	prev = region_free_neighbour(id, ext->start, 0);
+	if (prev && prev->start + prev->quanta == ext->start) {
+		region_free_erase(id, prev);
+		prev->quanta += ext->quanta;
+		kfree(ext);
+		ext = prev;
+	}
+
+	next = region_free_neighbour(id, ext->start, 1);
+	if (next && ext->start + ext->quanta == next->start) {
+		region_free_erase(id, next);
+		ext->quanta += next->quanta;
+		kfree(next);
+	}
+
+	region_free_insert(id, ext);
+}
+
+static int pmem_free_region(int id, int index)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct pmem_extent *ext;
+	char currtask_name[FIELD_SIZEOF(struct task_struct, comm) + 1];
+
+	DLOG("index %d\n", index);
+
+	ext = region_find(&PMEM_REGION(id).allocated, index);
+	if (!ext) {
+		printk(KERN_ALERT "pmem: %s: Attempt to free unallocated "
+			"index %d, id %d, pid %d(%s)\n", __func__, index, id,
+			current->pid, get_task_comm(currtask_name, current));
+		return -1;
+	}
+
+	rb_erase(&ext->addr_node, &PMEM_REGION(id).allocated);
+	PMEM_REGION(id).allocations--;
+	region_release(id, ext);
+
+	return 0;
+}
+
+static int pmem_free_space_region(int id, struct pmem_freespace *fs)
+{
+	/* caller should hold the lock on arena_mutex! */
+	fs->total = PMEM_REGION(id).free_quanta * pmem[id].quantum;
+	fs->largest = region_largest_free(id) * pmem[id].quantum;
+
+	return 0;
+}
+
 static void pmem_revoke(struct file *file, struct pmem_data *data);
 
 static int pmem_release(struct inode *inode, struct file *file)
@@ -1332,6 +1665,133 @@ static int pmem_allocator_system(const int id,
 	return (int)list;
 }
 
+/* first quantum at or after 'start' whose address is aligned to 'align' */
+static inline unsigned long region_align(const int id, unsigned long start,
+		const unsigned int align)
+{
+	unsigned long paddr = pmem[id].base + start * pmem[id].quantum;
+
+	return start + (ALIGN(paddr, align) - paddr) / pmem[id].quantum;
+}
+
+/*
+ * region_best_fit - returns the smallest free extent, lowest first among
+ * equals, holding 'quanta' quanta aligned to 'align', and sets 'startp'
+ * to where the allocation goes in it. The descent of the size tree is
+ * all it takes unless the alignment is larger than the quantum.
+ */
+static struct pmem_extent *region_best_fit(const int id,
+		const unsigned long quanta, const unsigned int align,
+		unsigned long *startp)
+{
+	struct rb_node *node = PMEM_REGION(id).free_by_size.rb_node;
+	struct pmem_extent *ext, *found = NULL;
+	unsigned long start;
+
+	while (node) {
+		ext = rb_entry(node, struct pmem_extent, size_node);
+		if (ext->quanta < quanta) {
+			node = node->rb_right;
+		} else {
+			found = ext;
+			node = node->rb_left;
+		}
+	}
+
+	for (node = found ? &found->size_node : NULL; node;
+			node = rb_next(node)) {
+		ext = rb_entry(node, struct pmem_extent, size_node);
+		start = region_align(id, ext->start, align);
+		if (start + quanta <= ext->start + ext->quanta) {
+			*startp = start;
+			return ext;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * region_carve - allocates quanta [start, start + quanta) out of free
+ * extent 'ext'. What is left of 'ext' before and after the allocation
+ * goes back to the free trees, using 'spare' for the part after it.
+ * Returns the allocated extent, which is 'ext' or 'alloc'; the extents
+ * that end up unused are freed.
+ */
+static struct pmem_extent *region_carve(const int id,
+		struct pmem_extent *ext, unsigned long start,
+		unsigned long quanta, unsigned int align,
+		struct pmem_extent *alloc, struct pmem_extent *spare)
+{
+	unsigned long end = ext->start + ext->quanta;
+
+	region_free_erase(id, ext);
+
+	if (end > start + quanta) {
+		spare->start = start + quanta;
+		spare->quanta = end - spare->start;
+		region_free_insert(id, spare);
+		spare = NULL;
+	}
+
+	if (start > ext->start) {
+		ext->quanta = start - ext->start;
+		region_free_insert(id, ext);
+	} else {
+		kfree(alloc);
+		alloc = ext;
+	}
+	kfree(spare);
+
+	alloc->start = start;
+	alloc->quanta = quanta;
+	alloc->align = align;
+	region_insert_addr(&PMEM_REGION(id).allocated, alloc);
+	PMEM_REGION(id).allocations++;
+
+	return alloc;
+}
+
+static int pmem_allocator_region(const int id,
+		const unsigned long len,
+		const unsigned int align)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct pmem_extent *ext, *alloc, *spare;
+	unsigned long quanta, start;
+
+	DLOG("region id %d, len %ld, align %u\n", id, len, align);
+
+	quanta = (len + pmem[id].quantum - 1) / pmem[id].quantum;
+	if (!quanta || quanta > PMEM_REGION(id).free_quanta)
+		goto fail;
+
+	ext = region_best_fit(id, quanta, align, &start);
+	if (!ext) {
+#if PMEM_DEBUG
+		printk(KERN_ALERT "pmem: %s: no free extent of %lu quanta "
+			"aligned to %u, %lu quanta free in %u extents\n",
+			__func__, quanta, align, PMEM_REGION(id).free_quanta,
+			PMEM_REGION(id).free_extents);
+#endif
+		goto fail;
+	}
+
+	alloc = kmalloc(sizeof(*alloc), GFP_KERNEL);
+	spare = kmalloc(sizeof(*spare), GFP_KERNEL);
+	if (!alloc || !spare) {
+		kfree(alloc);
+		kfree(spare);
+		goto fail;
+	}
+
+	ext = region_carve(id, ext, start, quanta, align, alloc, spare);
+	return ext->start;
+
+fail:
+	PMEM_REGION(id).failed_allocs++;
+	return -1;
+}
+
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
@@ -1423,6 +1883,25 @@ static unsigned long pmem_len_system(int id, struct pmem_data *data)
 	return ret;
 }
 
+static unsigned long pmem_start_addr_region(int id, struct pmem_data *data)
+{
+	return pmem[id].base + data->index * pmem[id].quantum;
+}
+
+static unsigned long pmem_len_region(int id, struct pmem_data *data)
+{
+	struct pmem_extent *ext;
+	unsigned long ret = 0;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ext = region_find(&PMEM_REGION(id).allocated, data->index);
+	if (ext)
+		ret = ext->quanta * pmem[id].quantum;
+	mutex_unlock(&pmem[id].arena_mutex);
+
+	return ret;
+}
+
 static int pmem_map_garbage(int id, struct vm_area_struct *vma,
 			    struct pmem_data *data, unsigned long offset,
 			    unsigned long len)
@@ -1711,7 +2190,7 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 	if (is_pmem_file(file)) {
 		struct pmem_data *data = file->private_data;
 
-		down_read(&data->sem);
+		down_write(&data->sem);
 		if (has_allocation(file)) {
 			int id = get_id(file);
 
@@ -1719,18 +2198,17 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 			*len = pmem[id].len(id, data);
 			*vstart = (unsigned long)
 				pmem_start_vaddr(id, data);
-			up_read(&data->sem);
+			data->flags |= PMEM_FLAGS_EXPOSED;
 #if PMEM_DEBUG
-			down_write(&data->sem);
 			data->ref++;
-			up_write(&data->sem);
 #endif
+			up_write(&data->sem);
 			DLOG("returning start %#lx len %lu "
 				"vstart %#lx\n",
 				*start, *len, *vstart);
 			ret = 0;
 		} else {
-			up_read(&data->sem);
+			up_write(&data->sem);
 		}
 	}
 	return ret;
@@ -2058,6 +2536,14 @@ static int pmem_kapi_free_index_system(const int32_t physaddr, int id)
 	return 0;
 }
 
+static int pmem_kapi_free_index_region(const int32_t physaddr, int id)
+{
+	return (physaddr >= pmem[id].base &&
+		physaddr < (pmem[id].base + pmem[id].size) &&
+		!((physaddr - pmem[id].base) % pmem[id].quantum)) ?
+		(physaddr - pmem[id].base) / pmem[id].quantum : -1;
+}
+
 int pmem_kfree(const int32_t physaddr)
 {
 	int i;
@@ -2092,6 +2578,98 @@ int pmem_kfree(const int32_t physaddr)
 }
 EXPORT_SYMBOL(pmem_kfree);
 
+/*
+ * region_move - moves the allocation at 'index' to the lowest free extent
+ * below it that can hold it, copying its contents. Returns the new index,
+ * or -1 if there is no such extent.
+ */
+static int region_move(int id, int index)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct pmem_extent *ext, *hole, *alloc, *spare;
+	struct rb_node *node;
+	unsigned long start;
+
+	ext = region_find(&PMEM_REGION(id).allocated, index);
+	if (!ext)
+		return -1;
+
+	for (node = rb_first(&PMEM_REGION(id).free_by_addr); node;
+			node = rb_next(node)) {
+		hole = rb_entry(node, struct pmem_extent, addr_node);
+		if (hole->start > ext->start)
+			return -1;
+		start = region_align(id, hole->start, ext->align);
+		if (start + ext->quanta <= hole->start + hole->quanta)
+			break;
+	}
+	if (!node)
+		return -1;
+
+	alloc = kmalloc(sizeof(*alloc), GFP_KERNEL);
+	spare = kmalloc(sizeof(*spare), GFP_KERNEL);
+	if (!alloc || !spare) {
+		kfree(alloc);
+		kfree(spare);
+		return -1;
+	}
+
+	alloc = region_carve(id, hole, start, ext->quanta, ext->align,
+			alloc, spare);
+	memcpy((void __force *)pmem[id].vbase + alloc->start * pmem[id].quantum,
+		(void __force *)pmem[id].vbase + ext->start * pmem[id].quantum,
+		ext->quanta * pmem[id].quantum);
+
+	rb_erase(&ext->addr_node, &PMEM_REGION(id).allocated);
+	PMEM_REGION(id).allocations--;
+	region_release(id, ext);
+	PMEM_REGION(id).defrag_moves++;
+
+	return alloc->start;
+}
+
+/*
+ * pmem_defrag_region - moves idle allocations down into the holes below
+ * them, so that free space gathers at the top of the region. Allocations
+ * are idle until they are mapped, connected to or have their physical
+ * address handed out, see PMEM_FLAGS_NOMOVE_MASK. Those in use are never
+ * moved, nor are kernel allocations. Returns the number of allocations
+ * moved.
+ */
+static int pmem_defrag_region(int id)
+{
+	struct pmem_data *data;
+	int index, moved = 0;
+
+	/* kernel regions are not mapped, nor are there files to move */
+	if (!pmem[id].vbase)
+		return 0;
+
+	mutex_lock(&pmem[id].data_list_mutex);
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		/* whoever holds it is about to use it */
+		if (!down_write_trylock(&data->sem))
+			continue;
+
+		if (data->index != -1 &&
+				!(data->flags & PMEM_FLAGS_NOMOVE_MASK)) {
+			mutex_lock(&pmem[id].arena_mutex);
+			index = region_move(id, data->index);
+			mutex_unlock(&pmem[id].arena_mutex);
+			if (index >= 0) {
+				DLOG("moved index %d to %d\n", data->index,
+					index);
+				data->index = index;
+				moved++;
+			}
+		}
+		up_write(&data->sem);
+	}
+	mutex_unlock(&pmem[id].data_list_mutex);
+
+	return moved;
+}
+
 static int pmem_connect(unsigned long connect, struct file *file)
 {
 	int ret = 0, put_needed;
@@ -2134,10 +2712,10 @@ static int pmem_connect(unsigned long connect, struct file *file)
 			goto put_src_file;
 		}
 
-		down_read(&src_data->sem);
+		down_write(&src_data->sem);
 
 		if (unlikely(!has_allocation(src_file))) {
-			up_read(&src_data->sem);
+			up_write(&src_data->sem);
 			pr_err("pmem: %s: src file has no allocation!\n",
 				__func__);
 			ret = -EINVAL;
@@ -2145,7 +2723,9 @@ static int pmem_connect(unsigned long connect, struct file *file)
 			struct pmem_data *data;
 			int src_index = src_data->index;
 
-			up_read(&src_data->sem);
+			/* the connected file shares the index */
+			src_data->flags |= PMEM_FLAGS_EXPOSED;
+			up_write(&src_data->sem);
 
 			data = file->private_data;
 			if (!data) {
@@ -2437,15 +3017,16 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			struct pmem_region region;
 
 			DLOG("get_phys\n");
-			down_read(&data->sem);
+			down_write(&data->sem);
 			if (!has_allocation(file)) {
 				region.offset = 0;
 				region.len = 0;
 			} else {
 				region.offset = pmem[id].start_addr(id, data);
 				region.len = pmem[id].len(id, data);
+				data->flags |= PMEM_FLAGS_EXPOSED;
 			}
-			up_read(&data->sem);
+			up_write(&data->sem);
 
 			if (copy_to_user((void __user *)arg, &region,
 						sizeof(struct pmem_region)))
@@ -2565,9 +3146,12 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 			if (alloc.align != SZ_4K &&
 					(pmem[id].allocator_type !=
-						PMEM_ALLOCATORTYPE_BITMAP)) {
+						PMEM_ALLOCATORTYPE_BITMAP) &&
+					(pmem[id].allocator_type !=
+						PMEM_ALLOCATORTYPE_REGION)) {
 				pr_err("pmem: Non 4k alignment requires bitmap"
-					" allocator on %s\n", pmem[id].name);
+					" or region allocator on %s\n",
+					pmem[id].name);
 				return -EINVAL;
 			}
 
@@ -3020,6 +3604,51 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 			id, pdata->name, pmem[id].size);
 		break;
 
+	case PMEM_ALLOCATORTYPE_REGION:
+	{
+		struct pmem_extent *ext;
+
+		PMEM_REGION(id).free_by_addr = RB_ROOT;
+		PMEM_REGION(id).free_by_size = RB_ROOT;
+		PMEM_REGION(id).allocated = RB_ROOT;
+		PMEM_REGION(id).free_quanta = 0;
+		PMEM_REGION(id).free_extents = 0;
+		PMEM_REGION(id).allocations = 0;
+		PMEM_REGION(id).failed_allocs = 0;
+		PMEM_REGION(id).defrag_moves = 0;
+
+		/* the whole space starts out as a single free extent */
+		ext = kmalloc(sizeof(*ext), GFP_KERNEL);
+		if (!ext) {
+			pr_alert("pmem: %s: Unable to register pmem "
+				"driver %s - can't allocate free extent!\n",
+				__func__, pdata->name);
+			goto err_reset_pmem_info;
+		}
+		ext->start = 0;
+		ext->quanta = pmem[id].num_entries;
+		region_free_insert(id, ext);
+
+		if (kobject_init_and_add(&pmem[id].kobj,
+				&pmem_region_ktype, NULL,
+				"%s", pdata->name))
+			goto out_put_kobj;
+
+		pmem[id].allocate = pmem_allocator_region;
+		pmem[id].free = pmem_free_region;
+		pmem[id].free_space = pmem_free_space_region;
+		pmem[id].kapi_free_index = pmem_kapi_free_index_region;
+		pmem[id].len = pmem_len_region;
+		pmem[id].start_addr = pmem_start_addr_region;
+		pmem[id].defrag = pmem_defrag_region;
+
+		DLOG("region allocator id %d (%s), num_entries %lu, raw size "
+			"%lu, quanta size %u\n",
+			id, pdata->name, pmem[id].num_entries,
+			pmem[id].size, pmem[id].quantum);
+		break;
+	}
+
 	default:
 		pr_alert("Invalid allocator type (%d) for pmem driver\n",
 			pdata->allocator_type);
@@ -3077,6 +3706,16 @@ out_put_kobj:
 	else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP) {
 		kfree(pmem[id].allocator.bitmap.bitmap);
 		kfree(pmem[id].allocator.bitmap.bitm_alloc);
+	} else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_REGION) {
+		struct rb_node *node;
+
+		while ((node = rb_first(&PMEM_REGION(id).free_by_addr))) {
+			struct pmem_extent *ext =
+				rb_entry(node, struct pmem_extent, addr_node);
+
+			region_free_erase(id, ext);
+			kfree(ext);
+		}
 	}
 err_reset_pmem_info:
 	pmem[id].allocate = 0;
@@ -33,11 +33,16 @@
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/ktime.h>
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
+static DEFINE_MUTEX(binder_main_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DECLARE_WAIT_QUEUE_HEAD(binder_tmp_ref_wait);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
@@ -80,6 +85,31 @@ BINDER_DEBUG_ENTRY(proc);
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/*
+ * Small buffers are rounded up to a power of two size class. When freed
+ * they are parked on a per-class list with their pages still mapped, so
+ * the next allocation of that class neither walks the free tree nor
+ * touches the page tables.
+ */
+#define BINDER_BUF_CLASS_MIN		64
+#define BINDER_BUF_CLASS_COUNT		6	/* 64 bytes .. 2K */
+#define BINDER_BUF_CLASS_CACHE_MAX	8	/* cached buffers per class */
+
+#define BINDER_ALLOC_HIST_BUCKETS	12	/* 64 bytes .. 64K, larger */
+
+struct binder_alloc_stats {
+	unsigned long size_hist[BINDER_ALLOC_HIST_BUCKETS];
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	unsigned long cache_flushes;
+	unsigned long pages_mapped;
+	unsigned long pages_unmapped;
+	unsigned long map_calls;
+	unsigned long unmap_calls;
+	unsigned long large_copies;
+	unsigned long zero_fill_avoided;	/* bytes */
+};
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -105,6 +135,15 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/*
+ * Payloads at least this large are copied into pages that are not zero
+ * filled first, and that are only mapped into the receiver once the copy
+ * is done. 0 disables this.
+ */
+static uint32_t binder_large_copy_threshold = 4 * PAGE_SIZE;
+module_param_named(large_copy_threshold, binder_large_copy_threshold,
+		   uint, S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -164,6 +203,47 @@ static inline void binder_stats_created(enum binder_stat_types type)
 	binder_stats.obj_created[type]++;
 }
 
+/*
+ * Lock contention accounting. The counters are only updated while the
+ * lock they describe is held, so they need no locking of their own.
+ */
+struct binder_lock_stats {
+	unsigned long acquired;
+	unsigned long contended;
+	u64 wait_ns;
+};
+
+static struct binder_lock_stats binder_main_lock_stats;
+
+static inline void binder_mutex_lock(struct mutex *lock,
+				     struct binder_lock_stats *stats)
+{
+	if (!mutex_trylock(lock)) {
+		u64 start = sched_clock();
+
+		mutex_lock(lock);
+		stats->contended++;
+		stats->wait_ns += sched_clock() - start;
+	}
+	stats->acquired++;
+}
+
+/*
+ * binder_main_lock protects the object graph: nodes, refs, death
+ * notifications, transaction stacks and todo lists. Per-process state
+ * that does not link to other processes (the thread tree and the buffer
+ * allocator) is protected by proc->lock, which nests inside it.
+ */
+static inline void binder_lock(void)
+{
+	binder_mutex_lock(&binder_main_lock, &binder_main_lock_stats);
+}
+
+static inline void binder_unlock(void)
+{
+	mutex_unlock(&binder_main_lock);
+}
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int call_type;
@@ -184,6 +264,75 @@ struct binder_transaction_log {
 static struct binder_transaction_log binder_transaction_log;
 static struct binder_transaction_log binder_transaction_log_failed;
 
+/*
+ * Timestamped transaction events, written with binder_main_lock held.
+ * The same events are also available as tracepoints.
+ */
+enum binder_event_type {
+	BINDER_EVENT_CALL,
+	BINDER_EVENT_ASYNC,
+	BINDER_EVENT_DISPATCH,
+	BINDER_EVENT_REPLY,
+};
+
+struct binder_event_log_entry {
+	u64 timestamp;
+	int type;
+	int debug_id;
+	int from_proc;
+	int from_thread;
+	int to_proc;
+	int to_thread;
+	unsigned int code;
+};
+struct binder_event_log {
+	int next;
+	int full;
+	struct binder_event_log_entry entry[256];
+};
+static struct binder_event_log binder_event_log;
+
+static void binder_event_log_add(int type, int debug_id, int from_proc,
+				 int from_thread, int to_proc, int to_thread,
+				 unsigned int code, u64 timestamp)
+{
+	struct binder_event_log *log = &binder_event_log;
+	struct binder_event_log_entry *e;
+
+	e = &log->entry[log->next];
+	e->timestamp = timestamp;
+	e->type = type;
+	e->debug_id = debug_id;
+	e->from_proc = from_proc;
+	e->from_thread = from_thread;
+	e->to_proc = to_proc;
+	e->to_thread = to_thread;
+	e->code = code;
+	log->next++;
+	if (log->next == ARRAY_SIZE(log->entry)) {
+		log->next = 0;
+		log->full = 1;
+	}
+}
+
+/*
+ * Per target process and transaction code latency histograms. Bucket i
+ * counts latencies below 2^i microseconds, the last bucket the rest.
+ * Synchronous calls are measured from send to reply, one-way calls from
+ * send to dispatch.
+ */
+#define BINDER_LATENCY_BUCKETS		21
+#define BINDER_LATENCY_MAX_CODES	64
+
+struct binder_latency {
+	struct list_head entry;
+	unsigned int code;
+	unsigned long count;
+	u64 total_ns;
+	u64 max_ns;
+	unsigned long hist[BINDER_LATENCY_BUCKETS];
+};
+
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
@@ -263,7 +412,11 @@ struct binder_buffer {
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned cached:1;
+	unsigned user_map_deferred:1;
+	unsigned debug_id:27;
+
+	struct binder_buffer *next_cached;
 
 	struct binder_transaction *transaction;
 
@@ -310,10 +463,87 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
+	struct list_head waiting_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+
+	struct mutex lock;
+	struct binder_lock_stats lock_stats;
+	int tmp_ref;
+	int is_dead;
+
+	struct binder_buffer *cached_buffers[BINDER_BUF_CLASS_COUNT];
+	int cached_count[BINDER_BUF_CLASS_COUNT];
+	struct binder_alloc_stats alloc_stats;
+
+	struct list_head latency;
+	int latency_codes;
+	unsigned long latency_dropped;
 };
 
+static inline void binder_proc_lock(struct binder_proc *proc)
+{
+	binder_mutex_lock(&proc->lock, &proc->lock_stats);
+}
+
+static inline void binder_proc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->lock);
+}
+
+/*
+ * A temporary reference keeps a target process from being torn down
+ * while binder_transaction runs without binder_main_lock. Both helpers
+ * are called with binder_main_lock held.
+ */
+static inline void binder_proc_inc_tmpref(struct binder_proc *proc)
+{
+	proc->tmp_ref++;
+}
+
+static inline void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	if (--proc->tmp_ref == 0 && proc->is_dead)
+		wake_up(&binder_tmp_ref_wait);
+}
+
+/* Called with binder_main_lock held */
+static void binder_account_latency(struct binder_proc *proc,
+				   unsigned int code, u64 latency_ns)
+{
+	struct binder_latency *lat;
+	u64 us = latency_ns;
+	int bucket;
+
+	list_for_each_entry(lat, &proc->latency, entry) {
+		if (lat->code == code)
+			goto found;
+	}
+	if (proc->latency_codes >= BINDER_LATENCY_MAX_CODES) {
+		proc->latency_dropped++;
+		return;
+	}
+	lat = kzalloc(sizeof(*lat), GFP_KERNEL);
+	if (lat == NULL) {
+		proc->latency_dropped++;
+		return;
+	}
+	lat->code = code;
+	list_add_tail(&lat->entry, &proc->latency);
+	proc->latency_codes++;
+found:
+	do_div(us, NSEC_PER_USEC);
+	bucket = us ? fls64(us) : 0;
+	if (bucket >= BINDER_LATENCY_BUCKETS)
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	lat->hist[bucket]++;
+	lat->count++;
+	lat->total_ns += latency_ns;
+	if (latency_ns > lat->max_ns)
+		lat->max_ns = latency_ns;
+}
+
 enum {
 	BINDER_LOOPER_STATE_REGISTERED  = 0x01,
 	BINDER_LOOPER_STATE_ENTERED     = 0x02,
@@ -336,6 +566,7 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct list_head waiting_thread_node;
 };
 
 struct binder_transaction {
@@ -354,7 +585,14 @@ struct binder_transaction {
 	unsigned int	flags;
 	long	priority;
 	long	saved_priority;
+	int	sched_policy;
+	int	rt_priority;
+	int	saved_sched_policy;
+	int	saved_rt_priority;
 	uid_t	sender_euid;
+	int	from_pid;	/* sender, kept for the event log since */
+	int	from_tid;	/* 'from' is NULL for one-way and replies */
+	u64	start_ns;
 };
 
 static void
@@ -515,6 +753,58 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static inline int binder_is_rt_policy(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+/*
+ * Switches current to the given scheduling policy. For real-time policies
+ * rt_priority is used, otherwise nice.
+ */
+static void binder_set_sched(int policy, int rt_priority, long nice)
+{
+	struct sched_param param;
+
+	if (binder_is_rt_policy(policy)) {
+		if (current->policy == policy &&
+		    current->rt_priority == rt_priority)
+			return;
+		param.sched_priority = rt_priority;
+		if (sched_setscheduler_nocheck(current, policy, &param))
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: failed to set policy %d "
+				     "prio %d\n", current->pid, policy,
+				     rt_priority);
+		return;
+	}
+	if (current->policy != policy) {
+		param.sched_priority = 0;
+		sched_setscheduler_nocheck(current, policy, &param);
+	}
+	binder_set_nice(nice);
+}
+
+/*
+ * Wakes the looper thread that went idle most recently, as its stack and
+ * cache are the most likely to still be warm. The proc wait queue is only
+ * used by poll, so it is woken only when no looper is idle.
+ */
+static void binder_wakeup_proc(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+
+	if (!list_empty(&proc->waiting_threads)) {
+		thread = list_first_entry(&proc->waiting_threads,
+					  struct binder_thread,
+					  waiting_thread_node);
+		list_del_init(&thread->waiting_thread_node);
+		wake_up_interruptible(&thread->wait);
+		return;
+	}
+	wake_up_interruptible(&proc->wait);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -607,15 +897,24 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
-static int binder_update_page_range(struct binder_proc *proc, int allocate,
-				    void *start, void *end,
-				    struct vm_area_struct *vma)
+/*
+ * Pages in [raw_start, raw_end) are allocated without being zero filled
+ * and are not mapped into userspace; the caller must fill them completely
+ * and then call binder_map_user_range.
+ */
+static int __binder_update_page_range(struct binder_proc *proc, int allocate,
+				      void *start, void *end,
+				      void *raw_start, void *raw_end,
+				      struct vm_area_struct *vma)
 {
 	void *page_addr;
-	unsigned long user_page_addr;
+	unsigned long user_start;
 	struct vm_struct tmp_area;
 	struct page **page;
+	struct page **page_array_ptr;
 	struct mm_struct *mm;
+	unsigned long zero_fill_avoided = 0;
+	int ret;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -634,6 +933,8 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
+	user_start = (uintptr_t)start + proc->user_buffer_offset;
+
 	if (allocate == 0)
 		goto free_range;
 
@@ -643,39 +944,56 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		goto err_no_vma;
 	}
 
+	/*
+	 * Allocate every page first so the whole range can be mapped into
+	 * the kernel with a single map_vm_area call.
+	 */
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
-		struct page **page_array_ptr;
+		gfp_t gfp_mask = GFP_KERNEL | __GFP_ZERO;
+
+		if (page_addr >= raw_start && page_addr < raw_end) {
+			gfp_mask &= ~__GFP_ZERO;
+			zero_fill_avoided += PAGE_SIZE;
+		}
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
 		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		*page = alloc_page(gfp_mask);
 		if (*page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
-		if (ret) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %p in kernel\n",
-			       proc->pid, page_addr);
-			goto err_map_kernel_failed;
-		}
-		user_page_addr =
-			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+	}
+	tmp_area.addr = start;
+	tmp_area.size = end - start + PAGE_SIZE /* guard page? */;
+	page_array_ptr = &proc->pages[(start - proc->buffer) / PAGE_SIZE];
+	ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
+	if (ret) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
+		       "to map pages at %p in kernel\n",
+		       proc->pid, start);
+		goto err_map_kernel_failed;
+	}
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		if (page_addr >= raw_start && page_addr < raw_end)
+			continue;
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		ret = vm_insert_page(vma, (uintptr_t)page_addr +
+				     proc->user_buffer_offset, *page);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
-			       proc->pid, user_page_addr);
+			       proc->pid, (uintptr_t)page_addr +
+			       proc->user_buffer_offset);
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
 	}
+	proc->alloc_stats.map_calls++;
+	proc->alloc_stats.pages_mapped += (end - start) / PAGE_SIZE;
+	/* only once the range is in place, a failed one is freed again */
+	proc->alloc_stats.zero_fill_avoided += zero_fill_avoided;
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -683,39 +1001,157 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+	if (vma)
+		zap_page_range(vma, user_start, end - start, NULL);
+	unmap_kernel_range((unsigned long)start, end - start);
+	proc->alloc_stats.unmap_calls++;
+	proc->alloc_stats.pages_unmapped += (end - start) / PAGE_SIZE;
+	page_addr = end;
+	goto free_pages;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	if (page_addr > start)
+		zap_page_range(vma, user_start, page_addr - start, NULL);
+	unmap_kernel_range((unsigned long)start, end - start);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	page_addr = end;
 err_alloc_page_failed:
-		;
+free_pages:
+	while (page_addr > start) {
+		page_addr -= PAGE_SIZE;
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (*page) {
+			__free_page(*page);
+			*page = NULL;
+		}
 	}
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
-	return -ENOMEM;
+	return allocate ? -ENOMEM : 0;
 }
 
+static int binder_update_page_range(struct binder_proc *proc, int allocate,
+				    void *start, void *end,
+				    struct vm_area_struct *vma)
+{
+	return __binder_update_page_range(proc, allocate, start, end,
+					  NULL, NULL, vma);
+}
+
+/* Maps pages left out by __binder_update_page_range into userspace */
+static int binder_map_user_range(struct binder_proc *proc,
+				 void *start, void *end)
+{
+	void *page_addr;
+	struct mm_struct *mm;
+	int ret = 0;
+
+	if (end <= start)
+		return 0;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm == NULL)
+		return -ESRCH;
+
+	down_write(&mm->mmap_sem);
+	if (proc->vma == NULL) {
+		ret = -ESRCH;
+		goto out;
+	}
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		struct page *page;
+
+		page = proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		ret = vm_insert_page(proc->vma, (uintptr_t)page_addr +
+				     proc->user_buffer_offset, page);
+		if (ret) {
+			printk(KERN_ERR "binder: %d: failed to map page at "
+			       "%lx in userspace\n", proc->pid,
+			       (uintptr_t)page_addr +
+			       proc->user_buffer_offset);
+			break;
+		}
+	}
+out:
+	up_write(&mm->mmap_sem);
+	mmput(mm);
+	return ret;
+}
+
+/*
+ * Range of whole pages inside the data area of a large buffer. These are
+ * overwritten by the copy from the sender, so they need not be zero
+ * filled, and must not be visible to the receiver before that copy.
+ */
+static void binder_buffer_raw_range(struct binder_buffer *buffer,
+				    size_t data_size,
+				    void **raw_start, void **raw_end)
+{
+	*raw_start = (void *)PAGE_ALIGN((uintptr_t)buffer->data);
+	*raw_end = (void *)(((uintptr_t)buffer->data + data_size) & PAGE_MASK);
+	if (*raw_end < *raw_start)
+		*raw_end = *raw_start;
+}
+
+static int binder_buffer_class(size_t size)
+{
+	int class;
+
+	for (class = 0; class < BINDER_BUF_CLASS_COUNT; class++) {
+		if (size <= (BINDER_BUF_CLASS_MIN << class))
+			return class;
+	}
+	return -1;
+}
+
+/* Space a buffer with these sizes takes, rounded up to its size class */
+static size_t binder_buffer_alloc_size(size_t data_size, size_t offsets_size)
+{
+	size_t size;
+	int class;
+
+	size = ALIGN(data_size, sizeof(void *)) +
+		ALIGN(offsets_size, sizeof(void *));
+	if (size < data_size || size < offsets_size)
+		return 0;
+	class = binder_buffer_class(size);
+	if (class >= 0)
+		size = BINDER_BUF_CLASS_MIN << class;
+	return size;
+}
+
+static void binder_account_alloc_size(struct binder_proc *proc, size_t size)
+{
+	int bucket = 0;
+
+	while (bucket < BINDER_ALLOC_HIST_BUCKETS - 1 &&
+	       size > (BINDER_BUF_CLASS_MIN << bucket))
+		bucket++;
+	proc->alloc_stats.size_hist[bucket]++;
+}
+
+static int binder_flush_buffer_cache(struct binder_proc *proc);
+static void binder_release_buf(struct binder_proc *proc,
+			       struct binder_buffer *buffer,
+			       size_t buffer_size);
+
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 					      size_t data_size,
-					      size_t offsets_size, int is_async)
+					      size_t offsets_size, int is_async,
+					      int large_copy)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	struct rb_node *best_fit;
 	void *has_page_addr;
 	void *end_page_addr;
+	void *raw_start = NULL, *raw_end = NULL;
 	size_t size;
+	int class;
 
 	if (proc->vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
@@ -723,10 +1159,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	size = ALIGN(data_size, sizeof(void *)) +
-		ALIGN(offsets_size, sizeof(void *));
-
-	if (size < data_size || size < offsets_size) {
+	size = binder_buffer_alloc_size(data_size, offsets_size);
+	if (size == 0) {
 		binder_user_error("binder: %d: got transaction with invalid "
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
@@ -740,6 +1174,23 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
+	binder_account_alloc_size(proc, size);
+	class = binder_buffer_class(size);
+	if (class >= 0 && proc->cached_buffers[class]) {
+		buffer = proc->cached_buffers[class];
+		proc->cached_buffers[class] = buffer->next_cached;
+		proc->cached_count[class]--;
+		buffer->next_cached = NULL;
+		buffer->cached = 0;
+		proc->alloc_stats.cache_hits++;
+		goto found;
+	}
+	if (class >= 0)
+		proc->alloc_stats.cache_misses++;
+
+retry:
+	n = proc->free_buffers.rb_node;
+	best_fit = NULL;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
@@ -756,6 +1207,8 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		}
 	}
 	if (best_fit == NULL) {
+		if (binder_flush_buffer_cache(proc))
+			goto retry;
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
@@ -781,9 +1234,16 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
 	if (end_page_addr > has_page_addr)
 		end_page_addr = has_page_addr;
-	if (binder_update_page_range(proc, 1,
-	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
+	if (large_copy) {
+		binder_buffer_raw_range(buffer, data_size,
+					&raw_start, &raw_end);
+		proc->alloc_stats.large_copies++;
+	}
+	if (__binder_update_page_range(proc, 1,
+	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr,
+	    raw_start, raw_end, NULL))
 		return NULL;
+	buffer->user_map_deferred = raw_end > raw_start;
 
 	rb_erase(best_fit, &proc->free_buffers);
 	buffer->free = 0;
@@ -792,8 +1252,14 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		struct binder_buffer *new_buffer = (void *)buffer->data + size;
 		list_add(&new_buffer->entry, &buffer->entry);
 		new_buffer->free = 1;
+		new_buffer->cached = 0;
 		binder_insert_free_buffer(proc, new_buffer);
 	}
+	goto init;
+
+found:
+	buffer->user_map_deferred = 0;
+init:
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got "
 		     "%p\n", proc->pid, size, buffer);
@@ -873,11 +1339,12 @@ static void binder_free_buf(struct binder_proc *proc,
 			    struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
+	int class;
 
 	buffer_size = binder_buffer_size(proc, buffer);
 
-	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+	size = binder_buffer_alloc_size(buffer->data_size,
+					buffer->offsets_size);
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
@@ -896,8 +1363,54 @@ static void binder_free_buf(struct binder_proc *proc,
 			     "binder: %d: binder_free_buf size %zd "
 			     "async free %zd\n", proc->pid, size,
 			     proc->free_async_space);
+		buffer->async_transaction = 0;
+	}
+
+	class = binder_buffer_class(size);
+	if (class >= 0 && !proc->is_dead &&
+	    proc->cached_count[class] < BINDER_BUF_CLASS_CACHE_MAX) {
+		/* stays in allocated_buffers, but cannot be freed by user */
+		buffer->allow_user_free = 0;
+		buffer->target_node = NULL;
+		buffer->cached = 1;
+		buffer->next_cached = proc->cached_buffers[class];
+		proc->cached_buffers[class] = buffer;
+		proc->cached_count[class]++;
+		return;
 	}
 
+	binder_release_buf(proc, buffer, buffer_size);
+}
+
+/*
+ * Returns all cached small buffers to the free tree. Returns the number
+ * of buffers released.
+ */
+static int binder_flush_buffer_cache(struct binder_proc *proc)
+{
+	struct binder_buffer *buffer;
+	int class, count = 0;
+
+	for (class = 0; class < BINDER_BUF_CLASS_COUNT; class++) {
+		while ((buffer = proc->cached_buffers[class])) {
+			proc->cached_buffers[class] = buffer->next_cached;
+			buffer->next_cached = NULL;
+			buffer->cached = 0;
+			binder_release_buf(proc, buffer,
+					   binder_buffer_size(proc, buffer));
+			count++;
+		}
+		proc->cached_count[class] = 0;
+	}
+	if (count)
+		proc->alloc_stats.cache_flushes++;
+	return count;
+}
+
+static void binder_release_buf(struct binder_proc *proc,
+			       struct binder_buffer *buffer,
+			       size_t buffer_size)
+{
 	binder_update_page_range(proc, 0,
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data),
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK),
@@ -1036,7 +1549,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			binder_wakeup_proc(node->proc);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
@@ -1376,6 +1889,25 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Returns the thread of target_proc that is already waiting on a reply
+ * further down the calling thread's transaction stack, if any. Sending
+ * nested calls to that thread keeps recursive calls from deadlocking.
+ */
+static struct binder_thread *
+binder_get_stack_target(struct binder_thread *thread,
+			struct binder_proc *target_proc)
+{
+	struct binder_thread *target_thread = NULL;
+	struct binder_transaction *tmp;
+
+	for (tmp = thread->transaction_stack; tmp; tmp = tmp->from_parent) {
+		if (tmp->from && tmp->from->proc == target_proc)
+			target_thread = tmp->from;
+	}
+	return target_thread;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
 			       struct binder_transaction_data *tr, int reply)
@@ -1390,6 +1922,8 @@ static void binder_transaction(struct binder_proc *proc,
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
+	const char *bad_ptr = NULL;
+	int map_failed = 0;
 	uint32_t return_error;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
@@ -1409,7 +1943,9 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_sched(in_reply_to->saved_sched_policy,
+				 in_reply_to->saved_rt_priority,
+				 in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1464,7 +2000,7 @@ static void binder_transaction(struct binder_proc *proc,
 		}
 		e->to_node = target_node->debug_id;
 		target_proc = target_node->proc;
-		if (target_proc == NULL) {
+		if (target_proc == NULL || target_proc->is_dead) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
@@ -1482,21 +2018,10 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
+			target_thread = binder_get_stack_target(thread,
+								target_proc);
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1539,38 +2064,103 @@ static void binder_transaction(struct binder_proc *proc,
 	else
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
+	t->from_pid = proc->pid;
+	t->from_tid = thread->pid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+	t->sched_policy = current->policy;
+	t->rt_priority = current->rt_priority;
+	t->start_ns = ktime_to_ns(ktime_get());
+
+	/*
+	 * Allocating the target buffer may have to map pages and copying the
+	 * payload may fault, so do both without holding binder_main_lock.
+	 * The node reference and the temporary proc reference keep the
+	 * target alive until the lock is retaken.
+	 */
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	binder_proc_inc_tmpref(target_proc);
+	binder_unlock();
+
+	binder_proc_lock(target_proc);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY),
+		binder_large_copy_threshold &&
+		tr->data_size >= binder_large_copy_threshold);
+	binder_proc_unlock(target_proc);
+	if (t->buffer) {
+		t->buffer->allow_user_free = 0;
+		t->buffer->debug_id = t->debug_id;
+		t->buffer->transaction = t;
+		t->buffer->target_node = target_node;
+
+		if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				   tr->data_size))
+			bad_ptr = "data";
+		else if (copy_from_user(t->buffer->data +
+					ALIGN(tr->data_size, sizeof(void *)),
+					tr->data.ptr.offsets,
+					tr->offsets_size))
+			bad_ptr = "offsets";
+
+		/*
+		 * copy_from_user zero fills whatever it could not copy, so
+		 * the receiver never sees stale page contents.
+		 */
+		if (t->buffer->user_map_deferred) {
+			void *raw_start, *raw_end;
+
+			binder_buffer_raw_range(t->buffer, tr->data_size,
+						&raw_start, &raw_end);
+			binder_proc_lock(target_proc);
+			if (binder_map_user_range(target_proc, raw_start,
+						  raw_end) && !bad_ptr)
+				map_failed = 1;
+			t->buffer->user_map_deferred = 0;
+			binder_proc_unlock(target_proc);
+		}
+	}
+
+	binder_lock();
 	if (t->buffer == NULL) {
+		if (target_node)
+			binder_dec_node(target_node, 1, 0);
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
-	t->buffer->debug_id = t->debug_id;
-	t->buffer->transaction = t;
-	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
-
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
-
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
+	if (map_failed) {
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
+	if (bad_ptr) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
+			"%s ptr\n", proc->pid, thread->pid, bad_ptr);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
+
+	/* The target thread may have exited while the lock was dropped */
+	if (reply) {
+		if (in_reply_to->from != target_thread) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target_thread;
+		}
+	} else if (target_thread)
+		target_thread = binder_get_stack_target(thread, target_proc);
+
+	t->to_thread = target_thread;
+	if (target_thread) {
+		e->to_thread = target_thread->pid;
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1611,6 +2201,7 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
 			ref = binder_get_ref_for_node(target_proc, node);
@@ -1717,7 +2308,12 @@ static void binder_transaction(struct binder_proc *proc,
 		}
 	}
 	if (reply) {
+		u64 latency_ns = t->start_ns - in_reply_to->start_ns;
+
 		BUG_ON(t->buffer->async_transaction != 0);
+		binder_account_latency(proc, in_reply_to->code, latency_ns);
+		trace_binder_transaction_done(in_reply_to->debug_id, proc->pid,
+					      in_reply_to->code, latency_ns);
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -1733,12 +2329,25 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
+	trace_binder_transaction(t->debug_id, reply, proc->pid, thread->pid,
+				 target_proc->pid,
+				 target_thread ? target_thread->pid : 0,
+				 t->code, t->flags, tr->data_size);
+	binder_event_log_add(reply ? BINDER_EVENT_REPLY :
+			     (t->flags & TF_ONE_WAY) ? BINDER_EVENT_ASYNC :
+			     BINDER_EVENT_CALL, t->debug_id,
+			     proc->pid, thread->pid, target_proc->pid,
+			     target_thread ? target_thread->pid : 0,
+			     t->code, t->start_ns);
 	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
+	if (target_wait == &target_proc->wait)
+		binder_wakeup_proc(target_proc);
+	else if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_proc_dec_tmpref(target_proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1749,11 +2358,15 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
+err_dead_target_thread:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
+	binder_proc_lock(target_proc);
 	binder_free_buf(target_proc, t->buffer);
+	binder_proc_unlock(target_proc);
 err_binder_alloc_buf_failed:
+	binder_proc_dec_tmpref(target_proc);
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -1934,7 +2547,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			binder_proc_lock(proc);
 			buffer = binder_buffer_lookup(proc, data_ptr);
+			binder_proc_unlock(proc);
 			if (buffer == NULL) {
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
@@ -1965,7 +2580,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
+			binder_proc_lock(proc);
 			binder_free_buf(proc, buffer);
+			binder_proc_unlock(proc);
 			break;
 		}
 
@@ -2084,7 +2701,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc(proc);
 					}
 				}
 			} else {
@@ -2114,7 +2731,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						list_add_tail(&death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc(proc);
 					}
 				} else {
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
@@ -2154,7 +2771,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_add_tail(&death->work.entry, &thread->todo);
 				} else {
 					list_add_tail(&death->work.entry, &proc->todo);
-					wake_up_interruptible(&proc->wait);
+					binder_wakeup_proc(proc);
 				}
 			}
 		} break;
@@ -2186,6 +2803,37 @@ static int binder_has_proc_work(struct binder_proc *proc,
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+/*
+ * binder_wakeup_proc() takes a thread off waiting_threads before it runs.
+ * If another thread got to the work first, go back on the list before
+ * sleeping again, or later work would never wake us. We may also have
+ * seen the work without being taken off the list, so only add ourselves
+ * back if we are not on it.
+ */
+static int binder_wait_for_proc_work(struct binder_proc *proc,
+				     struct binder_thread *thread)
+{
+	int ret;
+
+	while (1) {
+		ret = wait_event_interruptible(thread->wait,
+				binder_has_proc_work(proc, thread) ||
+				list_empty(&thread->waiting_thread_node));
+		if (ret)
+			return ret;
+
+		binder_lock();
+		if (binder_has_proc_work(proc, thread)) {
+			binder_unlock();
+			return 0;
+		}
+		if (list_empty(&thread->waiting_thread_node))
+			list_add(&thread->waiting_thread_node,
+				 &proc->waiting_threads);
+		binder_unlock();
+	}
+}
+
 static int binder_has_thread_work(struct binder_thread *thread)
 {
 	return !list_empty(&thread->todo) || thread->return_error != BR_OK ||
@@ -2231,9 +2879,13 @@ retry:
 
 
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
-	if (wait_for_proc_work)
+	if (wait_for_proc_work) {
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+		if (!non_block)
+			list_add(&thread->waiting_thread_node,
+				 &proc->waiting_threads);
+	}
+	binder_unlock();
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2249,7 +2901,7 @@ retry:
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
 		} else
-			ret = wait_event_interruptible_exclusive(proc->wait, binder_has_proc_work(proc, thread));
+			ret = binder_wait_for_proc_work(proc, thread);
 	} else {
 		if (non_block) {
 			if (!binder_has_thread_work(thread))
@@ -2257,9 +2909,11 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
-	if (wait_for_proc_work)
+	binder_lock();
+	if (wait_for_proc_work) {
 		proc->ready_threads--;
+		list_del_init(&thread->waiting_thread_node);
+	}
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
 
 	if (ret)
@@ -2408,7 +3062,18 @@ retry:
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
 			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
+			t->saved_sched_policy = current->policy;
+			t->saved_rt_priority = current->rt_priority;
+			if (!(t->flags & TF_ONE_WAY) &&
+			    binder_is_rt_policy(t->sched_policy)) {
+				/* inherit a real-time caller's policy */
+				if (!binder_is_rt_policy(current->policy) ||
+				    current->rt_priority < t->rt_priority)
+					binder_set_sched(t->sched_policy,
+							 t->rt_priority, 0);
+			} else if (binder_is_rt_policy(current->policy))
+				; /* never demote a real-time thread here */
+			else if (t->priority < target_node->min_priority &&
 			    !(t->flags & TF_ONE_WAY))
 				binder_set_nice(t->priority);
 			else if (!(t->flags & TF_ONE_WAY) ||
@@ -2448,6 +3113,18 @@ retry:
 		ptr += sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
+		{
+			u64 now = ktime_to_ns(ktime_get());
+
+			trace_binder_transaction_received(t->debug_id,
+				proc->pid, thread->pid, now - t->start_ns);
+			binder_event_log_add(BINDER_EVENT_DISPATCH,
+				t->debug_id, t->from_pid, t->from_tid,
+				proc->pid, thread->pid, t->code, now);
+			if (cmd == BR_TRANSACTION && (t->flags & TF_ONE_WAY))
+				binder_account_latency(proc, t->code,
+						       now - t->start_ns);
+		}
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2542,6 +3219,7 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		thread->pid = current->pid;
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
+		INIT_LIST_HEAD(&thread->waiting_thread_node);
 		rb_link_node(&thread->rb_node, parent, p);
 		rb_insert_color(&thread->rb_node, &proc->threads);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2558,7 +3236,10 @@ static int binder_free_thread(struct binder_proc *proc,
 	struct binder_transaction *send_reply = NULL;
 	int active_transactions = 0;
 
+	binder_proc_lock(proc);
 	rb_erase(&thread->rb_node, &proc->threads);
+	binder_proc_unlock(proc);
+	list_del_init(&thread->waiting_thread_node);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2599,12 +3280,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_lock();
+	binder_proc_lock(proc);
 	thread = binder_get_thread(proc);
+	binder_proc_unlock(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2636,8 +3319,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	binder_lock();
+	binder_proc_lock(proc);
 	thread = binder_get_thread(proc);
+	binder_proc_unlock(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
 		goto err;
@@ -2671,7 +3356,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
 			if (!list_empty(&proc->todo))
-				wake_up_interruptible(&proc->wait);
+				binder_wakeup_proc(proc);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2745,7 +3430,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2884,15 +3569,18 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	get_task_struct(current);
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
+	INIT_LIST_HEAD(&proc->waiting_threads);
 	init_waitqueue_head(&proc->wait);
+	mutex_init(&proc->lock);
+	INIT_LIST_HEAD(&proc->latency);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	binder_lock();
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2917,6 +3605,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	binder_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2925,6 +3615,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	binder_proc_unlock(proc);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2952,6 +3643,15 @@ static void binder_deferred_release(struct binder_proc *proc)
 	BUG_ON(proc->files);
 
 	hlist_del(&proc->proc_node);
+
+	/* wait for transactions still copying into our buffers */
+	proc->is_dead = 1;
+	while (proc->tmp_ref) {
+		binder_unlock();
+		wait_event(binder_tmp_ref_wait, !ACCESS_ONCE(proc->tmp_ref));
+		binder_lock();
+	}
+
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
@@ -2993,7 +3693,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 					if (list_empty(&ref->death->work.entry)) {
 						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
 						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
+						binder_wakeup_proc(ref->proc);
 					} else
 						BUG();
 				}
@@ -3014,6 +3714,10 @@ static void binder_deferred_release(struct binder_proc *proc)
 	binder_release_work(&proc->todo);
 	buffers = 0;
 
+	binder_proc_lock(proc);
+	binder_flush_buffer_cache(proc);
+	binder_proc_unlock(proc);
+
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3026,12 +3730,23 @@ static void binder_deferred_release(struct binder_proc *proc)
 			       proc->pid, t->debug_id);
 			/*BUG();*/
 		}
+		binder_proc_lock(proc);
 		binder_free_buf(proc, buffer);
+		binder_proc_unlock(proc);
 		buffers++;
 	}
 
 	binder_stats_deleted(BINDER_STAT_PROC);
 
+	while (!list_empty(&proc->latency)) {
+		struct binder_latency *lat;
+
+		lat = list_first_entry(&proc->latency, struct binder_latency,
+				       entry);
+		list_del(&lat->entry);
+		kfree(lat);
+	}
+
 	page_count = 0;
 	if (proc->pages) {
 		int i;
@@ -3072,7 +3787,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		binder_lock();
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3099,7 +3814,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3264,6 +3979,7 @@ static void print_binder_proc(struct seq_file *m,
 	seq_printf(m, "proc %d\n", proc->pid);
 	header_pos = m->count;
 
+	binder_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		print_binder_thread(m, rb_entry(n, struct binder_thread,
 						rb_node), print_all);
@@ -3280,9 +3996,13 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
-	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
-		print_binder_buffer(m, "  buffer",
-				    rb_entry(n, struct binder_buffer, rb_node));
+	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n)) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
+							rb_node);
+		if (!buffer->cached)
+			print_binder_buffer(m, "  buffer", buffer);
+	}
+	binder_proc_unlock(proc);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3378,14 +4098,51 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	}
 }
 
+static void print_binder_lock_stats(struct seq_file *m, const char *prefix,
+				   struct binder_lock_stats *stats)
+{
+	seq_printf(m, "%s: acquired %lu contended %lu wait %llu us\n",
+		   prefix, stats->acquired, stats->contended,
+		   (unsigned long long)div_u64(stats->wait_ns, NSEC_PER_USEC));
+}
+
+static void print_binder_alloc_stats(struct seq_file *m, const char *prefix,
+				     struct binder_alloc_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < BINDER_ALLOC_HIST_BUCKETS; i++) {
+		if (!stats->size_hist[i])
+			continue;
+		if (i == BINDER_ALLOC_HIST_BUCKETS - 1)
+			seq_printf(m, "%salloc >%d: %lu\n", prefix,
+				   BINDER_BUF_CLASS_MIN << (i - 1),
+				   stats->size_hist[i]);
+		else
+			seq_printf(m, "%salloc <=%d: %lu\n", prefix,
+				   BINDER_BUF_CLASS_MIN << i,
+				   stats->size_hist[i]);
+	}
+	seq_printf(m, "%salloc cache: hits %lu misses %lu flushes %lu\n",
+		   prefix, stats->cache_hits, stats->cache_misses,
+		   stats->cache_flushes);
+	seq_printf(m, "%spages: mapped %lu in %lu calls, "
+		   "unmapped %lu in %lu calls\n", prefix,
+		   stats->pages_mapped, stats->map_calls,
+		   stats->pages_unmapped, stats->unmap_calls);
+	seq_printf(m, "%slarge copies: %lu zero fill avoided %lu bytes\n",
+		   prefix, stats->large_copies, stats->zero_fill_avoided);
+}
+
 static void print_binder_proc_stats(struct seq_file *m,
 				    struct binder_proc *proc)
 {
 	struct binder_work *w;
 	struct rb_node *n;
-	int count, strong, weak;
+	int count, strong, weak, cached;
 
 	seq_printf(m, "proc %d\n", proc->pid);
+	binder_proc_lock(proc);
 	count = 0;
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
@@ -3412,9 +4169,17 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
-	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
-		count++;
-	seq_printf(m, "  buffers: %d\n", count);
+	cached = 0;
+	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n)) {
+		if (rb_entry(n, struct binder_buffer, rb_node)->cached)
+			cached++;
+		else
+			count++;
+	}
+	seq_printf(m, "  buffers: %d cached %d\n", count, cached);
+	print_binder_alloc_stats(m, "  ", &proc->alloc_stats);
+	binder_proc_unlock(proc);
+	print_binder_lock_stats(m, "  proc lock", &proc->lock_stats);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
@@ -3440,7 +4205,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder state:\n");
 
@@ -3452,7 +4217,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3463,16 +4228,17 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	print_binder_lock_stats(m, "main lock", &binder_main_lock_stats);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3483,13 +4249,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3499,11 +4265,11 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock();
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3532,6 +4298,93 @@ static int binder_transaction_log_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static const char *binder_event_strings[] = {
+	"call",
+	"async",
+	"dispatch",
+	"reply",
+};
+
+static void print_binder_event_log_entry(struct seq_file *m,
+					 struct binder_event_log_entry *e)
+{
+	u64 ts = e->timestamp;
+	unsigned long rem_ns = do_div(ts, NSEC_PER_SEC);
+
+	seq_printf(m, "[%5lu.%09lu] %d: %-8s %d:%d -> %d:%d code %x\n",
+		   (unsigned long)ts, rem_ns, e->debug_id,
+		   binder_event_strings[e->type], e->from_proc,
+		   e->from_thread, e->to_proc, e->to_thread, e->code);
+}
+
+static int binder_transaction_events_show(struct seq_file *m, void *unused)
+{
+	struct binder_event_log *log = &binder_event_log;
+	int do_lock = !binder_debug_no_lock;
+	int i;
+
+	if (do_lock)
+		binder_lock();
+	if (log->full) {
+		for (i = log->next; i < ARRAY_SIZE(log->entry); i++)
+			print_binder_event_log_entry(m, &log->entry[i]);
+	}
+	for (i = 0; i < log->next; i++)
+		print_binder_event_log_entry(m, &log->entry[i]);
+	if (do_lock)
+		binder_unlock();
+	return 0;
+}
+
+static void print_binder_latency(struct seq_file *m,
+				 struct binder_latency *lat)
+{
+	u64 avg = lat->total_ns;
+	u64 max = lat->max_ns;
+	int i, last = 0;
+
+	do_div(avg, lat->count);
+	do_div(avg, NSEC_PER_USEC);
+	do_div(max, NSEC_PER_USEC);
+	seq_printf(m, "  code %x: count %lu avg %llu us max %llu us\n   ",
+		   lat->code, lat->count, (unsigned long long)avg,
+		   (unsigned long long)max);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		if (lat->hist[i])
+			last = i;
+	}
+	for (i = 0; i <= last; i++)
+		seq_printf(m, " %lu", lat->hist[i]);
+	seq_puts(m, "\n");
+}
+
+static int binder_transaction_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	struct binder_latency *lat;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		binder_lock();
+
+	seq_puts(m, "binder transaction latency "
+		 "(histogram buckets: <1us, <2us, <4us, ...):\n");
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (list_empty(&proc->latency))
+			continue;
+		seq_printf(m, "proc %d\n", proc->pid);
+		list_for_each_entry(lat, &proc->latency, entry)
+			print_binder_latency(m, lat);
+		if (proc->latency_dropped)
+			seq_printf(m, "  dropped %lu\n",
+				   proc->latency_dropped);
+	}
+	if (do_lock)
+		binder_unlock();
+	return 0;
+}
+
 static const struct file_operations binder_fops = {
 	.owner = THIS_MODULE,
 	.poll = binder_poll,
@@ -3552,6 +4405,8 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(transaction_events);
+BINDER_DEBUG_ENTRY(transaction_latency);
 
 static int __init binder_init(void)
 {
@@ -3592,6 +4447,16 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("transaction_events",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_transaction_events_fops);
+		debugfs_create_file("transaction_latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_transaction_latency_fops);
 	}
 	return ret;
 }
@@ -0,0 +1,108 @@
+/* binder_trace.h
+ *
+ * Copyright (C) 2010 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(int debug_id, int reply, int from_proc, int from_thread,
+		 int to_proc, int to_thread, unsigned int code,
+		 unsigned int flags, size_t data_size),
+	TP_ARGS(debug_id, reply, from_proc, from_thread, to_proc, to_thread,
+		code, flags, data_size),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, reply)
+		__field(int, from_proc)
+		__field(int, from_thread)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+		__field(size_t, data_size)
+	),
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->reply = reply;
+		__entry->from_proc = from_proc;
+		__entry->from_thread = from_thread;
+		__entry->to_proc = to_proc;
+		__entry->to_thread = to_thread;
+		__entry->code = code;
+		__entry->flags = flags;
+		__entry->data_size = data_size;
+	),
+	TP_printk("transaction=%d dest_proc=%d dest_thread=%d reply=%d "
+		  "from=%d:%d code=0x%x flags=0x%x size=%zd",
+		  __entry->debug_id, __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->from_proc, __entry->from_thread,
+		  __entry->code, __entry->flags, __entry->data_size)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(int debug_id, int proc, int thread, u64 queued_ns),
+	TP_ARGS(debug_id, proc, thread, queued_ns),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, proc)
+		__field(int, thread)
+		__field(u64, queued_ns)
+	),
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->proc = proc;
+		__entry->thread = thread;
+		__entry->queued_ns = queued_ns;
+	),
+	TP_printk("transaction=%d proc=%d thread=%d queued=%llu ns",
+		  __entry->debug_id, __entry->proc, __entry->thread,
+		  (unsigned long long)__entry->queued_ns)
+);
+
+TRACE_EVENT(binder_transaction_done,
+	TP_PROTO(int debug_id, int proc, unsigned int code, u64 latency_ns),
+	TP_ARGS(debug_id, proc, code, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, proc)
+		__field(unsigned int, code)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->debug_id = debug_id;
+		__entry->proc = proc;
+		__entry->code = code;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("transaction=%d proc=%d code=0x%x latency=%llu ns",
+		  __entry->debug_id, __entry->proc, __entry->code,
+		  (unsigned long long)__entry->latency_ns)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
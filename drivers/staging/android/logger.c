@@ -25,10 +25,83 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/* size of each of the two per-cpu staging buffers of a log */
+#define LOGGER_STAGE_SIZE	(2 * LOGGER_ENTRY_MAX_LEN)
+
+/* longest time an entry stays staged when nobody looks at the log */
+#define LOGGER_STAGE_DELAY	(HZ / 10)
+
+/* uncompressed size of an archive chunk */
+#define LOGGER_CHUNK_SIZE	(4 * LOGGER_ENTRY_MAX_LEN)
+
+/*
+ * Per log budget in KB for entries that fell out of the ring. They are kept
+ * LZO compressed in chunks of LOGGER_CHUNK_SIZE; 0 disables the archive.
+ */
+static unsigned int logger_archive_kb;
+module_param_named(archive_kb, logger_archive_kb, uint, S_IRUGO | S_IWUSR);
+
+/*
+ * struct logger_chunk - a chunk of archived entries
+ *
+ * Entries are appended to the pending chunk of a log until it is full; the
+ * chunk is then sealed and compressed by the log's compress_work. Sealed
+ * chunks never change their contents. Protected by log->mutex.
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in logger_log's archive */
+	unsigned long		seq;	/* sequence number of the chunk */
+	unsigned char		*data;	/* raw or compressed entries */
+	size_t			raw_len; /* bytes of entries */
+	size_t			comp_len; /* size of data once compressed */
+	unsigned		sealed:1; /* no more entries are added */
+	unsigned		busy:1;	/* being compressed */
+	unsigned		dropped:1; /* flushed while busy */
+};
+
+/*
+ * struct logger_stage - per-cpu staging area for writers
+ *
+ * Writers append entries to the active buffer under 'mutex' instead of
+ * log->mutex. This is not lock free: the copy from user space is done under
+ * 'mutex' and can sleep, so a writer preempted or migrated meanwhile can
+ * make another writer on this cpu wait, and so can a drain. But writers on
+ * different cpus never contend.
+ *
+ * The entries are moved into the log when somebody looks at the log, when a
+ * stage fills up, or LOGGER_STAGE_DELAY after they were written. Each drain
+ * starts a new log->stage_gen, and the first to take a stage's 'mutex' in
+ * the new generation, writer or drain, switches its buffers. A drain takes
+ * every buffer of the previous generation, so when a writer moves between
+ * cpus, an entry it wrote after one drained is never drained before an
+ * earlier one. The drain_ fields are protected by log->mutex.
+ *
+ * Entries are stored 4-byte aligned, each after a __u32 taken from
+ * log->stage_seq that gives its place in the write order across cpus.
+ */
+struct logger_stage {
+	struct mutex		mutex;	/* protects the fields up to gen */
+	unsigned char		*buf[2]; /* active and draining buffer */
+	size_t			len[2];	/* bytes used in each buffer */
+	size_t			nr[2];	/* entries in each buffer */
+	int			active;	/* index of the buffer writers use */
+	unsigned int		gen;	/* log->stage_gen of the active buffer */
+	unsigned char		*drain_buf; /* buffer being drained */
+	size_t			drain_len; /* bytes to drain */
+	size_t			drain_off; /* next entry to drain */
+};
+
+#define LOGGER_STAGE_SEQ	sizeof(__u32)	/* sequence before each entry */
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
@@ -45,6 +118,17 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_stage	*stages; /* per-cpu writer staging areas */
+	atomic_t		stage_seq; /* orders staged entries */
+	unsigned int		stage_gen; /* number of drains started */
+	struct delayed_work	drain_work; /* drains entries left staged */
+	struct list_head	archive; /* archived chunks, oldest first */
+	struct logger_chunk	*pending; /* chunk being filled */
+	unsigned long		archive_seq; /* seq of the next chunk */
+	size_t			archive_bytes; /* memory used by chunks */
+	struct work_struct	compress_work; /* compresses sealed chunks */
+	void			*lzo_wrkmem; /* used by compress_work */
+	unsigned char		*lzo_buf; /* used by compress_work */
 };
 
 /*
@@ -57,6 +141,12 @@ struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	int			in_archive; /* reading archived entries */
+	unsigned long		a_seq;	/* archive chunk being read */
+	size_t			a_off;	/* offset of the next entry in it */
+	unsigned char		*a_buf;	/* decompressed copy of a chunk */
+	unsigned long		a_buf_seq; /* chunk held in a_buf */
+	int			a_buf_valid; /* a_buf holds a chunk */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -107,6 +197,290 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * logger_chunk_free - removes 'chunk' from the archive and frees it, unless
+ * compress_work is using it, in which case it frees it when done.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static void logger_chunk_free(struct logger_log *log,
+			      struct logger_chunk *chunk)
+{
+	list_del_init(&chunk->list);
+	log->archive_bytes -= chunk->comp_len ? chunk->comp_len :
+			      LOGGER_CHUNK_SIZE;
+	if (log->pending == chunk)
+		log->pending = NULL;
+	if (chunk->busy) {
+		chunk->dropped = 1;
+		return;
+	}
+	kfree(chunk->data);
+	kfree(chunk);
+}
+
+/*
+ * logger_archive_trim - drops the oldest chunks until the archive fits its
+ * budget again. Chunks still waiting for compression are only dropped if
+ * 'force' is set.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static void logger_archive_trim(struct logger_log *log, int force)
+{
+	struct logger_chunk *chunk;
+	size_t limit = (size_t)logger_archive_kb << 10;
+
+	while (log->archive_bytes > limit && !list_empty(&log->archive)) {
+		chunk = list_first_entry(&log->archive, struct logger_chunk,
+					 list);
+		if (chunk == log->pending || chunk->busy ||
+		    (!chunk->comp_len && !force))
+			break;
+		logger_chunk_free(log, chunk);
+	}
+}
+
+/*
+ * logger_archive_flush - drops all archived entries; readers that were in
+ * the archive continue from the head of the ring.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static void logger_archive_flush(struct logger_log *log)
+{
+	struct logger_chunk *chunk, *tmp;
+	struct logger_reader *reader;
+
+	list_for_each_entry_safe(chunk, tmp, &log->archive, list)
+		logger_chunk_free(log, chunk);
+
+	list_for_each_entry(reader, &log->readers, list) {
+		if (reader->in_archive) {
+			reader->in_archive = 0;
+			reader->r_off = log->head;
+		}
+		reader->a_buf_valid = 0;
+	}
+}
+
+/*
+ * logger_archive_chunk - returns a pending chunk with room for 'len' more
+ * bytes, sealing the current one and queueing it for compression if it is
+ * full. Returns NULL if no memory is available.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static struct logger_chunk *logger_archive_chunk(struct logger_log *log,
+						 size_t len)
+{
+	struct logger_chunk *chunk = log->pending;
+
+	if (chunk && chunk->raw_len + len <= LOGGER_CHUNK_SIZE)
+		return chunk;
+
+	if (chunk) {
+		chunk->sealed = 1;
+		log->pending = NULL;
+		schedule_work(&log->compress_work);
+	}
+
+	/* don't let the archive grow if compression can't keep up */
+	logger_archive_trim(log, log->archive_bytes >
+			    ((size_t)logger_archive_kb << 10) +
+			    2 * LOGGER_CHUNK_SIZE);
+
+	chunk = kzalloc(sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
+		return NULL;
+	chunk->data = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+	if (!chunk->data) {
+		kfree(chunk);
+		return NULL;
+	}
+	chunk->seq = log->archive_seq++;
+	list_add_tail(&chunk->list, &log->archive);
+	log->archive_bytes += LOGGER_CHUNK_SIZE;
+	log->pending = chunk;
+
+	return chunk;
+}
+
+/*
+ * logger_archive - appends the entries from 'off' up to 'end', which are
+ * about to be overwritten in the ring, to the archive. Readers sitting on one
+ * of those entries continue reading it from the archive.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static void logger_archive(struct logger_log *log, size_t off, size_t end)
+{
+	struct logger_chunk *chunk;
+	struct logger_reader *reader;
+	size_t len, part;
+
+	while (off != end) {
+		len = get_entry_len(log, off);
+		chunk = logger_archive_chunk(log, len);
+		if (!chunk)
+			return;
+
+		list_for_each_entry(reader, &log->readers, list) {
+			if (reader->in_archive || reader->r_off != off)
+				continue;
+			reader->in_archive = 1;
+			reader->a_seq = chunk->seq;
+			reader->a_off = chunk->raw_len;
+		}
+
+		part = min(len, log->size - off);
+		memcpy(chunk->data + chunk->raw_len, log->buffer + off, part);
+		if (len != part)
+			memcpy(chunk->data + chunk->raw_len + part, log->buffer,
+			       len - part);
+		chunk->raw_len += len;
+		off = logger_offset(off + len);
+	}
+}
+
+/*
+ * logger_compress_work - compresses sealed chunks of the archive. The raw
+ * data of a sealed chunk is immutable, so it is compressed without holding
+ * log->mutex.
+ */
+static void logger_compress_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      compress_work);
+	struct logger_chunk *chunk;
+	unsigned char *data;
+	size_t comp_len;
+	int ret;
+
+	if (!log->lzo_wrkmem)
+		log->lzo_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!log->lzo_buf)
+		log->lzo_buf = kmalloc(lzo1x_worst_compress(LOGGER_CHUNK_SIZE),
+				       GFP_KERNEL);
+	if (!log->lzo_wrkmem || !log->lzo_buf)
+		return;
+
+	for (;;) {
+		mutex_lock(&log->mutex);
+		data = NULL;
+		list_for_each_entry(chunk, &log->archive, list) {
+			if (chunk->sealed && !chunk->comp_len) {
+				chunk->busy = 1;
+				data = chunk->data;
+				break;
+			}
+		}
+		mutex_unlock(&log->mutex);
+		if (!data)
+			return;
+
+		ret = lzo1x_1_compress(data, chunk->raw_len, log->lzo_buf,
+				       &comp_len, log->lzo_wrkmem);
+		data = NULL;
+		if (ret == LZO_E_OK && comp_len < chunk->raw_len) {
+			data = kmalloc(comp_len, GFP_KERNEL);
+			if (data)
+				memcpy(data, log->lzo_buf, comp_len);
+		}
+
+		mutex_lock(&log->mutex);
+		chunk->busy = 0;
+		if (chunk->dropped) {
+			kfree(chunk->data);
+			kfree(chunk);
+			kfree(data);
+		} else if (data) {
+			kfree(chunk->data);
+			chunk->data = data;
+			chunk->comp_len = comp_len;
+			log->archive_bytes -= LOGGER_CHUNK_SIZE - comp_len;
+		} else {
+			/* incompressible, keep it raw */
+			chunk->comp_len = LOGGER_CHUNK_SIZE;
+		}
+		logger_archive_trim(log, 0);
+		mutex_unlock(&log->mutex);
+	}
+}
+
+/*
+ * logger_archive_entry - returns the next archived entry for 'reader', or
+ * NULL once the reader has caught up with the ring, in which case it leaves
+ * the archive and continues at the head of the ring.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static struct logger_entry *logger_archive_entry(struct logger_log *log,
+						 struct logger_reader *reader)
+{
+	struct logger_chunk *chunk;
+	size_t len;
+
+	list_for_each_entry(chunk, &log->archive, list) {
+		if (chunk->seq < reader->a_seq)
+			continue;
+		if (chunk->seq > reader->a_seq) {
+			/* our chunk was trimmed, skip ahead */
+			reader->a_seq = chunk->seq;
+			reader->a_off = 0;
+		}
+		if (reader->a_off < chunk->raw_len)
+			break;
+		if (!chunk->sealed)
+			goto caught_up;
+		reader->a_seq++;
+		reader->a_off = 0;
+	}
+	if (&chunk->list == &log->archive)
+		goto caught_up;
+
+	/* the pending chunk and uncompressed chunks are read in place */
+	if (!chunk->sealed || chunk->comp_len == LOGGER_CHUNK_SIZE ||
+	    !chunk->comp_len)
+		return (struct logger_entry *)(chunk->data + reader->a_off);
+
+	if (!reader->a_buf) {
+		reader->a_buf = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		if (!reader->a_buf)
+			return ERR_PTR(-ENOMEM);
+	}
+	if (!reader->a_buf_valid || reader->a_buf_seq != chunk->seq) {
+		len = LOGGER_CHUNK_SIZE;
+		if (lzo1x_decompress_safe(chunk->data, chunk->comp_len,
+					  reader->a_buf, &len) != LZO_E_OK ||
+		    len != chunk->raw_len) {
+			/* should not happen, drop the chunk for this reader */
+			reader->a_seq++;
+			reader->a_off = 0;
+			return logger_archive_entry(log, reader);
+		}
+		reader->a_buf_seq = chunk->seq;
+		reader->a_buf_valid = 1;
+	}
+	return (struct logger_entry *)(reader->a_buf + reader->a_off);
+
+caught_up:
+	reader->in_archive = 0;
+	reader->r_off = log->head;
+	return NULL;
+}
+
+/*
+ * logger_has_data - does 'reader' have something to read?
+ *
+ * Caller needs to hold log->mutex.
+ */
+static inline int logger_has_data(struct logger_log *log,
+				  struct logger_reader *reader)
+{
+	return reader->in_archive || log->w_off != reader->r_off;
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
@@ -142,6 +516,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	return count;
 }
 
+static void logger_drain(struct logger_log *log);
+
 /*
  * logger_read - our log's read() method
  *
@@ -167,7 +543,8 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		logger_drain(log);
+		ret = !logger_has_data(log, reader);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -190,6 +567,29 @@ start:
 		return ret;
 
 	mutex_lock(&log->mutex);
+	logger_drain(log);
+
+	if (reader->in_archive) {
+		struct logger_entry *entry = logger_archive_entry(log, reader);
+
+		if (IS_ERR(entry)) {
+			ret = PTR_ERR(entry);
+			goto out;
+		}
+		if (entry) {
+			ret = sizeof(struct logger_entry) + entry->len;
+			if (count < ret) {
+				ret = -EINVAL;
+				goto out;
+			}
+			if (copy_to_user(buf, entry, ret)) {
+				ret = -EFAULT;
+				goto out;
+			}
+			reader->a_off += ret;
+			goto out;
+		}
+	}
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
@@ -263,11 +663,17 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+		if (logger_archive_kb)
+			logger_archive(log, log->head, head);
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
+		if (!reader->in_archive &&
+		    clock_interval(old, new, reader->r_off))
 			reader->r_off = get_next_entry(log, reader->r_off, len);
 }
 
@@ -316,6 +722,190 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 	return count;
 }
 
+/*
+ * logger_stage_next - returns the stage holding the earliest written entry
+ * not yet drained, or NULL once all stages are drained.
+ *
+ * Entries are merged by sequence number rather than timestamp, which only
+ * has tick resolution, so a writer that moves between cpus keeps its
+ * entries in order.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static struct logger_stage *logger_stage_next(struct logger_log *log)
+{
+	struct logger_stage *stage, *next = NULL;
+	__u32 seq, oldest = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		if (stage->drain_off >= stage->drain_len)
+			continue;
+		seq = *(__u32 *)(stage->drain_buf + stage->drain_off);
+		if (!next || (__s32)(seq - oldest) < 0) {
+			oldest = seq;
+			next = stage;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * logger_stage_switch - starts a new active buffer if a drain has started
+ * since the current one was, leaving the current one to that drain.
+ *
+ * The caller needs to hold stage->mutex.
+ */
+static void logger_stage_switch(struct logger_log *log,
+				struct logger_stage *stage)
+{
+	unsigned int gen = ACCESS_ONCE(log->stage_gen);
+
+	if (stage->gen == gen)
+		return;
+
+	stage->gen = gen;
+	stage->active ^= 1;
+	stage->len[stage->active] = 0;
+	stage->nr[stage->active] = 0;
+}
+
+/*
+ * logger_drain - moves the entries staged by writers on all cpus into the
+ * log, merging them in the order they were written.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void logger_drain(struct logger_log *log)
+{
+	struct logger_stage *stage;
+	struct logger_entry *entry;
+	size_t pending = 0, len;
+	int cpu, batch, old;
+
+	log->stage_gen++;
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		mutex_lock(&stage->mutex);
+		logger_stage_switch(log, stage);
+		old = stage->active ^ 1;
+		stage->drain_buf = stage->buf[old];
+		stage->drain_len = stage->len[old];
+		stage->drain_off = 0;
+		pending += stage->len[old] - stage->nr[old] * LOGGER_STAGE_SEQ;
+		mutex_unlock(&stage->mutex);
+	}
+
+	if (!pending)
+		return;
+
+	/*
+	 * Fixing up the readers once for everything we are about to write
+	 * saves walking the readers for each entry. get_next_entry() may walk
+	 * up to 'pending' plus one entry past a reader, so this is only done
+	 * while that stays well clear of the write head.
+	 */
+	batch = pending <= log->size / 4;
+	if (batch)
+		fix_up_readers(log, pending);
+
+	while ((stage = logger_stage_next(log))) {
+		entry = (struct logger_entry *)
+			(stage->drain_buf + stage->drain_off + LOGGER_STAGE_SEQ);
+		len = sizeof(struct logger_entry) + entry->len;
+		if (!batch)
+			fix_up_readers(log, len);
+		do_write_log(log, entry, len);
+		stage->drain_off += LOGGER_STAGE_SEQ +
+			ALIGN(len, sizeof(__u32));
+	}
+}
+
+/*
+ * logger_drain_work - drains entries nobody has looked at for
+ * LOGGER_STAGE_DELAY.
+ */
+static void logger_drain_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      drain_work.work);
+
+	mutex_lock(&log->mutex);
+	logger_drain(log);
+	mutex_unlock(&log->mutex);
+}
+
+/*
+ * logger_stage_write - copies the entry into the staging area of the current
+ * cpu without taking log->mutex.
+ *
+ * Returns the payload length on success, 0 if the stage is full and the entry
+ * has to go into the log directly, negative error code on failure.
+ */
+static ssize_t logger_stage_write(struct logger_log *log,
+				  const struct iovec *iov,
+				  unsigned long nr_segs, size_t count)
+{
+	struct logger_stage *stage;
+	struct logger_entry *header;
+	struct timespec now;
+	size_t len = LOGGER_STAGE_SEQ +
+		ALIGN(sizeof(struct logger_entry) + count, sizeof(__u32));
+	ssize_t ret = 0;
+	unsigned char *p;
+
+	stage = per_cpu_ptr(log->stages, get_cpu());
+	put_cpu();
+
+	mutex_lock(&stage->mutex);
+	logger_stage_switch(log, stage);
+	if (stage->len[stage->active] + len > LOGGER_STAGE_SIZE) {
+		mutex_unlock(&stage->mutex);
+		return 0;
+	}
+
+	/* stamp under the stage mutex so each stage stays in order */
+	now = current_kernel_time();
+
+	p = stage->buf[stage->active] + stage->len[stage->active];
+	*(__u32 *)p = atomic_inc_return(&log->stage_seq);
+
+	header = (struct logger_entry *)(p + LOGGER_STAGE_SEQ);
+	header->pid = current->tgid;
+	header->tid = current->pid;
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+	header->len = count;
+	header->__pad = 0;
+
+	p = (unsigned char *)header->msg;
+	while (nr_segs-- > 0 && ret < count) {
+		size_t seg = min_t(size_t, iov->iov_len, count - ret);
+
+		if (copy_from_user(p, iov->iov_base, seg)) {
+			mutex_unlock(&stage->mutex);
+			return -EFAULT;
+		}
+		p += seg;
+		ret += seg;
+		iov++;
+	}
+	header->len = ret;
+	stage->len[stage->active] += LOGGER_STAGE_SEQ +
+		ALIGN(sizeof(struct logger_entry) + ret, sizeof(__u32));
+	stage->nr[stage->active]++;
+
+	mutex_unlock(&stage->mutex);
+
+	if (!delayed_work_pending(&log->drain_work))
+		schedule_delayed_work(&log->drain_work, LOGGER_STAGE_DELAY);
+
+	return ret;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -325,25 +915,37 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	size_t orig;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
 
+	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+
+	/* null writes succeed, return zero */
+	if (unlikely(!header.len))
+		return 0;
+
+	ret = logger_stage_write(log, iov, nr_segs, header.len);
+	if (ret) {
+		if (ret > 0)
+			wake_up_interruptible(&log->wq);
+		return ret;
+	}
+
+	/* our stage is full, drain it and write to the log directly */
 	now = current_kernel_time();
 
 	header.pid = current->tgid;
 	header.tid = current->pid;
 	header.sec = now.tv_sec;
 	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
-
-	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
-		return 0;
 
 	mutex_lock(&log->mutex);
 
+	logger_drain(log);
+	orig = log->w_off;
+
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
 	 * entry after (what will be) the new write offset. We do this now
@@ -410,9 +1012,16 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
+		reader->a_buf = NULL;
+		reader->a_buf_valid = 0;
+		reader->a_off = 0;
 
 		mutex_lock(&log->mutex);
 		reader->r_off = log->head;
+		reader->in_archive = !list_empty(&log->archive);
+		if (reader->in_archive)
+			reader->a_seq = list_first_entry(&log->archive,
+					struct logger_chunk, list)->seq;
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -433,6 +1042,7 @@ static int logger_release(struct inode *ignored, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
 		list_del(&reader->list);
+		kfree(reader->a_buf);
 		kfree(reader);
 	}
 
@@ -463,13 +1073,85 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	logger_drain(log);
+	if (logger_has_data(log, reader))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
+/*
+ * logger_set_read_off - moves the read head of a reader consuming the log
+ * through mmap() forward to 'off', which has to be an entry boundary between
+ * the current read head and the write head.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static long logger_set_read_off(struct logger_log *log,
+				struct logger_reader *reader, unsigned long off)
+{
+	size_t pos = reader->r_off;
+
+	if (reader->in_archive || off >= log->size)
+		return -EINVAL;
+
+	while (pos != off) {
+		if (pos == log->w_off)
+			return -EINVAL;
+		pos = logger_offset(pos + get_entry_len(log, pos));
+	}
+	reader->r_off = off;
+
+	return 0;
+}
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Readers may map the ring read-only and parse entries in place. The read
+ * head is obtained with LOGGER_GET_READ_OFF and advanced with
+ * LOGGER_SET_READ_OFF. Since writers keep going meanwhile, a reader has to
+ * check that LOGGER_GET_READ_OFF did not change under it (it was lapped)
+ * before trusting what it parsed.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long off;
+	unsigned char *addr;
+	struct page *page;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff || size > PAGE_ALIGN(log->size))
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/*
+	 * The ring is a static array, which lives in vmalloc space when we
+	 * are built as a module, so it is only virtually contiguous. Map it
+	 * a page at a time.
+	 */
+	for (off = 0; off < size; off += PAGE_SIZE) {
+		addr = log->buffer + off;
+		if (virt_addr_valid(addr))
+			page = virt_to_page(addr);
+		else
+			page = vmalloc_to_page(addr);
+		ret = vm_insert_page(vma, vma->vm_start + off, page);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
@@ -477,6 +1159,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	long ret = -ENOTTY;
 
 	mutex_lock(&log->mutex);
+	logger_drain(log);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -499,6 +1182,19 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		if (reader->in_archive) {
+			struct logger_entry *entry;
+
+			entry = logger_archive_entry(log, reader);
+			if (IS_ERR(entry)) {
+				ret = PTR_ERR(entry);
+				break;
+			}
+			if (entry) {
+				ret = sizeof(struct logger_entry) + entry->len;
+				break;
+			}
+		}
 		if (log->w_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
@@ -509,11 +1205,33 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
+		logger_archive_flush(log);
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
 		ret = 0;
 		break;
+	case LOGGER_GET_READ_OFF:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		/* archived entries can only be read with read() */
+		if (reader->in_archive && logger_archive_entry(log, reader)) {
+			ret = -EAGAIN;
+			break;
+		}
+		ret = reader->r_off;
+		break;
+	case LOGGER_SET_READ_OFF:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_set_read_off(log, reader, arg);
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
@@ -526,6 +1244,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -538,7 +1257,7 @@ static const struct file_operations logger_fops = {
  * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -553,6 +1272,11 @@ static struct logger_log VAR = { \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.archive = LIST_HEAD_INIT(VAR .archive), \
+	.compress_work = __WORK_INITIALIZER(VAR .compress_work, \
+					    logger_compress_work), \
+	.drain_work = __DELAYED_WORK_INITIALIZER(VAR .drain_work, \
+						 logger_drain_work), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
@@ -575,19 +1299,45 @@ static struct logger_log *get_log_from_minor(int minor)
 
 static int __init init_log(struct logger_log *log)
 {
-	int ret;
+	struct logger_stage *stage;
+	int ret, cpu;
+
+	log->stages = alloc_percpu(struct logger_stage);
+	if (!log->stages)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		mutex_init(&stage->mutex);
+		stage->buf[0] = kmalloc(LOGGER_STAGE_SIZE, GFP_KERNEL);
+		stage->buf[1] = kmalloc(LOGGER_STAGE_SIZE, GFP_KERNEL);
+		if (!stage->buf[0] || !stage->buf[1]) {
+			ret = -ENOMEM;
+			goto err_free_stages;
+		}
+	}
 
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
-		return ret;
+		goto err_free_stages;
 	}
 
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
 	return 0;
+
+err_free_stages:
+	for_each_possible_cpu(cpu) {
+		stage = per_cpu_ptr(log->stages, cpu);
+		kfree(stage->buf[0]);
+		kfree(stage->buf[1]);
+	}
+	free_percpu(log->stages);
+	log->stages = NULL;
+	return ret;
 }
 
 static int __init logger_init(void)
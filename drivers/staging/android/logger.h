@@ -45,5 +45,7 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_GET_READ_OFF		_IO(__LOGGERIO, 5) /* mmap read head */
+#define LOGGER_SET_READ_OFF		_IO(__LOGGERIO, 6) /* advance it */
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,22 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Candidate processes are kept in an index bucketed by oom_adj, which is
+ * maintained from fork, exec, exit and oom_adj writes, so picking a victim only
+ * looks at the highest populated bucket instead of every process. The
+ * number of scans, the time spent in them and the kills per level are
+ * reported in the scan_count, scan_time_us, scan_max_ns and kills
+ * parameters.
+ *
+ * With pressure_mode set, the driver also samples reclaim efficiency and the
+ * major fault rate from the vm event counters every pressure_interval_ms
+ * while reclaim is running and maps them to a pressure level of 0 to 3 using
+ * the pressure_thresholds (in percent of scanned pages that could not be
+ * reclaimed) and majfault_thresholds (major faults per second) lists. At level N one process
+ * with an oom_adj of at least pressure_adj[N-1] is killed per interval, well
+ * before the minfree thresholds are reached. The current level is reported in
+ * pressure_level, which can be polled for changes (POLLPRI).
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +51,11 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/workqueue.h>
+#include <linux/sysfs.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +76,70 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static DEFINE_SPINLOCK(lowmem_deathpending_lock);
 
+static uint32_t lowmem_scan_count;
+static unsigned long lowmem_scan_time_us;
+static uint32_t lowmem_scan_max_ns;
+static uint32_t lowmem_kills[6];
+static int lowmem_kills_size = ARRAY_SIZE(lowmem_kills);
+
+#define LOWMEM_PRESSURE_LEVELS	3
+/* fewer scanned pages per interval than this say nothing about pressure */
+#define LOWMEM_PRESSURE_MIN_SCAN	(SWAP_CLUSTER_MAX * 8)
+
+static uint32_t lowmem_pressure_mode;
+static uint32_t lowmem_pressure_interval_ms = 100;
+static uint32_t lowmem_pressure_thresholds[LOWMEM_PRESSURE_LEVELS] = {
+	60, 80, 95
+};
+static int lowmem_pressure_thresholds_size = LOWMEM_PRESSURE_LEVELS;
+static uint32_t lowmem_majfault_thresholds[LOWMEM_PRESSURE_LEVELS] = {
+	250, 1000, 4000
+};
+static int lowmem_majfault_thresholds_size = LOWMEM_PRESSURE_LEVELS;
+static int lowmem_pressure_adj[LOWMEM_PRESSURE_LEVELS] = {
+	12, 6, 1
+};
+static int lowmem_pressure_adj_size = LOWMEM_PRESSURE_LEVELS;
+static uint32_t lowmem_pressure_kills[LOWMEM_PRESSURE_LEVELS];
+static int lowmem_pressure_kills_size = LOWMEM_PRESSURE_LEVELS;
+
+static uint32_t lowmem_pressure_level;
+static uint32_t lowmem_pressure;	/* percent, last interval */
+static uint32_t lowmem_majfault_rate;	/* per second, last interval */
+static unsigned long lowmem_pressure_stamp;
+static unsigned long lowmem_pressure_kill_stamp;
+static unsigned long lowmem_prev_scanned;
+static unsigned long lowmem_prev_reclaimed;
+static unsigned long lowmem_prev_majfaults;
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static struct kobject *lowmem_kobj;
+
+/*
+ * struct lowmem_task - a thread group in the victim index
+ *
+ * Thread groups are hashed by their signal_struct and queued on the bucket
+ * of their oom_adj. The rss is cached for LOWMEM_RSS_REFRESH jiffies. All
+ * fields are protected by lowmem_index_lock.
+ */
+struct lowmem_task {
+	struct hlist_node	hash;	/* in lowmem_task_hash */
+	struct list_head	list;	/* in lowmem_buckets */
+	struct task_struct	*task;	/* group leader, referenced */
+	struct signal_struct	*sig;	/* hash key */
+	int			oom_adj; /* bucket we are on */
+	int			rss;	/* cached rss in pages */
+	unsigned long		rss_stamp; /* jiffies when rss was read */
+};
+
+#define LOWMEM_BUCKETS		(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	7
+#define LOWMEM_RSS_REFRESH	(HZ / 4)
+
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_HASH_BITS];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct kmem_cache *lowmem_task_cachep;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -91,20 +176,319 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+static struct hlist_head *lowmem_task_bucket(struct signal_struct *sig)
+{
+	return &lowmem_task_hash[hash_ptr(sig, LOWMEM_HASH_BITS)];
+}
+
+/* Caller must hold lowmem_index_lock */
+static struct lowmem_task *lowmem_task_find(struct signal_struct *sig)
+{
+	struct lowmem_task *lt;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(lt, node, lowmem_task_bucket(sig), hash)
+		if (lt->sig == sig)
+			return lt;
+	return NULL;
+}
+
+/* Caller must hold lowmem_index_lock */
+static void lowmem_task_queue(struct lowmem_task *lt, int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	lt->oom_adj = oom_adj;
+	list_move(&lt->list, &lowmem_buckets[oom_adj - OOM_DISABLE]);
+}
+
+/*
+ * Adds the thread group of 'p' to the index unless it is there already or
+ * exiting. 'lt' is a preallocated entry, returned if it was not used.
+ */
+static struct lowmem_task *lowmem_task_add(struct task_struct *p,
+					   struct lowmem_task *lt)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!(p->flags & PF_EXITING) && !lowmem_task_find(p->signal)) {
+		get_task_struct(p);
+		lt->task = p;
+		lt->sig = p->signal;
+		lt->rss = 0;
+		lt->rss_stamp = jiffies - LOWMEM_RSS_REFRESH - 1;
+		INIT_LIST_HEAD(&lt->list);
+		hlist_add_head(&lt->hash, lowmem_task_bucket(lt->sig));
+		lowmem_task_queue(lt, lt->sig->oom_adj);
+		lt = NULL;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	return lt;
+}
+
+static void lowmem_index_resync_fn(struct work_struct *work);
+static DECLARE_WORK(lowmem_index_resync_work, lowmem_index_resync_fn);
+
+/*
+ * Indexes the thread group of 'p'. The notifier may not sleep, so if the
+ * entry cannot be allocated the index is resynced from a work item.
+ */
+static void lowmem_task_index(struct task_struct *p)
+{
+	struct lowmem_task *lt;
+
+	if (!p->mm)
+		return;
+	lt = kmem_cache_alloc(lowmem_task_cachep, GFP_ATOMIC | __GFP_NOWARN);
+	if (!lt) {
+		schedule_work(&lowmem_index_resync_work);
+		return;
+	}
+	lt = lowmem_task_add(p, lt);
+	if (lt)
+		kmem_cache_free(lowmem_task_cachep, lt);
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+	struct task_struct *put = NULL;
+	struct lowmem_task *lt;
+	unsigned long flags;
+
+	switch (val) {
+	case OOM_ADJ_CHANGE:
+		spin_lock_irqsave(&lowmem_index_lock, flags);
+		lt = lowmem_task_find(task->signal);
+		if (lt)
+			lowmem_task_queue(lt, task->signal->oom_adj);
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+		/* not indexed yet if the entry could not be allocated */
+		if (!lt)
+			lowmem_task_index(task);
+		break;
+	case OOM_ADJ_FORK:
+		/* children of kernel threads have no mm until they exec */
+		lowmem_task_index(task);
+		break;
+	case OOM_ADJ_EXEC:
+		/* a non-leader thread that exec'd took over as group leader */
+		spin_lock_irqsave(&lowmem_index_lock, flags);
+		lt = lowmem_task_find(task->signal);
+		if (lt && lt->task != task) {
+			put = lt->task;
+			get_task_struct(task);
+			lt->task = task;
+			lt->rss_stamp = jiffies - LOWMEM_RSS_REFRESH - 1;
+		}
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+		if (put)
+			put_task_struct(put);
+		if (!lt)
+			lowmem_task_index(task);
+		break;
+	case OOM_ADJ_EXIT:
+		spin_lock_irqsave(&lowmem_index_lock, flags);
+		lt = lowmem_task_find(task->signal);
+		if (lt) {
+			hlist_del(&lt->hash);
+			list_del(&lt->list);
+			put = lt->task;
+		}
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+		if (lt) {
+			put_task_struct(put);
+			kmem_cache_free(lowmem_task_cachep, lt);
+		}
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+/*
+ * lowmem_select - picks the largest thread group from the highest populated
+ * bucket at or above 'min_adj' and returns it with a reference held.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *oom_adj, int *size)
 {
-	struct task_struct *p;
 	struct task_struct *selected = NULL;
+	struct lowmem_task *lt, *best;
+	struct mm_struct *mm;
+	unsigned long flags;
+	int adj;
+
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		best = NULL;
+		list_for_each_entry(lt, &lowmem_buckets[adj - OOM_DISABLE],
+				    list) {
+			if (time_after(jiffies,
+				       lt->rss_stamp + LOWMEM_RSS_REFRESH)) {
+				task_lock(lt->task);
+				mm = lt->task->mm;
+				lt->rss = mm ? get_mm_rss(mm) : 0;
+				task_unlock(lt->task);
+				lt->rss_stamp = jiffies;
+			}
+			if (lt->rss <= 0)
+				continue;
+			if (!best || lt->rss > best->rss)
+				best = lt;
+		}
+		if (best) {
+			selected = best->task;
+			get_task_struct(selected);
+			*oom_adj = adj;
+			*size = best->rss;
+		}
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	return selected;
+}
+
+static void lowmem_pressure_notify_fn(struct work_struct *work)
+{
+	if (lowmem_kobj)
+		sysfs_notify(lowmem_kobj, "parameters", "pressure_level");
+}
+static DECLARE_WORK(lowmem_pressure_notify_work, lowmem_pressure_notify_fn);
+
+static void lowmem_pressure_decay_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_pressure_decay_work,
+			    lowmem_pressure_decay_fn);
+
+/*
+ * lowmem_vm_events - sums the reclaim and fault events over all CPUs.
+ *
+ * all_vm_events() takes the CPU hotplug lock and fills in every event, so
+ * only the few counters needed here are read. The sums are approximate, a
+ * CPU going offline may fold its counts into another one while they are read.
+ */
+static void lowmem_vm_events(unsigned long *scanned, unsigned long *reclaimed,
+			     unsigned long *majfaults)
+{
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	int cpu, i;
+
+	*scanned = *reclaimed = *majfaults = 0;
+	for_each_possible_cpu(cpu) {
+		struct vm_event_state *this = &per_cpu(vm_event_states, cpu);
+
+		for (i = 0; i < MAX_NR_ZONES; i++) {
+			*scanned += this->event[PGSCAN_KSWAPD_NORMAL -
+						ZONE_NORMAL + i];
+			*scanned += this->event[PGSCAN_DIRECT_NORMAL -
+						ZONE_NORMAL + i];
+			*reclaimed += this->event[PGSTEAL_NORMAL -
+						  ZONE_NORMAL + i];
+		}
+		*majfaults += this->event[PGMAJFAULT];
+	}
+#else
+	*scanned = *reclaimed = *majfaults = 0;
+#endif
+}
+
+/*
+ * lowmem_pressure_sample - updates the pressure level if the current
+ * interval is over and returns it.
+ */
+static int lowmem_pressure_sample(void)
+{
+	unsigned long interval = msecs_to_jiffies(lowmem_pressure_interval_ms);
+	unsigned long now = jiffies;
+	unsigned long scanned, reclaimed, majfaults, elapsed;
+	int level = lowmem_pressure_level;
+	int i;
+
+	if (time_before(now, lowmem_pressure_stamp + interval) ||
+	    !spin_trylock(&lowmem_pressure_lock))
+		return level;
+
+	elapsed = now - lowmem_pressure_stamp;
+	if (!elapsed || time_before(now, lowmem_pressure_stamp + interval))
+		goto out;
+
+	lowmem_vm_events(&scanned, &reclaimed, &majfaults);
+	scanned -= lowmem_prev_scanned;
+	reclaimed -= lowmem_prev_reclaimed;
+	lowmem_prev_scanned += scanned;
+	lowmem_prev_reclaimed += reclaimed;
+	/* a racing CPU hotplug fold can make a sum go back for a moment */
+	if ((long)scanned < 0 || (long)reclaimed < 0)
+		scanned = reclaimed = 0;
+	if ((long)(majfaults - lowmem_prev_majfaults) > 0)
+		lowmem_majfault_rate = (majfaults - lowmem_prev_majfaults) *
+				       HZ / elapsed;
+	else
+		lowmem_majfault_rate = 0;
+	lowmem_prev_majfaults = majfaults;
+	lowmem_pressure_stamp = now;
+
+	if (scanned < LOWMEM_PRESSURE_MIN_SCAN)
+		lowmem_pressure = 0;
+	else if (reclaimed >= scanned)
+		lowmem_pressure = 0;
+	else
+		lowmem_pressure = 100 - reclaimed * 100 / scanned;
+
+	level = 0;
+	for (i = 0; i < LOWMEM_PRESSURE_LEVELS; i++) {
+		if ((i < lowmem_pressure_thresholds_size &&
+		     lowmem_pressure >= lowmem_pressure_thresholds[i]) ||
+		    (i < lowmem_majfault_thresholds_size &&
+		     lowmem_majfault_rate >= lowmem_majfault_thresholds[i]))
+			level = i + 1;
+	}
+
+	if (level != lowmem_pressure_level) {
+		lowmem_print(3, "pressure level %d, pressure %u%%, "
+			     "major faults %u/s\n", level, lowmem_pressure,
+			     lowmem_majfault_rate);
+		lowmem_pressure_level = level;
+		schedule_work(&lowmem_pressure_notify_work);
+	}
+	/* reclaim may stop before pressure is gone, keep sampling then */
+	if (level)
+		schedule_delayed_work(&lowmem_pressure_decay_work, interval);
+out:
+	spin_unlock(&lowmem_pressure_lock);
+	return level;
+}
+
+static void lowmem_pressure_decay_fn(struct work_struct *work)
+{
+	lowmem_pressure_sample();
+}
+
+static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
 	int rem = 0;
-	int tasksize;
 	int i;
+	int level = 0;
+	int pressure_level = 0;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int selected_oom_adj = 0;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
 	unsigned long flags;
+	unsigned long long start, delta;
 
 	/*
 	 * If we already have a death outstanding, then
@@ -123,9 +507,20 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	for (i = 0; i < array_size; i++) {
 		if (other_file < lowmem_minfree[i]) {
 			min_adj = lowmem_adj[i];
+			level = i;
 			break;
 		}
 	}
+	if (lowmem_pressure_mode && nr_to_scan > 0) {
+		i = lowmem_pressure_sample();
+		if (i && i <= lowmem_pressure_adj_size &&
+		    lowmem_pressure_adj[i - 1] < min_adj &&
+		    time_after_eq(jiffies, lowmem_pressure_kill_stamp +
+			msecs_to_jiffies(lowmem_pressure_interval_ms))) {
+			min_adj = lowmem_pressure_adj[i - 1];
+			pressure_level = i;
+		}
+	}
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -139,45 +534,19 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
+	start = sched_clock();
+	selected = lowmem_select(min_adj, &selected_oom_adj, &selected_tasksize);
+	delta = sched_clock() - start;
+	lowmem_scan_count++;
+	lowmem_scan_time_us += (unsigned long)delta / NSEC_PER_USEC;
+	if (delta > lowmem_scan_max_ns)
+		lowmem_scan_max_ns = delta;
 
 	if (selected) {
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			     selected->pid, selected->comm, selected_oom_adj,
+			     selected_tasksize);
 		spin_lock_irqsave(&lowmem_deathpending_lock, flags);
 		if (!lowmem_deathpending) {
 			lowmem_print(1,
@@ -188,15 +557,60 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 			task_free_register(&task_nb);
 			force_sig(SIGKILL, selected);
 			rem -= selected_tasksize;
+			if (pressure_level) {
+				lowmem_pressure_kills[pressure_level - 1]++;
+				lowmem_pressure_kill_stamp = jiffies;
+			} else
+				lowmem_kills[level]++;
 		}
 		spin_unlock_irqrestore(&lowmem_deathpending_lock, flags);
+		put_task_struct(selected);
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
+/* Indexes the thread groups that already exist when we are loaded */
+static void lowmem_index_populate(void)
+{
+	struct task_struct *p;
+	struct lowmem_task *lt = NULL;
+
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		if (!p->mm)
+			continue;
+		if (!lt)
+			lt = kmem_cache_alloc(lowmem_task_cachep, GFP_ATOMIC);
+		if (!lt)
+			break;
+		lt = lowmem_task_add(p, lt);
+	}
+	read_unlock(&tasklist_lock);
+	if (lt)
+		kmem_cache_free(lowmem_task_cachep, lt);
+}
+
+static void lowmem_index_resync_fn(struct work_struct *work)
+{
+	lowmem_index_populate();
+}
+
+static void lowmem_index_destroy(void)
+{
+	struct lowmem_task *lt, *tmp;
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++) {
+		list_for_each_entry_safe(lt, tmp, &lowmem_buckets[i], list) {
+			list_del(&lt->list);
+			put_task_struct(lt->task);
+			kmem_cache_free(lowmem_task_cachep, lt);
+		}
+	}
+}
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -204,6 +618,20 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	int i;
+
+	lowmem_task_cachep = KMEM_CACHE(lowmem_task, 0);
+	if (!lowmem_task_cachep)
+		return -ENOMEM;
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
+	register_oom_adj_notifier(&oom_adj_nb);
+	lowmem_index_populate();
+	lowmem_pressure_stamp = jiffies;
+	lowmem_vm_events(&lowmem_prev_scanned, &lowmem_prev_reclaimed,
+			 &lowmem_prev_majfaults);
+	lowmem_kobj = kset_find_obj(module_kset, KBUILD_MODNAME);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -211,6 +639,14 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_pressure_decay_work);
+	cancel_work_sync(&lowmem_pressure_notify_work);
+	if (lowmem_kobj)
+		kobject_put(lowmem_kobj);
+	unregister_oom_adj_notifier(&oom_adj_nb);
+	cancel_work_sync(&lowmem_index_resync_work);
+	lowmem_index_destroy();
+	kmem_cache_destroy(lowmem_task_cachep);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -219,6 +655,27 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(scan_count, lowmem_scan_count, uint, S_IRUGO);
+module_param_named(scan_time_us, lowmem_scan_time_us, ulong, S_IRUGO);
+module_param_named(scan_max_ns, lowmem_scan_max_ns, uint, S_IRUGO);
+module_param_array_named(kills, lowmem_kills, uint, &lowmem_kills_size,
+			 S_IRUGO);
+module_param_named(pressure_mode, lowmem_pressure_mode, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_interval_ms, lowmem_pressure_interval_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(pressure_thresholds, lowmem_pressure_thresholds, uint,
+			 &lowmem_pressure_thresholds_size, S_IRUGO | S_IWUSR);
+module_param_array_named(majfault_thresholds, lowmem_majfault_thresholds,
+			 uint, &lowmem_majfault_thresholds_size,
+			 S_IRUGO | S_IWUSR);
+module_param_array_named(pressure_adj, lowmem_pressure_adj, int,
+			 &lowmem_pressure_adj_size, S_IRUGO | S_IWUSR);
+module_param_array_named(pressure_kills, lowmem_pressure_kills, uint,
+			 &lowmem_pressure_kills_size, S_IRUGO);
+module_param_named(pressure_level, lowmem_pressure_level, uint, S_IRUGO);
+module_param_named(pressure, lowmem_pressure, uint, S_IRUGO);
+module_param_named(majfault_rate, lowmem_majfault_rate, uint, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -20,6 +20,9 @@
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 
@@ -36,6 +39,22 @@ static void stat_dec(u64 *value)
 	*value = *value - 1;
 }
 
+static u32 page_used(struct page *page)
+{
+	return page_private(page) & XV_PAGE_USED_MASK;
+}
+
+static int page_isolated(struct page *page)
+{
+	return !!(page_private(page) & XV_PAGE_ISOLATED);
+}
+
+static void add_used(struct xv_pool *pool, struct page *page, long bytes)
+{
+	set_page_private(page, page_private(page) + bytes);
+	pool->used_bytes += bytes;
+}
+
 static int test_flag(struct block_header *block, enum blockflags flag)
 {
 	return block->prev & BIT(flag);
@@ -282,8 +301,10 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 		return -ENOMEM;
 
 	stat_inc(&pool->total_pages);
+	set_page_private(page, 0);
 
 	spin_lock(&pool->lock);
+	list_add(&page->lru, &pool->pages);
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -314,6 +335,7 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
 
 	return pool;
 }
@@ -325,55 +347,22 @@ void xv_destroy_pool(struct xv_pool *pool)
 }
 EXPORT_SYMBOL_GPL(xv_destroy_pool);
 
-/**
- * xv_malloc - Allocate block of given size from pool.
- * @pool: pool to allocate from
- * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
- *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
- *
- * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+/*
+ * Allocate block of given size from the free lists, without growing
+ * the pool. Called with pool->lock held.
  */
-int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
-		u32 *offset, gfp_t flags)
+static int __xv_malloc(struct xv_pool *pool, u32 origsize, struct page **page,
+		u32 *offset)
 {
-	int error;
-	u32 index, tmpsize, origsize, tmpoffset;
+	u32 index, size, tmpsize, tmpoffset;
 	struct block_header *block, *tmpblock;
 
-	*page = NULL;
-	*offset = 0;
-	origsize = size;
-
-	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
-		return -ENOMEM;
-
-	size = ALIGN(size, XV_ALIGN);
-
-	spin_lock(&pool->lock);
+	size = ALIGN(origsize, XV_ALIGN);
 
+	*page = NULL;
 	index = find_block(pool, size, page, offset);
-
-	if (!*page) {
-		spin_unlock(&pool->lock);
-		if (flags & GFP_NOWAIT)
-			return -ENOMEM;
-		error = grow_pool(pool, flags);
-		if (unlikely(error))
-			return error;
-
-		spin_lock(&pool->lock);
-		index = find_block(pool, size, page, offset);
-	}
-
-	if (!*page) {
-		spin_unlock(&pool->lock);
+	if (!*page)
 		return -ENOMEM;
-	}
 
 	block = get_ptr_atomic(*page, *offset, KM_USER0);
 
@@ -406,12 +395,57 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 	clear_flag(block, BLOCK_FREE);
 
 	put_ptr_atomic(block, KM_USER0);
-	spin_unlock(&pool->lock);
 
+	add_used(pool, *page, size + XV_ALIGN);
 	*offset += XV_ALIGN;
 
 	return 0;
 }
+
+/**
+ * xv_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @page: page no. that holds the object
+ * @offset: location of object within page
+ *
+ * On success, <page, offset> identifies block allocated
+ * and 0 is returned. On failure, <page, offset> is set to
+ * 0 and -ENOMEM is returned.
+ *
+ * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+ */
+int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	int error;
+
+	*page = NULL;
+	*offset = 0;
+
+	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	spin_lock(&pool->lock);
+
+	error = __xv_malloc(pool, size, page, offset);
+
+	if (error) {
+		spin_unlock(&pool->lock);
+		if (flags & GFP_NOWAIT)
+			return -ENOMEM;
+		error = grow_pool(pool, flags);
+		if (unlikely(error))
+			return error;
+
+		spin_lock(&pool->lock);
+		error = __xv_malloc(pool, size, page, offset);
+	}
+
+	spin_unlock(&pool->lock);
+
+	return error;
+}
 EXPORT_SYMBOL_GPL(xv_malloc);
 
 /*
@@ -433,6 +467,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	BUG_ON(test_flag(block, BLOCK_FREE));
 
 	block->size = ALIGN(block->size, XV_ALIGN);
+	add_used(pool, page, -(long)(block->size + XV_ALIGN));
 
 	tmpblock = BLOCK_NEXT(block);
 	if (offset + block->size + XV_ALIGN == PAGE_SIZE)
@@ -466,8 +501,12 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 		block = tmpblock;
 	}
 
-	/* No used objects in this page. Free it. */
-	if (block->size == PAGE_SIZE - XV_ALIGN) {
+	/*
+	 * No used objects in this page. Free it, unless compaction
+	 * isolated it: it is then freed by xv_compact().
+	 */
+	if (block->size == PAGE_SIZE - XV_ALIGN && !page_isolated(page)) {
+		list_del(&page->lru);
 		put_ptr_atomic(page_start, KM_USER0);
 		spin_unlock(&pool->lock);
 
@@ -476,9 +515,18 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 		return;
 	}
 
+	/*
+	 * Free blocks of isolated pages are kept off the free lists. Their
+	 * links are cleared, here and in isolate_page() for the blocks that
+	 * were already free, so that merging them later is a no-op.
+	 */
 	set_flag(block, BLOCK_FREE);
-	if (block->size >= XV_MIN_ALLOC_SIZE)
-		insert_block(pool, page, offset, block);
+	if (block->size >= XV_MIN_ALLOC_SIZE) {
+		if (!page_isolated(page))
+			insert_block(pool, page, offset, block);
+		else
+			memset(&block->link, 0, sizeof(block->link));
+	}
 
 	if (offset + block->size + XV_ALIGN != PAGE_SIZE) {
 		tmpblock = BLOCK_NEXT(block);
@@ -508,3 +556,265 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 	return pool->total_pages << PAGE_SHIFT;
 }
 EXPORT_SYMBOL_GPL(xv_get_total_size_bytes);
+
+/*
+ * Returns memory used by allocated objects and their headers
+ */
+u64 xv_get_used_size_bytes(struct xv_pool *pool)
+{
+	return pool->used_bytes;
+}
+EXPORT_SYMBOL_GPL(xv_get_used_size_bytes);
+
+/*
+ * Returns the percentage of pool memory not used by objects
+ */
+int xv_get_frag_percent(struct xv_pool *pool)
+{
+	u64 total, used;
+
+	spin_lock(&pool->lock);
+	total = pool->total_pages << PAGE_SHIFT;
+	used = pool->used_bytes;
+	spin_unlock(&pool->lock);
+
+	if (!total)
+		return 0;
+
+	return div64_u64((total - used) * 100, total);
+}
+EXPORT_SYMBOL_GPL(xv_get_frag_percent);
+
+/*
+ * Takes the free blocks of a page off the free lists, so that no new
+ * objects are allocated from it, and removes it from the page list.
+ */
+static void isolate_page(struct xv_pool *pool, struct page *page)
+{
+	u32 offset;
+	void *page_start;
+	struct block_header *block;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (offset = 0; offset < PAGE_SIZE;
+			offset += ALIGN(block->size, XV_ALIGN) + XV_ALIGN) {
+		block = (struct block_header *)((char *)page_start + offset);
+		if (test_flag(block, BLOCK_FREE) &&
+		    block->size >= XV_MIN_ALLOC_SIZE) {
+			remove_block(pool, page, offset, block,
+				    get_index_for_insert(block->size));
+			/*
+			 * xv_free() merges with this block while the page is
+			 * isolated; stale links would point at blocks that may
+			 * have been allocated since.
+			 */
+			memset(&block->link, 0, sizeof(block->link));
+		}
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	set_page_private(page, page_private(page) | XV_PAGE_ISOLATED);
+	list_del(&page->lru);
+}
+
+/*
+ * Returns an isolated page to the pool. Its free blocks, which may
+ * have grown while it was isolated, go back on the free lists.
+ */
+static void putback_page(struct xv_pool *pool, struct page *page)
+{
+	u32 offset;
+	void *page_start;
+	struct block_header *block;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (offset = 0; offset < PAGE_SIZE;
+			offset += ALIGN(block->size, XV_ALIGN) + XV_ALIGN) {
+		block = (struct block_header *)((char *)page_start + offset);
+		if (test_flag(block, BLOCK_FREE) &&
+		    block->size >= XV_MIN_ALLOC_SIZE)
+			insert_block(pool, page, offset, block);
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	set_page_private(page, page_private(page) & ~XV_PAGE_ISOLATED);
+	list_add_tail(&page->lru, &pool->pages);
+}
+
+/*
+ * Returns the offset of the first allocated block at or after 'start'
+ * in the given page and its size, or PAGE_SIZE if there is none.
+ */
+static u32 next_object(struct page *page, u32 start, u32 *size)
+{
+	u32 offset;
+	void *page_start;
+	struct block_header *block;
+
+	*size = 0;
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (offset = 0; offset < PAGE_SIZE;
+			offset += ALIGN(block->size, XV_ALIGN) + XV_ALIGN) {
+		block = (struct block_header *)((char *)page_start + offset);
+		if (offset >= start && !test_flag(block, BLOCK_FREE)) {
+			*size = block->size;
+			break;
+		}
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	return offset;
+}
+
+/*
+ * Frees an isolated page if it has no objects left, otherwise puts it
+ * back. Returns 1 if the page was freed.
+ */
+static int release_page(struct xv_pool *pool, struct page *page)
+{
+	list_del(&page->lru);
+	if (page_used(page)) {
+		putback_page(pool, page);
+		return 0;
+	}
+
+	set_page_private(page, 0);
+	__free_page(page);
+	stat_dec(&pool->total_pages);
+
+	return 1;
+}
+
+/**
+ * xv_compact - Move objects out of sparsely used pages.
+ * @pool: pool to compact
+ * @max_pages: maximum number of pages to empty
+ * @migrate: moves an object to its new location, see xv_migrate_fn
+ * @private: passed to migrate
+ * @moved: incremented for each object moved
+ *
+ * Pages using at most XV_COMPACT_MAX_USED bytes are isolated from
+ * further allocations, then each of their objects is moved to free
+ * blocks of other pages. Objects are never moved to new pages: when
+ * no free block fits, compaction stops. The pool lock is dropped while
+ * calling migrate, which may sleep.
+ *
+ * Returns the number of pages freed.
+ */
+int xv_compact(struct xv_pool *pool, int max_pages, xv_migrate_fn migrate,
+		void *private, u64 *moved)
+{
+	LIST_HEAD(isolated);
+	struct page *page, *tmp, *new_page;
+	u32 offset, new_offset, size, start;
+	int scan = XV_COMPACT_SCAN, freed = 0, full = 0, ret;
+
+	spin_lock(&pool->lock);
+
+	/* Isolate sparse pages, rotating the others to the tail */
+	list_for_each_entry_safe(page, tmp, &pool->pages, lru) {
+		if (!scan-- || !max_pages)
+			break;
+		if (page_used(page) <= XV_COMPACT_MAX_USED) {
+			isolate_page(pool, page);
+			list_add_tail(&page->lru, &isolated);
+			max_pages--;
+		} else {
+			list_move_tail(&page->lru, &pool->pages);
+		}
+	}
+
+	list_for_each_entry_safe(page, tmp, &isolated, lru) {
+		/*
+		 * Blocks merge while the lock is dropped, so always walk
+		 * from the start of the page. Allocated blocks stay put.
+		 */
+		start = 0;
+		while (!full) {
+			offset = next_object(page, start, &size);
+			if (offset == PAGE_SIZE)
+				break;
+			start = offset + XV_ALIGN;
+
+			if (__xv_malloc(pool, size, &new_page, &new_offset)) {
+				full = 1;
+				break;
+			}
+			spin_unlock(&pool->lock);
+
+			ret = migrate(private, page, offset + XV_ALIGN,
+					new_page, new_offset);
+			if (ret) {
+				xv_free(pool, new_page, new_offset);
+			} else {
+				xv_free(pool, page, offset + XV_ALIGN);
+				(*moved)++;
+			}
+
+			cond_resched();
+			spin_lock(&pool->lock);
+		}
+
+		freed += release_page(pool, page);
+	}
+
+	spin_unlock(&pool->lock);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(xv_compact);
+
+/**
+ * xv_evict - Drop all objects of some pages.
+ * @pool: pool to shrink
+ * @max_pages: number of pages to empty
+ * @evict: drops an object, see xv_evict_fn
+ * @private: passed to evict
+ * @evicted: incremented for each object dropped
+ *
+ * Unlike freeing objects one by one, which rarely empties a page, this
+ * frees whole pages. Pages are taken from the tail of the page list,
+ * new pages being added at its head, so older pages tend to go first.
+ * The pool lock is dropped while calling evict, which may sleep.
+ *
+ * Returns the number of pages freed.
+ */
+int xv_evict(struct xv_pool *pool, int max_pages, xv_evict_fn evict,
+		void *private, u64 *evicted)
+{
+	LIST_HEAD(isolated);
+	struct page *page, *tmp;
+	u32 offset, size, start;
+	int freed = 0;
+
+	spin_lock(&pool->lock);
+
+	while (max_pages-- && !list_empty(&pool->pages)) {
+		page = list_entry(pool->pages.prev, struct page, lru);
+		isolate_page(pool, page);
+		list_add_tail(&page->lru, &isolated);
+	}
+
+	list_for_each_entry_safe(page, tmp, &isolated, lru) {
+		start = 0;
+		for (;;) {
+			offset = next_object(page, start, &size);
+			if (offset == PAGE_SIZE)
+				break;
+			start = offset + XV_ALIGN;
+
+			spin_unlock(&pool->lock);
+			if (!evict(private, page, offset + XV_ALIGN))
+				(*evicted)++;
+			cond_resched();
+			spin_lock(&pool->lock);
+		}
+
+		freed += release_page(pool, page);
+	}
+
+	spin_unlock(&pool->lock);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(xv_evict);
@@ -16,6 +16,23 @@
 #include <linux/types.h>
 
 struct xv_pool;
+struct page;
+
+/*
+ * Called by xv_compact() to move the object at <page, offset> to the
+ * already allocated <new_page, new_offset>. Must copy the object and
+ * update all references to it, or return an error if it cannot be
+ * moved (e.g. because it has been freed meanwhile).
+ */
+typedef int (*xv_migrate_fn)(void *private, struct page *page, u32 offset,
+			struct page *new_page, u32 new_offset);
+
+/*
+ * Called by xv_evict() to drop the object at <page, offset>. Must free
+ * it with xv_free() after removing all references to it, or return an
+ * error if it cannot be dropped.
+ */
+typedef int (*xv_evict_fn)(void *private, struct page *page, u32 offset);
 
 struct xv_pool *xv_create_pool(void);
 void xv_destroy_pool(struct xv_pool *pool);
@@ -26,5 +43,12 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
 
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
+u64 xv_get_used_size_bytes(struct xv_pool *pool);
+int xv_get_frag_percent(struct xv_pool *pool);
+
+int xv_compact(struct xv_pool *pool, int max_pages, xv_migrate_fn migrate,
+			void *private, u64 *moved);
+int xv_evict(struct xv_pool *pool, int max_pages, xv_evict_fn evict,
+			void *private, u64 *evicted);
 
 #endif
@@ -14,6 +14,7 @@
 #define _XV_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 /* User configurable params */
@@ -48,6 +49,12 @@
 
 #define MAX_FLI		DIV_ROUND_UP(NUM_FREE_LISTS, BITS_PER_LONG)
 
+/* Pages using at most this many bytes are emptied by compaction */
+#define XV_COMPACT_MAX_USED	(PAGE_SIZE / 2)
+
+/* Pages looked at per compaction pass to find sparsely used ones */
+#define XV_COMPACT_SCAN		256
+
 /* End of user params */
 
 enum blockflags {
@@ -59,6 +66,13 @@ enum blockflags {
 #define FLAGS_MASK	XV_ALIGN_MASK
 #define PREV_MASK	(~FLAGS_MASK)
 
+/*
+ * page->private of pool pages holds the bytes used by allocated blocks
+ * (including their headers) and whether compaction isolated the page.
+ */
+#define XV_PAGE_ISOLATED	(1UL << (BITS_PER_LONG - 1))
+#define XV_PAGE_USED_MASK	(XV_PAGE_ISOLATED - 1)
+
 struct freelist_entry {
 	struct page *page;
 	u16 offset;
@@ -88,6 +102,8 @@ struct xv_pool {
 	ulong flbitmap;
 	ulong slbitmap[MAX_FLI];
 	u64 total_pages;	/* stats */
+	u64 used_bytes;		/* in allocated blocks, including headers */
+	struct list_head pages;	/* all pages not isolated by compaction */
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 	spinlock_t lock;
 };
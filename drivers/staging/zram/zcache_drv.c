@@ -20,16 +20,17 @@
  * instance of mounted filesystem.
  *  - inode_no: This represents a file/inode within this filesystem. An
  * inode is represented using struct zcache_inode_rb within zcache which
- * are arranged in a red-black tree indexed using inode_no.
+ * are spread over ZCACHE_INODE_SHARDS radix trees indexed using inode_no.
+ * Lookups only take the RCU read lock, updates the lock of the shard.
  *  - index: This represents page/index within an inode. Pages within an
- * inode are arranged in a radix tree. So, each node of red-black tree
- * above refers to a separate radix tree.
+ * inode are arranged in a radix tree. So, each inode node above refers
+ * to a separate radix tree.
  *
  * Locking order:
  * 1. zcache_inode_rb->tree_lock	(spin_lock)
- * 2. zcache_pool->tree_lock		(rwlock_t: write)
+ * 2. zcache_inode_shard->lock		(spin_lock)
  *
- * Nodes in an inode tree are reference counted and are freed when they
+ * Nodes in an inode shard are reference counted and are freed when they
  * do not any pages i.e. corresponding radix tree, maintaining list of
  * pages associated with this inode, is empty.
  */
@@ -42,7 +43,7 @@
 #include <linux/cleancache.h>
 #include <linux/cpu.h>
 #include <linux/highmem.h>
-#include <linux/lzo.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/u64_stats_sync.h>
@@ -51,7 +52,6 @@
 #include "zcache_drv.h"
 
 static DEFINE_PER_CPU(unsigned char *, compress_buffer);
-static DEFINE_PER_CPU(unsigned char *, compress_workmem);
 
 /*
  * For zero-filled pages, we directly insert 'index' value
@@ -159,6 +159,79 @@ static void zcache_dump_stats(struct zcache_pool *zpool)
 	pr_debug("\n");
 }
 
+static void zcache_comp_free(struct zcache_comp *comp)
+{
+	unsigned int cpu;
+	struct crypto_comp *tfm;
+
+	if (comp->tfm) {
+		for_each_possible_cpu(cpu) {
+			tfm = *per_cpu_ptr(comp->tfm, cpu);
+			if (tfm)
+				crypto_free_comp(tfm);
+		}
+		free_percpu(comp->tfm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Returns the compressor currently selected for new pools, allocating
+ * its per-CPU instances if no other pool uses it yet.
+ */
+static struct zcache_comp *zcache_comp_get(void)
+{
+	unsigned int cpu;
+	struct crypto_comp *tfm;
+	struct zcache_comp *comp;
+
+	mutex_lock(&zcache->comp_lock);
+	list_for_each_entry(comp, &zcache->comps, list)
+		if (!strcmp(comp->name, zcache->compressor))
+			goto out;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		goto out;
+
+	strcpy(comp->name, zcache->compressor);
+	comp->tfm = alloc_percpu(struct crypto_comp *);
+	if (!comp->tfm)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(comp->name, 0, 0);
+		if (IS_ERR(tfm)) {
+			pr_info("Failed to allocate compressor: %s\n",
+				comp->name);
+			goto fail;
+		}
+		*per_cpu_ptr(comp->tfm, cpu) = tfm;
+	}
+	list_add(&comp->list, &zcache->comps);
+
+out:
+	if (comp)
+		comp->users++;
+	mutex_unlock(&zcache->comp_lock);
+	return comp;
+
+fail:
+	zcache_comp_free(comp);
+	comp = NULL;
+	goto out;
+}
+
+static void zcache_comp_put(struct zcache_comp *comp)
+{
+	mutex_lock(&zcache->comp_lock);
+	if (!--comp->users) {
+		list_del(&comp->list);
+		zcache_comp_free(comp);
+	}
+	mutex_unlock(&zcache->comp_lock);
+}
+
 static void zcache_destroy_pool(struct zcache_pool *zpool)
 {
 	int i;
@@ -174,16 +247,24 @@ static void zcache_destroy_pool(struct zcache_pool *zpool)
 	zcache->pools[i] = NULL;
 	spin_unlock(&zcache->pool_lock);
 
-	if (!RB_EMPTY_ROOT(&zpool->inode_tree)) {
-		pr_warn("Memory leak detected. Freeing non-empty pool!\n");
-		zcache_dump_stats(zpool);
+	for (i = 0; i < ZCACHE_INODE_SHARDS; i++) {
+		if (zpool->shards[i].tree.rnode) {
+			pr_warn("Memory leak detected. "
+				"Freeing non-empty pool!\n");
+			zcache_dump_stats(zpool);
+			break;
+		}
 	}
 
+	if (zpool->comp)
+		zcache_comp_put(zpool->comp);
 	free_percpu(zpool->stats);
 	xv_destroy_pool(zpool->xv_pool);
 	kfree(zpool);
 }
 
+static void zcache_compact_work(struct work_struct *work);
+
 /*
  * Allocate a new zcache pool and set default memlimit.
  *
@@ -191,7 +272,7 @@ static void zcache_destroy_pool(struct zcache_pool *zpool)
  */
 int zcache_create_pool(void)
 {
-	int ret;
+	int i, ret;
 	u64 memlimit;
 	struct zcache_pool *zpool = NULL;
 
@@ -227,9 +308,18 @@ int zcache_create_pool(void)
 		goto out;
 	}
 
-	rwlock_init(&zpool->tree_lock);
+	zpool->comp = zcache_comp_get();
+	if (!zpool->comp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < ZCACHE_INODE_SHARDS; i++) {
+		INIT_RADIX_TREE(&zpool->shards[i].tree, GFP_NOWAIT);
+		spin_lock_init(&zpool->shards[i].lock);
+	}
 	seqlock_init(&zpool->memlimit_lock);
-	zpool->inode_tree = RB_ROOT;
+	INIT_WORK(&zpool->compact_work, zcache_compact_work);
 
 	memlimit = zcache_pool_default_memlimit_perc_ram *
 				((totalram_pages << PAGE_SHIFT) / 100);
@@ -251,9 +341,21 @@ out:
 	return ret;
 }
 
+static struct zcache_inode_shard *zcache_inode_shard(
+			struct zcache_pool *zpool, ino_t inode_no)
+{
+	return &zpool->shards[inode_no & (ZCACHE_INODE_SHARDS - 1)];
+}
+
+/* Key of an inode in its shard, consecutive inodes keep trees dense */
+static unsigned long zcache_inode_key(ino_t inode_no)
+{
+	return inode_no >> ZCACHE_INODE_SHARD_BITS;
+}
+
 /*
  * Allocate a new zcache node and insert it in given pool's
- * inode_tree at location 'inode_no'.
+ * inode shard at location 'inode_no'.
  *
  * On success, returns newly allocated node and increments
  * its refcount for caller. Returns NULL on failure.
@@ -261,18 +363,19 @@ out:
 static struct zcache_inode_rb *zcache_inode_create(int pool_id,
 						ino_t inode_no)
 {
+	int ret;
 	unsigned long flags;
-	struct rb_node *parent, **link;
 	struct zcache_inode_rb *new_znode;
+	struct zcache_inode_shard *shard;
 	struct zcache_pool *zpool = zcache->pools[pool_id];
 
 	/*
 	 * We can end up allocating multiple nodes due to racing
 	 * zcache_put_page(). But only one will be added to zpool
-	 * inode tree and rest will be freed.
+	 * inode shard and rest will be freed.
 	 *
 	 * To avoid this possibility of redundant allocation, we
-	 * could do it inside zpool tree lock. However, that seems
+	 * could do it inside the shard lock. However, that seems
 	 * more wasteful.
 	 */
 	new_znode = kzalloc(sizeof(*new_znode), GFP_NOWAIT);
@@ -282,40 +385,28 @@ static struct zcache_inode_rb *zcache_inode_create(int pool_id,
 	INIT_RADIX_TREE(&new_znode->page_tree, GFP_NOWAIT);
 	spin_lock_init(&new_znode->tree_lock);
 	kref_init(&new_znode->refcount);
-	RB_CLEAR_NODE(&new_znode->rb_node);
 	new_znode->inode_no = inode_no;
 	new_znode->pool = zpool;
 
-	parent = NULL;
-	write_lock_irqsave(&zpool->tree_lock, flags);
-	link = &zpool->inode_tree.rb_node;
-	while (*link) {
-		struct zcache_inode_rb *znode;
-
-		znode = rb_entry(*link, struct zcache_inode_rb, rb_node);
-		parent = *link;
-
-		if (znode->inode_no > inode_no)
-			link = &(*link)->rb_left;
-		else if (znode->inode_no < inode_no)
-			link = &(*link)->rb_right;
-		else {
-			/*
-			 * New node added by racing zcache_put_page(). Free
-			 * this newly allocated node and use the existing one.
-			 */
-			kfree(new_znode);
-			new_znode = znode;
-			goto out;
-		}
+	shard = zcache_inode_shard(zpool, inode_no);
+	spin_lock_irqsave(&shard->lock, flags);
+	ret = radix_tree_insert(&shard->tree, zcache_inode_key(inode_no),
+				new_znode);
+	if (ret == -EEXIST) {
+		/*
+		 * New node added by racing zcache_put_page(). Free
+		 * this newly allocated node and use the existing one.
+		 */
+		kfree(new_znode);
+		new_znode = radix_tree_lookup(&shard->tree,
+					zcache_inode_key(inode_no));
+	} else if (unlikely(ret)) {
+		spin_unlock_irqrestore(&shard->lock, flags);
+		kfree(new_znode);
+		return NULL;
 	}
-
-	rb_link_node(&new_znode->rb_node, parent, link);
-	rb_insert_color(&new_znode->rb_node, &zpool->inode_tree);
-
-out:
 	kref_get(&new_znode->refcount);
-	write_unlock_irqrestore(&zpool->tree_lock, flags);
+	spin_unlock_irqrestore(&shard->lock, flags);
 
 	return new_znode;
 }
@@ -328,10 +419,16 @@ static int zcache_inode_is_empty(struct zcache_inode_rb *znode)
 	return znode->page_tree.rnode == NULL;
 }
 
+static void zcache_inode_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct zcache_inode_rb, rcu));
+}
+
 /*
  * kref_put callback for zcache node.
  *
- * The node must have been isolated already.
+ * The node must have been isolated already. Lookups running under
+ * RCU may still see it, so it is freed after a grace period.
  */
 static void zcache_inode_release(struct kref *kref)
 {
@@ -339,37 +436,39 @@ static void zcache_inode_release(struct kref *kref)
 
 	znode = container_of(kref, struct zcache_inode_rb, refcount);
 	BUG_ON(!zcache_inode_is_empty(znode));
-	kfree(znode);
+	call_rcu(&znode->rcu, zcache_inode_free_rcu);
 }
 
 /*
- * Removes the given node from its inode_tree and drops corresponding
+ * Removes the given node from its inode shard and drops corresponding
  * refcount. Its called when someone removes the last page from a
  * zcache node.
  *
- * Called under zcache_inode_rb->spin_lock
+ * Called under zcache_inode_rb->tree_lock
  */
 static void zcache_inode_isolate(struct zcache_inode_rb *znode)
 {
 	unsigned long flags;
-	struct zcache_pool *zpool = znode->pool;
+	struct zcache_inode_shard *shard;
 
-	write_lock_irqsave(&zpool->tree_lock, flags);
+	shard = zcache_inode_shard(znode->pool, znode->inode_no);
+	spin_lock_irqsave(&shard->lock, flags);
 	/*
 	 * Someone can get reference on this node before we could
-	 * acquire write lock above. We want to remove it from its
-	 * inode_tree when only the caller and corresponding inode_tree
-	 * holds a reference to it. This ensures that a racing zcache
-	 * put will not end up adding a page to an isolated node and
-	 * thereby losing that memory.
-	 *
+	 * acquire the shard lock above. We want to remove it from its
+	 * shard when only the caller and corresponding shard hold a
+	 * reference to it. A lookup can still take a reference right
+	 * after the check: 'dead', tested under tree_lock before adding
+	 * pages, makes sure a racing zcache put does not end up adding
+	 * a page to an isolated node and thereby losing that memory.
 	 */
-	if (atomic_read(&znode->refcount.refcount) == 2) {
-		rb_erase(&znode->rb_node, &znode->pool->inode_tree);
-		RB_CLEAR_NODE(&znode->rb_node);
+	if (!znode->dead && atomic_read(&znode->refcount.refcount) == 2) {
+		radix_tree_delete(&shard->tree,
+				zcache_inode_key(znode->inode_no));
+		znode->dead = 1;
 		kref_put(&znode->refcount, zcache_inode_release);
 	}
-	write_unlock_irqrestore(&zpool->tree_lock, flags);
+	spin_unlock_irqrestore(&shard->lock, flags);
 }
 
 /*
@@ -381,30 +480,19 @@ static void zcache_inode_isolate(struct zcache_inode_rb *znode)
 static struct zcache_inode_rb *zcache_find_inode(struct zcache_pool *zpool,
 						ino_t inode_no)
 {
-	unsigned long flags;
-	struct rb_node *node;
-
-	read_lock_irqsave(&zpool->tree_lock, flags);
-	node = zpool->inode_tree.rb_node;
-	while (node) {
-		struct zcache_inode_rb *znode;
-
-		znode = rb_entry(node, struct zcache_inode_rb, rb_node);
-		if (znode->inode_no > inode_no)
-			node = node->rb_left;
-		else if (znode->inode_no < inode_no)
-			node = node->rb_right;
-		else {
-			/* found */
-			kref_get(&znode->refcount);
-			read_unlock_irqrestore(&zpool->tree_lock, flags);
-			return znode;
-		}
-	}
-	read_unlock_irqrestore(&zpool->tree_lock, flags);
+	struct zcache_inode_rb *znode;
+	struct zcache_inode_shard *shard;
+
+	shard = zcache_inode_shard(zpool, inode_no);
 
-	/* not found */
-	return NULL;
+	rcu_read_lock();
+	znode = radix_tree_lookup(&shard->tree, zcache_inode_key(inode_no));
+	/* The node is being freed if its refcount already dropped to 0 */
+	if (znode && !atomic_inc_not_zero(&znode->refcount.refcount))
+		znode = NULL;
+	rcu_read_unlock();
+
+	return znode;
 }
 
 static void zcache_handle_zero_page(struct page *page)
@@ -504,6 +592,98 @@ static unsigned long zcache_ptr_to_index(void *ptr)
 	return index;
 }
 
+/*
+ * Called by xv_compact() to move the object at <page, offset>. Its
+ * header leads to the radix node, which is only updated if it still
+ * refers to the object: it may have been freed or taken by get_page.
+ */
+static int zcache_migrate(void *private, struct page *page, u32 offset,
+			struct page *new_page, u32 new_offset)
+{
+	int ret = -ENOENT;
+	void **slot;
+	ino_t inode_no;
+	unsigned long index, flags;
+	unsigned char *src_data, *dest_data;
+
+	struct zcache_objheader *zheader;
+	struct zcache_inode_rb *znode;
+	struct zcache_pool *zpool = private;
+
+	zheader = kmap_atomic(page, KM_USER0) + offset;
+	index = zheader->index;
+	inode_no = zheader->inode_no;
+	kunmap_atomic(zheader, KM_USER0);
+
+	znode = zcache_find_inode(zpool, inode_no);
+	if (!znode)
+		return ret;
+
+	spin_lock_irqsave(&znode->tree_lock, flags);
+	slot = radix_tree_lookup_slot(&znode->page_tree, index);
+	if (slot && radix_tree_deref_slot(slot) ==
+			zcache_xv_location_to_ptr(page, offset)) {
+		src_data = kmap_atomic(page, KM_USER0) + offset;
+		dest_data = kmap_atomic(new_page, KM_USER1) + new_offset;
+		memcpy(dest_data, src_data, xv_get_object_size(src_data));
+		kunmap_atomic(dest_data, KM_USER1);
+		kunmap_atomic(src_data, KM_USER0);
+
+		radix_tree_replace_slot(slot,
+			zcache_xv_location_to_ptr(new_page, new_offset));
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&znode->tree_lock, flags);
+
+	kref_put(&znode->refcount, zcache_inode_release);
+
+	return ret;
+}
+
+/*
+ * Moves objects out of sparsely used pages of the pool until compaction
+ * stops freeing pages. Returns the number of pages freed.
+ */
+static int zcache_compact_pool(struct zcache_pool *zpool)
+{
+	int freed, total = 0;
+	u64 moved = 0;
+
+	do {
+		freed = xv_compact(zpool->xv_pool, ZCACHE_COMPACT_BATCH,
+				zcache_migrate, zpool, &moved);
+		total += freed;
+	} while (freed && !zpool->dying);
+
+	zcache_add_stat(zpool, ZPOOL_STAT_COMPACT_MOVED, moved);
+	zcache_add_stat(zpool, ZPOOL_STAT_COMPACT_FREED, total);
+
+	return total;
+}
+
+static void zcache_compact_work(struct work_struct *work)
+{
+	struct zcache_pool *zpool;
+
+	zpool = container_of(work, struct zcache_pool, compact_work);
+	zcache_compact_pool(zpool);
+}
+
+/*
+ * Called with interrupts disabled, like all users of the xv_pool lock
+ */
+static int zcache_needs_compaction(struct zcache_pool *zpool)
+{
+	if (zpool->dying || work_pending(&zpool->compact_work))
+		return 0;
+
+	if (xv_get_total_size_bytes(zpool->xv_pool) >> PAGE_SHIFT <
+			zcache_compact_min_pages)
+		return 0;
+
+	return xv_get_frag_percent(zpool->xv_pool) >= zcache_compact_frag_perc;
+}
+
 void zcache_free_page(struct zcache_pool *zpool, void *ptr)
 {
 	int is_zero;
@@ -528,6 +708,8 @@ void zcache_free_page(struct zcache_pool *zpool, void *ptr)
 		zcache_add_stat(zpool, ZPOOL_STAT_COMPR_SIZE, -clen);
 		local_irq_save(flags);
 		xv_free(zpool->xv_pool, page, offset);
+		if (zcache_needs_compaction(zpool))
+			schedule_work(&zpool->compact_work);
 		local_irq_restore(flags);
 	}
 
@@ -546,12 +728,13 @@ static int zcache_store_page(struct zcache_inode_rb *znode,
 {
 	int ret;
 	void *nodeptr;
-	size_t clen;
+	unsigned int clen;
 	unsigned long flags;
 
 	u32 zoffset;
 	struct page *zpage;
-	unsigned char *zbuffer, *zworkmem;
+	struct crypto_comp *tfm;
+	unsigned char *zbuffer;
 	unsigned char *src_data, *dest_data;
 
 	struct zcache_objheader *zheader;
@@ -564,18 +747,19 @@ static int zcache_store_page(struct zcache_inode_rb *znode,
 
 	preempt_disable();
 	zbuffer = __get_cpu_var(compress_buffer);
-	zworkmem = __get_cpu_var(compress_workmem);
-	if (unlikely(!zbuffer || !zworkmem)) {
+	if (unlikely(!zbuffer)) {
 		ret = -EFAULT;
 		preempt_enable();
 		goto out;
 	}
+	tfm = *this_cpu_ptr(zpool->comp->tfm);
 
 	src_data = kmap_atomic(page, KM_USER0);
-	ret = lzo1x_1_compress(src_data, PAGE_SIZE, zbuffer, &clen, zworkmem);
+	clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(tfm, src_data, PAGE_SIZE, zbuffer, &clen);
 	kunmap_atomic(src_data, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK) || clen > zcache_max_page_size) {
+	if (unlikely(ret) || clen > zcache_max_page_size) {
 		ret = -EINVAL;
 		preempt_enable();
 		goto out;
@@ -596,6 +780,7 @@ static int zcache_store_page(struct zcache_inode_rb *znode,
 	/* Store index value in header */
 	zheader = (struct zcache_objheader *)dest_data;
 	zheader->index = index;
+	zheader->inode_no = znode->inode_no;
 	dest_data += sizeof(*zheader);
 
 	memcpy(dest_data, zbuffer, clen);
@@ -606,11 +791,18 @@ static int zcache_store_page(struct zcache_inode_rb *znode,
 
 out_store:
 	spin_lock_irqsave(&znode->tree_lock, flags);
-	ret = radix_tree_insert(&znode->page_tree, index, nodeptr);
+	/* Isolated by a racing get/flush, the caller retries */
+	if (unlikely(znode->dead))
+		ret = -ESTALE;
+	else
+		ret = radix_tree_insert(&znode->page_tree, index, nodeptr);
 	if (unlikely(ret)) {
 		spin_unlock_irqrestore(&znode->tree_lock, flags);
-		if (!is_zero)
-			__free_page(zpage);
+		if (!is_zero) {
+			local_irq_save(flags);
+			xv_free(zpool->xv_pool, zpage, zoffset);
+			local_irq_restore(flags);
+		}
 		goto out;
 	}
 	if (is_zero) {
@@ -693,79 +885,73 @@ static u32 zcache_count_excess_pages(struct zcache_pool *zpool)
 }
 
 /*
- * Free pages from this pool till we come within its memlimit.
- *
- * Currently, its called only when user sets memlimit lower than the
- * number of pages currently stored in that pool. We select nodes in
- * order of increasing inode number. This, in general, has no correlation
- * with the order in which these are added. So, it is essentially random
- * selection of nodes. Pages within a victim node node are freed in order
- * of increasing index number.
- *
- * Automatic cache resizing and better page replacement policies will
- * be implemented later.
+ * Called by xv_evict() to drop the object at <page, offset>. Like
+ * zcache_migrate(), it only does so if the radix node still refers to
+ * the object.
  */
-static void zcache_shrink_pool(struct zcache_pool *zpool)
+static int zcache_evict(void *private, struct page *page, u32 offset)
 {
-	struct rb_node *node;
+	int found = 0;
+	void **slot, *ptr;
+	ino_t inode_no;
+	unsigned long index, flags;
+
+	struct zcache_objheader *zheader;
 	struct zcache_inode_rb *znode;
+	struct zcache_pool *zpool = private;
 
-	read_lock(&zpool->tree_lock);
-	node = rb_first(&zpool->inode_tree);
-	if (unlikely(!node)) {
-		read_unlock(&zpool->tree_lock);
-		return;
+	zheader = kmap_atomic(page, KM_USER0) + offset;
+	index = zheader->index;
+	inode_no = zheader->inode_no;
+	kunmap_atomic(zheader, KM_USER0);
+
+	znode = zcache_find_inode(zpool, inode_no);
+	if (!znode)
+		return -ENOENT;
+
+	ptr = zcache_xv_location_to_ptr(page, offset);
+	spin_lock_irqsave(&znode->tree_lock, flags);
+	slot = radix_tree_lookup_slot(&znode->page_tree, index);
+	if (slot && radix_tree_deref_slot(slot) == ptr) {
+		radix_tree_delete(&znode->page_tree, index);
+		found = 1;
 	}
-	znode = rb_entry(node, struct zcache_inode_rb, rb_node);
-	kref_get(&znode->refcount);
-	read_unlock(&zpool->tree_lock);
+	if (zcache_inode_is_empty(znode))
+		zcache_inode_isolate(znode);
+	spin_unlock_irqrestore(&znode->tree_lock, flags);
 
-	do {
-		u32 pages_to_free;
-		struct rb_node *next_node;
-		struct zcache_inode_rb *next_znode;
-
-		pages_to_free = zcache_count_excess_pages(zpool);
-		if (!pages_to_free) {
-			spin_lock(&znode->tree_lock);
-			if (zcache_inode_is_empty(znode))
-				zcache_inode_isolate(znode);
-			spin_unlock(&znode->tree_lock);
-
-			kref_put(&znode->refcount, zcache_inode_release);
-			break;
-		}
+	kref_put(&znode->refcount, zcache_inode_release);
 
-		/*
-		 * Get the next victim node before we (possibly) isolate
-		 * the current node.
-		 */
-		read_lock(&zpool->tree_lock);
-		next_node = rb_next(node);
-		next_znode = NULL;
-		if (next_node) {
-			next_znode = rb_entry(next_node,
-				struct zcache_inode_rb, rb_node);
-			kref_get(&next_znode->refcount);
-		}
-		read_unlock(&zpool->tree_lock);
+	if (!found)
+		return -ENOENT;
 
-		spin_lock(&znode->tree_lock);
-		/* Free 'pages_to_free' non-zero pages in the current node */
-		zcache_free_inode_pages(znode, pages_to_free,
-					ZCACHE_TAG_NONZERO_PAGE);
-		if (zcache_inode_is_empty(znode))
-			zcache_inode_isolate(znode);
-		spin_unlock(&znode->tree_lock);
+	zcache_free_page(zpool, ptr);
+	zcache_inc_stat(zpool, ZPOOL_STAT_PAGES_EVICTED);
 
-		kref_put(&znode->refcount, zcache_inode_release);
+	return 0;
+}
 
-		/* Avoid busy-looping */
-		cond_resched();
+/*
+ * Free pages from this pool till we come within its memlimit.
+ *
+ * Currently, its called only when user sets memlimit lower than the
+ * number of pages currently stored in that pool. Rather than freeing
+ * pages one by one, which leaves the xvmalloc pool as large as it was
+ * but fragmented, all pages stored in a batch of xvmalloc pages are
+ * freed at once so that these pages go back to the system. Zero-filled
+ * pages use no memory and are kept.
+ */
+static void zcache_shrink_pool(struct zcache_pool *zpool)
+{
+	u64 evicted;
 
-		node = next_node;
-		znode = next_znode;
-	} while (znode);
+	while (zcache_count_excess_pages(zpool)) {
+		evicted = 0;
+		xv_evict(zpool->xv_pool, ZCACHE_SHRINK_BATCH, zcache_evict,
+			zpool, &evicted);
+		if (!evicted)
+			break;
+	}
 }
 
 #ifdef CONFIG_SYSFS
@@ -833,6 +1019,64 @@ static ssize_t mem_used_total_show(struct kobject *kobj,
 }
 ZCACHE_POOL_ATTR_RO(mem_used_total);
 
+/* Percentage of the memory used by this pool not used by objects */
+static ssize_t frag_percent_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	int val;
+	unsigned long flags;
+	struct zcache_pool *zpool = zcache_kobj_to_pool(kobj);
+
+	local_irq_save(flags);
+	val = xv_get_frag_percent(zpool->xv_pool);
+	local_irq_restore(flags);
+
+	return sprintf(buf, "%d\n", val);
+}
+ZCACHE_POOL_ATTR_RO(frag_percent);
+
+static ssize_t compact_moved_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	struct zcache_pool *zpool = zcache_kobj_to_pool(kobj);
+
+	return sprintf(buf, "%llu\n", zcache_get_stat(
+			zpool, ZPOOL_STAT_COMPACT_MOVED));
+}
+ZCACHE_POOL_ATTR_RO(compact_moved);
+
+static ssize_t compact_freed_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	struct zcache_pool *zpool = zcache_kobj_to_pool(kobj);
+
+	return sprintf(buf, "%llu\n", zcache_get_stat(
+			zpool, ZPOOL_STAT_COMPACT_FREED));
+}
+ZCACHE_POOL_ATTR_RO(compact_freed);
+
+static ssize_t evicted_pages_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	struct zcache_pool *zpool = zcache_kobj_to_pool(kobj);
+
+	return sprintf(buf, "%llu\n", zcache_get_stat(
+			zpool, ZPOOL_STAT_PAGES_EVICTED));
+}
+ZCACHE_POOL_ATTR_RO(evicted_pages);
+
+static ssize_t compact_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t len)
+{
+	struct zcache_pool *zpool = zcache_kobj_to_pool(kobj);
+
+	zcache_compact_pool(zpool);
+
+	return len;
+}
+static struct kobj_attribute compact_attr =
+	__ATTR(compact, 0200, NULL, compact_store);
+
 static void memlimit_sysfs_common(struct kobject *kobj, u64 *value, int store)
 {
 	struct zcache_pool *zpool = zcache_kobj_to_pool(kobj);
@@ -872,18 +1116,80 @@ static ssize_t memlimit_show(struct kobject *kobj,
 }
 ZCACHE_POOL_ATTR(memlimit);
 
+static ssize_t compressor_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	struct zcache_pool *zpool = zcache_kobj_to_pool(kobj);
+
+	return sprintf(buf, "%s\n", zpool->comp->name);
+}
+ZCACHE_POOL_ATTR_RO(compressor);
+
 static struct attribute *zcache_pool_attrs[] = {
 	&zero_pages_attr.attr,
 	&orig_data_size_attr.attr,
 	&compr_data_size_attr.attr,
 	&mem_used_total_attr.attr,
+	&frag_percent_attr.attr,
+	&compact_moved_attr.attr,
+	&compact_freed_attr.attr,
+	&compact_attr.attr,
+	&evicted_pages_attr.attr,
 	&memlimit_attr.attr,
+	&compressor_attr.attr,
 	NULL,
 };
 
 static struct attribute_group zcache_pool_attr_group = {
 	.attrs = zcache_pool_attrs,
 };
+
+/*
+ * Compressor used by pools created from now on, i.e. for filesystems
+ * mounted later. Pools keep the compressor they were created with.
+ */
+static ssize_t zcache_compressor_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	ssize_t len;
+
+	mutex_lock(&zcache->comp_lock);
+	len = sprintf(buf, "%s\n", zcache->compressor);
+	mutex_unlock(&zcache->comp_lock);
+
+	return len;
+}
+
+static ssize_t zcache_compressor_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t len)
+{
+	char name[CRYPTO_MAX_ALG_NAME];
+
+	strlcpy(name, buf, sizeof(name));
+	strim(name);
+
+	if (!crypto_has_comp(name, 0, 0))
+		return -EINVAL;
+
+	mutex_lock(&zcache->comp_lock);
+	strcpy(zcache->compressor, name);
+	mutex_unlock(&zcache->comp_lock);
+
+	return len;
+}
+
+static struct kobj_attribute zcache_compressor_attr =
+	__ATTR(compressor, 0644, zcache_compressor_show,
+		zcache_compressor_store);
+
+static struct attribute *zcache_attrs[] = {
+	&zcache_compressor_attr.attr,
+	NULL,
+};
+
+static struct attribute_group zcache_attr_group = {
+	.attrs = zcache_attrs,
+};
 #endif	/* CONFIG_SYSFS */
 
 /*
@@ -988,11 +1294,12 @@ static int zcache_get_page(int pool_id, ino_t inode_no,
 {
 	int ret;
 	void *nodeptr;
-	size_t clen;
+	unsigned int clen;
 	unsigned long flags;
 
 	u32 offset;
 	struct page *src_page;
+	struct crypto_comp *tfm;
 	unsigned char *src_data, *dest_data;
 
 	struct zcache_inode_rb *znode;
@@ -1034,15 +1341,17 @@ static int zcache_get_page(int pool_id, ino_t inode_no,
 
 	dest_data = kmap_atomic(page, KM_USER1);
 
-	ret = lzo1x_decompress_safe(src_data + sizeof(*zheader),
+	tfm = *per_cpu_ptr(zpool->comp->tfm, get_cpu());
+	ret = crypto_comp_decompress(tfm, src_data + sizeof(*zheader),
 			xv_get_object_size(src_data) - sizeof(*zheader),
 			dest_data, &clen);
+	put_cpu();
 
 	kunmap_atomic(src_data, KM_USER0);
 	kunmap_atomic(dest_data, KM_USER1);
 
-	/* Failure here means bug in LZO! */
-	if (unlikely(ret != LZO_E_OK))
+	/* Failure here means bug in the compressor! */
+	if (unlikely(ret))
 		goto out_free;
 
 	flush_dcache_page(page);
@@ -1123,6 +1432,10 @@ out_find_store:
 		zcache_free_page(zpool, zpage);
 
 	ret = zcache_store_page(znode, index, page, is_zero);
+	if (unlikely(ret == -ESTALE)) {
+		kref_put(&znode->refcount, zcache_inode_release);
+		goto out_find_store;
+	}
 	if (unlikely(ret)) {
 		zcache_add_stat(zpool, ZPOOL_STAT_COMPR_SIZE,
 				-zcache_max_page_size);
@@ -1200,8 +1513,8 @@ static void zcache_flush_inode(int pool_id, ino_t inode_no)
  */
 static void zcache_flush_fs(int pool_id)
 {
-	struct rb_node *node;
-	struct zcache_inode_rb *znode;
+	int i, j, count;
+	struct zcache_inode_rb *znode, *znodes[FREE_BATCH];
 	struct zcache_pool *zpool = zcache->pools[pool_id];
 
 #ifdef CONFIG_SYSFS
@@ -1210,17 +1523,28 @@ static void zcache_flush_fs(int pool_id)
 	kobject_put(zpool->kobj);
 #endif
 
+	/* Frees below must not queue compaction again */
+	zpool->dying = 1;
+	cancel_work_sync(&zpool->compact_work);
+
 	/*
 	 * At this point, there is no active I/O on this filesystem.
 	 * So we can free all its pages without holding any locks.
 	 */
-	node = rb_first(&zpool->inode_tree);
-	while (node) {
-		znode = rb_entry(node, struct zcache_inode_rb, rb_node);
-		node = rb_next(node);
-		zcache_free_inode_pages(znode, UINT_MAX, ZCACHE_TAG_INVALID);
-		rb_erase(&znode->rb_node, &zpool->inode_tree);
-		kfree(znode);
+	for (i = 0; i < ZCACHE_INODE_SHARDS; i++) {
+		struct zcache_inode_shard *shard = &zpool->shards[i];
+
+		while ((count = radix_tree_gang_lookup(&shard->tree,
+					(void **)znodes, 0, FREE_BATCH))) {
+			for (j = 0; j < count; j++) {
+				znode = znodes[j];
+				zcache_free_inode_pages(znode, UINT_MAX,
+						ZCACHE_TAG_INVALID);
+				radix_tree_delete(&shard->tree,
+					zcache_inode_key(znode->inode_no));
+				call_rcu(&znode->rcu, zcache_inode_free_rcu);
+			}
+		}
 	}
 
 	zcache_destroy_pool(zpool);
@@ -1238,8 +1562,6 @@ static int zcache_cpu_notify(struct notifier_block *nb, unsigned long action,
 	case CPU_UP_PREPARE:
 		per_cpu(compress_buffer, cpu) = (void *)__get_free_pages(
 					GFP_KERNEL | __GFP_ZERO, 1);
-		per_cpu(compress_workmem, cpu) = kzalloc(
-					LZO1X_MEM_COMPRESS, GFP_KERNEL);
 
 		break;
 	case CPU_DEAD:
@@ -1247,9 +1569,6 @@ static int zcache_cpu_notify(struct notifier_block *nb, unsigned long action,
 		free_pages((unsigned long)(per_cpu(compress_buffer, cpu)), 1);
 		per_cpu(compress_buffer, cpu) = NULL;
 
-		kfree(per_cpu(compress_buffer, cpu));
-		per_cpu(compress_buffer, cpu) = NULL;
-
 		break;
 	default:
 		break;
@@ -1281,6 +1600,11 @@ static int __init zcache_init(void)
 	if (!zcache)
 		goto out;
 
+	mutex_init(&zcache->comp_lock);
+	INIT_LIST_HEAD(&zcache->comps);
+	strlcpy(zcache->compressor, ZCACHE_DEFAULT_COMPRESSOR,
+		sizeof(zcache->compressor));
+
 	ret = register_cpu_notifier(&zcache_cpu_nb);
 	if (ret)
 		goto out;
@@ -1295,6 +1619,12 @@ static int __init zcache_init(void)
 	zcache->kobj = kobject_create_and_add("zcache", mm_kobj);
 	if (!zcache->kobj)
 		goto out;
+
+	ret = sysfs_create_group(zcache->kobj, &zcache_attr_group);
+	if (ret) {
+		kobject_put(zcache->kobj);
+		goto out;
+	}
 #endif
 
 	spin_lock_init(&zcache->pool_lock);
@@ -10,13 +10,16 @@
 #ifndef _ZCACHE_DRV_H_
 #define _ZCACHE_DRV_H_
 
+#include <linux/crypto.h>
 #include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 #include <linux/radix-tree.h>
-#include <linux/rbtree.h>
-#include <linux/rwlock.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock.h>
 #include <linux/seqlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #define MAX_ZCACHE_POOLS	32	/* arbitrary */
 #define MAX_ZPOOL_NAME_LEN	8	/* "pool"+id (shown in sysfs) */
@@ -25,6 +28,9 @@ enum zcache_pool_stats_index {
 	ZPOOL_STAT_PAGES_ZERO,
 	ZPOOL_STAT_PAGES_STORED,
 	ZPOOL_STAT_COMPR_SIZE,
+	ZPOOL_STAT_COMPACT_MOVED,
+	ZPOOL_STAT_COMPACT_FREED,
+	ZPOOL_STAT_PAGES_EVICTED,
 	ZPOOL_STAT_NSTATS,
 };
 
@@ -41,19 +47,58 @@ static const unsigned zcache_pool_default_memlimit_perc_ram = 10;
  /* We only keep pages that compress to less than this size */
 static const int zcache_max_page_size = PAGE_SIZE / 2;
 
+/*
+ * Compact a pool in the background once this percentage of its memory
+ * is not used by objects, if it has at least zcache_compact_min_pages.
+ */
+static const int zcache_compact_frag_perc = 40;
+static const u64 zcache_compact_min_pages = 64;
+
+/* Pages emptied per xv_compact() call */
+#define ZCACHE_COMPACT_BATCH	32
+
+/* Pages emptied per xv_evict() call when shrinking a pool */
+#define ZCACHE_SHRINK_BATCH	16
+
+/* Inodes of a pool are spread over this many independently locked trees */
+#define ZCACHE_INODE_SHARD_BITS	4
+#define ZCACHE_INODE_SHARDS	(1 << ZCACHE_INODE_SHARD_BITS)
+
+/* Crypto API compressor for new pools unless changed through sysfs */
+#define ZCACHE_DEFAULT_COMPRESSOR	"lzo"
+
+/* Compressor instance per CPU, shared by all pools using it */
+struct zcache_comp {
+	struct list_head list;
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct crypto_comp * __percpu *tfm;
+	int users;			/* pools using this compressor */
+};
+
 /* Stored in the beginning of each compressed object */
 struct zcache_objheader {
 	unsigned long index;
+	ino_t inode_no;		/* lets compaction find the radix node */
 };
 
-/* Red-Black tree node. Maps inode to its page-tree */
+/*
+ * Inode node. Maps inode to its page-tree. Looked up under RCU, so it
+ * is freed after a grace period.
+ */
 struct zcache_inode_rb {
 	struct radix_tree_root page_tree; /* maps inode index to page */
-	spinlock_t tree_lock;		/* protects page_tree */
+	spinlock_t tree_lock;		/* protects page_tree and dead */
 	struct kref refcount;
-	struct rb_node rb_node;
+	int dead;			/* removed from its inode shard */
 	ino_t inode_no;
 	struct zcache_pool *pool;	/* back-reference to parent pool */
+	struct rcu_head rcu;
+};
+
+/* Maps (inode_no >> ZCACHE_INODE_SHARD_BITS) to inode node */
+struct zcache_inode_shard {
+	struct radix_tree_root tree;
+	spinlock_t lock;		/* protects tree updates */
 };
 
 struct zcache_pool_stats_cpu {
@@ -63,14 +108,16 @@ struct zcache_pool_stats_cpu {
 
 /* One zcache pool per (cleancache aware) filesystem mount instance */
 struct zcache_pool {
-	struct rb_root inode_tree;	/* maps inode number to page tree */
-	rwlock_t tree_lock;		/* protects inode_tree */
+	struct zcache_inode_shard shards[ZCACHE_INODE_SHARDS];
 
 	seqlock_t memlimit_lock;	/* protects memlimit */
 	u64 memlimit;			/* bytes */
 
 	struct xv_pool *xv_pool;	/* xvmalloc pool */
+	struct zcache_comp *comp;	/* fixed for the pool's lifetime */
 	struct zcache_pool_stats_cpu *stats;	/* percpu stats */
+	struct work_struct compact_work;	/* compacts xv_pool */
+	int dying;			/* no more compaction, see flush_fs */
 #ifdef CONFIG_SYSFS
 	unsigned char name[MAX_ZPOOL_NAME_LEN];
 	struct kobject *kobj;		/* sysfs */
@@ -82,6 +129,9 @@ struct zcache {
 	struct zcache_pool *pools[MAX_ZCACHE_POOLS];
 	u32 num_pools;		/* current no. of zcache pools */
 	spinlock_t pool_lock;	/* protects pools[] and num_pools */
+	struct mutex comp_lock;	/* protects comps and compressor */
+	struct list_head comps;	/* compressors in use */
+	char compressor[CRYPTO_MAX_ALG_NAME];	/* for new pools */
 #ifdef CONFIG_SYSFS
 	struct kobject *kobj;	/* sysfs */
 #endif
@@ -21,13 +21,17 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
+#include <linux/time.h>
 #include <linux/vmalloc.h>
+#include <linux/sched.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
 
 #include "zram_drv.h"
 
@@ -38,6 +42,8 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 unsigned int zram_num_devices;
 
+static struct kmem_cache *zram_dedup_cachep;
+
 static void zram_stat_inc(u32 *v)
 {
 	*v = *v + 1;
@@ -100,6 +106,97 @@ static int page_zero_filled(void *ptr)
 	return 1;
 }
 
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_hash[hash_32(checksum, zram->dedup_bits)];
+}
+
+/*
+ * Looks for an object holding the same compressed data as 'src' and takes
+ * a reference to it. Identical pages compress to identical data, so there
+ * is no need to decompress for the comparison.
+ *
+ * Caller must hold zram->dedup_lock.
+ */
+static struct zram_dedup_obj *zram_dedup_get(struct zram *zram, u32 checksum,
+					     void *src, size_t clen)
+{
+	struct zram_dedup_obj *obj;
+	struct hlist_node *node;
+	unsigned char *cmem;
+	int match;
+
+	hlist_for_each_entry(obj, node, zram_dedup_bucket(zram, checksum),
+			     hash) {
+		if (obj->checksum != checksum || obj->clen != clen)
+			continue;
+
+		cmem = kmap_atomic(obj->page, KM_USER1) + obj->offset;
+		match = !memcmp(cmem + sizeof(struct zobj_header), src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		if (match) {
+			obj->refcount++;
+			return obj;
+		}
+	}
+
+	return NULL;
+}
+
+/* Caller must hold zram->dedup_lock */
+static struct zram_dedup_obj *zram_dedup_find(struct zram *zram, u32 index)
+{
+	struct zram_dedup_obj *obj;
+	struct hlist_node *node;
+	u32 checksum = zram->table[index].checksum;
+
+	hlist_for_each_entry(obj, node, zram_dedup_bucket(zram, checksum),
+			     hash) {
+		if (obj->page == zram->table[index].page &&
+		    obj->offset == zram->table[index].offset)
+			return obj;
+	}
+
+	return NULL;
+}
+
+/*
+ * Drops the reference of table entry 'index' on its shared object.
+ * Returns 1 if this was the last reference, in which case the caller
+ * frees the compressed data.
+ */
+static int zram_dedup_put(struct zram *zram, u32 index)
+{
+	struct zram_dedup_obj *obj;
+	int last;
+	u16 clen = 0;
+
+	zram_clear_flag(zram, index, ZRAM_DEDUP);
+
+	spin_lock(&zram->dedup_lock);
+	obj = zram_dedup_find(zram, index);
+	if (unlikely(!obj)) {
+		spin_unlock(&zram->dedup_lock);
+		pr_err("Dedup object missing for page: %u\n", index);
+		return 1;
+	}
+	last = !--obj->refcount;
+	if (last)
+		hlist_del(&obj->hash);
+	else
+		clen = obj->clen;
+	spin_unlock(&zram->dedup_lock);
+
+	if (last) {
+		kmem_cache_free(zram_dedup_cachep, obj);
+		return 1;
+	}
+
+	zram_stat_dec(&zram->stats.pages_dedup);
+	zram_stat64_sub(zram, &zram->stats.dedup_saved, clen);
+	return 0;
+}
+
 static u64 zram_default_disksize_bytes(void)
  {
 	return ((totalram_pages << PAGE_SHIFT) *
@@ -112,7 +209,50 @@ static void zram_set_disksize(struct zram *zram, u64 size_bytes)
 	set_capacity(zram->disk, size_bytes >> SECTOR_SHIFT);
 }
 
-static void zram_free_page(struct zram *zram, size_t index)
+#ifdef CONFIG_ZRAM_WRITEBACK
+static u32 zram_now(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return ts.tv_sec;
+}
+
+/* Records an access to page 'index', for idle page writeback */
+static void zram_touch(struct zram *zram, u32 index)
+{
+	zram->table[index].atime = zram_now();
+}
+
+/* Returns a free backing device page, or -ENOSPC */
+static long zram_bd_alloc(struct zram *zram)
+{
+	unsigned long bd_index;
+
+	spin_lock(&zram->bd_lock);
+	bd_index = find_first_zero_bit(zram->bd_bitmap, zram->bd_pages);
+	if (bd_index < zram->bd_pages)
+		__set_bit(bd_index, zram->bd_bitmap);
+	spin_unlock(&zram->bd_lock);
+
+	if (bd_index >= zram->bd_pages)
+		return -ENOSPC;
+
+	return bd_index;
+}
+
+static void zram_bd_free(struct zram *zram, u32 bd_index)
+{
+	spin_lock(&zram->bd_lock);
+	__clear_bit(bd_index, zram->bd_bitmap);
+	spin_unlock(&zram->bd_lock);
+}
+#else
+static void zram_touch(struct zram *zram, u32 index) { }
+static void zram_bd_free(struct zram *zram, u32 bd_index) { }
+#endif
+
+static void __zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
 	void *obj;
@@ -120,6 +260,9 @@ static void zram_free_page(struct zram *zram, size_t index)
 	struct page *page = zram->table[index].page;
 	u32 offset = zram->table[index].offset;
 
+	/* Tells a writeback in progress that the page changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
 	if (unlikely(!page)) {
 		/*
 		 * No memory is allocated for zero filled pages.
@@ -129,9 +272,22 @@ static void zram_free_page(struct zram *zram, size_t index)
 			zram_clear_flag(zram, index, ZRAM_ZERO);
 			zram_stat_dec(&zram->stats.pages_zero);
 		}
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			zram_bd_free(zram, zram->table[index].bd_index);
+			zram_clear_flag(zram, index, ZRAM_WB);
+			zram_stat_dec(&zram->stats.bd_count);
+			zram_stat_dec(&zram->stats.pages_stored);
+		}
 		return;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_DEDUP) &&
+	    !zram_dedup_put(zram, index)) {
+		/* other pages still share the object */
+		zram_stat_dec(&zram->stats.pages_stored);
+		goto clear;
+	}
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
 		__free_page(page);
@@ -152,10 +308,683 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
+clear:
 	zram->table[index].page = NULL;
 	zram->table[index].offset = 0;
 }
 
+static void zram_free_page(struct zram *zram, size_t index)
+{
+	u64 total;
+
+	write_lock(&zram->table_lock);
+	__zram_free_page(zram, index);
+	write_unlock(&zram->table_lock);
+
+	/* Freeing objects is what leaves holes in the pool */
+	if (!zram->compact_threshold || work_pending(&zram->compact_work))
+		return;
+
+	total = xv_get_total_size_bytes(zram->mem_pool) >> PAGE_SHIFT;
+	if (total >= compact_min_pages &&
+	    xv_get_frag_percent(zram->mem_pool) >= zram->compact_threshold)
+		schedule_work(&zram->compact_work);
+}
+
+/*
+ * Called by xv_compact() to move the object at <page, offset>. The
+ * object header leads to the table entry, which is only updated if it
+ * still points to the object: it may have been freed meanwhile.
+ */
+static int zram_migrate(void *private, struct page *page, u32 offset,
+			struct page *new_page, u32 new_offset)
+{
+	struct zram *zram = private;
+	struct zram_dedup_obj *obj = NULL;
+	unsigned char *cmem, *new_cmem;
+	u32 index;
+	int ret = -ENOENT;
+
+	mutex_lock(&zram->lock);
+	write_lock(&zram->table_lock);
+
+	cmem = kmap_atomic(page, KM_USER0) + offset;
+	index = ((struct zobj_header *)cmem)->table_idx;
+
+	if (index >= zram->disksize >> PAGE_SHIFT ||
+	    zram->table[index].page != page ||
+	    zram->table[index].offset != offset ||
+	    zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		goto out;
+
+	/*
+	 * The header only refers to the page that stored the object, so
+	 * objects other pages share cannot be moved.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		spin_lock(&zram->dedup_lock);
+		obj = zram_dedup_find(zram, index);
+		if (!obj || obj->refcount > 1) {
+			spin_unlock(&zram->dedup_lock);
+			ret = -EBUSY;
+			goto out;
+		}
+	}
+
+	new_cmem = kmap_atomic(new_page, KM_USER1) + new_offset;
+	memcpy(new_cmem, cmem, xv_get_object_size(cmem));
+	kunmap_atomic(new_cmem, KM_USER1);
+
+	zram->table[index].page = new_page;
+	zram->table[index].offset = new_offset;
+	if (obj) {
+		obj->page = new_page;
+		obj->offset = new_offset;
+		spin_unlock(&zram->dedup_lock);
+	}
+	ret = 0;
+
+out:
+	kunmap_atomic(cmem, KM_USER0);
+	write_unlock(&zram->table_lock);
+	mutex_unlock(&zram->lock);
+
+	return ret;
+}
+
+/*
+ * Moves objects out of sparsely used pages of the memory pool until
+ * compaction stops freeing pages. Returns the number of pages freed.
+ */
+int zram_compact(struct zram *zram)
+{
+	int freed, total = 0;
+	u64 moved = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done)
+		goto out;
+
+	do {
+		freed = xv_compact(zram->mem_pool, ZRAM_COMPACT_BATCH,
+				zram_migrate, zram, &moved);
+		total += freed;
+	} while (freed);
+
+	zram_stat64_add(zram, &zram->stats.compact_moved, moved);
+	zram_stat64_add(zram, &zram->stats.compact_freed, total);
+out:
+	mutex_unlock(&zram->init_lock);
+
+	return total;
+}
+
+static void zram_compact_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, compact_work);
+
+	zram_compact(zram);
+}
+
+static void zram_strm_free(struct zram_strm *strm)
+{
+	if (!IS_ERR_OR_NULL(strm->tfm))
+		crypto_free_comp(strm->tfm);
+	free_pages((unsigned long)strm->buffer, 1);
+	kfree(strm);
+}
+
+static struct zram_strm *zram_strm_alloc(struct zram *zram)
+{
+	struct zram_strm *strm;
+
+	strm = kzalloc(sizeof(*strm), GFP_KERNEL);
+	if (!strm)
+		return NULL;
+
+	strm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+	/* compressed data may be larger than a page */
+	strm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(strm->tfm) || !strm->buffer) {
+		zram_strm_free(strm);
+		return NULL;
+	}
+
+	return strm;
+}
+
+/*
+ * Allocates streams until max_strm exist. Streams are never allocated from
+ * the I/O path: when zram is the swap device, that runs under memory
+ * pressure and crypto_alloc_comp() could recurse into reclaim.
+ *
+ * Returns the number of streams allocated in all.
+ */
+static int zram_strm_grow(struct zram *zram)
+{
+	struct zram_strm *strm;
+
+	spin_lock(&zram->strm_lock);
+	while (zram->avail_strm < zram->max_strm) {
+		spin_unlock(&zram->strm_lock);
+		strm = zram_strm_alloc(zram);
+		spin_lock(&zram->strm_lock);
+		if (!strm)
+			break;
+		zram->avail_strm++;
+		list_add(&strm->list, &zram->idle_strm);
+		wake_up(&zram->strm_wait);
+	}
+	spin_unlock(&zram->strm_lock);
+
+	return zram->avail_strm;
+}
+
+/*
+ * Returns an idle compression stream, waiting for one to become idle if
+ * all are in use.
+ */
+static struct zram_strm *zram_strm_get(struct zram *zram)
+{
+	struct zram_strm *strm;
+	u64 start;
+
+	spin_lock(&zram->strm_lock);
+	while (list_empty(&zram->idle_strm)) {
+		if (!zram->avail_strm) {
+			spin_unlock(&zram->strm_lock);
+			return NULL;
+		}
+
+		spin_unlock(&zram->strm_lock);
+		start = sched_clock();
+		wait_event(zram->strm_wait, !list_empty(&zram->idle_strm));
+		zram_stat64_inc(zram, &zram->stats.strm_waits);
+		zram_stat64_add(zram, &zram->stats.strm_wait_ns,
+				sched_clock() - start);
+		spin_lock(&zram->strm_lock);
+	}
+	strm = list_first_entry(&zram->idle_strm, struct zram_strm, list);
+	list_del(&strm->list);
+	zram->strm_in_use++;
+	if (zram->strm_in_use > zram->max_strm_in_use)
+		zram->max_strm_in_use = zram->strm_in_use;
+	spin_unlock(&zram->strm_lock);
+
+	return strm;
+}
+
+static void zram_strm_put(struct zram *zram, struct zram_strm *strm)
+{
+	spin_lock(&zram->strm_lock);
+	zram->strm_in_use--;
+	if (zram->avail_strm > zram->max_strm) {
+		zram->avail_strm--;
+		spin_unlock(&zram->strm_lock);
+		zram_strm_free(strm);
+		return;
+	}
+	list_add(&strm->list, &zram->idle_strm);
+	spin_unlock(&zram->strm_lock);
+
+	wake_up(&zram->strm_wait);
+}
+
+/* Frees idle streams above 'max' (all idle ones for max == 0) */
+static void zram_strm_shrink(struct zram *zram, int max)
+{
+	struct zram_strm *strm;
+
+	spin_lock(&zram->strm_lock);
+	while (zram->avail_strm > max && !list_empty(&zram->idle_strm)) {
+		strm = list_first_entry(&zram->idle_strm, struct zram_strm,
+					list);
+		list_del(&strm->list);
+		zram->avail_strm--;
+		spin_unlock(&zram->strm_lock);
+		zram_strm_free(strm);
+		spin_lock(&zram->strm_lock);
+	}
+	spin_unlock(&zram->strm_lock);
+}
+
+void zram_set_max_streams(struct zram *zram, int max)
+{
+	mutex_lock(&zram->init_lock);
+	spin_lock(&zram->strm_lock);
+	zram->max_strm = max;
+	spin_unlock(&zram->strm_lock);
+
+	if (zram->init_done)
+		zram_strm_grow(zram);
+	mutex_unlock(&zram->init_lock);
+
+	/* streams in use are freed when they are put back */
+	zram_strm_shrink(zram, max);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+struct zram_wb_batch {
+	struct page *pages[ZRAM_WB_BATCH];
+	u32 index[ZRAM_WB_BATCH];
+	u32 bd_index[ZRAM_WB_BATCH];
+	int count;
+	atomic_t pending;	/* bios in flight */
+	int error;
+	struct completion done;
+};
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_batch *batch = bio->bi_private;
+
+	if (err)
+		batch->error = err;
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+	bio_put(bio);
+}
+
+/* Called with table_lock held */
+static int zram_obj_shared(struct zram *zram, u32 index)
+{
+	struct zram_dedup_obj *obj;
+	int shared;
+
+	if (!zram_test_flag(zram, index, ZRAM_DEDUP))
+		return 0;
+
+	spin_lock(&zram->dedup_lock);
+	obj = zram_dedup_find(zram, index);
+	shared = !obj || obj->refcount > 1;
+	spin_unlock(&zram->dedup_lock);
+
+	return shared;
+}
+
+/*
+ * Tells if page 'index' should go to the backing device: incompressible
+ * pages always do, others once idle for idle_age seconds. Objects other
+ * pages share stay in memory, since writing them back frees nothing.
+ *
+ * Called with zram->lock and table_lock held.
+ */
+static int zram_wb_candidate(struct zram *zram, u32 index, u32 now)
+{
+	if (!zram->table[index].page ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
+
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return 1;
+
+	if (!zram->idle_age || now - zram->table[index].atime < zram->idle_age)
+		return 0;
+	zram_stat_inc(&zram->stats.pages_idle);
+
+	return !zram_obj_shared(zram, index);
+}
+
+/*
+ * Copies the uncompressed contents of page 'index' to the next page of
+ * the batch and marks it as under writeback.
+ *
+ * Called with zram->lock and table_lock held.
+ */
+static int zram_wb_add(struct zram *zram, struct zram_wb_batch *batch,
+			u32 index, struct zram_strm *strm)
+{
+	unsigned char *dst, *cmem;
+	unsigned int clen = PAGE_SIZE;
+	long bd_index;
+	int ret = 0;
+
+	bd_index = zram_bd_alloc(zram);
+	if (bd_index < 0)
+		return bd_index;
+
+	dst = kmap_atomic(batch->pages[batch->count], KM_USER0);
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
+			zram->table[index].offset;
+
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		memcpy(dst, cmem, PAGE_SIZE);
+	else
+		ret = crypto_comp_decompress(strm->tfm,
+			cmem + sizeof(struct zobj_header),
+			xv_get_object_size(cmem) - sizeof(struct zobj_header),
+			dst, &clen);
+
+	kunmap_atomic(cmem, KM_USER1);
+	kunmap_atomic(dst, KM_USER0);
+
+	if (unlikely(ret || clen != PAGE_SIZE)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		zram_bd_free(zram, bd_index);
+		return -EIO;
+	}
+
+	zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	batch->index[batch->count] = index;
+	batch->bd_index[batch->count] = bd_index;
+	batch->count++;
+
+	return 0;
+}
+
+/*
+ * Writes the batch to the backing device, then frees the memory of the
+ * pages that were not changed meanwhile. Returns the pages written back.
+ */
+static int zram_wb_flush(struct zram *zram, struct zram_wb_batch *batch)
+{
+	struct bio *bio;
+	int i, written = 0;
+	u32 index;
+
+	batch->error = 0;
+	atomic_set(&batch->pending, batch->count);
+	init_completion(&batch->done);
+
+	for (i = 0; i < batch->count; i++) {
+		bio = bio_alloc(GFP_NOIO, 1);
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = (sector_t)batch->bd_index[i] <<
+					SECTORS_PER_PAGE_SHIFT;
+		bio_add_page(bio, batch->pages[i], PAGE_SIZE, 0);
+		bio->bi_end_io = zram_wb_end_io;
+		bio->bi_private = batch;
+		submit_bio(WRITE, bio);
+	}
+	wait_for_completion(&batch->done);
+
+	for (i = 0; i < batch->count; i++) {
+		index = batch->index[i];
+
+		mutex_lock(&zram->lock);
+		write_lock(&zram->table_lock);
+		/* Pages freed, rewritten or shared meanwhile stay as is */
+		if (batch->error ||
+		    !zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+		    zram_obj_shared(zram, index)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_bd_free(zram, batch->bd_index[i]);
+			goto next;
+		}
+
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		__zram_free_page(zram, index);
+		zram->table[index].bd_index = batch->bd_index[i];
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(&zram->stats.bd_count);
+		written++;
+next:
+		write_unlock(&zram->table_lock);
+		mutex_unlock(&zram->lock);
+	}
+
+	zram_stat64_add(zram, &zram->stats.bd_writes, written);
+	batch->count = 0;
+
+	return written;
+}
+
+/*
+ * Writes incompressible and idle pages to the backing device in batches.
+ * Called with init_lock held. Returns the pages written back.
+ */
+static int __zram_writeback(struct zram *zram)
+{
+	struct zram_wb_batch *batch;
+	struct zram_strm *strm;
+	u32 index, num_pages, now;
+	int i, ret = 0, written = 0;
+
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		batch->pages[i] = alloc_page(GFP_KERNEL);
+		if (!batch->pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	strm = zram_strm_get(zram);
+	if (!strm) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	now = zram_now();
+	num_pages = zram->disksize >> PAGE_SHIFT;
+	zram->stats.pages_idle = 0;
+
+	for (index = 0; index < num_pages; index++) {
+		mutex_lock(&zram->lock);
+		write_lock(&zram->table_lock);
+		if (zram_wb_candidate(zram, index, now))
+			ret = zram_wb_add(zram, batch, index, strm);
+		write_unlock(&zram->table_lock);
+		mutex_unlock(&zram->lock);
+
+		/* Backing device full: still write what was gathered */
+		if (ret == -ENOSPC)
+			break;
+
+		if (batch->count == ZRAM_WB_BATCH) {
+			written += zram_wb_flush(zram, batch);
+			cond_resched();
+		}
+	}
+	if (batch->count)
+		written += zram_wb_flush(zram, batch);
+
+	zram_strm_put(zram, strm);
+	ret = written;
+
+out:
+	for (i = 0; i < ZRAM_WB_BATCH; i++)
+		if (batch->pages[i])
+			__free_page(batch->pages[i]);
+	kfree(batch);
+
+	return ret;
+}
+
+int zram_writeback(struct zram *zram)
+{
+	int ret = -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done && zram->bdev)
+		ret = __zram_writeback(zram);
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, wb_work.work);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done && zram->bdev) {
+		__zram_writeback(zram);
+		schedule_delayed_work(&zram->wb_work, wb_interval * HZ);
+	}
+	mutex_unlock(&zram->init_lock);
+}
+
+/* Starts a writeback pass now, rather than at the next interval */
+static void zram_wb_kick(struct zram *zram)
+{
+	if (cancel_delayed_work(&zram->wb_work))
+		schedule_delayed_work(&zram->wb_work, 0);
+}
+
+/* A read bio some of whose pages come from the backing device */
+struct zram_bd_read {
+	struct bio *parent;
+	atomic_t pending;	/* backing device bios, plus one for zram_read */
+	int error;
+};
+
+static void zram_bd_read_put(struct zram_bd_read *rd)
+{
+	if (!atomic_dec_and_test(&rd->pending))
+		return;
+
+	if (rd->error) {
+		bio_io_error(rd->parent);
+	} else {
+		set_bit(BIO_UPTODATE, &rd->parent->bi_flags);
+		bio_endio(rd->parent, 0);
+	}
+	kfree(rd);
+}
+
+static void zram_bd_read_end_io(struct bio *bio, int err)
+{
+	struct zram_bd_read *rd = bio->bi_private;
+
+	if (err)
+		rd->error = err;
+	else
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+	bio_put(bio);
+	zram_bd_read_put(rd);
+}
+
+/*
+ * Starts reading backing device page 'bd_index' into 'page', a page of
+ * 'parent'. Bios submitted from our make_request function are only issued
+ * once it returns, so the read can't be waited for: 'parent' is ended by
+ * whoever drops the last reference to *rdp, see zram_read().
+ */
+static int zram_bd_read(struct zram *zram, struct bio *parent,
+			struct zram_bd_read **rdp, u32 bd_index,
+			struct page *page)
+{
+	struct zram_bd_read *rd = *rdp;
+	struct bio *bio;
+
+	if (!rd) {
+		rd = kmalloc(sizeof(*rd), GFP_NOIO);
+		if (!rd)
+			return -ENOMEM;
+		rd->parent = parent;
+		atomic_set(&rd->pending, 1);
+		rd->error = 0;
+		*rdp = rd;
+	}
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = (sector_t)bd_index << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+	bio->bi_end_io = zram_bd_read_end_io;
+	bio->bi_private = rd;
+
+	atomic_inc(&rd->pending);
+	submit_bio(READ, bio);
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return 0;
+}
+
+/* Called with init_lock held */
+static void zram_bd_release(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	close_bdev_exclusive(zram->bdev, FMODE_READ | FMODE_WRITE);
+	zram->bdev = NULL;
+	vfree(zram->bd_bitmap);
+	zram->bd_bitmap = NULL;
+	zram->bd_pages = 0;
+	kfree(zram->bd_path);
+	zram->bd_path = NULL;
+}
+
+/*
+ * Attaches the block device at 'path' to an uninitialized zram device,
+ * or detaches the current one for "none".
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long *bitmap;
+	unsigned long pages;
+	char *bd_path;
+	int ret;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram_bd_release(zram);
+	ret = 0;
+	if (!strcmp(path, "none"))
+		goto out;
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret)
+		goto close;
+
+	ret = -EINVAL;
+	pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!pages)
+		goto close;
+
+	ret = -ENOMEM;
+	bd_path = kstrdup(path, GFP_KERNEL);
+	bitmap = vzalloc(BITS_TO_LONGS(pages) * sizeof(long));
+	if (!bd_path || !bitmap) {
+		kfree(bd_path);
+		vfree(bitmap);
+		goto close;
+	}
+
+	zram->bdev = bdev;
+	zram->bd_path = bd_path;
+	zram->bd_bitmap = bitmap;
+	zram->bd_pages = pages;
+	pr_info("Backing device %s, %lu pages\n", path, pages);
+	ret = 0;
+	goto out;
+
+close:
+	close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+out:
+	mutex_unlock(&zram->init_lock);
+	return ret;
+}
+#else
+struct zram_bd_read;
+
+static int zram_bd_read(struct zram *zram, struct bio *parent,
+			struct zram_bd_read **rdp, u32 bd_index,
+			struct page *page)
+{
+	return -EIO;
+}
+
+static void zram_bd_read_put(struct zram_bd_read *rd) { }
+#endif
+
 static void zram_discard(struct zram *zram, struct bio *bio)
 {
 	u32 i, npages, index;
@@ -185,6 +1014,7 @@ static void handle_zero_page(struct page *page)
 	flush_dcache_page(page);
 }
 
+/* Called with table_lock held */
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
@@ -205,8 +1035,9 @@ static int zram_read(struct zram *zram, struct bio *bio)
 {
 
 	int i;
-	u32 index;
+	u32 index, bd_index;
 	struct bio_vec *bvec;
+	struct zram_bd_read *rd = NULL;
 
 	if (unlikely(!zram->init_done)) {
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
@@ -219,33 +1050,71 @@ static int zram_read(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
+		unsigned int clen;
 		struct page *page;
 		struct zobj_header *zheader;
+		struct zram_strm *strm = NULL;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
+		/*
+		 * Writeback, compaction and writes change the entry under
+		 * table_lock, so it is tested and its object read in one go.
+		 */
+retry:
+		read_lock(&zram->table_lock);
+
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+			read_unlock(&zram->table_lock);
 			handle_zero_page(page);
-			index++;
-			continue;
+			goto next;
+		}
+
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			bd_index = zram->table[index].bd_index;
+			zram_touch(zram, index);
+			read_unlock(&zram->table_lock);
+
+			if (zram_bd_read(zram, bio, &rd, bd_index, page)) {
+				if (strm)
+					zram_strm_put(zram, strm);
+				zram_stat64_inc(zram, &zram->stats.failed_reads);
+				goto out;
+			}
+			goto next;
 		}
 
 		/* Requested page is not present in compressed area */
 		if (unlikely(!zram->table[index].page)) {
+			read_unlock(&zram->table_lock);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
-			index++;
-			continue;
+			goto next;
 		}
 
+		zram_touch(zram, index);
+
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
+			read_unlock(&zram->table_lock);
+			goto next;
+		}
+
+		/*
+		 * Decompression may need the compressor's state too. Getting
+		 * a stream can sleep, so the entry is looked at again after.
+		 */
+		if (!strm) {
+			read_unlock(&zram->table_lock);
+			strm = zram_strm_get(zram);
+			if (unlikely(!strm)) {
+				zram_stat64_inc(zram, &zram->stats.failed_reads);
+				goto out;
+			}
+			goto retry;
 		}
 
 		user_mem = kmap_atomic(page, KM_USER0);
@@ -254,16 +1123,19 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
 				zram->table[index].offset;
 
-		ret = lzo1x_decompress_safe(
+		ret = crypto_comp_decompress(strm->tfm,
 			cmem + sizeof(*zheader),
 			xv_get_object_size(cmem) - sizeof(*zheader),
 			user_mem, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 		kunmap_atomic(cmem, KM_USER1);
+		read_unlock(&zram->table_lock);
+		zram_strm_put(zram, strm);
+		strm = NULL;
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret || clen != PAGE_SIZE)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -271,14 +1143,28 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		}
 
 		flush_dcache_page(page);
+next:
+		if (strm)
+			zram_strm_put(zram, strm);
 		index++;
 	}
 
+	/* Pages still being read from the backing device end the bio */
+	if (rd) {
+		zram_bd_read_put(rd);
+		return 0;
+	}
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
+	if (rd) {
+		rd->error = -EIO;
+		zram_bd_read_put(rd);
+		return 0;
+	}
 	bio_io_error(bio);
 	return 0;
 }
@@ -300,46 +1186,89 @@ static int zram_write(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		u32 offset;
-		size_t clen;
+		unsigned int clen;
 		struct zobj_header *zheader;
 		struct page *page, *page_store;
 		unsigned char *user_mem, *cmem, *src;
+		struct zram_strm *strm;
+		struct zram_dedup_obj *obj;
+		u32 checksum;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
 		/*
 		 * System overwrites unused sectors. Free memory associated
 		 * with this sector now.
 		 */
 		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
+				zram_test_flag(zram, index, ZRAM_ZERO) ||
+				zram_test_flag(zram, index, ZRAM_WB))
 			zram_free_page(zram, index);
 
-		mutex_lock(&zram->lock);
-
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
+			mutex_lock(&zram->lock);
 			zram_stat_inc(&zram->stats.pages_zero);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			mutex_unlock(&zram->lock);
 			index++;
 			continue;
 		}
+		kunmap_atomic(user_mem, KM_USER0);
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		/* Compression runs in parallel, one stream per writer */
+		strm = zram_strm_get(zram);
+		if (unlikely(!strm)) {
+			pr_info("Error allocating compression stream\n");
+			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			goto out;
+		}
+		src = strm->buffer;
 
+		user_mem = kmap_atomic(page, KM_USER0);
+		clen = 2 * PAGE_SIZE;
+		ret = crypto_comp_compress(strm->tfm, user_mem, PAGE_SIZE,
+					src, &clen);
+		checksum = 0;
+		if (zram->dedup)
+			checksum = jhash2((u32 *)user_mem,
+					  PAGE_SIZE / sizeof(u32), 0);
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_strm_put(zram, strm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
+		/* Share the object of an identical page if there is one */
+		obj = NULL;
+		if (zram->dedup && clen <= max_zpage_size) {
+			spin_lock(&zram->dedup_lock);
+			obj = zram_dedup_get(zram, checksum, src, clen);
+			spin_unlock(&zram->dedup_lock);
+		}
+		if (obj) {
+			zram_strm_put(zram, strm);
+			mutex_lock(&zram->lock);
+			zram->table[index].page = obj->page;
+			zram->table[index].offset = obj->offset;
+			zram->table[index].checksum = checksum;
+			zram_set_flag(zram, index, ZRAM_DEDUP);
+			zram_touch(zram, index);
+			zram_stat_inc(&zram->stats.pages_stored);
+			zram_stat_inc(&zram->stats.pages_dedup);
+			mutex_unlock(&zram->lock);
+			zram_stat64_inc(zram, &zram->stats.dedup_hits);
+			zram_stat64_add(zram, &zram->stats.dedup_saved, clen);
+			index++;
+			continue;
+		}
+
+		mutex_lock(&zram->lock);
+
 		/*
 		 * Page is incompressible. Store it as-is (uncompressed)
 		 * since we do not want to return too many disk write
@@ -350,6 +1279,7 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
 				mutex_unlock(&zram->lock);
+				zram_strm_put(zram, strm);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -369,26 +1299,26 @@ static int zram_write(struct zram *zram, struct bio *bio)
 				&zram->table[index].page, &offset,
 				GFP_NOIO | __GFP_HIGHMEM)) {
 			mutex_unlock(&zram->lock);
+			zram_strm_put(zram, strm);
 			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
+				"page: %u, size=%u\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
 memstore:
 		zram->table[index].offset = offset;
+		zram_touch(zram, index);
 
 		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
 				zram->table[index].offset;
 
-#if 0
 		/* Back-reference needed for memory defragmentation */
 		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
 			zheader = (struct zobj_header *)cmem;
 			zheader->table_idx = index;
 			cmem += sizeof(*zheader);
 		}
-#endif
 
 		memcpy(cmem, src, clen);
 
@@ -402,7 +1332,34 @@ memstore:
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
+		/* Make the object available to identical pages */
+		if (zram->dedup &&
+		    !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+			obj = kmem_cache_alloc(zram_dedup_cachep, GFP_NOIO);
+			if (obj) {
+				obj->page = zram->table[index].page;
+				obj->offset = offset;
+				obj->clen = clen;
+				obj->checksum = checksum;
+				obj->refcount = 1;
+				zram->table[index].checksum = checksum;
+				zram_set_flag(zram, index, ZRAM_DEDUP);
+				spin_lock(&zram->dedup_lock);
+				hlist_add_head(&obj->hash,
+					zram_dedup_bucket(zram, checksum));
+				spin_unlock(&zram->dedup_lock);
+			}
+		}
+
 		mutex_unlock(&zram->lock);
+		zram_strm_put(zram, strm);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* Incompressible pages waste the most memory, move them soon */
+		if (zram->bdev && zram->stats.pages_expand >= ZRAM_WB_BATCH &&
+		    zram->stats.bd_count < zram->bd_pages)
+			zram_wb_kick(zram);
+#endif
 		index++;
 	}
 
@@ -468,15 +1425,18 @@ void zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
+	/* The works take init_lock, wait for them before taking it here */
+	cancel_work_sync(&zram->compact_work);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	cancel_delayed_work_sync(&zram->wb_work);
+#endif
+
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the compression streams */
+	zram_strm_shrink(zram, 0);
+	zram->max_strm_in_use = 0;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
@@ -486,7 +1446,8 @@ void zram_reset_device(struct zram *zram)
 		page = zram->table[index].page;
 		offset = zram->table[index].offset;
 
-		if (!page)
+		/* Shared objects are freed through the dedup hash below */
+		if (!page || zram_test_flag(zram, index, ZRAM_DEDUP))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
@@ -495,12 +1456,32 @@ void zram_reset_device(struct zram *zram)
 			xv_free(zram->mem_pool, page, offset);
 	}
 
+	if (zram->dedup_hash) {
+		for (index = 0; index < 1 << zram->dedup_bits; index++) {
+			struct zram_dedup_obj *obj;
+			struct hlist_node *node, *tmp;
+
+			hlist_for_each_entry_safe(obj, node, tmp,
+					&zram->dedup_hash[index], hash) {
+				xv_free(zram->mem_pool, obj->page,
+					obj->offset);
+				kmem_cache_free(zram_dedup_cachep, obj);
+			}
+		}
+		vfree(zram->dedup_hash);
+		zram->dedup_hash = NULL;
+	}
+
 	vfree(zram->table);
 	zram->table = NULL;
 
 	xv_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_bd_release(zram);
+#endif
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -523,16 +1504,9 @@ int zram_init_device(struct zram *zram)
 	if (!zram->disksize)
 		zram_set_disksize(zram, zram_default_disksize_bytes());
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	/* Can make do with fewer streams, but not with none */
+	if (!zram_strm_grow(zram)) {
+		pr_err("Error allocating compression stream!\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -548,6 +1522,19 @@ int zram_init_device(struct zram *zram)
 	}
 	memset(zram->table, 0, num_pages * sizeof(*zram->table));
 
+	if (zram->dedup) {
+		zram->dedup_bits = clamp_t(int,
+				ilog2(num_pages) - ZRAM_DEDUP_PAGES_SHIFT,
+				ZRAM_DEDUP_MIN_BITS, ZRAM_DEDUP_MAX_BITS);
+		zram->dedup_hash = vzalloc((1 << zram->dedup_bits) *
+					   sizeof(*zram->dedup_hash));
+		if (!zram->dedup_hash) {
+			pr_err("Error allocating dedup hash\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
@@ -559,6 +1546,10 @@ int zram_init_device(struct zram *zram)
 	}
 
 	zram->init_done = 1;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram->bdev)
+		schedule_delayed_work(&zram->wb_work, wb_interval * HZ);
+#endif
 	mutex_unlock(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
@@ -597,6 +1588,20 @@ static int create_device(struct zram *zram, int device_id)
 	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->strm_lock);
+	spin_lock_init(&zram->dedup_lock);
+	rwlock_init(&zram->table_lock);
+	INIT_WORK(&zram->compact_work, zram_compact_work);
+	zram->compact_threshold = default_compact_threshold;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bd_lock);
+	INIT_DELAYED_WORK(&zram->wb_work, zram_wb_work);
+#endif
+	INIT_LIST_HEAD(&zram->idle_strm);
+	init_waitqueue_head(&zram->strm_wait);
+	zram->max_strm = num_online_cpus();
+	strlcpy(zram->compressor, ZRAM_DEFAULT_COMPRESSOR,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -699,11 +1704,17 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_dedup_cachep = KMEM_CACHE(zram_dedup_obj, 0);
+	if (!zram_dedup_cachep) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_cache;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -728,6 +1739,8 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_cache:
+	kmem_cache_destroy(zram_dedup_cachep);
 out:
 	return ret;
 }
@@ -743,11 +1756,15 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		zram_bd_release(zram);
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(zram_devices);
+	kmem_cache_destroy(zram_dedup_cachep);
 	pr_debug("Cleanup done!\n");
 }
 
@@ -17,6 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/crypto.h>
 
 #include "xvmalloc.h"
 
@@ -33,9 +37,7 @@ static const unsigned max_num_devices = 32;
  * object. This is required to support memory defragmentation.
  */
 struct zobj_header {
-#if 0
 	u32 table_idx;
-#endif
 };
 
 /*-- Configurable parameters */
@@ -49,6 +51,24 @@ static const unsigned default_disksize_perc_ram = 25;
  */
 static const u64 max_zpage_size = PAGE_SIZE / 4 * 3;
 
+/*
+ * Compact the memory pool in the background once this percentage of it
+ * is not used by objects. Can be changed through sysfs, 0 disables it.
+ */
+static const unsigned default_compact_threshold = 40;
+
+/* Pools smaller than this are never compacted in the background */
+static const u64 compact_min_pages = 64;
+
+/* Pages emptied per xv_compact() call */
+#define ZRAM_COMPACT_BATCH	32
+
+/* Pages written to the backing device at once */
+#define ZRAM_WB_BATCH		32
+
+/* Seconds between background writeback passes */
+static const unsigned wb_interval = 30;
+
 /*
  * NOTE: max_zpage_size must be less than or equal to:
  *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
@@ -70,6 +90,15 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Object is shared with identical pages through the dedup hash */
+	ZRAM_DEDUP,
+
+	/* Page is stored on the backing device */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -81,8 +110,36 @@ struct table {
 	u16 offset;
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+	union {
+		u32 checksum;	/* content hash, valid with ZRAM_DEDUP */
+		u32 bd_index;	/* backing device page, valid with ZRAM_WB */
+	};
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 atime;	/* last access, in seconds since boot */
+#endif
 } __attribute__((aligned(4)));
 
+/*
+ * The dedup hash has a bucket for every 2^ZRAM_DEDUP_PAGES_SHIFT pages of
+ * disksize, within these bounds.
+ */
+#define ZRAM_DEDUP_PAGES_SHIFT	3
+#define ZRAM_DEDUP_MIN_BITS	8
+#define ZRAM_DEDUP_MAX_BITS	20
+
+/*
+ * A compressed object that can be shared by all table entries whose
+ * pages have the same contents. Hashed by checksum.
+ */
+struct zram_dedup_obj {
+	struct hlist_node hash;
+	struct page *page;
+	u16 offset;
+	u16 clen;
+	u32 checksum;
+	u32 refcount;	/* table entries pointing to this object */
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -96,21 +153,84 @@ struct zram_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u64 strm_waits;		/* I/Os that waited for a stream */
+	u64 strm_wait_ns;	/* time spent waiting for streams */
+	u64 dedup_hits;		/* writes that found an identical page */
+	u64 dedup_saved;	/* bytes currently saved by sharing */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u64 compact_moved;	/* objects moved by compaction */
+	u64 compact_freed;	/* pages freed by compaction */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u32 bd_count;		/* pages currently on the backing device */
+	u32 pages_idle;		/* idle pages seen by the last writeback */
+};
+
+/* Crypto API compressor used unless another is set through sysfs */
+#define ZRAM_DEFAULT_COMPRESSOR	"lzo"
+
+/*
+ * Compression stream: compressor instance and output buffer for one
+ * compression or decompression running at a time.
+ */
+struct zram_strm {
+	struct crypto_comp *tfm;
+	void *buffer;
+	struct list_head list;
 };
 
 struct zram {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	struct mutex lock;	/* protect allocations and table updates
+				 * against concurrent writes */
+	rwlock_t table_lock;	/* protect table page/offset against
+				 * compaction moving the object */
+	/*
+	 * Compression streams. max_strm are allocated up front, when the
+	 * device is initialized or the limit is raised, so that as many
+	 * writes can compress in parallel.
+	 */
+	spinlock_t strm_lock;	/* protects the fields below */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;		/* streams allocated */
+	int max_strm;		/* limit set through sysfs */
+	int strm_in_use;
+	int max_strm_in_use;	/* highest strm_in_use seen */
+	/* Can be changed only while the device is not initialized */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	/*
+	 * Compressed objects by content, if dedup is enabled. Protected by
+	 * a spinlock since pages are also freed from the swap slot free
+	 * notifier.
+	 */
+	int dedup;	/* can be changed only while not initialized */
+	spinlock_t dedup_lock;
+	struct hlist_head *dedup_hash;
+	unsigned dedup_bits;	/* log2 of buckets in dedup_hash */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
 	/* Prevent concurrent execution of device init and reset */
 	struct mutex init_lock;
+	/* Background compaction of mem_pool */
+	struct work_struct compact_work;
+	unsigned compact_threshold;	/* % of pool unused, 0: disabled */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/*
+	 * Backing device for incompressible and idle pages. Can be set
+	 * only while the device is not initialized.
+	 */
+	struct block_device *bdev;
+	char *bd_path;
+	spinlock_t bd_lock;		/* protects bd_bitmap */
+	unsigned long *bd_bitmap;	/* backing device pages in use */
+	unsigned long bd_pages;
+	struct delayed_work wb_work;
+	unsigned idle_age;	/* seconds, 0: incompressible pages only */
+#endif
 	/*
 	 * This is the limit on amount of *uncompressed* worth of data
 	 * we can store in a disk.
@@ -128,5 +248,11 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern void zram_set_max_streams(struct zram *zram, int max);
+extern int zram_compact(struct zram *zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern int zram_writeback(struct zram *zram);
+#endif
 
 #endif
@@ -0,0 +1,840 @@
+/*
+ * Compressed swap cache
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com/
+ *
+ * Design:
+ * zswap is a frontswap backend. Pages being swapped out are handed to
+ * it by swap_writepage() (frontswap_ops.put_page). They are compressed
+ * and stored in an xvmalloc pool, which grows and shrinks with the
+ * number of pages stored, so the swap device is not written at all.
+ * swap_readpage() gets them back (frontswap_ops.get_page) and the copy
+ * is dropped once the swap entry is freed (frontswap_ops.flush_page).
+ *
+ * A page in zswap is identified with tuple <type, offset> of its swap
+ * entry. For each swap type, a radix tree maps offsets to the location
+ * of the compressed object. The object header contains the swap entry
+ * so that the radix node can be found from the object.
+ *
+ * The pool is limited to max_pool_percent of RAM. When the limit is
+ * hit, the oldest pool pages are emptied by writing back the pages
+ * they hold to the swap device, see zswap_writeback().
+ *
+ * Puts, gets and flushes of a swap entry are serialized by the swap
+ * cache: they are done with a locked swap cache page for that entry, or
+ * when none can exist. Writeback claims the entry in the swap cache
+ * with swapcache_prepare() before touching it for the same reason.
+ */
+
+#define KMSG_COMPONENT "zswap"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cpu.h>
+#include <linux/frontswap.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/swapops.h>
+#include <linux/writeback.h>
+
+#include "xvmalloc.h"
+#include "zswap_drv.h"
+
+static DEFINE_PER_CPU(unsigned char *, compress_buffer);
+
+/*
+ * For zero-filled pages, we directly insert the swap offset in the
+ * radix node. These defines make sure we do not try to store NULL
+ * value in radix node (offset can be 0) and that we do not use the
+ * lowest bit (which radix tree uses for its own purpose). Object
+ * locations never have the mark bit set since objects are XV_ALIGN
+ * aligned.
+ */
+#define ZSWAP_ZERO_PAGE_OFFSET_SHIFT	2
+#define ZSWAP_ZERO_PAGE_MARK_BIT	(1 << 1)
+
+static char *zswap_compressor = ZSWAP_DEFAULT_COMPRESSOR;
+module_param_named(compressor, zswap_compressor, charp, 0444);
+MODULE_PARM_DESC(compressor, "Crypto API compressor to use");
+
+static struct zswap *zswap;
+
+/*
+ * Individual percpu values can go negative but the sum across all CPUs
+ * must always be positive (we store various counts). So, return sum as
+ * unsigned value.
+ */
+static u64 zswap_get_stat(enum zswap_stats_index idx)
+{
+	int cpu;
+	s64 val = 0;
+
+	for_each_possible_cpu(cpu) {
+		unsigned int start;
+		struct zswap_stats_cpu *stats;
+
+		stats = per_cpu_ptr(zswap->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			val += stats->count[idx];
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+	}
+
+	BUG_ON(val < 0);
+	return val;
+}
+
+static void zswap_add_stat(enum zswap_stats_index idx, s64 val)
+{
+	struct zswap_stats_cpu *stats;
+
+	preempt_disable();
+	stats = __this_cpu_ptr(zswap->stats);
+	u64_stats_update_begin(&stats->syncp);
+	stats->count[idx] += val;
+	u64_stats_update_end(&stats->syncp);
+	preempt_enable();
+}
+
+static void zswap_inc_stat(enum zswap_stats_index idx)
+{
+	zswap_add_stat(idx, 1);
+}
+
+static void zswap_dec_stat(enum zswap_stats_index idx)
+{
+	zswap_add_stat(idx, -1);
+}
+
+static int zswap_pool_full(void)
+{
+	u64 pages = xv_get_total_size_bytes(zswap->xv_pool) >> PAGE_SHIFT;
+
+	return pages >= totalram_pages * zswap->max_pool_percent / 100;
+}
+
+static void zswap_handle_zero_page(struct page *page)
+{
+	void *user_mem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	memset(user_mem, 0, PAGE_SIZE);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+}
+
+static int zswap_page_zero_filled(void *ptr)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	page = (unsigned long *)ptr;
+
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos])
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Encode <page, offset> as a single "pointer" value which is stored
+ * in the radix tree node.
+ */
+static void *zswap_xv_location_to_ptr(struct page *page, u32 offset)
+{
+	unsigned long ptrval;
+
+	ptrval = page_to_pfn(page) << PAGE_SHIFT;
+	ptrval |= (offset & ~PAGE_MASK);
+
+	return (void *)ptrval;
+}
+
+/*
+ * Decode <page, offset> pair from "pointer" value returned from
+ * radix tree lookup.
+ */
+static void zswap_ptr_to_xv_location(void *ptr, struct page **page,
+				u32 *offset)
+{
+	unsigned long ptrval = (unsigned long)ptr;
+
+	*page = pfn_to_page(ptrval >> PAGE_SHIFT);
+	*offset = ptrval & ~PAGE_MASK;
+}
+
+static void *zswap_offset_to_ptr(pgoff_t offset)
+{
+	return (void *)((offset << ZSWAP_ZERO_PAGE_OFFSET_SHIFT) |
+			ZSWAP_ZERO_PAGE_MARK_BIT);
+}
+
+static int zswap_is_zero_page(void *ptr)
+{
+	return (unsigned long)ptr & ZSWAP_ZERO_PAGE_MARK_BIT;
+}
+
+/*
+ * Returns the swap offset the radix node pointer 'ptr' is stored at.
+ */
+static pgoff_t zswap_ptr_to_offset(void *ptr)
+{
+	u32 offset;
+	pgoff_t swp_off;
+	struct page *page;
+	struct zswap_objheader *zheader;
+
+	if (zswap_is_zero_page(ptr))
+		return (unsigned long)ptr >> ZSWAP_ZERO_PAGE_OFFSET_SHIFT;
+
+	zswap_ptr_to_xv_location(ptr, &page, &offset);
+	zheader = kmap_atomic(page, KM_USER0) + offset;
+	swp_off = swp_offset(zheader->entry);
+	kunmap_atomic(zheader, KM_USER0);
+
+	return swp_off;
+}
+
+/*
+ * Frees the object at the location encoded in 'ptr'. The caller has
+ * already removed it from its radix tree.
+ */
+static void zswap_free_obj(void *ptr)
+{
+	u32 offset;
+	struct page *page;
+	struct zswap_objheader *zheader;
+
+	if (zswap_is_zero_page(ptr)) {
+		zswap_dec_stat(ZSWAP_STAT_PAGES_ZERO);
+		return;
+	}
+
+	zswap_ptr_to_xv_location(ptr, &page, &offset);
+	zheader = kmap_atomic(page, KM_USER0) + offset;
+	zswap_add_stat(ZSWAP_STAT_COMPR_SIZE, -(s64)zheader->clen);
+	kunmap_atomic(zheader, KM_USER0);
+
+	xv_free(zswap->xv_pool, page, offset);
+	zswap_dec_stat(ZSWAP_STAT_PAGES_STORED);
+}
+
+/*
+ * Compresses 'page' into a new object tagged with swap 'entry'.
+ *
+ * Returns 0 and the object location in 'ptr' on success, negative
+ * error code on failure.
+ */
+static int zswap_compress(swp_entry_t entry, struct page *page, void **ptr)
+{
+	int ret;
+	u32 zoffset;
+	unsigned int clen;
+	struct page *zpage;
+	struct crypto_comp *tfm;
+	unsigned char *zbuffer;
+	unsigned char *src_data, *dest_data;
+	struct zswap_objheader *zheader;
+
+	preempt_disable();
+	zbuffer = __get_cpu_var(compress_buffer);
+	if (unlikely(!zbuffer)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	tfm = *this_cpu_ptr(zswap->tfm);
+
+	src_data = kmap_atomic(page, KM_USER0);
+	clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(tfm, src_data, PAGE_SIZE, zbuffer, &clen);
+	kunmap_atomic(src_data, KM_USER0);
+
+	if (unlikely(ret) || clen > zswap_max_page_size) {
+		zswap_inc_stat(ZSWAP_STAT_REJECT_COMPRESS);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = xv_malloc(zswap->xv_pool, clen + sizeof(*zheader),
+			&zpage, &zoffset, GFP_NOWAIT | __GFP_HIGHMEM);
+	if (unlikely(ret)) {
+		zswap_inc_stat(ZSWAP_STAT_REJECT_ALLOC);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dest_data = kmap_atomic(zpage, KM_USER0) + zoffset;
+	zheader = (struct zswap_objheader *)dest_data;
+	zheader->entry = entry;
+	zheader->clen = clen;
+	memcpy(dest_data + sizeof(*zheader), zbuffer, clen);
+	kunmap_atomic(dest_data, KM_USER0);
+
+	*ptr = zswap_xv_location_to_ptr(zpage, zoffset);
+	zswap_add_stat(ZSWAP_STAT_COMPR_SIZE, clen);
+
+out:
+	preempt_enable();
+	return ret;
+}
+
+/*
+ * Fills 'page' with the contents of the object at 'ptr'.
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+static int zswap_decompress(void *ptr, struct page *page)
+{
+	int ret;
+	u32 offset;
+	unsigned int clen;
+	struct page *src_page;
+	struct crypto_comp *tfm;
+	unsigned char *src_data, *dest_data;
+	struct zswap_objheader *zheader;
+
+	if (zswap_is_zero_page(ptr)) {
+		zswap_handle_zero_page(page);
+		return 0;
+	}
+
+	zswap_ptr_to_xv_location(ptr, &src_page, &offset);
+
+	src_data = kmap_atomic(src_page, KM_USER0) + offset;
+	zheader = (struct zswap_objheader *)src_data;
+	dest_data = kmap_atomic(page, KM_USER1);
+
+	clen = PAGE_SIZE;
+	tfm = *per_cpu_ptr(zswap->tfm, get_cpu());
+	ret = crypto_comp_decompress(tfm, src_data + sizeof(*zheader),
+			zheader->clen, dest_data, &clen);
+	put_cpu();
+
+	kunmap_atomic(dest_data, KM_USER1);
+	kunmap_atomic(src_data, KM_USER0);
+
+	/* Failure here means bug in the compressor! */
+	if (unlikely(ret || clen != PAGE_SIZE)) {
+		pr_err("Decompression failed! err=%d, entry=%lx\n",
+			ret, zheader->entry.val);
+		return -EIO;
+	}
+
+	flush_dcache_page(page);
+	return 0;
+}
+
+/*
+ * Writes back the page stored at <page, offset> to the swap device:
+ * the page is decompressed into a new swap cache page, the zswap copy
+ * is flushed and the swap cache page is written out. Called by
+ * xv_evict(), the object may have been freed meanwhile, so its header
+ * is only trusted once the radix node is found to refer to it.
+ *
+ * Returns 0 if the object was written back, negative error code
+ * otherwise.
+ */
+static int zswap_writeback(void *private, struct page *page, u32 offset)
+{
+	int ret;
+	void *ptr;
+	pgoff_t swp_off;
+	swp_entry_t entry;
+	struct page *new_page;
+	struct zswap_tree *tree;
+	struct zswap_objheader *zheader;
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+	};
+
+	zheader = kmap_atomic(page, KM_USER0) + offset;
+	entry = zheader->entry;
+	kunmap_atomic(zheader, KM_USER0);
+
+	if (swp_type(entry) >= MAX_SWAPFILES)
+		return -ENOENT;
+
+	tree = &zswap->trees[swp_type(entry)];
+	swp_off = swp_offset(entry);
+	ptr = zswap_xv_location_to_ptr(page, offset);
+
+	spin_lock(&tree->lock);
+	ret = radix_tree_lookup(&tree->root, swp_off) == ptr ? 0 : -ENOENT;
+	spin_unlock(&tree->lock);
+	if (ret)
+		return ret;
+
+	new_page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN);
+	if (!new_page)
+		return -ENOMEM;
+
+	/*
+	 * Fails if the entry was freed or if a page is in the swap cache
+	 * for it, i.e. it is being swapped in or out right now.
+	 */
+	ret = swapcache_prepare(entry);
+	if (ret)
+		goto out_free;
+
+	/* The entry may have been freed and reused before we claimed it */
+	spin_lock(&tree->lock);
+	if (radix_tree_lookup(&tree->root, swp_off) != ptr)
+		ret = -ENOENT;
+	spin_unlock(&tree->lock);
+	if (ret) {
+		swapcache_free(entry, NULL);
+		goto out_free;
+	}
+
+	__set_page_locked(new_page);
+	SetPageSwapBacked(new_page);
+	ret = add_to_swap_cache(new_page, entry, GFP_NOIO);
+	if (ret) {
+		ClearPageSwapBacked(new_page);
+		__clear_page_locked(new_page);
+		swapcache_free(entry, NULL);
+		goto out_free;
+	}
+
+	ret = zswap_decompress(ptr, new_page);
+	if (unlikely(ret)) {
+		delete_from_swap_cache(new_page);
+		unlock_page(new_page);
+		goto out_free;
+	}
+	SetPageUptodate(new_page);
+	lru_cache_add_anon(new_page);
+
+	/* Clears the frontswap bit so the page is read from the device */
+	__frontswap_flush_page(swp_type(entry), swp_off);
+
+	/* Rotate to the tail of the LRU once written */
+	SetPageReclaim(new_page);
+	__swap_writepage(new_page, &wbc);
+	zswap_inc_stat(ZSWAP_STAT_WRITTEN_BACK);
+
+out_free:
+	page_cache_release(new_page);
+	return ret;
+}
+
+/*
+ * Writes back the pages held by the oldest pool pages. This is what
+ * actually makes the pool shrink: objects freed one by one rarely
+ * empty a whole pool page.
+ */
+static void zswap_shrink(void)
+{
+	u64 written = 0;
+
+	xv_evict(zswap->xv_pool, ZSWAP_WB_BATCH, zswap_writeback, NULL,
+		&written);
+}
+
+/*
+ * frontswap_ops.init
+ *
+ * Called on swapon. Trees are set up at load time and emptied by
+ * flush_area on swapoff, so there is nothing to do.
+ */
+static void zswap_init_area(unsigned type)
+{
+}
+
+/*
+ * frontswap_ops.flush_page
+ *
+ * Frees the page stored for swap entry <type, offset>, if any.
+ */
+static void zswap_flush_page(unsigned type, pgoff_t offset)
+{
+	void *ptr;
+	struct zswap_tree *tree = &zswap->trees[type];
+
+	spin_lock(&tree->lock);
+	ptr = radix_tree_delete(&tree->root, offset);
+	spin_unlock(&tree->lock);
+
+	if (ptr)
+		zswap_free_obj(ptr);
+}
+
+/*
+ * frontswap_ops.put_page
+ *
+ * Compresses 'page' and stores it for swap entry <type, offset>,
+ * replacing what might already be stored for it.
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+static int zswap_put_page(unsigned type, pgoff_t offset, struct page *page)
+{
+	int ret, is_zero;
+	void *ptr, *old;
+	unsigned char *src_data;
+	struct zswap_tree *tree = &zswap->trees[type];
+
+	src_data = kmap_atomic(page, KM_USER0);
+	is_zero = zswap_page_zero_filled(src_data);
+	kunmap_atomic(src_data, KM_USER0);
+	/* Zero-filled pages take no memory and are kept even when full */
+	if (!is_zero && zswap_pool_full()) {
+		zswap_inc_stat(ZSWAP_STAT_POOL_LIMIT_HIT);
+		zswap_shrink();
+		if (zswap_pool_full()) {
+			ret = -ENOMEM;
+			goto out_flush;
+		}
+	}
+
+	ret = radix_tree_preload(GFP_NOIO);
+	if (ret) {
+		zswap_inc_stat(ZSWAP_STAT_REJECT_ALLOC);
+		goto out_flush;
+	}
+
+	if (is_zero) {
+		ptr = zswap_offset_to_ptr(offset);
+	} else {
+		ret = zswap_compress(swp_entry(type, offset), page, &ptr);
+		if (ret) {
+			radix_tree_preload_end();
+			goto out_flush;
+		}
+	}
+
+	spin_lock(&tree->lock);
+	old = radix_tree_delete(&tree->root, offset);
+	ret = radix_tree_insert(&tree->root, offset, ptr);
+	spin_unlock(&tree->lock);
+	radix_tree_preload_end();
+
+	/* Cannot fail after the preload and delete above */
+	BUG_ON(ret);
+
+	if (old)
+		zswap_free_obj(old);
+	zswap_inc_stat(is_zero ? ZSWAP_STAT_PAGES_ZERO :
+				ZSWAP_STAT_PAGES_STORED);
+
+	return 0;
+
+out_flush:
+	/* frontswap forgets the previous copy when a put fails */
+	zswap_flush_page(type, offset);
+	return ret;
+}
+
+/*
+ * frontswap_ops.get_page
+ *
+ * Fills 'page' with the page stored for swap entry <type, offset>. The
+ * zswap copy is kept until the entry is flushed.
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+static int zswap_get_page(unsigned type, pgoff_t offset, struct page *page)
+{
+	int ret;
+	void *ptr;
+	struct zswap_tree *tree = &zswap->trees[type];
+
+	spin_lock(&tree->lock);
+	ptr = radix_tree_lookup(&tree->root, offset);
+	spin_unlock(&tree->lock);
+
+	if (!ptr) {
+		zswap_inc_stat(ZSWAP_STAT_MISSES);
+		return -ENOENT;
+	}
+
+	ret = zswap_decompress(ptr, page);
+	if (!ret)
+		zswap_inc_stat(ZSWAP_STAT_HITS);
+
+	return ret;
+}
+
+/*
+ * frontswap_ops.flush_area
+ *
+ * Called on swapoff. Frees all pages stored for the given swap type.
+ */
+#define FREE_BATCH 16
+static void zswap_flush_area(unsigned type)
+{
+	int i, count;
+	void *ptrs[FREE_BATCH];
+	struct zswap_tree *tree = &zswap->trees[type];
+
+	do {
+		spin_lock(&tree->lock);
+		count = radix_tree_gang_lookup(&tree->root, ptrs, 0,
+				FREE_BATCH);
+		for (i = 0; i < count; i++)
+			radix_tree_delete(&tree->root,
+				zswap_ptr_to_offset(ptrs[i]));
+		spin_unlock(&tree->lock);
+
+		for (i = 0; i < count; i++)
+			zswap_free_obj(ptrs[i]);
+
+		cond_resched();
+	} while (count);
+}
+
+#ifdef CONFIG_SYSFS
+
+#define ZSWAP_STAT_ATTR(_name, _idx)					\
+static ssize_t _name##_show(struct kobject *kobj,			\
+			struct kobj_attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%llu\n", zswap_get_stat(_idx));		\
+}									\
+static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+
+ZSWAP_STAT_ATTR(stored_pages, ZSWAP_STAT_PAGES_STORED);
+ZSWAP_STAT_ATTR(zero_pages, ZSWAP_STAT_PAGES_ZERO);
+ZSWAP_STAT_ATTR(compr_data_size, ZSWAP_STAT_COMPR_SIZE);
+ZSWAP_STAT_ATTR(hits, ZSWAP_STAT_HITS);
+ZSWAP_STAT_ATTR(misses, ZSWAP_STAT_MISSES);
+ZSWAP_STAT_ATTR(written_back_pages, ZSWAP_STAT_WRITTEN_BACK);
+ZSWAP_STAT_ATTR(reject_compress_poor, ZSWAP_STAT_REJECT_COMPRESS);
+ZSWAP_STAT_ATTR(reject_alloc_fail, ZSWAP_STAT_REJECT_ALLOC);
+ZSWAP_STAT_ATTR(pool_limit_hit, ZSWAP_STAT_POOL_LIMIT_HIT);
+
+/*
+ * Total memory used by the pool, including allocator fragmentation
+ * and metadata overhead.
+ */
+static ssize_t pool_total_size_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n",
+		xv_get_total_size_bytes(zswap->xv_pool));
+}
+static struct kobj_attribute pool_total_size_attr =
+	__ATTR_RO(pool_total_size);
+
+static ssize_t max_pool_percent_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", zswap->max_pool_percent);
+}
+
+/*
+ * Lowering the limit below the current pool size does not write back
+ * anything by itself, the pool shrinks as pages are put.
+ */
+static ssize_t max_pool_percent_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret || val > 100)
+		return -EINVAL;
+
+	zswap->max_pool_percent = val;
+
+	return len;
+}
+static struct kobj_attribute max_pool_percent_attr =
+	__ATTR(max_pool_percent, 0644, max_pool_percent_show,
+		max_pool_percent_store);
+
+static ssize_t compressor_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", zswap_compressor);
+}
+static struct kobj_attribute compressor_attr = __ATTR_RO(compressor);
+
+static struct attribute *zswap_attrs[] = {
+	&stored_pages_attr.attr,
+	&zero_pages_attr.attr,
+	&compr_data_size_attr.attr,
+	&pool_total_size_attr.attr,
+	&hits_attr.attr,
+	&misses_attr.attr,
+	&written_back_pages_attr.attr,
+	&reject_compress_poor_attr.attr,
+	&reject_alloc_fail_attr.attr,
+	&pool_limit_hit_attr.attr,
+	&max_pool_percent_attr.attr,
+	&compressor_attr.attr,
+	NULL,
+};
+
+static struct attribute_group zswap_attr_group = {
+	.attrs = zswap_attrs,
+};
+#endif	/* CONFIG_SYSFS */
+
+/*
+ * Callback for CPU hotplug events. Allocates percpu compression buffers.
+ */
+static int zswap_cpu_notify(struct notifier_block *nb, unsigned long action,
+			void *pcpu)
+{
+	int cpu = (long)pcpu;
+
+	switch (action) {
+	case CPU_UP_PREPARE:
+		per_cpu(compress_buffer, cpu) = (void *)__get_free_pages(
+					GFP_KERNEL | __GFP_ZERO, 1);
+
+		break;
+	case CPU_DEAD:
+	case CPU_UP_CANCELED:
+		free_pages((unsigned long)(per_cpu(compress_buffer, cpu)), 1);
+		per_cpu(compress_buffer, cpu) = NULL;
+
+		break;
+	default:
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block zswap_cpu_nb = {
+	.notifier_call = zswap_cpu_notify
+};
+
+static void zswap_free_tfm(void)
+{
+	int cpu;
+	struct crypto_comp *tfm;
+
+	for_each_possible_cpu(cpu) {
+		tfm = *per_cpu_ptr(zswap->tfm, cpu);
+		if (tfm)
+			crypto_free_comp(tfm);
+	}
+	free_percpu(zswap->tfm);
+}
+
+static int zswap_alloc_tfm(void)
+{
+	int cpu;
+	struct crypto_comp *tfm;
+
+	if (!crypto_has_comp(zswap_compressor, 0, 0)) {
+		pr_info("Compressor %s not available, using %s\n",
+			zswap_compressor, ZSWAP_DEFAULT_COMPRESSOR);
+		zswap_compressor = ZSWAP_DEFAULT_COMPRESSOR;
+	}
+
+	zswap->tfm = alloc_percpu(struct crypto_comp *);
+	if (!zswap->tfm)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(zswap_compressor, 0, 0);
+		if (IS_ERR(tfm)) {
+			pr_info("Failed to allocate compressor: %s\n",
+				zswap_compressor);
+			zswap_free_tfm();
+			return PTR_ERR(tfm);
+		}
+		*per_cpu_ptr(zswap->tfm, cpu) = tfm;
+	}
+
+	return 0;
+}
+
+static int __init zswap_init(void)
+{
+	int i, ret = -ENOMEM;
+	unsigned int cpu;
+
+	struct frontswap_ops ops = {
+		.init = zswap_init_area,
+		.put_page = zswap_put_page,
+		.get_page = zswap_get_page,
+		.flush_page = zswap_flush_page,
+		.flush_area = zswap_flush_area,
+	};
+
+	zswap = kzalloc(sizeof(*zswap), GFP_KERNEL);
+	if (!zswap)
+		goto out;
+
+	for (i = 0; i < MAX_SWAPFILES; i++) {
+		INIT_RADIX_TREE(&zswap->trees[i].root, GFP_NOWAIT);
+		spin_lock_init(&zswap->trees[i].lock);
+	}
+	zswap->max_pool_percent = ZSWAP_DEFAULT_MAX_POOL_PERCENT;
+
+	zswap->stats = alloc_percpu(struct zswap_stats_cpu);
+	if (!zswap->stats)
+		goto out;
+
+	zswap->xv_pool = xv_create_pool();
+	if (!zswap->xv_pool)
+		goto out;
+
+	ret = zswap_alloc_tfm();
+	if (ret)
+		goto out;
+
+	ret = register_cpu_notifier(&zswap_cpu_nb);
+	if (ret)
+		goto out_tfm;
+
+	for_each_online_cpu(cpu) {
+		void *pcpu = (void *)(long)cpu;
+		zswap_cpu_notify(&zswap_cpu_nb, CPU_UP_PREPARE, pcpu);
+	}
+
+#ifdef CONFIG_SYSFS
+	/* Create /sys/kernel/mm/zswap/ */
+	zswap->kobj = kobject_create_and_add("zswap", mm_kobj);
+	if (!zswap->kobj) {
+		ret = -ENOMEM;
+		goto out_cpu;
+	}
+
+	ret = sysfs_create_group(zswap->kobj, &zswap_attr_group);
+	if (ret) {
+		kobject_put(zswap->kobj);
+		goto out_cpu;
+	}
+#endif
+
+	frontswap_register_ops(&ops);
+	pr_info("Using %s compressor\n", zswap_compressor);
+
+	return 0;
+
+#ifdef CONFIG_SYSFS
+out_cpu:
+	unregister_cpu_notifier(&zswap_cpu_nb);
+	for_each_online_cpu(cpu) {
+		void *pcpu = (void *)(long)cpu;
+		zswap_cpu_notify(&zswap_cpu_nb, CPU_DEAD, pcpu);
+	}
+#endif
+out_tfm:
+	zswap_free_tfm();
+out:
+	if (zswap) {
+		if (zswap->xv_pool)
+			xv_destroy_pool(zswap->xv_pool);
+		free_percpu(zswap->stats);
+		kfree(zswap);
+	}
+	return ret;
+}
+
+module_init(zswap_init);
@@ -0,0 +1,72 @@
+/*
+ * Compressed swap cache
+ *
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com/
+ */
+
+#ifndef _ZSWAP_DRV_H_
+#define _ZSWAP_DRV_H_
+
+#include <linux/crypto.h>
+#include <linux/radix-tree.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/types.h>
+#include <linux/u64_stats_sync.h>
+
+enum zswap_stats_index {
+	ZSWAP_STAT_PAGES_ZERO,
+	ZSWAP_STAT_PAGES_STORED,
+	ZSWAP_STAT_COMPR_SIZE,
+	ZSWAP_STAT_HITS,		/* gets served from the pool */
+	ZSWAP_STAT_MISSES,		/* gets not found in the pool */
+	ZSWAP_STAT_WRITTEN_BACK,	/* pages moved to the swap device */
+	ZSWAP_STAT_REJECT_COMPRESS,	/* puts that did not compress well */
+	ZSWAP_STAT_REJECT_ALLOC,	/* puts that failed to allocate */
+	ZSWAP_STAT_POOL_LIMIT_HIT,	/* puts that found the pool full */
+	ZSWAP_STAT_NSTATS,
+};
+
+/* Default pool size limit: 20% of total RAM */
+#define ZSWAP_DEFAULT_MAX_POOL_PERCENT	20
+
+ /* We only keep pages that compress to less than this size */
+static const int zswap_max_page_size = PAGE_SIZE / 2;
+
+/* Pages emptied per xv_evict() call when the pool is full */
+#define ZSWAP_WB_BATCH		16
+
+/* Crypto API compressor unless changed on the command line */
+#define ZSWAP_DEFAULT_COMPRESSOR	"lzo"
+
+/* Stored in the beginning of each compressed object */
+struct zswap_objheader {
+	swp_entry_t entry;	/* lets writeback find the radix node */
+	u32 clen;		/* object size is rounded up by xvmalloc */
+};
+
+/* Maps swap offset to compressed object, one per swap type */
+struct zswap_tree {
+	struct radix_tree_root root;
+	spinlock_t lock;	/* protects root */
+};
+
+struct zswap_stats_cpu {
+	s64 count[ZSWAP_STAT_NSTATS];
+	struct u64_stats_sync syncp;
+};
+
+struct zswap {
+	struct zswap_tree trees[MAX_SWAPFILES];
+	struct xv_pool *xv_pool;	/* shared by all swap types */
+	struct crypto_comp * __percpu *tfm;
+	struct zswap_stats_cpu *stats;	/* percpu stats */
+	unsigned int max_pool_percent;	/* of total RAM */
+#ifdef CONFIG_SYSFS
+	struct kobject *kobj;		/* sysfs */
+#endif
+};
+
+#endif
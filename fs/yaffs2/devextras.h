@@ -30,6 +30,7 @@
 typedef unsigned char __u8;
 typedef unsigned short __u16;
 typedef unsigned __u32;
+typedef unsigned long long __u64;
 
 #endif
 
@@ -51,6 +51,8 @@ extern const char *yaffs_guts_c_version;
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 
 #include "asm/div64.h"
 
@@ -121,16 +123,19 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+unsigned int yaffs_bg_enable = 1;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_bg_enable, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
+MODULE_PARM(yaffs_bg_enable, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -232,6 +237,7 @@ static int yaffs_statfs(struct super_block *sb, struct kstatfs *buf);
 #else
 static int yaffs_statfs(struct super_block *sb, struct statfs *buf);
 #endif
+static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data);
 
 #ifdef YAFFS_HAS_PUT_INODE
 static void yaffs_put_inode(struct inode *inode);
@@ -363,16 +369,75 @@ static const struct super_operations yaffs_super_ops = {
 	.put_inode = yaffs_put_inode,
 #endif
 	.put_super = yaffs_put_super,
+	.remount_fs = yaffs_remount_fs,
 	.delete_inode = yaffs_delete_inode,
 	.clear_inode = yaffs_clear_inode,
 	.sync_fs = yaffs_sync_fs,
 	.write_super = yaffs_write_super,
 };
 
+/*
+ * Locking.
+ *
+ * Each device has two locks, always taken in this order:
+ *
+ * dirLock protects the visible directory tree: the children lists, the
+ * parent, name and hardlink links of every object reachable from the root,
+ * and each search context's nextReturn. Namespace lookups (lookup, readdir)
+ * take it for reading, so they run alongside each other and never wait for
+ * file data I/O. Operations that change the tree (create, link, unlink,
+ * rename) and unmount take it for writing.
+ *
+ * grossLock serializes everything else inside yaffs_guts: NAND access,
+ * chunk allocation, garbage collection, the short op cache, tnodes, the
+ * object hash and the hidden unlinked and deleted directories. File I/O,
+ * inode teardown and checkpointing take only this lock. Namespace readers
+ * take it only when they have to touch NAND, i.e. to read a long name or
+ * lazy load an object: when every name involved is in RAM (short names,
+ * see CONFIG_YAFFS_SHORT_NAMES_IN_RAM), lookup and readdir hold dirLock
+ * alone. Lazy loading clears lazyLoaded last, behind a write barrier, so
+ * such readers never see half loaded objects. Reading file data (readpage)
+ * still needs grossLock, even when the chunk is in the short op cache.
+ *
+ * Anything that changes the visible tree holds both locks, so holding
+ * either one is enough to walk it. The search context list is changed
+ * under grossLock, because garbage collection can remove objects from the
+ * hidden directories and so run the remove callback without dirLock.
+ *
+ * Neither lock may be held for writing across yaffs_get_inode() by a path
+ * that inode teardown could wait on: yaffs_clear_inode() and
+ * yaffs_delete_inode() only take grossLock, so holding dirLock there is
+ * fine, holding grossLock is not.
+ */
+
+static void yaffs_DirLockRead(yaffs_Device *dev)
+{
+	down_read(&dev->dirLock);
+}
+
+static void yaffs_DirUnlockRead(yaffs_Device *dev)
+{
+	up_read(&dev->dirLock);
+}
+
+static void yaffs_DirLockWrite(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs dir locking %p\n", current));
+	down_write(&dev->dirLock);
+	T(YAFFS_TRACE_OS, ("yaffs dir locked %p\n", current));
+}
+
+static void yaffs_DirUnlockWrite(yaffs_Device *dev)
+{
+	T(YAFFS_TRACE_OS, ("yaffs dir unlocking %p\n", current));
+	up_write(&dev->dirLock);
+}
+
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
 	down(&dev->grossLock);
+	dev->lastActivity = jiffies;
 	T(YAFFS_TRACE_OS, ("yaffs locked %p\n", current));
 }
 
@@ -399,7 +464,8 @@ static void yaffs_GrossUnlock(yaffs_Device *dev)
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * yaffs_NewSearch() and yaffs_EndSearch() must be called with grossLock
+ * held, yaffs_SearchAdvance() with dirLock held.
  */
 
 struct yaffs_SearchContext {
@@ -570,19 +636,30 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
+	/* Keeps obj in the tree until its inode is set up */
+	yaffs_DirLockRead(dev);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_lookup for %d:%s\n",
 		yaffs_InodeToObject(dir)->objectId, dentry->d_name.name));
 
-	obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
-					dentry->d_name.name);
+	if (yaffs_FindObjectByNameInRAM(yaffs_InodeToObject(dir),
+					dentry->d_name.name, &obj)) {
+		/* A found object has its hardlink target loaded too */
+		obj = yaffs_GetEquivalentObject(obj);
+	} else {
+		/* Some names have to be read from NAND */
+		yaffs_GrossLock(dev);
 
-	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
+		obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
+						dentry->d_name.name);
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
-	yaffs_GrossUnlock(dev);
+		/* in case it was a hardlink */
+		obj = yaffs_GetEquivalentObject(obj);
+
+		/* Can't hold gross lock when calling yaffs_get_inode() */
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -609,6 +686,8 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 
 	}
 
+	yaffs_DirUnlockRead(dev);
+
 /* added NCB for 2.5/6 compatability - forces add even if inode is
  * NULL which creates dentry hash */
 	d_add(dentry, inode);
@@ -681,6 +760,10 @@ static void yaffs_delete_inode(struct inode *inode)
 		atomic_read(&inode->i_count),
 		obj ? "object exists" : "null object"));
 
+	/* The object is in the unlinked directory by now, so grossLock is
+	 * enough. Taking dirLock could deadlock against a lookup waiting
+	 * in iget for this inode to go away.
+	 */
 	if (obj) {
 		dev = obj->myDev;
 		yaffs_GrossLock(dev);
@@ -1259,11 +1342,13 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_DentryToObject(f->f_dentry);
 	dev = obj->myDev;
 
-	yaffs_GrossLock(dev);
+	yaffs_DirLockRead(dev);
 
 	offset = f->f_pos;
 
-        sc = yaffs_NewSearch(obj);
+	yaffs_GrossLock(dev);
+	sc = yaffs_NewSearch(obj);
+	yaffs_GrossUnlock(dev);
         if(!sc){
                 retVal = -ENOMEM;
                 goto unlock_out;
@@ -1275,10 +1360,10 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			("yaffs_readdir: entry . ino %d \n",
 			(int)inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_DirUnlockRead(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0)
 			goto out;
-		yaffs_GrossLock(dev);
+		yaffs_DirLockRead(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1286,11 +1371,11 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		T(YAFFS_TRACE_OS,
 			("yaffs_readdir: entry .. ino %d \n",
 			(int)f->f_dentry->d_parent->d_inode->i_ino));
-		yaffs_GrossUnlock(dev);
+		yaffs_DirUnlockRead(dev);
 		if (filldir(dirent, "..", 2, offset,
 			f->f_dentry->d_parent->d_inode->i_ino, DT_DIR) < 0)
 			goto out;
-		yaffs_GrossLock(dev);
+		yaffs_DirLockRead(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -1310,16 +1395,23 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		curoffs++;
                 l = sc->nextReturn;
 		if (curoffs >= offset) {
-                        int this_inode = yaffs_GetObjectInode(l);
-                        int this_type = yaffs_GetObjectType(l);
-
+			int this_inode;
+			int this_type;
+			int nand = !yaffs_ObjectDetailsInRAM(l);
+
+			/* These may have to read the object header */
+			if (nand)
+				yaffs_GrossLock(dev);
+			this_inode = yaffs_GetObjectInode(l);
+			this_type = yaffs_GetObjectType(l);
 			yaffs_GetObjectName(l, name,
 					    YAFFS_MAX_NAME_LENGTH + 1);
+			if (nand)
+				yaffs_GrossUnlock(dev);
 			T(YAFFS_TRACE_OS,
-			  ("yaffs_readdir: %s inode %d\n", name,
-			   yaffs_GetObjectInode(l)));
+			  ("yaffs_readdir: %s inode %d\n", name, this_inode));
 
-                        yaffs_GrossUnlock(dev);
+			yaffs_DirUnlockRead(dev);
 
 			if (filldir(dirent,
 					name,
@@ -1329,7 +1421,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 					this_type) < 0)
 				goto out;
 
-                        yaffs_GrossLock(dev);
+			yaffs_DirLockRead(dev);
 
 			offset++;
 			f->f_pos++;
@@ -1338,9 +1430,11 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	}
 
 unlock_out:
-	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlockRead(dev);
 out:
-        yaffs_EndSearch(sc);
+	yaffs_GrossLock(dev);
+	yaffs_EndSearch(sc);
+	yaffs_GrossUnlock(dev);
 
 	return retVal;
 }
@@ -1393,6 +1487,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 
 	dev = parent->myDev;
 
+	yaffs_DirLockWrite(dev);
 	yaffs_GrossLock(dev);
 
 	switch (mode & S_IFMT) {
@@ -1441,6 +1536,8 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 		error = -ENOMEM;
 	}
 
+	yaffs_DirUnlockWrite(dev);
+
 	return error;
 }
 
@@ -1475,6 +1572,7 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 
 	dev = yaffs_InodeToObject(dir)->myDev;
 
+	yaffs_DirLockWrite(dev);
 	yaffs_GrossLock(dev);
 
 	retVal = yaffs_Unlink(yaffs_InodeToObject(dir), dentry->d_name.name);
@@ -1483,11 +1581,13 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 		dentry->d_inode->i_nlink--;
 		dir->i_version++;
 		yaffs_GrossUnlock(dev);
+		yaffs_DirUnlockWrite(dev);
 		mark_inode_dirty(dentry->d_inode);
 		update_dir_time(dir);
 		return 0;
 	}
 	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlockWrite(dev);
 	return -ENOTEMPTY;
 }
 
@@ -1507,6 +1607,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 	obj = yaffs_InodeToObject(inode);
 	dev = obj->myDev;
 
+	yaffs_DirLockWrite(dev);
 	yaffs_GrossLock(dev);
 
 	if (!S_ISDIR(inode->i_mode))		/* Don't link directories */
@@ -1524,6 +1625,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 	}
 
 	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlockWrite(dev);
 
 	if (link){
 		update_dir_time(dir);
@@ -1544,6 +1646,7 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 	T(YAFFS_TRACE_OS, ("yaffs_symlink\n"));
 
 	dev = yaffs_InodeToObject(dir)->myDev;
+	yaffs_DirLockWrite(dev);
 	yaffs_GrossLock(dev);
 	obj = yaffs_MknodSymLink(yaffs_InodeToObject(dir), dentry->d_name.name,
 				S_IFLNK | S_IRWXUGO, uid, gid, symname);
@@ -1554,6 +1657,7 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 
 		inode = yaffs_get_inode(dir->i_sb, obj->yst_mode, 0, obj);
 		d_instantiate(dentry, inode);
+		yaffs_DirUnlockWrite(dev);
 		update_dir_time(dir);
 		T(YAFFS_TRACE_OS, ("symlink created OK\n"));
 		return 0;
@@ -1561,6 +1665,8 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 		T(YAFFS_TRACE_OS, ("symlink not created\n"));
 	}
 
+	yaffs_DirUnlockWrite(dev);
+
 	return -ENOMEM;
 }
 
@@ -1604,6 +1710,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	T(YAFFS_TRACE_OS, ("yaffs_rename\n"));
 	dev = yaffs_InodeToObject(old_dir)->myDev;
 
+	yaffs_DirLockWrite(dev);
 	yaffs_GrossLock(dev);
 
 	/* Check if the target is an existing directory that is not empty. */
@@ -1628,6 +1735,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 				new_dentry->d_name.name);
 	}
 	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlockWrite(dev);
 
 	if (retVal == YAFFS_OK) {
 		if (target) {
@@ -1856,17 +1964,145 @@ static void yaffs_read_inode(struct inode *inode)
 
 static YLIST_HEAD(yaffs_dev_list);
 
-#if 0 /* not used */
+/*
+ * Background garbage collection.
+ *
+ * Each read-write mount has a thread that keeps dev->gcReserveBlocks
+ * erased blocks ready, so writers seldom have to collect themselves.
+ * Remounting read-only stops it and remounting read-write starts it.
+ *
+ * It sleeps until the allocator starts a block while the reserve is short,
+ * then waits until nobody has taken grossLock for YAFFS_BG_IDLE, unless the
+ * reserve is nearly gone, and drops the lock after every few chunks it
+ * copies so a writer arriving meanwhile only waits for those. When no
+ * block is worth collecting it ignores wakeups for a while, twice as long
+ * each time up to YAFFS_BG_MAX_BACKOFF, as finding that out means looking
+ * at every block.
+ */
+#define YAFFS_BG_IDLE		(HZ / 10)
+#define YAFFS_BG_MAX_BACKOFF	(30 * HZ)
+
+static int yaffs_BackgroundThread(void *data)
+{
+	yaffs_Device *dev = (yaffs_Device *)data;
+	struct super_block *sb = (struct super_block *)dev->superBlock;
+	unsigned long idleAt, retryAt = jiffies;
+	long backoff = YAFFS_BG_IDLE;
+	long timeout;
+	int urgency;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		if (try_to_freeze())
+			continue;
+
+		timeout = MAX_SCHEDULE_TIMEOUT;
+
+		if (time_before(jiffies, retryAt)) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			timeout = retryAt - jiffies;
+			goto sleep;
+		}
+
+		/* Not yaffs_GrossLock(), we don't count as activity */
+		down(&dev->grossLock);
+
+		urgency = 0;
+		if (yaffs_bg_enable && !dev->isCheckpointed &&
+		    !(sb->s_flags & MS_RDONLY))
+			urgency = yaffs_BackgroundGCUrgency(dev);
+
+		if (urgency) {
+			idleAt = dev->lastActivity + YAFFS_BG_IDLE;
+			if (urgency > 1 || time_after_eq(jiffies, idleAt)) {
+				if (yaffs_BackgroundGarbageCollect(dev, urgency)) {
+					timeout = 0;
+					backoff = YAFFS_BG_IDLE;
+				} else if (yaffs_BackgroundGCUrgency(dev)) {
+					/* Short of blocks, but none to collect */
+					retryAt = jiffies + backoff;
+					backoff = min_t(long, backoff * 2,
+							YAFFS_BG_MAX_BACKOFF);
+				}
+			} else {
+				timeout = idleAt - jiffies;
+			}
+		}
+
+		/* Writers wake us holding grossLock, so none is missed */
+		set_current_state(TASK_INTERRUPTIBLE);
+		up(&dev->grossLock);
+
+sleep:
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		if (timeout) {
+			schedule_timeout(timeout);
+		} else {
+			__set_current_state(TASK_RUNNING);
+			cond_resched();
+		}
+	}
+
+	return 0;
+}
+
+/* Called by yaffs_guts with grossLock held */
+static void yaffs_WakeBackgroundThread(yaffs_Device *dev)
+{
+	if (dev->bgThread)
+		wake_up_process(dev->bgThread);
+}
+
+static void yaffs_StartBackgroundThread(yaffs_Device *dev, int index)
+{
+	struct task_struct *thread;
+
+	thread = kthread_run(yaffs_BackgroundThread, dev, "yaffs-bg-%d", index);
+	if (IS_ERR(thread)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs: could not start background gc: %ld\n",
+		   PTR_ERR(thread)));
+		return;
+	}
+
+	yaffs_GrossLock(dev);
+	dev->bgThread = thread;
+	dev->hasBackgroundGC = 1;
+	yaffs_GrossUnlock(dev);
+}
+
+static void yaffs_StopBackgroundThread(yaffs_Device *dev)
+{
+	struct task_struct *thread = dev->bgThread;
+
+	if (!thread)
+		return;
+
+	/* Writers must not wake it once it is gone */
+	yaffs_GrossLock(dev);
+	dev->hasBackgroundGC = 0;
+	dev->bgThread = NULL;
+	yaffs_GrossUnlock(dev);
+
+	kthread_stop(thread);
+}
+
 static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 {
-	yaffs_Device    *dev = yaffs_SuperToDevice(sb);
+	yaffs_Device *dev = yaffs_SuperToDevice(sb);
+	struct mtd_info *mtd = yaffs_SuperToDevice(sb)->genericDevice;
 
 	if (*flags & MS_RDONLY) {
-		struct mtd_info *mtd = yaffs_SuperToDevice(sb)->genericDevice;
-
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RO\n", dev->name));
 
+		/* Takes grossLock itself, and nothing may write from now on */
+		yaffs_StopBackgroundThread(dev);
+
 		yaffs_GrossLock(dev);
 
 		yaffs_FlushEntireDeviceCache(dev);
@@ -1880,11 +2116,13 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 	} else {
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RW\n", dev->name));
+
+		if (!dev->bgThread)
+			yaffs_StartBackgroundThread(dev, mtd->index);
 	}
 
 	return 0;
 }
-#endif
 
 static void yaffs_put_super(struct super_block *sb)
 {
@@ -1892,6 +2130,9 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_StopBackgroundThread(dev);
+
+	yaffs_DirLockWrite(dev);
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -1904,6 +2145,7 @@ static void yaffs_put_super(struct super_block *sb)
 	yaffs_Deinitialise(dev);
 
 	yaffs_GrossUnlock(dev);
+	yaffs_DirUnlockWrite(dev);
 
 	/* we assume this is protected by lock_kernel() in mount/umount */
 	ylist_del(&dev->devList);
@@ -1941,7 +2183,10 @@ typedef struct {
 	int inband_tags;
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
+	int summary;
+	int no_extents;
 	int no_cache;
+	int cache_size;
 	int empty_lost_and_found_overridden;
 	int empty_lost_and_found;
 } yaffs_options;
@@ -1974,6 +2219,17 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 			options->inband_tags = 1;
 		else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
+		else if (!strncmp(cur_opt, "cache-size=", 11)) {
+			options->cache_size =
+				simple_strtoul(cur_opt + 11, NULL, 0);
+			if (options->cache_size <= 0 ||
+			    options->cache_size > YAFFS_MAX_SHORT_OP_CACHES) {
+				printk(KERN_INFO "yaffs: cache-size must be "
+				       "1 to %d chunks\n",
+				       YAFFS_MAX_SHORT_OP_CACHES);
+				error = 1;
+			}
+		}
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
 			options->skip_checkpoint_read = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-write"))
@@ -1981,6 +2237,10 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 		else if (!strcmp(cur_opt, "no-checkpoint")) {
 			options->skip_checkpoint_read = 1;
 			options->skip_checkpoint_write = 1;
+		} else if (!strcmp(cur_opt, "summary")) {
+			options->summary = 1;
+		} else if (!strcmp(cur_opt, "no-extents")) {
+			options->no_extents = 1;
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-disable")) {
 			options->empty_lost_and_found = 0;
 			options->empty_lost_and_found_overridden = 1;
@@ -2198,7 +2458,12 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	dev->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	dev->nReservedBlocks = 5;
-	dev->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		dev->nShortOpCaches = 0;
+	else if (options.cache_size)
+		dev->nShortOpCaches = options.cache_size;
+	else
+		dev->nShortOpCaches = YAFFS_DEFAULT_SHORT_OP_CACHES;
 	dev->inbandTags = options.inband_tags;
 
 	/* ... and the functions. */
@@ -2209,6 +2474,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_ReadChunkWithTagsFromNAND;
 		dev->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		dev->queryNANDBlock = nandmtd2_QueryNANDBlock;
+		dev->readBlockTagsFromNAND = nandmtd2_ReadBlockTagsFromNAND;
 		dev->spareBuffer = YMALLOC(mtd->oobsize);
 		dev->isYaffs2 = 1;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
@@ -2245,6 +2511,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 
 	dev->superBlock = (void *)sb;
 	dev->markSuperBlockDirty = yaffs_MarkSuperBlockDirty;
+	dev->wakeBackgroundGC = yaffs_WakeBackgroundThread;
 
 
 #ifndef CONFIG_YAFFS_DOES_ECC
@@ -2257,6 +2524,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 
 	dev->skipCheckpointRead = options.skip_checkpoint_read;
 	dev->skipCheckpointWrite = options.skip_checkpoint_write;
+	dev->summaryDisabled = !options.summary;
+	dev->extentsDisabled = options.no_extents;
 
 	/* we assume this is protected by lock_kernel() in mount/umount */
 	ylist_add_tail(&dev->devList, &yaffs_dev_list);
@@ -2266,6 +2535,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
 
 	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->dirLock);
 
 	yaffs_GrossLock(dev);
 
@@ -2304,6 +2574,9 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+	if (!(sb->s_flags & MS_RDONLY))
+		yaffs_StartBackgroundThread(dev, mtd->index);
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2407,6 +2680,10 @@ static struct proc_dir_entry *my_proc_entry;
 
 static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 {
+	yaffs_RAMUsage ram;
+
+	yaffs_GetRAMUsage(dev, &ram);
+
 	buf += sprintf(buf, "startBlock......... %d\n", dev->startBlock);
 	buf += sprintf(buf, "endBlock........... %d\n", dev->endBlock);
 	buf += sprintf(buf, "totalBytesPerChunk. %d\n", dev->totalBytesPerChunk);
@@ -2420,6 +2697,14 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "nFreeTnodes........ %d\n", dev->nFreeTnodes);
 	buf += sprintf(buf, "nObjectsCreated.... %d\n", dev->nObjectsCreated);
 	buf += sprintf(buf, "nFreeObjects....... %d\n", dev->nFreeObjects);
+	buf += sprintf(buf, "ramTnodes(KB)...... %u\n", ram.tnodes / 1024);
+	buf += sprintf(buf, "ramExtents(KB)..... %u\n", ram.extents / 1024);
+	buf += sprintf(buf, "ramObjects(KB)..... %u\n", ram.objects / 1024);
+	buf += sprintf(buf, "ramBlocks(KB)...... %u\n", ram.blocks / 1024);
+	buf += sprintf(buf, "ramBuffers(KB)..... %u\n", ram.buffers / 1024);
+	buf += sprintf(buf, "ramTotal(KB)....... %u\n",
+		    (ram.tnodes + ram.extents + ram.objects +
+		     ram.blocks + ram.buffers) / 1024);
 	buf += sprintf(buf, "nFreeChunks........ %d\n", dev->nFreeChunks);
 	buf += sprintf(buf, "nPageWrites........ %d\n", dev->nPageWrites);
 	buf += sprintf(buf, "nPageReads......... %d\n", dev->nPageReads);
@@ -2428,6 +2713,18 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
+	buf += sprintf(buf, "gcReserveBlocks.... %d\n", dev->gcReserveBlocks);
+	buf += sprintf(buf, "fgGCTime(us)....... %llu\n",
+		    (unsigned long long)dev->gcForegroundTime);
+	buf += sprintf(buf, "fgGCMaxTime(us).... %u\n",
+		    dev->gcForegroundMaxTime);
+	buf += sprintf(buf, "bgGCTime(us)....... %llu\n",
+		    (unsigned long long)dev->gcBackgroundTime);
+	buf += sprintf(buf, "mountTime(us)...... %u\n", dev->mountTime);
+	buf += sprintf(buf, "nScannedBlocks..... %d\n", dev->nScannedBlocks);
+	buf += sprintf(buf, "nSummaryBlocks..... %d\n", dev->nSummaryBlocks);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2436,6 +2733,11 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %d\n", dev->cacheMisses);
+	buf += sprintf(buf, "cacheWriteBacks.... %d\n", dev->cacheWriteBacks);
+	buf += sprintf(buf, "cacheCombinedWrites %d\n",
+		    dev->cacheCombinedWrites);
+	buf += sprintf(buf, "nDirtyCacheChunks.. %d\n", dev->nDirtyCacheChunks);
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
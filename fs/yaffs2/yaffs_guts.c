@@ -28,12 +28,14 @@ const char *yaffs_guts_c_version =
 #include "yaffs_nand.h"
 
 #include "yaffs_checkptrw.h"
+#include "yaffs_summary.h"
 
 #include "yaffs_nand.h"
 #include "yaffs_packedtags2.h"
 
 
 #define YAFFS_PASSIVE_GC_CHUNKS 2
+#define YAFFS_MAX_GC_RESERVE_BLOCKS 16
 
 #include "yaffs_ecc.h"
 
@@ -112,6 +114,8 @@ static __u32 yaffs_GetChunkGroupBase(yaffs_Device *dev, yaffs_Tnode *tn,
 static yaffs_Tnode *yaffs_FindLevel0Tnode(yaffs_Device *dev,
 					yaffs_FileStructure *fStruct,
 					__u32 chunkId);
+static int yaffs_FindExtentChunk(yaffs_FileStructure *fStruct, __u32 chunkId);
+static void yaffs_SoftDeleteExtents(yaffs_Object *obj);
 
 /* Function to calculate chunk and offset */
 
@@ -675,7 +679,7 @@ static void yaffs_VerifyFile(yaffs_Object *obj)
 
 	actualTallness = obj->variant.fileVariant.topLevel;
 
-	if (requiredTallness > actualTallness)
+	if (obj->variant.fileVariant.top && requiredTallness > actualTallness)
 		T(YAFFS_TRACE_VERIFY,
 		(TSTR("Obj %d had tnode tallness %d, needs to be %d"TENDSTR),
 		 obj->objectId, actualTallness, requiredTallness));
@@ -690,18 +694,23 @@ static void yaffs_VerifyFile(yaffs_Object *obj)
 		return;
 
 	for (i = 1; i <= lastChunk; i++) {
-		tn = yaffs_FindLevel0Tnode(dev, &obj->variant.fileVariant, i);
+		__u32 theChunk = 0;
 
-		if (tn) {
-			__u32 theChunk = yaffs_GetChunkGroupBase(dev, tn, i);
-			if (theChunk > 0) {
-				/* T(~0,(TSTR("verifying (%d:%d) %d"TENDSTR),objectId,i,theChunk)); */
-				yaffs_ReadChunkWithTagsFromNAND(dev, theChunk, NULL, &tags);
-				if (tags.objectId != objectId || tags.chunkId != i) {
-					T(~0, (TSTR("Object %d chunkId %d NAND mismatch chunk %d tags (%d:%d)"TENDSTR),
-						objectId, i, theChunk,
-						tags.objectId, tags.chunkId));
-				}
+		if (!obj->variant.fileVariant.top) {
+			theChunk = yaffs_FindExtentChunk(&obj->variant.fileVariant, i);
+		} else {
+			tn = yaffs_FindLevel0Tnode(dev, &obj->variant.fileVariant, i);
+			if (tn)
+				theChunk = yaffs_GetChunkGroupBase(dev, tn, i);
+		}
+
+		if (theChunk > 0) {
+			/* T(~0,(TSTR("verifying (%d:%d) %d"TENDSTR),objectId,i,theChunk)); */
+			yaffs_ReadChunkWithTagsFromNAND(dev, theChunk, NULL, &tags);
+			if (tags.objectId != objectId || tags.chunkId != i) {
+				T(~0, (TSTR("Object %d chunkId %d NAND mismatch chunk %d tags (%d:%d)"TENDSTR),
+					objectId, i, theChunk,
+					tags.objectId, tags.chunkId));
 			}
 		}
 	}
@@ -994,6 +1003,8 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 		/* Copy the data into the robustification buffer */
 		yaffs_HandleWriteChunkOk(dev, chunk, data, tags);
 
+		yaffs_SummaryAdd(dev, tags, chunk);
+
 	} while (writeOk != YAFFS_OK &&
 		(yaffs_wr_attempts <= 0 || attempts <= yaffs_wr_attempts));
 
@@ -1462,6 +1473,14 @@ static yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 	if (chunkId > YAFFS_MAX_CHUNK_ID)
 		return NULL;
 
+	/* Files mapped by extents don't have a tree yet */
+	if (!fStruct->top) {
+		fStruct->top = yaffs_GetTnode(dev);
+		fStruct->topLevel = 0;
+		if (!fStruct->top)
+			return NULL;
+	}
+
 	/* First check we're tall enough (ie enough topLevel) */
 
 	x = chunkId >> YAFFS_TNODES_LEVEL0_BITS;
@@ -1745,6 +1764,9 @@ static void yaffs_SoftDeleteFile(yaffs_Object *obj)
 			  (TSTR("yaffs: Deleting empty file %d" TENDSTR),
 			   obj->objectId));
 			yaffs_DoGenericObjectDeletion(obj);
+		} else if (!obj->variant.fileVariant.top) {
+			yaffs_SoftDeleteExtents(obj);
+			obj->softDeleted = 1;
 		} else {
 			yaffs_SoftDeleteWorker(obj,
 					       obj->variant.fileVariant.top,
@@ -1838,9 +1860,359 @@ static int yaffs_PruneFileStructure(yaffs_Device *dev,
 		}
 	}
 
+	/* A file with no chunks left goes back to being mapped by extents */
+	if (fStruct->topLevel == 0 && fStruct->top && !dev->extentsDisabled) {
+		tn = fStruct->top;
+		hasData = 0;
+		for (i = 0; i < (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/32; i++) {
+			if (((__u32 *)tn)[i])
+				hasData++;
+		}
+
+		if (!hasData) {
+			yaffs_FreeTnode(dev, tn);
+			fStruct->top = NULL;
+		}
+	}
+
+	return YAFFS_OK;
+}
+
+/*-------------------- Extent maps -----------------------------------------
+ * Most files are written in one go, so their chunks end up in consecutive
+ * NAND chunks. Such a file is mapped by a short list of extents instead of a
+ * tnode tree. Once the list would take more RAM than the level 0 tnodes it
+ * replaces, the file is moved over to tnodes and stays there until it is
+ * truncated to nothing.
+ */
+
+#define YAFFS_MIN_EXTENTS	4
+
+static int yaffs_ExtentMapSize(int maxExtents)
+{
+	return sizeof(yaffs_ExtentMap) + maxExtents * sizeof(yaffs_Extent);
+}
+
+static void yaffs_FreeExtents(yaffs_Device *dev, yaffs_FileStructure *fStruct)
+{
+	if (fStruct->extents) {
+		dev->nExtentBytes -=
+			yaffs_ExtentMapSize(fStruct->extents->maxExtents);
+		YFREE(fStruct->extents);
+		fStruct->extents = NULL;
+		dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
+	}
+}
+
+/* Finds the extent holding chunkId, or else the last one before it.
+ * Returns -1 if there is none before it.
+ */
+static int yaffs_FindExtent(yaffs_ExtentMap *map, __u32 chunkId)
+{
+	int lo = 0;
+	int hi = map->nExtents - 1;
+	int mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (map->extent[mid].chunkId <= chunkId)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return hi;
+}
+
+/* Returns the NAND chunk mapped to chunkId, or 0 if there is none */
+static int yaffs_FindExtentChunk(yaffs_FileStructure *fStruct, __u32 chunkId)
+{
+	yaffs_ExtentMap *map = fStruct->extents;
+	yaffs_Extent *e;
+	int i;
+
+	if (!map)
+		return 0;
+
+	i = yaffs_FindExtent(map, chunkId);
+	if (i < 0)
+		return 0;
+
+	e = &map->extent[i];
+	if (chunkId >= e->chunkId + e->nChunks)
+		return 0;
+
+	return e->nandChunk + (chunkId - e->chunkId);
+}
+
+/* Opens a gap for a new extent at position i, growing the map if needed.
+ * Fails if the file would then need more extents than it is worth keeping.
+ */
+static int yaffs_InsertExtent(yaffs_Device *dev, yaffs_FileStructure *fStruct,
+				int i, __u32 lastChunk)
+{
+	yaffs_ExtentMap *map = fStruct->extents;
+	yaffs_ExtentMap *newMap;
+	int nExtents = map ? map->nExtents : 0;
+	int maxExtents;
+	int tnodeSize;
+
+	tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
+
+	if (tnodeSize < sizeof(yaffs_Tnode))
+		tnodeSize = sizeof(yaffs_Tnode);
+
+	/* Allow as many extents as fit in the level 0 tnodes of the file */
+	maxExtents = ((lastChunk >> YAFFS_TNODES_LEVEL0_BITS) + 1) *
+			tnodeSize / sizeof(yaffs_Extent);
+	if (maxExtents < YAFFS_MIN_EXTENTS)
+		maxExtents = YAFFS_MIN_EXTENTS;
+
+	if (nExtents >= maxExtents)
+		return YAFFS_FAIL;
+
+	if (!map || nExtents == map->maxExtents) {
+		if (map && map->maxExtents * 2 < maxExtents)
+			maxExtents = map->maxExtents * 2;
+		else if (!map)
+			maxExtents = 1;
+
+		newMap = YMALLOC(yaffs_ExtentMapSize(maxExtents));
+		if (!newMap)
+			return YAFFS_FAIL;
+
+		newMap->nExtents = nExtents;
+		newMap->maxExtents = maxExtents;
+		if (map) {
+			memcpy(newMap->extent, map->extent,
+				nExtents * sizeof(yaffs_Extent));
+			yaffs_FreeExtents(dev, fStruct);
+		}
+
+		dev->nExtentBytes += yaffs_ExtentMapSize(maxExtents);
+		dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
+		fStruct->extents = map = newMap;
+	}
+
+	memmove(&map->extent[i + 1], &map->extent[i],
+		(nExtents - i) * sizeof(yaffs_Extent));
+	map->nExtents++;
+
 	return YAFFS_OK;
 }
 
+static void yaffs_DeleteExtent(yaffs_Device *dev, yaffs_FileStructure *fStruct,
+				int i)
+{
+	yaffs_ExtentMap *map = fStruct->extents;
+
+	map->nExtents--;
+	memmove(&map->extent[i], &map->extent[i + 1],
+		(map->nExtents - i) * sizeof(yaffs_Extent));
+
+	if (!map->nExtents)
+		yaffs_FreeExtents(dev, fStruct);
+}
+
+/* Unmaps chunkId. Fails if that splits an extent and there is no room for
+ * the second half, in which case the map is left as it was.
+ */
+static int yaffs_RemoveExtentChunk(yaffs_Device *dev,
+				yaffs_FileStructure *fStruct, __u32 chunkId)
+{
+	yaffs_ExtentMap *map = fStruct->extents;
+	yaffs_Extent *e;
+	__u32 first;
+	__u32 last;
+	__u32 lastChunk;
+	int i;
+
+	i = map ? yaffs_FindExtent(map, chunkId) : -1;
+	if (i < 0)
+		return YAFFS_OK;
+
+	e = &map->extent[i];
+	first = e->chunkId;
+	last = e->chunkId + e->nChunks - 1;
+
+	if (chunkId > last)
+		return YAFFS_OK;
+
+	if (chunkId == first) {
+		e->chunkId++;
+		e->nandChunk++;
+		e->nChunks--;
+		if (!e->nChunks)
+			yaffs_DeleteExtent(dev, fStruct, i);
+	} else if (chunkId == last) {
+		e->nChunks--;
+	} else {
+		e = &map->extent[map->nExtents - 1];
+		lastChunk = e->chunkId + e->nChunks - 1;
+
+		if (yaffs_InsertExtent(dev, fStruct, i + 1, lastChunk) != YAFFS_OK)
+			return YAFFS_FAIL;
+
+		/* The map might have moved */
+		map = fStruct->extents;
+		e = &map->extent[i];
+		map->extent[i + 1].chunkId = chunkId + 1;
+		map->extent[i + 1].nandChunk = e->nandChunk + (chunkId + 1 - first);
+		map->extent[i + 1].nChunks = last - chunkId;
+		e->nChunks = chunkId - first;
+	}
+
+	return YAFFS_OK;
+}
+
+/* Maps chunkId to chunkInNAND, joining it onto the extents either side when
+ * the NAND chunks follow on. Fails if the file needs too many extents or we
+ * are out of memory; the caller then moves the file over to tnodes.
+ */
+static int yaffs_SetExtentChunk(yaffs_Device *dev, yaffs_FileStructure *fStruct,
+				__u32 chunkId, __u32 chunkInNAND)
+{
+	yaffs_ExtentMap *map;
+	yaffs_Extent *e;
+	yaffs_Extent *before = NULL;
+	yaffs_Extent *after = NULL;
+	__u32 lastChunk = chunkId;
+	int i;
+
+	if (chunkId > YAFFS_MAX_CHUNK_ID)
+		return YAFFS_FAIL;
+
+	if (yaffs_RemoveExtentChunk(dev, fStruct, chunkId) != YAFFS_OK)
+		return YAFFS_FAIL;
+
+	map = fStruct->extents;
+	i = map ? yaffs_FindExtent(map, chunkId) : -1;
+
+	if (i >= 0) {
+		e = &map->extent[i];
+		if (e->chunkId + e->nChunks == chunkId &&
+		    e->nandChunk + e->nChunks == chunkInNAND)
+			before = e;
+	}
+
+	if (map && i + 1 < map->nExtents) {
+		e = &map->extent[i + 1];
+		if (e->chunkId == chunkId + 1 && e->nandChunk == chunkInNAND + 1)
+			after = e;
+	}
+
+	if (before) {
+		before->nChunks++;
+		if (after) {
+			before->nChunks += after->nChunks;
+			yaffs_DeleteExtent(dev, fStruct, i + 1);
+		}
+		return YAFFS_OK;
+	}
+
+	if (after) {
+		after->chunkId--;
+		after->nandChunk--;
+		after->nChunks++;
+		return YAFFS_OK;
+	}
+
+	if (map) {
+		e = &map->extent[map->nExtents - 1];
+		if (e->chunkId + e->nChunks - 1 > lastChunk)
+			lastChunk = e->chunkId + e->nChunks - 1;
+	}
+
+	if (yaffs_InsertExtent(dev, fStruct, i + 1, lastChunk) != YAFFS_OK)
+		return YAFFS_FAIL;
+
+	e = &fStruct->extents->extent[i + 1];
+	e->chunkId = chunkId;
+	e->nandChunk = chunkInNAND;
+	e->nChunks = 1;
+
+	return YAFFS_OK;
+}
+
+static void yaffs_FreeTnodeTree(yaffs_Device *dev, yaffs_Tnode *tn, int level)
+{
+	int i;
+
+	if (!tn)
+		return;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_FreeTnodeTree(dev, tn->internal[i], level - 1);
+	}
+
+	yaffs_FreeTnode(dev, tn);
+}
+
+/* Moves the chunks mapped by extents into the tnode tree, creating the
+ * tree if the file does not have one yet. If we run out of tnodes while
+ * creating it, the file is left mapped by its extents.
+ */
+static int yaffs_ExtentsToTnodes(yaffs_Device *dev, yaffs_FileStructure *fStruct)
+{
+	yaffs_ExtentMap *map = fStruct->extents;
+	yaffs_Extent *e;
+	yaffs_Tnode *tn;
+	int newTree = 0;
+	__u32 c;
+	int i;
+
+	if (!fStruct->top) {
+		fStruct->top = yaffs_GetTnode(dev);
+		fStruct->topLevel = 0;
+		if (!fStruct->top)
+			return YAFFS_FAIL;
+		newTree = 1;
+	}
+
+	for (i = 0; map && i < map->nExtents; i++) {
+		e = &map->extent[i];
+		for (c = e->chunkId; c < e->chunkId + e->nChunks; c++) {
+			tn = yaffs_AddOrFindLevel0Tnode(dev, fStruct, c, NULL);
+			if (!tn) {
+				T(YAFFS_TRACE_ERROR,
+				  (TSTR("yaffs: no tnodes to map extents"
+				    TENDSTR)));
+				if (newTree) {
+					yaffs_FreeTnodeTree(dev, fStruct->top,
+							fStruct->topLevel);
+					fStruct->top = NULL;
+					fStruct->topLevel = 0;
+				}
+				return YAFFS_FAIL;
+			}
+			yaffs_PutLevel0Tnode(dev, tn, c,
+					e->nandChunk + (c - e->chunkId));
+		}
+	}
+
+	yaffs_FreeExtents(dev, fStruct);
+
+	return YAFFS_OK;
+}
+
+static void yaffs_SoftDeleteExtents(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_FileStructure *fStruct = &obj->variant.fileVariant;
+	yaffs_Extent *e;
+	__u32 c;
+	int i;
+
+	for (i = 0; fStruct->extents && i < fStruct->extents->nExtents; i++) {
+		e = &fStruct->extents->extent[i];
+		for (c = e->nandChunk; c < e->nandChunk + e->nChunks; c++)
+			yaffs_SoftDeleteChunk(dev, c);
+	}
+
+	yaffs_FreeExtents(dev, fStruct);
+}
+
 /*-------------------- End of File Structure functions.-------------------*/
 
 /* yaffs_CreateFreeObjects creates a bunch more objects and
@@ -2003,6 +2375,9 @@ static void yaffs_FreeObject(yaffs_Object *tn)
 	}
 #endif
 
+	if (tn->variantType == YAFFS_OBJECT_TYPE_FILE)
+		yaffs_FreeExtents(dev, &tn->variant.fileVariant);
+
 	yaffs_UnhashObject(tn);
 
 #ifdef VALGRIND_TEST
@@ -2031,6 +2406,18 @@ static void yaffs_DeinitialiseObjects(yaffs_Device *dev)
 	/* Free the list of allocated Objects */
 
 	yaffs_ObjectList *tmp;
+	struct ylist_head *lh;
+	yaffs_Object *obj;
+	int i;
+
+	/* Extent maps live outside the object lists */
+	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
+		ylist_for_each(lh, &dev->objectBucket[i].list) {
+			obj = ylist_entry(lh, yaffs_Object, hashLink);
+			if (obj->variantType == YAFFS_OBJECT_TYPE_FILE)
+				yaffs_FreeExtents(dev, &obj->variant.fileVariant);
+		}
+	}
 
 	while (dev->allocatedObjectList) {
 		tmp = dev->allocatedObjectList->next;
@@ -2173,7 +2560,8 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 	if (!theObject)
 		return NULL;
 
-	if (type == YAFFS_OBJECT_TYPE_FILE) {
+	/* New files start out mapped by extents */
+	if (type == YAFFS_OBJECT_TYPE_FILE && dev->extentsDisabled) {
 		tn = yaffs_GetTnode(dev);
 		if (!tn) {
 			yaffs_FreeObject(theObject);
@@ -2585,6 +2973,26 @@ static void yaffs_DeinitialiseBlocks(yaffs_Device *dev)
 	dev->chunkBits = NULL;
 }
 
+/* Chunks of a block that can hold data. With block summaries the last
+ * chunk of each block is kept for the summary.
+ */
+static int yaffs_DataChunksPerBlock(yaffs_Device *dev)
+{
+	return dev->chunksPerSummary ? dev->chunksPerSummary :
+		dev->nChunksPerBlock;
+}
+
+/* Summary chunks count as free in nFreeChunks, like deleted chunks, but
+ * collecting a block does not get its summary chunk back. This is how
+ * much of nFreeChunks is really summary overhead.
+ */
+static int yaffs_SummaryOverhead(yaffs_Device *dev)
+{
+	if (!dev->chunksPerSummary)
+		return 0;
+	return dev->internalEndBlock - dev->internalStartBlock + 1;
+}
+
 static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
 					yaffs_BlockInfo *bi)
 {
@@ -2609,7 +3017,8 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
 			b = yaffs_GetBlockInfo(dev, i);
 			if (b->blockState == YAFFS_BLOCK_STATE_FULL &&
 			    (b->pagesInUse - b->softDeletions) <
-			    dev->nChunksPerBlock && b->sequenceNumber < seq) {
+			    yaffs_DataChunksPerBlock(dev) &&
+			    b->sequenceNumber < seq) {
 				seq = b->sequenceNumber;
 			}
 		}
@@ -2622,12 +3031,35 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
 	return (bi->sequenceNumber <= dev->oldestDirtySequence);
 }
 
+/* Cost-benefit score of collecting a block, as in LFS: the space it frees
+ * times how long its data has gone without being rewritten, over the cost
+ * of reading the block and copying its live chunks out. Sequence numbers
+ * count allocated blocks, so age is measured in blocks written since.
+ * Old, mostly dead blocks score highest; young blocks are left alone for
+ * a while since more of their chunks are likely to die soon.
+ */
+static unsigned yaffs_GCScore(yaffs_Device *dev, yaffs_BlockInfo *bi,
+				int pagesInUse)
+{
+	unsigned age = dev->sequenceNumber - bi->sequenceNumber;
+
+	if (age > 0xffff)
+		age = 0xffff;
+
+	return ((yaffs_DataChunksPerBlock(dev) - pagesInUse) * (age + 1) * 16) /
+		(dev->nChunksPerBlock + pagesInUse);
+}
+
 /* FindDiretiestBlock is used to select the dirtiest block (or close enough)
  * for garbage collection.
+ *
+ * Aggressive gc is about to stall a writer, so it takes the block with the
+ * fewest chunks to copy. Passive and background gc have time to spare and
+ * pick by yaffs_GCScore() among the blocks that are dirty enough.
  */
 
 static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
-					int aggressive)
+					int aggressive, int background)
 {
 	int b = dev->currentDirtyChecker;
 
@@ -2635,6 +3067,10 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	int iterations;
 	int dirtiest = -1;
 	int pagesInUse = 0;
+	int maxInUse;
+	int inUse;
+	unsigned score;
+	unsigned bestScore = 0;
 	int prioritised = 0;
 	yaffs_BlockInfo *bi;
 	int pendingPrioritisedExist = 0;
@@ -2666,18 +3102,29 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	 * search harder.
 	 * else (we're doing a leasurely gc), then we only bother to do this if the
 	 * block has only a few pages in use.
+	 * Background gc searches the whole device, but unless it is urgent
+	 * it leaves blocks that are still mostly live, copying those costs
+	 * more flash wear than the space is worth.
 	 */
 
-	dev->nonAggressiveSkip--;
+	if (!background) {
+		dev->nonAggressiveSkip--;
 
-	if (!aggressive && (dev->nonAggressiveSkip > 0))
-		return -1;
+		if (!aggressive && (dev->nonAggressiveSkip > 0))
+			return -1;
+	}
+
+	if (aggressive)
+		maxInUse = yaffs_DataChunksPerBlock(dev);
+	else if (background)
+		maxInUse = dev->nChunksPerBlock - dev->nChunksPerBlock / 4;
+	else
+		maxInUse = YAFFS_PASSIVE_GC_CHUNKS + 1;
 
 	if (!prioritised)
-		pagesInUse =
-			(aggressive) ? dev->nChunksPerBlock : YAFFS_PASSIVE_GC_CHUNKS + 1;
+		pagesInUse = maxInUse;
 
-	if (aggressive)
+	if (aggressive || background)
 		iterations =
 		    dev->internalEndBlock - dev->internalStartBlock + 1;
 	else {
@@ -2701,11 +3148,25 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 		bi = yaffs_GetBlockInfo(dev, b);
 
-		if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-			(bi->pagesInUse - bi->softDeletions) < pagesInUse &&
-				yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
-			dirtiest = b;
-			pagesInUse = (bi->pagesInUse - bi->softDeletions);
+		if (bi->blockState != YAFFS_BLOCK_STATE_FULL)
+			continue;
+
+		inUse = bi->pagesInUse - bi->softDeletions;
+
+		if (aggressive && !background) {
+			if (inUse < pagesInUse &&
+			    yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
+				dirtiest = b;
+				pagesInUse = inUse;
+			}
+		} else if (inUse < maxInUse) {
+			score = yaffs_GCScore(dev, bi, inUse);
+			if (score > bestScore &&
+			    yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
+				dirtiest = b;
+				pagesInUse = inUse;
+				bestScore = score;
+			}
 		}
 	}
 
@@ -2719,7 +3180,7 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 	dev->oldestDirtySequence = 0;
 
-	if (dirtiest > 0)
+	if (dirtiest > 0 && !background)
 		dev->nonAggressiveSkip = 4;
 
 	return dirtiest;
@@ -2772,6 +3233,7 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		bi->pagesInUse = 0;
 		bi->softDeletions = 0;
 		bi->hasShrinkHeader = 0;
+		bi->hasSummary = 0;
 		bi->skipErasedCheck = 1;  /* This is clean, so no need to check */
 		bi->gcPrioritise = 0;
 		yaffs_ClearChunkBits(dev, blockNo);
@@ -2858,6 +3320,7 @@ static int yaffs_CalcCheckpointBlocksRequired(yaffs_Device *dev)
 		nBytes += devBlocks * dev->chunkBitmapStride;
 		nBytes += (sizeof(yaffs_CheckpointObject) + sizeof(__u32)) * (dev->nObjectsCreated - dev->nFreeObjects);
 		nBytes += (tnodeSize + sizeof(__u32)) * (dev->nTnodesCreated - dev->nFreeTnodes);
+		nBytes += dev->nExtentBytes;
 		nBytes += sizeof(yaffs_CheckpointValidity);
 		nBytes += sizeof(__u32); /* checksum*/
 
@@ -2891,10 +3354,31 @@ static int yaffs_CheckSpaceForAllocation(yaffs_Device *dev)
 	}
 
 	reservedChunks = ((reservedBlocks + checkpointBlocks) * dev->nChunksPerBlock);
+	reservedChunks += yaffs_SummaryOverhead(dev);
 
 	return (dev->nFreeChunks > reservedChunks);
 }
 
+/* Dirty cache chunks will need a chunk each when they are written out, so
+ * only take on another one if there is room for all of them.
+ */
+static int yaffs_CheckSpaceForCachedWrite(yaffs_Device *dev)
+{
+	int reservedBlocks = dev->nReservedBlocks;
+	int checkpointBlocks = 0;
+
+	if (dev->isYaffs2) {
+		checkpointBlocks =  yaffs_CalcCheckpointBlocksRequired(dev) -
+				    dev->blocksInCheckpoint;
+		if (checkpointBlocks < 0)
+			checkpointBlocks = 0;
+	}
+
+	return dev->nFreeChunks >
+		(reservedBlocks + checkpointBlocks) * dev->nChunksPerBlock +
+		yaffs_SummaryOverhead(dev) + dev->nDirtyCacheChunks;
+}
+
 static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		yaffs_BlockInfo **blockUsedPtr)
 {
@@ -2905,6 +3389,11 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* Get next block to allocate off */
 		dev->allocationBlock = yaffs_FindBlockForAllocation(dev);
 		dev->allocationPage = 0;
+
+		/* One erased block fewer, background gc may have to act */
+		if (dev->hasBackgroundGC && dev->wakeBackgroundGC &&
+		    yaffs_BackgroundGCUrgency(dev))
+			dev->wakeBackgroundGC(dev);
 	}
 
 	if (!useReserve && !yaffs_CheckSpaceForAllocation(dev)) {
@@ -2932,7 +3421,7 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		dev->nFreeChunks--;
 
 		/* If the block is full set the state to full */
-		if (dev->allocationPage >= dev->nChunksPerBlock) {
+		if (dev->allocationPage >= yaffs_DataChunksPerBlock(dev)) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
 			dev->allocationBlock = -1;
 		}
@@ -3213,6 +3702,18 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	return retVal;
 }
 
+/* Below this many erased blocks writers collect aggressively themselves. */
+static int yaffs_GCHardLimit(yaffs_Device *dev)
+{
+	int checkpointBlockAdjust;
+
+	checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
+	if (checkpointBlockAdjust < 0)
+		checkpointBlockAdjust = 0;
+
+	return dev->nReservedBlocks + checkpointBlockAdjust + 2;
+}
+
 /* New garbage collector
  * If we're very low on erased blocks then we do aggressive garbage collection
  * otherwise we do "leasurely" garbage collection.
@@ -3221,6 +3722,9 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
  *
  * The idea is to help clear out space in a more spread-out manner.
  * Dunno if it really does anything useful.
+ *
+ * When the OS runs background gc, that keeps a reserve of erased blocks
+ * and writers leave passive gc to it unless it is falling behind.
  */
 static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 {
@@ -3228,8 +3732,9 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	int aggressive;
 	int gcOk = YAFFS_OK;
 	int maxTries = 0;
-
-	int checkpointBlockAdjust;
+	int hardLimit;
+	__u32 start;
+	__u32 elapsed;
 
 	if (dev->isDoingGC) {
 		/* Bail out so we don't get recursive gc */
@@ -3243,20 +3748,23 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	do {
 		maxTries++;
 
-		checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
-		if (checkpointBlockAdjust < 0)
-			checkpointBlockAdjust = 0;
+		hardLimit = yaffs_GCHardLimit(dev);
 
-		if (dev->nErasedBlocks < (dev->nReservedBlocks + checkpointBlockAdjust + 2)) {
+		if (dev->nErasedBlocks < hardLimit) {
 			/* We need a block soon...*/
 			aggressive = 1;
 		} else {
 			/* We're in no hurry */
 			aggressive = 0;
+
+			if (dev->hasBackgroundGC &&
+			    dev->nErasedBlocks >=
+					hardLimit + dev->gcReserveBlocks / 2)
+				return YAFFS_OK;
 		}
 
 		if (dev->gcBlock <= 0) {
-			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive);
+			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive, 0);
 			dev->gcChunk = 0;
 		}
 
@@ -3272,7 +3780,13 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 			   ("yaffs: GC erasedBlocks %d aggressive %d" TENDSTR),
 			   dev->nErasedBlocks, aggressive));
 
+			start = Y_CURRENT_USECS();
 			gcOk = yaffs_GarbageCollectBlock(dev, block, aggressive);
+			elapsed = Y_CURRENT_USECS() - start;
+
+			dev->gcForegroundTime += elapsed;
+			if (elapsed > dev->gcForegroundMaxTime)
+				dev->gcForegroundMaxTime = elapsed;
 		}
 
 		if (dev->nErasedBlocks < (dev->nReservedBlocks) && block > 0) {
@@ -3288,6 +3802,65 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/* How much the device needs background gc:
+ * 0 - the erased block reserve is full, or there is not a block's worth
+ *     of dead chunks to reclaim,
+ * 1 - below the reserve,
+ * 2 - below half of it, writers are about to start collecting themselves.
+ */
+int yaffs_BackgroundGCUrgency(yaffs_Device *dev)
+{
+	int hardLimit = yaffs_GCHardLimit(dev);
+
+	if (dev->nErasedBlocks >= hardLimit + dev->gcReserveBlocks)
+		return 0;
+
+	if (dev->nFreeChunks - yaffs_GetErasedChunks(dev) -
+			yaffs_SummaryOverhead(dev) < dev->nChunksPerBlock)
+		return 0;
+
+	if (dev->nErasedBlocks >= hardLimit + dev->gcReserveBlocks / 2)
+		return 1;
+
+	return 2;
+}
+
+/* One step of background gc: pick a victim if there is none in progress
+ * and copy a few chunks off it, so the caller can drop its lock between
+ * steps. Returns 1 if there is more to do.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int urgency)
+{
+	int block;
+	__u32 start;
+
+	if (urgency <= 0 || dev->isDoingGC)
+		return 0;
+
+	if (dev->gcBlock <= 0) {
+		dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev,
+							urgency > 1, 1);
+		dev->gcChunk = 0;
+	}
+
+	block = dev->gcBlock;
+	if (block <= 0)
+		return 0;
+
+	if (dev->gcChunk == 0)
+		dev->backgroundGarbageCollections++;
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: background GC erasedBlocks %d urgency %d" TENDSTR),
+	   dev->nErasedBlocks, urgency));
+
+	start = Y_CURRENT_USECS();
+	yaffs_GarbageCollectBlock(dev, block, 0);
+	dev->gcBackgroundTime += Y_CURRENT_USECS() - start;
+
+	return yaffs_BackgroundGCUrgency(dev) > 0;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3317,6 +3890,17 @@ static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 		tags = &localTags;
 	}
 
+	if (!in->variant.fileVariant.top) {
+		/* Extents map the exact chunk, so no tags need to be read */
+		theChunk = yaffs_FindExtentChunk(&in->variant.fileVariant,
+						chunkInInode);
+		if (theChunk > 0 &&
+		    yaffs_CheckChunkBit(dev, theChunk / dev->nChunksPerBlock,
+				theChunk % dev->nChunksPerBlock))
+			retVal = theChunk;
+		return retVal;
+	}
+
 	tn = yaffs_FindLevel0Tnode(dev, &in->variant.fileVariant, chunkInInode);
 
 	if (tn) {
@@ -3345,6 +3929,18 @@ static int yaffs_FindAndDeleteChunkInFile(yaffs_Object *in, int chunkInInode,
 		tags = &localTags;
 	}
 
+	if (!in->variant.fileVariant.top) {
+		retVal = yaffs_FindChunkInFile(in, chunkInInode, tags);
+		if (retVal == -1 ||
+		    yaffs_RemoveExtentChunk(dev, &in->variant.fileVariant,
+					chunkInInode) == YAFFS_OK)
+			return retVal;
+
+		/* Too fragmented to split the extent, delete it from tnodes */
+		if (yaffs_ExtentsToTnodes(dev, &in->variant.fileVariant) != YAFFS_OK)
+			return -1;
+	}
+
 	tn = yaffs_FindLevel0Tnode(dev, &in->variant.fileVariant, chunkInInode);
 
 	if (tn) {
@@ -3452,14 +4048,20 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		return YAFFS_OK;
 	}
 
-	tn = yaffs_AddOrFindLevel0Tnode(dev,
-					&in->variant.fileVariant,
-					chunkInInode,
-					NULL);
-	if (!tn)
-		return YAFFS_FAIL;
+	if (!in->variant.fileVariant.top) {
+		tn = NULL;
+		existingChunk = yaffs_FindExtentChunk(&in->variant.fileVariant,
+						chunkInInode);
+	} else {
+		tn = yaffs_AddOrFindLevel0Tnode(dev,
+						&in->variant.fileVariant,
+						chunkInInode,
+						NULL);
+		if (!tn)
+			return YAFFS_FAIL;
 
-	existingChunk = yaffs_GetChunkGroupBase(dev, tn, chunkInInode);
+		existingChunk = yaffs_GetChunkGroupBase(dev, tn, chunkInInode);
+	}
 
 	if (inScan != 0) {
 		/* If we're scanning then we need to test for duplicates
@@ -3536,10 +4138,26 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 
 	}
 
+	if (!tn) {
+		if (yaffs_SetExtentChunk(dev, &in->variant.fileVariant,
+					chunkInInode, chunkInNAND) != YAFFS_OK) {
+			/* Too fragmented for extents, move over to tnodes */
+			if (yaffs_ExtentsToTnodes(dev, &in->variant.fileVariant) != YAFFS_OK)
+				return YAFFS_FAIL;
+			tn = yaffs_AddOrFindLevel0Tnode(dev,
+							&in->variant.fileVariant,
+							chunkInInode,
+							NULL);
+			if (!tn)
+				return YAFFS_FAIL;
+		}
+	}
+
 	if (existingChunk == 0)
 		in->nDataChunks++;
 
-	yaffs_PutLevel0Tnode(dev, tn, chunkInInode, chunkInNAND);
+	if (tn)
+		yaffs_PutLevel0Tnode(dev, tn, chunkInInode, chunkInNAND);
 
 	return YAFFS_OK;
 }
@@ -3855,220 +4473,281 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache chunks are found through a hash of the object and chunk id. They sit on one
+ *   of two lists in least recently used order: free and clean chunks (free ones at the
+ *   head) and dirty chunks. When a dirty chunk has to be pushed out to make room, the
+ *   dirty chunks of the same file on either side of it are written out with it, so
+ *   short random writes close to each other reach NAND together.
  */
 
+/* Most dirty chunks written out together when a dirty chunk is pushed out */
+#define YAFFS_CACHE_WRITE_RUN	16
+
+static struct ylist_head *yaffs_CacheBucket(yaffs_Device *dev,
+					const yaffs_Object *obj, int chunkId)
+{
+	return &dev->srCacheHash[(obj->objectId * 31 + chunkId) &
+				 dev->srCacheHashMask];
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
 	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->nShortOpCaches;
+	struct ylist_head *i;
+
+	if (dev->nShortOpCaches <= 0)
+		return 0;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
+	ylist_for_each(i, &dev->srCacheDirty) {
+		cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (cache->object == obj)
 			return 1;
 	}
 
 	return 0;
 }
 
-
-static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
+/* Find a cached chunk */
+static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
+					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
 	yaffs_ChunkCache *cache;
-	int chunkWritten = 0;
-	int nCaches = obj->myDev->nShortOpCaches;
-
-	if (nCaches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
+	struct ylist_head *i;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	if (dev->nShortOpCaches > 0) {
+		ylist_for_each(i, yaffs_CacheBucket(dev, obj, chunkId)) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId)
+				return cache;
+		}
+	}
+	return NULL;
+}
 
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+/* Attach a free cache chunk to a chunk of a file */
+static void yaffs_AssignChunkCache(yaffs_ChunkCache *cache, yaffs_Object *obj,
+				int chunkId)
+{
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->nBytes = 0;
+	ylist_add(&cache->hashLink, yaffs_CacheBucket(obj->myDev, obj, chunkId));
+}
 
-		} while (cache && chunkWritten > 0);
+/* Drop a cache chunk's contents and make it the next one to be reused */
+static void yaffs_ReleaseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (!cache->object)
+		return;
 
-		if (cache) {
-			/* Hoosterman, disk full while writing cache out. */
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+	if (cache->dirty)
+		dev->nDirtyCacheChunks--;
+	cache->dirty = 0;
+	cache->object = NULL;
+	ylist_del_init(&cache->hashLink);
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheClean);
+}
 
-		}
+/* Mark the chunk for the least recently used algorithym */
+static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				int isAWrite)
+{
+	if (isAWrite && !cache->dirty) {
+		cache->dirty = 1;
+		dev->nDirtyCacheChunks++;
 	}
 
+	ylist_del(&cache->lruLink);
+	ylist_add_tail(&cache->lruLink,
+		       cache->dirty ? &dev->srCacheDirty : &dev->srCacheClean);
 }
 
-/*yaffs_FlushEntireDeviceCache(dev)
- *
- *
+/* Write a dirty chunk out. It stays cached as a clean chunk, unless the
+ * write failed in which case the data is lost.
  */
+static int yaffs_WriteBackChunkCache(yaffs_Device *dev,
+				yaffs_ChunkCache *cache)
+{
+	int chunkWritten;
 
-void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
+	chunkWritten = yaffs_WriteChunkDataToObject(cache->object,
+						    cache->chunkId,
+						    cache->data,
+						    cache->nBytes,
+						    1);
+	if (chunkWritten < 0) {
+		yaffs_ReleaseChunkCache(dev, cache);
+		return chunkWritten;
+	}
+
+	cache->dirty = 0;
+	dev->nDirtyCacheChunks--;
+	dev->cacheWriteBacks++;
+	yaffs_UseChunkCache(dev, cache, 0);
+
+	return chunkWritten;
+}
+
+/* Push a dirty chunk out along with the run of dirty chunks of the same file
+ * around it, in chunk order.
+ */
+static int yaffs_WriteBackChunkCacheRun(yaffs_Device *dev,
+					yaffs_ChunkCache *cache)
 {
-	yaffs_Object *obj;
-	int nCaches = dev->nShortOpCaches;
-	int i;
+	yaffs_Object *obj = cache->object;
+	int first = cache->chunkId;
+	int last = cache->chunkId;
+	yaffs_ChunkCache *other;
+	int chunk;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
+	while (last - first + 1 < YAFFS_CACHE_WRITE_RUN) {
+		other = yaffs_FindChunkCache(obj, first - 1);
+		if (!other || !other->dirty || other->locked)
+			break;
+		first--;
+	}
 
-		}
-		if (obj)
-			yaffs_FlushFilesChunkCache(obj);
+	while (last - first + 1 < YAFFS_CACHE_WRITE_RUN) {
+		other = yaffs_FindChunkCache(obj, last + 1);
+		if (!other || !other->dirty || other->locked)
+			break;
+		last++;
+	}
 
-	} while (obj);
+	for (chunk = first; chunk <= last; chunk++) {
+		other = yaffs_FindChunkCache(obj, chunk);
+		if (yaffs_WriteBackChunkCache(dev, other) < 0)
+			return YAFFS_FAIL;
+		if (other != cache)
+			dev->cacheCombinedWrites++;
+	}
 
+	return YAFFS_OK;
 }
 
-
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
- */
-static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
+/* Find the dirty cache for this object with the lowest chunk id. */
+static yaffs_ChunkCache *yaffs_FindLowestDirtyChunkCache(yaffs_Object *obj)
 {
-	int i;
+	yaffs_Device *dev = obj->myDev;
+	yaffs_ChunkCache *cache = NULL;
+	yaffs_ChunkCache *other;
+	struct ylist_head *i;
 
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
+	ylist_for_each(i, &dev->srCacheDirty) {
+		other = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (other->object == obj && !other->locked &&
+		    (!cache || other->chunkId < cache->chunkId))
+			cache = other;
 	}
 
-	return NULL;
+	return cache;
 }
 
-static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
+static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
+	yaffs_Device *dev = obj->myDev;
 	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
+	int chunkWritten = 0;
+	int chunk;
 
-	if (dev->nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
+	if (dev->nShortOpCaches <= 0)
+		return;
 
-		cache = yaffs_GrabChunkCacheWorker(dev);
+	/* Write the dirty chunks out in order, a run of neighbours at a time. */
+	while (chunkWritten >= 0 &&
+	       (cache = yaffs_FindLowestDirtyChunkCache(obj)) != NULL) {
+		chunk = cache->chunkId;
+		do {
+			chunkWritten = yaffs_WriteBackChunkCache(dev, cache);
+			cache = yaffs_FindChunkCache(obj, ++chunk);
+		} while (chunkWritten >= 0 && cache && cache->dirty &&
+			 !cache->locked);
+	}
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+	if (chunkWritten < 0) {
+		/* Hoosterman, disk full while writing cache out. */
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
 
-			/* With locking we can't assume we can use entry zero */
+	}
 
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+}
 
-			for (i = 0; i < dev->nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
-			}
+/*yaffs_FlushEntireDeviceCache(dev)
+ *
+ *
+ */
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
-				cache = yaffs_GrabChunkCacheWorker(dev);
-			}
+void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
+{
+	yaffs_ChunkCache *cache;
 
-		}
-		return cache;
-	} else
-		return NULL;
+	if (dev->nShortOpCaches <= 0)
+		return;
+
+	/* Flush the object of the least recently used dirty chunk...
+	 * until there are no further dirty objects. A failed write drops
+	 * the chunk, so this always ends.
+	 */
+	while (!ylist_empty(&dev->srCacheDirty)) {
+		cache = ylist_entry(dev->srCacheDirty.next, yaffs_ChunkCache,
+				    lruLink);
+		yaffs_FlushFilesChunkCache(cache->object);
+	}
 
 }
 
-/* Find a cached chunk */
-static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
-					      int chunkId)
+
+/* Grab us a cache chunk for use and attach it to chunkId of obj.
+ * First look for a free one, then for the least recently used clean one.
+ * If they are all dirty, push out the least recently used dirty one and its
+ * neighbours and use that. Returns NULL if that write back fails, so a
+ * chunk whose data never reached flash is not reused.
+ */
+static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Object *obj, int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	yaffs_ChunkCache *cache = NULL;
+	yaffs_ChunkCache *other;
+	struct ylist_head *i;
 
-				return &dev->srCache[i];
-			}
+	if (dev->nShortOpCaches <= 0)
+		return NULL;
+
+	ylist_for_each(i, &dev->srCacheClean) {
+		other = ylist_entry(i, yaffs_ChunkCache, lruLink);
+		if (!other->locked) {
+			cache = other;
+			break;
 		}
 	}
-	return NULL;
-}
-
-/* Mark the chunk for the least recently used algorithym */
-static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
-				int isAWrite)
-{
-
-	if (dev->nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
 
-			dev->srLastUse = 0;
+	if (!cache) {
+		/* With locking we can't assume we can use the first one */
+		ylist_for_each(i, &dev->srCacheDirty) {
+			other = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (!other->locked) {
+				cache = other;
+				break;
+			}
 		}
+		if (!cache)
+			return NULL;
 
-		dev->srLastUse++;
+		if (yaffs_WriteBackChunkCacheRun(dev, cache) != YAFFS_OK)
+			return NULL;
+	}
 
-		cache->lastUse = dev->srLastUse;
+	yaffs_ReleaseChunkCache(dev, cache);
+	yaffs_AssignChunkCache(cache, obj, chunkId);
 
-		if (isAWrite)
-			cache->dirty = 1;
-	}
+	return cache;
 }
 
 /* Invalidate a single cache page.
@@ -4081,7 +4760,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_ReleaseChunkCache(object->myDev, cache);
 	}
 }
 
@@ -4097,7 +4776,7 @@ static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->nShortOpCaches; i++) {
 			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+				yaffs_ReleaseChunkCache(dev, &dev->srCache[i]);
 		}
 	}
 }
@@ -4343,16 +5022,71 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 
 }
 
+/* A file mapped by extents writes one record holding all of them, flagged
+ * in place of the base chunk of a level 0 tnode.
+ */
+#define YAFFS_CHECKPOINT_EXTENTS	0x80000000
+
+static int yaffs_WriteCheckpointExtents(yaffs_Object *obj)
+{
+	yaffs_ExtentMap *map = obj->variant.fileVariant.extents;
+	__u32 header;
+	int nBytes;
+	int ok = 1;
+
+	if (map) {
+		header = YAFFS_CHECKPOINT_EXTENTS | map->nExtents;
+		nBytes = map->nExtents * sizeof(yaffs_Extent);
+		ok = (yaffs_CheckpointWrite(obj->myDev, &header, sizeof(header)) == sizeof(header));
+		if (ok)
+			ok = (yaffs_CheckpointWrite(obj->myDev, map->extent, nBytes) == nBytes);
+	}
+
+	return ok;
+}
+
+static int yaffs_ReadCheckpointExtents(yaffs_Object *obj, int nExtents)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_FileStructure *fileStructPtr = &obj->variant.fileVariant;
+	yaffs_ExtentMap *map;
+	int nBytes = nExtents * sizeof(yaffs_Extent);
+
+	if (fileStructPtr->extents || nExtents <= 0 || nExtents > YAFFS_MAX_CHUNK_ID)
+		return 0;
+
+	map = YMALLOC(yaffs_ExtentMapSize(nExtents));
+	if (!map)
+		return 0;
+
+	map->nExtents = nExtents;
+	map->maxExtents = nExtents;
+	fileStructPtr->extents = map;
+	dev->nExtentBytes += yaffs_ExtentMapSize(nExtents);
+	dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
+
+	if (yaffs_CheckpointRead(dev, map->extent, nBytes) != nBytes)
+		return 0;
+
+	if (fileStructPtr->top || dev->extentsDisabled)
+		return yaffs_ExtentsToTnodes(dev, fileStructPtr) == YAFFS_OK;
+
+	return 1;
+}
+
 static int yaffs_WriteCheckpointTnodes(yaffs_Object *obj)
 {
 	__u32 endMarker = ~0;
 	int ok = 1;
 
 	if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
-		ok = yaffs_CheckpointTnodeWorker(obj,
-					    obj->variant.fileVariant.top,
-					    obj->variant.fileVariant.topLevel,
-					    0);
+		if (obj->variant.fileVariant.top)
+			ok = yaffs_CheckpointTnodeWorker(obj,
+						obj->variant.fileVariant.top,
+						obj->variant.fileVariant.topLevel,
+						0);
+		else
+			ok = yaffs_WriteCheckpointExtents(obj);
 		if (ok)
 			ok = (yaffs_CheckpointWrite(obj->myDev, &endMarker, sizeof(endMarker)) ==
 				sizeof(endMarker));
@@ -4378,6 +5112,15 @@ static int yaffs_ReadCheckpointTnodes(yaffs_Object *obj)
 
 	while (ok && (~baseChunk)) {
 		nread++;
+
+		if (baseChunk & YAFFS_CHECKPOINT_EXTENTS) {
+			ok = yaffs_ReadCheckpointExtents(obj,
+					baseChunk & ~YAFFS_CHECKPOINT_EXTENTS);
+			if (ok)
+				ok = (yaffs_CheckpointRead(dev, &baseChunk, sizeof(baseChunk)) == sizeof(baseChunk));
+			continue;
+		}
+
 		/* Read level 0 tnode */
 
 
@@ -4718,18 +5461,18 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 				/* If we can't find the data in the cache, then load it up. */
 
-				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->
-								      data);
-					cache->nBytes = 0;
+				if (cache) {
+					dev->cacheHits++;
+				} else {
+					dev->cacheMisses++;
+					cache = yaffs_GrabChunkCache(in, chunk);
+					if (cache)
+						yaffs_ReadChunkDataFromObject(
+							in, chunk, cache->data);
 				}
+			}
 
+			if (cache) {
 				yaffs_UseChunkCache(dev, cache, 0);
 
 				cache->locked = 1;
@@ -4846,20 +5589,20 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				/* If we can't find the data in the cache, then load the cache */
 				cache = yaffs_FindChunkCache(in, chunk);
 
+				if (cache)
+					dev->cacheHits++;
+				else
+					dev->cacheMisses++;
+
 				if (!cache
-				    && yaffs_CheckSpaceForAllocation(in->
-								     myDev)) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_ReadChunkDataFromObject(in, chunk,
-								      cache->
-								      data);
+				    && yaffs_CheckSpaceForCachedWrite(dev)) {
+					cache = yaffs_GrabChunkCache(in, chunk);
+					if (cache)
+						yaffs_ReadChunkDataFromObject(in,
+							chunk, cache->data);
 				} else if (cache &&
 					!cache->dirty &&
-					!yaffs_CheckSpaceForAllocation(in->myDev)) {
+					!yaffs_CheckSpaceForCachedWrite(dev)) {
 					/* Drop the cache if it was a read cache item and
 					 * no space check has been made for it.
 					 */
@@ -4878,15 +5621,10 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 					cache->locked = 0;
 					cache->nBytes = nToWriteBack;
 
-					if (writeThrough) {
+					if (writeThrough)
 						chunkWritten =
-						    yaffs_WriteChunkDataToObject
-						    (cache->object,
-						     cache->chunkId,
-						     cache->data, cache->nBytes,
-						     1);
-						cache->dirty = 0;
-					}
+						    yaffs_WriteBackChunkCache(
+							dev, cache);
 
 				} else {
 					chunkWritten = -1;	/* fail the write */
@@ -6049,7 +6787,6 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 #endif
 
 	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -6082,6 +6819,10 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 		}
 
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+
+		/* Cleared last, see yaffs_ObjectDetailsInRAM() */
+		Y_WMB();
+		in->lazyLoaded = 0;
 	}
 }
 
@@ -6118,6 +6859,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
+	yaffs_ExtendedTags *blockTags;
+	int haveBlockTags;
 
 	if (!dev->isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
@@ -6148,6 +6891,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	dev->blocksInCheckpoint = 0;
 
+	/* Tags of a whole block, from its summary or one batched read. We can
+	 * still scan chunk by chunk without it.
+	 */
+	blockTags = YMALLOC(dev->nChunksPerBlock * sizeof(yaffs_ExtendedTags));
+
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 	/* Scan all the blocks to determine their state */
@@ -6265,6 +7013,18 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		haveBlockTags = 0;
+		if (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING && blockTags) {
+			if (yaffs_SummaryRead(dev, blk, blockTags)) {
+				dev->nSummaryBlocks++;
+				haveBlockTags = 1;
+			} else if (yaffs_ReadBlockTagsFromNAND(dev, blk,
+						blockTags) == YAFFS_OK) {
+				haveBlockTags = 1;
+			}
+		}
+		dev->nScannedBlocks++;
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
@@ -6277,8 +7037,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (haveBlockTags)
+				tags = blockTags[c];
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6313,6 +7076,10 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 							dev->allocationBlock = blk;
 							dev->allocationPage = c;
 							dev->allocationBlockFinder = blk;
+						} else if (c == dev->summaryChunk) {
+							/* A full block that did not get a
+							 * summary, nothing wrong with it.
+							 */
 						} else {
 							/* This is a partially written block that is not
 							 * the current allocation block. This block must have
@@ -6338,6 +7105,16 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 				  dev->nFreeChunks++;
 
+			} else if (tags.objectId == YAFFS_OBJECTID_SUMMARY) {
+				/* The block summary. It holds no data and
+				 * is freed with the block.
+				 */
+				foundChunksInBlock = 1;
+				if (c == dev->nChunksPerBlock - 1)
+					bi->hasSummary = 1;
+
+				dev->nFreeChunks++;
+
 			} else if (tags.chunkId > 0) {
 				/* chunkId > 0 so it is a data chunk... */
 				unsigned int endpos;
@@ -6732,6 +7509,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	else
 		YFREE(blockIndex);
 
+	if (blockTags)
+		YFREE(blockTags);
+
 	/* Ok, we've done all the scanning.
 	 * Fix up the hard link chains.
 	 * We should now have scanned all the objects, now it's time to add these
@@ -6914,6 +7694,85 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	yaffs_VerifyObjectInDirectory(obj);
 }
 
+/*
+ * Tells whether an object's name, type and inode number can be had without
+ * reading NAND. Those are then safe to get without the gross lock, as long
+ * as the caller keeps the directory tree from changing.
+ */
+int yaffs_ObjectDetailsInRAM(yaffs_Object *obj)
+{
+	yaffs_Object *equiv = obj;
+
+	if (obj->variantType == YAFFS_OBJECT_TYPE_HARDLINK)
+		equiv = obj->variant.hardLinkVariant.equivalentObject;
+
+	if ((obj->lazyLoaded && obj->hdrChunk > 0) ||
+	    (equiv && equiv->lazyLoaded && equiv->hdrChunk > 0))
+		return 0;
+
+	/* Lazy loading clears lazyLoaded only once the details are in */
+	Y_RMB();
+
+	if (obj->objectId == YAFFS_OBJECTID_LOSTNFOUND || obj->hdrChunk <= 0)
+		return 1;
+#ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
+	if (obj->shortName[0])
+		return 1;
+#endif
+	return 0;
+}
+
+/*
+ * Like yaffs_FindObjectByName(), but only looks at what is in RAM.
+ * Returns 0 if that was not enough to tell whether the name is there,
+ * 1 otherwise with the object, or NULL, in *found.
+ */
+int yaffs_FindObjectByNameInRAM(yaffs_Object *directory, const YCHAR *name,
+				yaffs_Object **found)
+{
+	int sum;
+
+	struct ylist_head *i;
+	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+
+	yaffs_Object *l;
+
+	*found = NULL;
+
+	if (!name || !directory ||
+	    directory->variantType != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return 0;
+
+	sum = yaffs_CalcNameSum(name);
+
+	ylist_for_each(i, &directory->variant.directoryVariant.children) {
+		l = ylist_entry(i, yaffs_Object, siblings);
+
+		/* The name sum is only good once the header is loaded */
+		if (l->lazyLoaded && l->hdrChunk > 0)
+			return 0;
+		Y_RMB();
+
+		if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
+			if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0) {
+				*found = l;
+				return 1;
+			}
+		} else if (yaffs_SumCompare(l->sum, sum) || l->hdrChunk <= 0) {
+			if (!yaffs_ObjectDetailsInRAM(l))
+				return 0;
+			yaffs_GetObjectName(l, buffer,
+					    YAFFS_MAX_NAME_LENGTH + 1);
+			if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0) {
+				*found = l;
+				return 1;
+			}
+		}
+	}
+
+	return 1;
+}
+
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 				     const YCHAR *name)
 {
@@ -7291,6 +8150,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	int init_failed = 0;
 	unsigned x;
 	int bits;
+	__u32 mountStart;
 
 	T(YAFFS_TRACE_TRACING, (TSTR("yaffs: yaffs_GutsInitialise()" TENDSTR)));
 
@@ -7438,7 +8298,23 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
+	dev->backgroundGarbageCollections = 0;
+	dev->gcForegroundTime = 0;
+	dev->gcForegroundMaxTime = 0;
+	dev->gcBackgroundTime = 0;
 	dev->currentDirtyChecker = 0;
+
+	/* Enough erased blocks to absorb a burst of writes, about 3% of the
+	 * device, without tying up much space on big ones.
+	 */
+	if (dev->gcReserveBlocks <= 0) {
+		dev->gcReserveBlocks =
+			(dev->internalEndBlock - dev->internalStartBlock + 1) / 32;
+		if (dev->gcReserveBlocks < 2)
+			dev->gcReserveBlocks = 2;
+		if (dev->gcReserveBlocks > YAFFS_MAX_GC_RESERVE_BLOCKS)
+			dev->gcReserveBlocks = YAFFS_MAX_GC_RESERVE_BLOCKS;
+	}
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
 	dev->nDeletedFiles = 0;
@@ -7461,35 +8337,58 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->gcCleanupList = NULL;
 
 
+	dev->srCacheHash = NULL;
+	YINIT_LIST_HEAD(&dev->srCacheClean);
+	YINIT_LIST_HEAD(&dev->srCacheDirty);
+	dev->nDirtyCacheChunks = 0;
+
 	if (!init_failed &&
 	    dev->nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
+		int nBuckets;
 
 		if (dev->nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+
+		/* About one chunk per bucket */
+		for (nBuckets = 1; nBuckets < dev->nShortOpCaches; nBuckets <<= 1)
+			;
+
 		dev->srCache =  YMALLOC(srCacheBytes);
+		dev->srCacheHash = YMALLOC(nBuckets * sizeof(struct ylist_head));
+		dev->srCacheHashMask = nBuckets - 1;
 
 		buf = (__u8 *) dev->srCache;
 
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		if (!dev->srCacheHash)
+			buf = NULL;
+
+		for (i = 0; i < nBuckets && buf; i++)
+			YINIT_LIST_HEAD(&dev->srCacheHash[i]);
+
 		for (i = 0; i < dev->nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			ylist_add_tail(&dev->srCache[i].lruLink,
+				       &dev->srCacheClean);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
+	dev->cacheWriteBacks = 0;
+	dev->cacheCombinedWrites = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->nChunksPerBlock * sizeof(__u32));
@@ -7497,6 +8396,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 			init_failed = 1;
 	}
 
+	if (!init_failed && !yaffs_SummaryInit(dev))
+		init_failed = 1;
+
 	if (dev->isYaffs2)
 		dev->useHeaderFileSize = 1;
 
@@ -7510,6 +8412,10 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		init_failed = 1;
 
 
+	dev->nScannedBlocks = 0;
+	dev->nSummaryBlocks = 0;
+	mountStart = Y_CURRENT_USECS();
+
 	if (!init_failed) {
 		/* Now scan the flash. */
 		if (dev->isYaffs2) {
@@ -7557,6 +8463,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 			yaffs_EmptyLostAndFound(dev);
 	}
 
+	dev->mountTime = Y_CURRENT_USECS() - mountStart;
+
 	if (init_failed) {
 		/* Clean up the mess */
 		T(YAFFS_TRACE_TRACING,
@@ -7609,8 +8517,15 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			dev->srCache = NULL;
 		}
 
+		if (dev->srCacheHash) {
+			YFREE(dev->srCacheHash);
+			dev->srCacheHash = NULL;
+		}
+
 		YFREE(dev->gcCleanupList);
 
+		yaffs_SummaryDeinit(dev);
+
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			YFREE(dev->tempBuffer[i].buffer);
 
@@ -7654,9 +8569,7 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	/* This is what we report to the outside world */
 
 	int nFree;
-	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -7666,17 +8579,13 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	nFree += dev->nDeletedFiles;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
-
-	nFree -= nDirtyCacheChunks;
+	/* Now subtract the dirty chunks in the cache */
+	nFree -= dev->nDirtyCacheChunks;
 
 	nFree -= ((dev->nReservedBlocks + 1) * dev->nChunksPerBlock);
 
+	nFree -= yaffs_SummaryOverhead(dev);
+
 	/* Now we figure out how much to reserve for the checkpoint and report that... */
 	blocksForCheckpoint = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
 	if (blocksForCheckpoint < 0)
@@ -7691,6 +8600,32 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 }
 
+void yaffs_GetRAMUsage(yaffs_Device *dev, yaffs_RAMUsage *ram)
+{
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	int tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
+
+	if (tnodeSize < sizeof(yaffs_Tnode))
+		tnodeSize = sizeof(yaffs_Tnode);
+
+	ram->tnodes = dev->nTnodesCreated * tnodeSize;
+	ram->extents = dev->nExtentBytes;
+	ram->objects = dev->nObjectsCreated * sizeof(yaffs_Object);
+	ram->blocks = nBlocks * (sizeof(yaffs_BlockInfo) + dev->chunkBitmapStride);
+
+	ram->buffers = YAFFS_N_TEMP_BUFFERS * dev->totalBytesPerChunk;
+	if (dev->srCache)
+		ram->buffers += dev->nShortOpCaches *
+			(sizeof(yaffs_ChunkCache) + dev->totalBytesPerChunk) +
+			(dev->srCacheHashMask + 1) * sizeof(struct ylist_head);
+	if (dev->checkpointBuffer)
+		ram->buffers += dev->totalBytesPerChunk;
+	if (dev->gcCleanupList)
+		ram->buffers += dev->nChunksPerBlock * sizeof(__u32);
+	if (dev->sumTags)
+		ram->buffers += dev->chunksPerSummary * sizeof(yaffs_SummaryTags);
+}
+
 static int yaffs_freeVerificationFailures;
 
 static void yaffs_VerifyFreeChunks(yaffs_Device *dev)
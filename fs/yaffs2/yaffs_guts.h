@@ -63,7 +63,7 @@
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
-#define YAFFS_CHECKPOINT_VERSION 	3
+#define YAFFS_CHECKPOINT_VERSION 	4
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -86,9 +86,13 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
+/* Pseudo object id for block summaries */
+#define YAFFS_OBJECTID_SUMMARY		0x30
+
 /* */
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	256
+#define YAFFS_DEFAULT_SHORT_OP_CACHES	32
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -115,10 +119,11 @@
 typedef struct {
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
+	struct ylist_head hashLink;	/* In srCacheHash while object is set */
+	struct ylist_head lruLink;	/* In srCacheClean or srCacheDirty */
 #ifdef CONFIG_YAFFS_YAFFS2
 	__u8 *data;
 #else
@@ -205,6 +210,15 @@ typedef struct {
 
 } yaffs_ExtendedTags;
 
+/* One chunk's entry in a block summary, as packed in yaffs2 tags.
+ * objectId is 0 for a chunk that was not written.
+ */
+typedef struct {
+	__u32 objectId;
+	__u32 chunkId;
+	__u32 byteCount;
+} yaffs_SummaryTags;
+
 /* Spare structure for YAFFS1 */
 typedef struct {
 	__u8 tagByte0;
@@ -289,6 +303,7 @@ typedef struct {
 
 #ifdef CONFIG_YAFFS_YAFFS2
 	__u32 hasShrinkHeader:1; /* This block has at least one shrink object header */
+	__u32 hasSummary:1;	/* The last chunk holds a summary of the tags */
 	__u32 sequenceNumber;	 /* block sequence number for yaffs2 */
 #endif
 
@@ -377,12 +392,31 @@ typedef struct yaffs_TnodeList_struct yaffs_TnodeList;
  * - a hard link
  */
 
+/* A run of a file's chunks that were written to consecutive NAND chunks. */
+typedef struct {
+	__u32 chunkId;		/* First chunk of the file in the run */
+	__u32 nandChunk;	/* Where that chunk is in NAND */
+	__u32 nChunks;
+} yaffs_Extent;
+
+/* Extents of a file, sorted by chunkId */
+typedef struct {
+	int nExtents;
+	int maxExtents;
+	yaffs_Extent extent[0];
+} yaffs_ExtentMap;
+
+/* A file's chunks are mapped either by a list of extents, which is compact
+ * for files written sequentially, or, once that gets too fragmented, by a
+ * tree of tnodes. The file uses tnodes when top is set.
+ */
 typedef struct {
 	__u32 fileSize;
 	__u32 scannedFileSize;
 	__u32 shrinkSize;
 	int topLevel;
 	yaffs_Tnode *top;
+	yaffs_ExtentMap *extents;
 } yaffs_FileStructure;
 
 typedef struct {
@@ -544,6 +578,9 @@ struct yaffs_DeviceStruct {
 	int endBlock;		/* End block we're allowed to use */
 	int nReservedBlocks;	/* We want this tuneable so that we can reduce */
 				/* reserved blocks on NOR and RAM. */
+	int gcReserveBlocks;	/* Erased blocks background gc keeps on top of
+				 * the reserved ones. 0 for the default.
+				 */
 
 
 	/* Stuff used by the shared space checkpointing mechanism */
@@ -590,6 +627,12 @@ struct yaffs_DeviceStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+
+	/* Optional. Reads the tags of every chunk in a block at once for
+	 * the scan. Returns YAFFS_FAIL to have them read chunk by chunk.
+	 */
+	int (*readBlockTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+				      int blockNo, yaffs_ExtendedTags *tags);
 #endif
 
 	int isYaffs2;
@@ -605,6 +648,8 @@ struct yaffs_DeviceStruct {
 	void (*markSuperBlockDirty)(void *superblock);
 
 	int wideTnodesDisabled; /* Set to disable wide tnodes */
+	int extentsDisabled;	/* Set to map all files with tnodes */
+	int summaryDisabled;	/* Set to not write block summaries */
 
 	YCHAR *pathDividers;	/* String of legal path dividers */
 
@@ -615,6 +660,12 @@ struct yaffs_DeviceStruct {
 	__u8 skipCheckpointRead;
 	__u8 skipCheckpointWrite;
 
+	/* Set by the OS while it runs background gc for this device */
+	int hasBackgroundGC;
+
+	/* Called with hasBackgroundGC set when background gc has work */
+	void (*wakeBackgroundGC)(struct yaffs_DeviceStruct *dev);
+
 	/* Runtime parameters. Set up by YAFFS. */
 
 	__u16 chunkGroupBits;	/* 0 for devices <= 32MB. else log2(nchunks) - 16 */
@@ -636,7 +687,7 @@ struct yaffs_DeviceStruct {
 #ifdef __KERNEL__
 
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
-	struct semaphore grossLock;	/* Gross locking semaphore */
+	struct semaphore grossLock;	/* Serializes NAND, allocation and GC */
 	struct rw_semaphore dirLock; /* Lock the directory structure */
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
@@ -644,6 +695,8 @@ struct yaffs_DeviceStruct {
 				 */
 	void (*putSuperFunc) (struct super_block *sb);
         struct ylist_head searchContexts;
+	struct task_struct *bgThread;	/* Background gc */
+	unsigned long lastActivity;	/* jiffies of the last foreground lock */
 
 #endif
 
@@ -695,11 +748,19 @@ struct yaffs_DeviceStruct {
 	yaffs_Tnode *freeTnodes;
 	int nFreeTnodes;
 	yaffs_TnodeList *allocatedTnodeList;
+	int nExtentBytes;	/* RAM held by extent maps */
 
 	int isDoingGC;
 	int gcBlock;
 	int gcChunk;
 
+	/* Block summaries, see yaffs_summary.c */
+	int chunksPerSummary;		/* 0 if summaries are off */
+	int summaryChunk;		/* Where summaries are, 0 if none fit */
+	yaffs_SummaryTags *sumTags;	/* Tags of the block being filled */
+	int sumBlock;			/* Block sumTags belong to, or -1 */
+	int sumCount;			/* Chunks recorded in sumTags */
+
 	int nObjectsCreated;
 	yaffs_Object *freeObjects;
 	int nFreeObjects;
@@ -725,6 +786,13 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
+	__u64 gcForegroundTime;		/* usecs writers spent collecting */
+	__u32 gcForegroundMaxTime;	/* longest single foreground gc, usecs */
+	__u64 gcBackgroundTime;		/* usecs spent in background gc */
+	__u32 mountTime;		/* usecs to restore or scan at mount */
+	int nScannedBlocks;		/* Blocks scanned at mount... */
+	int nSummaryBlocks;		/* ...of those, from their summary */
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -749,9 +817,16 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head *srCacheHash;	/* Cached chunks by object and chunk id */
+	int srCacheHashMask;
+	struct ylist_head srCacheClean;	/* Free then clean chunks, oldest first */
+	struct ylist_head srCacheDirty;	/* Dirty chunks, oldest first */
+	int nDirtyCacheChunks;
 
 	int cacheHits;
+	int cacheMisses;
+	int cacheWriteBacks;		/* Dirty chunks written out */
+	int cacheCombinedWrites;	/* ...of those, along with a neighbour */
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -853,6 +928,21 @@ int yaffs_FlushFile(yaffs_Object *obj, int updateTime);
 /* Flushing and checkpointing */
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev);
 
+/* Background garbage collection */
+int yaffs_BackgroundGCUrgency(yaffs_Device *dev);
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int urgency);
+
+/* RAM held by a mounted device, in bytes */
+typedef struct {
+	__u32 tnodes;
+	__u32 extents;
+	__u32 objects;
+	__u32 blocks;		/* block info and chunk bitmap */
+	__u32 buffers;		/* caches, temp buffers and the like */
+} yaffs_RAMUsage;
+
+void yaffs_GetRAMUsage(yaffs_Device *dev, yaffs_RAMUsage *ram);
+
 int yaffs_CheckpointSave(yaffs_Device *dev);
 int yaffs_CheckpointRestore(yaffs_Device *dev);
 
@@ -860,6 +950,9 @@ int yaffs_CheckpointRestore(yaffs_Device *dev);
 yaffs_Object *yaffs_MknodDirectory(yaffs_Object *parent, const YCHAR *name,
 				__u32 mode, __u32 uid, __u32 gid);
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *theDir, const YCHAR *name);
+int yaffs_FindObjectByNameInRAM(yaffs_Object *theDir, const YCHAR *name,
+				yaffs_Object **found);
+int yaffs_ObjectDetailsInRAM(yaffs_Object *obj);
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
 				   int (*fn) (yaffs_Object *));
 
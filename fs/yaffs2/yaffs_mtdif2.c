@@ -187,6 +187,61 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+/* Read the oob of a whole block with one request, which lets the driver
+ * stream the pages instead of setting up a read for each chunk.
+ */
+int nandmtd2_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockNo,
+				   yaffs_ExtendedTags *tags)
+{
+#if (MTD_VERSION_CODE > MTD_VERSION(2, 6, 17))
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	struct mtd_oob_ops ops;
+	yaffs_PackedTags2 pt;
+	__u8 *oob;
+	int retval;
+	int i;
+
+	loff_t addr = ((loff_t) blockNo) * dev->nChunksPerBlock *
+			dev->totalBytesPerChunk;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadBlockTagsFromNAND block %d" TENDSTR), blockNo));
+
+	if (dev->inbandTags || mtd->oobavail < sizeof(pt))
+		return YAFFS_FAIL;
+
+	oob = kmalloc(mtd->oobavail * dev->nChunksPerBlock, GFP_NOFS);
+	if (!oob)
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = mtd->oobavail * dev->nChunksPerBlock;
+	ops.len = ops.ooblen;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = oob;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	/* ECC results can't be told apart per chunk, so let the caller
+	 * read chunk by chunk if anything went wrong.
+	 */
+	if (retval || ops.oobretlen != ops.ooblen) {
+		kfree(oob);
+		return YAFFS_FAIL;
+	}
+
+	for (i = 0; i < dev->nChunksPerBlock; i++) {
+		memcpy(&pt, oob + i * mtd->oobavail, sizeof(pt));
+		yaffs_UnpackTags2(&tags[i], &pt);
+	}
+
+	kfree(oob);
+	return YAFFS_OK;
+#else
+	return YAFFS_FAIL;
+#endif
+}
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
@@ -53,6 +53,31 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockNo,
+				yaffs_ExtendedTags *tags)
+{
+	yaffs_BlockInfo *bi;
+	int result;
+	int i;
+
+	if (!dev->readBlockTagsFromNAND)
+		return YAFFS_FAIL;
+
+	result = dev->readBlockTagsFromNAND(dev, blockNo - dev->blockOffset,
+					    tags);
+	if (result != YAFFS_OK)
+		return result;
+
+	dev->nPageReads += dev->nChunksPerBlock;
+
+	bi = yaffs_GetBlockInfo(dev, blockNo);
+	for (i = 0; i < dev->nChunksPerBlock; i++)
+		if (tags[i].eccResult > YAFFS_ECC_RESULT_NO_ERROR)
+			yaffs_HandleChunkError(dev, bi);
+
+	return YAFFS_OK;
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
@@ -0,0 +1,254 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2007 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Block summaries.
+ *
+ * When a yaffs2 block fills up, the tags of all its data chunks are
+ * written to its last chunk, so a scan without a checkpoint can read one
+ * chunk of a full block instead of the tags of every chunk in it.
+ *
+ * The allocator leaves the last chunk of each block for the summary. The
+ * summary chunk is never in use: it has no chunk bit, is not counted in
+ * pagesInUse and counts as free space like any other dead chunk, so gc
+ * just drops it with the block. If a chunk in the block could not be
+ * written, or the block was started before this mount, no summary is
+ * written and the scan reads the block chunk by chunk as before.
+ *
+ * Summaries are only written when mounted with the "summary" option, but
+ * the scan reads those already on NAND whatever the options.
+ */
+
+const char *yaffs_summary_c_version =
+	"$Id$";
+
+#include "yaffs_summary.h"
+#include "yaffs_packedtags2.h"
+#include "yaffs_nand.h"
+#include "yaffs_tagsvalidity.h"
+#include "yaffs_getblockinfo.h"
+
+#define YAFFS_SUMMARY_VERSION	1
+
+/* Followed by the tags of chunks 0 to chunksPerSummary - 1 */
+typedef struct {
+	__u32 version;
+	__u32 block;
+	__u32 sequenceNumber;
+	__u32 sum;
+} yaffs_SummaryHeader;
+
+int yaffs_SummaryInit(yaffs_Device *dev)
+{
+	int nBytes;
+
+	dev->chunksPerSummary = 0;
+	dev->summaryChunk = 0;
+	dev->sumTags = NULL;
+	dev->sumBlock = -1;
+	dev->sumCount = 0;
+
+	if (!dev->isYaffs2)
+		return YAFFS_OK;
+
+	nBytes = sizeof(yaffs_SummaryHeader) +
+		(dev->nChunksPerBlock - 1) * sizeof(yaffs_SummaryTags);
+	if (nBytes > dev->nDataBytesPerChunk) {
+		if (!dev->summaryDisabled)
+			T(YAFFS_TRACE_ALWAYS,
+			  (TSTR("yaffs: %d chunks per block is too many for "
+				"block summaries" TENDSTR),
+			   dev->nChunksPerBlock));
+		return YAFFS_OK;
+	}
+
+	/* Read even when not written, a previous mount may have */
+	dev->summaryChunk = dev->nChunksPerBlock - 1;
+
+	if (dev->summaryDisabled)
+		return YAFFS_OK;
+
+	dev->sumTags = YMALLOC((dev->nChunksPerBlock - 1) *
+				sizeof(yaffs_SummaryTags));
+	if (!dev->sumTags)
+		return YAFFS_FAIL;
+
+	dev->chunksPerSummary = dev->nChunksPerBlock - 1;
+
+	return YAFFS_OK;
+}
+
+void yaffs_SummaryDeinit(yaffs_Device *dev)
+{
+	if (dev->sumTags) {
+		YFREE(dev->sumTags);
+		dev->sumTags = NULL;
+	}
+	dev->chunksPerSummary = 0;
+	dev->summaryChunk = 0;
+}
+
+static __u32 yaffs_SummarySum(const __u8 *buffer, int nBytes)
+{
+	const __u32 *p = (const __u32 *)buffer;
+	__u32 sum = 0;
+	int i;
+
+	/* Rotate as we go so swapped entries don't add up the same */
+	for (i = 0; i < nBytes / 4; i++)
+		sum = ((sum << 1) | (sum >> 31)) + p[i];
+
+	return sum;
+}
+
+static void yaffs_SummaryWrite(yaffs_Device *dev, int blk)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_SummaryHeader *hdr;
+	yaffs_ExtendedTags tags;
+	__u8 *buffer;
+	int nBytes;
+
+	nBytes = sizeof(yaffs_SummaryHeader) +
+		dev->chunksPerSummary * sizeof(yaffs_SummaryTags);
+
+	buffer = yaffs_GetTempBuffer(dev, __LINE__);
+	memset(buffer, 0xff, dev->nDataBytesPerChunk);
+
+	hdr = (yaffs_SummaryHeader *)buffer;
+	hdr->version = YAFFS_SUMMARY_VERSION;
+	hdr->block = blk;
+	hdr->sequenceNumber = bi->sequenceNumber;
+	hdr->sum = 0;
+	memcpy(hdr + 1, dev->sumTags,
+		dev->chunksPerSummary * sizeof(yaffs_SummaryTags));
+	hdr->sum = yaffs_SummarySum(buffer, nBytes);
+
+	yaffs_InitialiseTags(&tags);
+	tags.objectId = YAFFS_OBJECTID_SUMMARY;
+	tags.chunkId = 1;
+	tags.byteCount = nBytes;
+
+	if (yaffs_WriteChunkWithTagsToNAND(dev,
+			blk * dev->nChunksPerBlock + dev->chunksPerSummary,
+			buffer, &tags) == YAFFS_OK)
+		bi->hasSummary = 1;
+	else
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("**>> yaffs summary write failed, block %d" TENDSTR),
+		   blk));
+
+	yaffs_ReleaseTempBuffer(dev, buffer, __LINE__);
+}
+
+/* Called for every chunk written through the allocator */
+void yaffs_SummaryAdd(yaffs_Device *dev, const yaffs_ExtendedTags *tags,
+			int chunkInNAND)
+{
+	yaffs_PackedTags2TagsPart pt;
+	yaffs_SummaryTags *st;
+	int blk = chunkInNAND / dev->nChunksPerBlock;
+	int c = chunkInNAND % dev->nChunksPerBlock;
+
+	if (!dev->chunksPerSummary)
+		return;
+
+	if (c == 0) {
+		memset(dev->sumTags, 0,
+			dev->chunksPerSummary * sizeof(yaffs_SummaryTags));
+		dev->sumBlock = blk;
+		dev->sumCount = 0;
+	}
+
+	if (blk != dev->sumBlock || c >= dev->chunksPerSummary)
+		return;
+
+	yaffs_PackTags2TagsPart(&pt, tags);
+
+	st = &dev->sumTags[c];
+	st->objectId = pt.objectId;
+	st->chunkId = pt.chunkId;
+	st->byteCount = pt.byteCount;
+	dev->sumCount++;
+
+	if (c == dev->chunksPerSummary - 1) {
+		if (dev->sumCount == dev->chunksPerSummary)
+			yaffs_SummaryWrite(dev, blk);
+		dev->sumBlock = -1;
+	}
+}
+
+/* Fill in the tags of every chunk in a block from its summary, including
+ * those of the summary chunk itself. Returns 0 if the block has no usable
+ * summary.
+ */
+int yaffs_SummaryRead(yaffs_Device *dev, int blk, yaffs_ExtendedTags *tags)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_ExtendedTags *sumChunkTags;
+	yaffs_PackedTags2TagsPart pt;
+	yaffs_SummaryHeader *hdr;
+	yaffs_SummaryTags *st;
+	__u32 sum;
+	__u8 *buffer;
+	int nBytes;
+	int ok;
+	int c;
+
+	if (!dev->summaryChunk)
+		return 0;
+
+	nBytes = sizeof(yaffs_SummaryHeader) +
+		dev->summaryChunk * sizeof(yaffs_SummaryTags);
+	sumChunkTags = &tags[dev->summaryChunk];
+
+	buffer = yaffs_GetTempBuffer(dev, __LINE__);
+
+	yaffs_ReadChunkWithTagsFromNAND(dev,
+			blk * dev->nChunksPerBlock + dev->summaryChunk,
+			buffer, sumChunkTags);
+
+	hdr = (yaffs_SummaryHeader *)buffer;
+	sum = hdr->sum;
+	hdr->sum = 0;
+
+	ok = sumChunkTags->chunkUsed &&
+		sumChunkTags->eccResult != YAFFS_ECC_RESULT_UNFIXED &&
+		sumChunkTags->objectId == YAFFS_OBJECTID_SUMMARY &&
+		sumChunkTags->byteCount == nBytes &&
+		hdr->version == YAFFS_SUMMARY_VERSION &&
+		hdr->block == blk &&
+		hdr->sequenceNumber == bi->sequenceNumber &&
+		yaffs_SummarySum(buffer, nBytes) == sum;
+
+	if (ok) {
+		st = (yaffs_SummaryTags *)(hdr + 1);
+		for (c = 0; c < dev->summaryChunk; c++, st++) {
+			if (!st->objectId) {
+				/* Skipped when the block was written */
+				yaffs_InitialiseTags(&tags[c]);
+				continue;
+			}
+			pt.sequenceNumber = bi->sequenceNumber;
+			pt.objectId = st->objectId;
+			pt.chunkId = st->chunkId;
+			pt.byteCount = st->byteCount;
+			yaffs_UnpackTags2TagsPart(&tags[c], &pt);
+			tags[c].eccResult = YAFFS_ECC_RESULT_NO_ERROR;
+		}
+	}
+
+	yaffs_ReleaseTempBuffer(dev, buffer, __LINE__);
+
+	return ok;
+}
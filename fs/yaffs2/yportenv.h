@@ -47,6 +47,7 @@
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
 
 #define YCHAR char
 #define YUCHAR unsigned char
@@ -80,6 +81,7 @@
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 #define Y_CURRENT_TIME CURRENT_TIME.tv_sec
 #define Y_TIME_CONVERT(x) (x).tv_sec
+#define Y_CURRENT_USECS() ((__u32)ktime_to_us(ktime_get()))
 #else
 #define Y_CURRENT_TIME CURRENT_TIME
 #define Y_TIME_CONVERT(x) (x)
@@ -88,6 +90,9 @@
 #define yaffs_SumCompare(x, y) ((x) == (y))
 #define yaffs_strcmp(a, b) strcmp(a, b)
 
+#define Y_WMB() smp_wmb()
+#define Y_RMB() smp_rmb()
+
 #define TENDSTR "\n"
 #define TSTR(x) KERN_WARNING x
 #define TCONT(x) x
@@ -196,6 +201,17 @@ extern unsigned int yaffs_wr_attempts;
 
 #define T(mask, p) do { if ((mask) & (yaffs_traceMask | YAFFS_TRACE_ALWAYS)) TOUT(p); } while (0)
 
+/* Only used for statistics, so environments without a clock can use 0 */
+#ifndef Y_CURRENT_USECS
+#define Y_CURRENT_USECS() 0
+#endif
+
+/* Only needed where objects are looked at without the gross lock */
+#ifndef Y_WMB
+#define Y_WMB() do { } while (0)
+#define Y_RMB() do { } while (0)
+#endif
+
 #ifndef YBUG
 #define YBUG() do {T(YAFFS_TRACE_BUG, (TSTR("==>> yaffs bug: " __FILE__ " %d" TENDSTR), __LINE__)); } while (0)
 #endif
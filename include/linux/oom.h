@@ -14,6 +14,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -32,6 +33,23 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events of the oom_adj notifier, called with the task whose thread group
+ * was created, died or had its oom_adj changed. OOM_ADJ_EXEC is called
+ * with the new group leader once an exec has given it its new mm. The
+ * chain is atomic, callbacks must not sleep.
+ */
+enum oom_adj_event {
+	OOM_ADJ_FORK,
+	OOM_ADJ_EXIT,
+	OOM_ADJ_CHANGE,
+	OOM_ADJ_EXEC,
+};
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(enum oom_adj_event event, struct task_struct *tsk);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
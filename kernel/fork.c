@@ -65,6 +65,7 @@
 #include <linux/perf_event.h>
 #include <linux/posix-timers.h>
 #include <linux/user-return-notifier.h>
+#include <linux/oom.h>
 
 #include <asm/pgtable.h>
 #include <asm/pgalloc.h>
@@ -1460,6 +1461,9 @@ long do_fork(unsigned long clone_flags,
 		audit_finish_fork(p);
 		tracehook_report_clone(regs, clone_flags, nr, p);
 
+		if (!(clone_flags & CLONE_THREAD))
+			oom_adj_notify(OOM_ADJ_FORK, p);
+
 		/*
 		 * We set PF_STARTING at creation in case tracing wants to
 		 * use this to distinguish a fully live task from one that
@@ -0,0 +1,117 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Produces the LZ4 block format described in lz4defs.h. Matches are
+ *  found through a single hash table of the last position each 4 byte
+ *  sequence was seen at, without any chaining, and the search speeds
+ *  up over data that does not compress.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(u32 seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static inline unsigned char *lz4_put_literals(unsigned char *op,
+		unsigned char *token, const unsigned char *anchor, size_t len)
+{
+	if (len >= LZ4_RUN_MASK) {
+		*token = LZ4_RUN_MASK << LZ4_RUN_BITS;
+		op = lz4_put_length(op, len - LZ4_RUN_MASK);
+	} else {
+		*token = len << LZ4_RUN_BITS;
+	}
+	memcpy(op, anchor, len);
+	return op + len;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char * const in_end = src + src_len;
+	const unsigned char * const mf_limit = in_end - LZ4_MF_LIMIT;
+	const unsigned char * const match_limit = in_end - LZ4_LAST_LITERALS;
+	const unsigned char *ip = src, *anchor = src, *ref, *start;
+	unsigned char *op = dst, *token;
+	u32 *table = wrkmem;
+	unsigned int misses = 1 << LZ4_SKIP_TRIGGER;
+	size_t len;
+	u32 seq, h;
+
+	if (src_len < LZ4_MF_LIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+
+	while (ip < mf_limit) {
+		seq = get_unaligned((const u32 *)ip);
+		h = lz4_hash(seq);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE ||
+		    get_unaligned((const u32 *)ref) != seq) {
+			/* step further the longer nothing matched */
+			ip += misses++ >> LZ4_SKIP_TRIGGER;
+			continue;
+		}
+		misses = 1 << LZ4_SKIP_TRIGGER;
+
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		token = op++;
+		op = lz4_put_literals(op, token, anchor, ip - anchor);
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		ip += LZ4_MIN_MATCH;
+		ref += LZ4_MIN_MATCH;
+		start = ip;
+		while (ip < match_limit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+
+		len = ip - start;
+		if (len >= LZ4_ML_MASK) {
+			*token |= LZ4_ML_MASK;
+			op = lz4_put_length(op, len - LZ4_ML_MASK);
+		} else {
+			*token |= len;
+		}
+
+		anchor = ip;
+	}
+
+last_literals:
+	token = op++;
+	op = lz4_put_literals(op, token, anchor, in_end - anchor);
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
@@ -0,0 +1,104 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Decodes the LZ4 block format described in lz4defs.h, checking every
+ *  length and offset against the input and output buffers.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline int lz4_get_length(const unsigned char **ip,
+		const unsigned char *in_end, size_t *len)
+{
+	unsigned int s;
+
+	do {
+		if (unlikely(*ip >= in_end))
+			return LZ4_E_INPUT_OVERRUN;
+		s = *(*ip)++;
+		*len += s;
+	} while (s == 255);
+
+	return LZ4_E_OK;
+}
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char * const in_end = src + src_len;
+	unsigned char * const out_end = dst + *dst_len;
+	const unsigned char *ip = src;
+	unsigned char *op = dst, *ref;
+	unsigned int token;
+	size_t len, off;
+
+	for (;;) {
+		if (unlikely(ip >= in_end))
+			goto input_overrun;
+		token = *ip++;
+
+		len = token >> LZ4_RUN_BITS;
+		if (len == LZ4_RUN_MASK && lz4_get_length(&ip, in_end, &len))
+			goto input_overrun;
+		if (unlikely(len > in_end - ip))
+			goto input_overrun;
+		if (unlikely(len > out_end - op))
+			goto output_overrun;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* the last sequence has no match */
+		if (ip == in_end)
+			break;
+
+		if (unlikely(in_end - ip < 2))
+			goto input_overrun;
+		off = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!off || off > op - dst))
+			goto lookbehind_overrun;
+
+		len = token & LZ4_ML_MASK;
+		if (len == LZ4_ML_MASK && lz4_get_length(&ip, in_end, &len))
+			goto input_overrun;
+		len += LZ4_MIN_MATCH;
+		if (unlikely(len > out_end - op))
+			goto output_overrun;
+
+		ref = op - off;
+		if (off >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			/* overlapping copy repeats the last 'off' bytes */
+			do {
+				*op++ = *ref++;
+			} while (--len);
+		}
+	}
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+
+input_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_INPUT_OVERRUN;
+
+output_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_OUTPUT_OVERRUN;
+
+lookbehind_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_LOOKBEHIND_OVERRUN;
+}
+EXPORT_SYMBOL_GPL(lz4_decompress_safe);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
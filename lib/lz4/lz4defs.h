@@ -0,0 +1,26 @@
+/*
+ *  lz4defs.h -- LZ4 block format definitions
+ *
+ *  A compressed block is a sequence of
+ *
+ *	token, [literal length], literals, offset, [match length]
+ *
+ *  The upper nibble of the token holds the literal count and the lower
+ *  nibble the match length minus LZ4_MIN_MATCH. A nibble of 15 is
+ *  continued by bytes that are added to it, for as long as they are 255.
+ *  The offset is a 16 bit little endian distance back into the output.
+ *  The last sequence ends after its literals.
+ */
+
+#define LZ4_MIN_MATCH		4
+#define LZ4_RUN_BITS		4
+#define LZ4_RUN_MASK		((1U << LZ4_RUN_BITS) - 1)
+#define LZ4_ML_MASK		((1U << LZ4_RUN_BITS) - 1)
+#define LZ4_MAX_DISTANCE	0xffff
+
+/* the last match must start this far from the end of the input */
+#define LZ4_MF_LIMIT		12
+/* and the last bytes of the input are always literals */
+#define LZ4_LAST_LITERALS	5
+
+#define LZ4_SKIP_TRIGGER	6
@@ -27,23 +27,42 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/shmem_fs.h>
+#include <linux/spinlock.h>
 #include <linux/ashmem.h>
+#include <linux/crypto.h>
+#include <linux/pagemap.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
 #include <asm/cacheflush.h>
 
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
 #define ASHMEM_NAME_PREFIX_LEN (sizeof(ASHMEM_NAME_PREFIX) - 1)
 #define ASHMEM_FULL_NAME_LEN (ASHMEM_NAME_LEN + ASHMEM_NAME_PREFIX_LEN)
 
+/* Ranges purged by the shrinker with a single lock of their area */
+#define ASHMEM_SHRINK_BATCH	16
+
+/* LRU entries looked at by the shrinker to fill a batch */
+#define ASHMEM_SHRINK_SCAN	64
+
+/* Default limit of memory holding compressed ranges: 10% of total RAM */
+#define ASHMEM_DEFAULT_MAX_POOL_PERCENT	10
+
+/* Pages compressing to this size or more are not worth keeping */
+#define ASHMEM_ZPAGE_MAX	(PAGE_SIZE * 3 / 4)
+
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct mutex mutex;		/* protects the area and its ranges */
+	struct rb_root unpinned;	/* unpinned ranges, by pgstart */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long vm_start;		/* Start address of vm_area
@@ -51,32 +70,59 @@ struct ashmem_area {
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
 };
 
+/*
+ * ashmem_zpage - compressed copy of one page of an evicted range
+ */
+struct ashmem_zpage {
+	unsigned int len;		/* compressed length of data */
+	u8 data[0];
+};
+
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex', `lru' by `ashmem_lru_lock'
+ *
+ * Ranges of an area never overlap, so the tree sorted by pgstart is
+ * also sorted by pgend and finding the ranges overlapping an interval
+ * takes a single O(log n) descent.
+ *
+ * With CONFIG_ASHMEM_COMPRESS the shrinker first replaces the pages of
+ * a range by compressed copies, moving it to the compressed LRU, and
+ * only purges it if that fails or once the compressed LRU is reached.
+ * Pinning a compressed range writes its pages back to the file.
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node node;		/* entry in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
+#ifdef CONFIG_ASHMEM_COMPRESS
+	struct ashmem_zpage **zpages;	/* one per page, if compressed */
+#endif
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
+/* LRU list of compressed ranges and their page count, same lock */
+static LIST_HEAD(ashmem_zlru_list);
+static unsigned long zlru_count;
+
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU lists and their counts
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: ashmem_area->mutex -> ashmem_lru_lock
+ *		  ashmem_area->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker finds areas through the LRU, so it only trylocks them.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -103,33 +149,348 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 #define range_before_page(range, page) \
   ((range)->pgend < (page))
 
+#ifdef CONFIG_ASHMEM_COMPRESS
+#define range_compressed(range) \
+  ((range)->zpages != NULL)
+#else
+#define range_compressed(range) 0
+#endif
+
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+static inline void zlru_add(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	list_add_tail(&range->lru, &ashmem_zlru_list);
+	zlru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
-	lru_count -= range_size(range);
+	if (range_compressed(range))
+		zlru_count -= range_size(range);
+	else
+		lru_count -= range_size(range);
+}
+
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+#ifdef CONFIG_ASHMEM_COMPRESS
+
+enum ashmem_stats_index {
+	ASHMEM_STAT_COMPRESSED,		/* pages held compressed */
+	ASHMEM_STAT_COMPR_SIZE,		/* bytes they take */
+	ASHMEM_STAT_RESTORED,		/* pages brought back on pin */
+	ASHMEM_STAT_PURGED,		/* pages dropped for good */
+	ASHMEM_STAT_COMPRESS_FAILS,	/* ranges that could not be compressed */
+	ASHMEM_STAT_NSTATS,
+};
+
+static atomic_long_t ashmem_stats[ASHMEM_STAT_NSTATS];
+
+static inline void ashmem_stat_add(enum ashmem_stats_index idx, long val)
+{
+	atomic_long_add(val, &ashmem_stats[idx]);
+}
+
+/* Set once ashmem_compress_init() has allocated the compressors */
+static int ashmem_compress;
+static unsigned int ashmem_max_pool_percent = ASHMEM_DEFAULT_MAX_POOL_PERCENT;
+
+static DEFINE_PER_CPU(struct crypto_comp *, ashmem_tfm);
+static DEFINE_PER_CPU(void *, ashmem_zbuffer);
+
+static inline int zpool_full(void)
+{
+	unsigned long max_bytes;
+
+	max_bytes = (totalram_pages * ashmem_max_pool_percent / 100)
+			<< PAGE_SHIFT;
+
+	return atomic_long_read(&ashmem_stats[ASHMEM_STAT_COMPR_SIZE]) >=
+			max_bytes;
+}
+
+/*
+ * zpage_compress - returns a compressed copy of 'page', or NULL if it
+ * does not compress well, the pool is full or memory is short.
+ *
+ * May be called from reclaim, so it does not sleep.
+ */
+static struct ashmem_zpage *zpage_compress(struct page *page)
+{
+	struct ashmem_zpage *zpage = NULL;
+	unsigned int len = PAGE_SIZE * 2;
+	void *src, *dst;
+	int ret;
+
+	dst = get_cpu_var(ashmem_zbuffer);
+
+	src = kmap_atomic(page, KM_USER0);
+	ret = crypto_comp_compress(__get_cpu_var(ashmem_tfm), src, PAGE_SIZE,
+				   dst, &len);
+	kunmap_atomic(src, KM_USER0);
+
+	if (!ret && len < ASHMEM_ZPAGE_MAX && !zpool_full())
+		zpage = kmalloc(sizeof(*zpage) + len, GFP_NOWAIT |
+				__GFP_NOWARN | __GFP_NOMEMALLOC);
+	if (zpage) {
+		zpage->len = len;
+		memcpy(zpage->data, dst, len);
+		ashmem_stat_add(ASHMEM_STAT_COMPR_SIZE, len);
+	}
+
+	put_cpu_var(ashmem_zbuffer);
+
+	return zpage;
+}
+
+static int zpage_decompress(struct ashmem_zpage *zpage, void *dst)
+{
+	unsigned int len = PAGE_SIZE;
+	int ret;
+
+	ret = crypto_comp_decompress(get_cpu_var(ashmem_tfm), zpage->data,
+				     zpage->len, dst, &len);
+	put_cpu_var(ashmem_tfm);
+
+	if (!ret && len != PAGE_SIZE)
+		ret = -EIO;
+
+	return ret;
+}
+
+static void zpages_free(struct ashmem_zpage **zpages, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (!zpages[i])
+			break;
+		ashmem_stat_add(ASHMEM_STAT_COMPR_SIZE, -(long)zpages[i]->len);
+		kfree(zpages[i]);
+	}
+	kfree(zpages);
+}
+
+/*
+ * range_zfree - drops the compressed copy of 'range', if any
+ *
+ * Caller must hold asma->mutex and have taken the range off the LRU.
+ */
+static void range_zfree(struct ashmem_range *range)
+{
+	if (!range_compressed(range))
+		return;
+
+	zpages_free(range->zpages, range_size(range));
+	range->zpages = NULL;
+	ashmem_stat_add(ASHMEM_STAT_COMPRESSED, -(long)range_size(range));
+}
+
+/*
+ * range_compress - stores a compressed copy of the pages of 'range',
+ * which the caller then truncates. Fails if one of the pages is not in
+ * the page cache, as it may have gone to swap, or does not compress.
+ *
+ * Caller must hold asma->mutex and have taken the range off the LRU.
+ */
+static int range_compress(struct ashmem_range *range)
+{
+	struct address_space *mapping = range->asma->file->f_mapping;
+	size_t i, nr = range_size(range);
+	struct ashmem_zpage **zpages;
+	struct page *page;
+
+	if (!ashmem_compress)
+		return -EINVAL;
+
+	zpages = kcalloc(nr, sizeof(*zpages),
+			 GFP_NOWAIT | __GFP_NOWARN | __GFP_NOMEMALLOC);
+	if (!zpages)
+		goto fail;
+
+	for (i = 0; i < nr; i++) {
+		page = find_get_page(mapping, range->pgstart + i);
+		if (!page)
+			goto fail_free;
+		if (PageUptodate(page))
+			zpages[i] = zpage_compress(page);
+		page_cache_release(page);
+		if (!zpages[i])
+			goto fail_free;
+	}
+
+	range->zpages = zpages;
+	ashmem_stat_add(ASHMEM_STAT_COMPRESSED, nr);
+
+	return 0;
+
+fail_free:
+	zpages_free(zpages, nr);
+fail:
+	ashmem_stat_add(ASHMEM_STAT_COMPRESS_FAILS, 1);
+	return -ENOMEM;
+}
+
+/*
+ * range_write - writes one page from 'buf' at page 'pgoff' of the file
+ */
+static int range_write(struct ashmem_area *asma, void *buf, size_t pgoff)
+{
+	loff_t pos = (loff_t)pgoff << PAGE_SHIFT;
+	mm_segment_t old_fs;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = asma->file->f_op->write(asma->file, (char __user *)buf,
+				      PAGE_SIZE, &pos);
+	set_fs(old_fs);
+
+	return ret == PAGE_SIZE ? 0 : -EIO;
+}
+
+/*
+ * range_restore - writes the pages of compressed 'range' back to the file
+ * and returns it to the LRU of uncompressed ranges, or marks it purged if
+ * that fails.
+ *
+ * Caller must hold asma->mutex.
+ */
+static void range_restore(struct ashmem_area *asma, struct ashmem_range *range)
+{
+	size_t i, nr = range_size(range);
+	void *buf;
+	int ret = -ENOMEM;
+
+	lru_del(range);
+
+	buf = (void *)__get_free_page(GFP_KERNEL);
+	if (buf) {
+		for (i = 0, ret = 0; !ret && i < nr; i++) {
+			ret = zpage_decompress(range->zpages[i], buf);
+			if (!ret)
+				ret = range_write(asma, buf, range->pgstart + i);
+		}
+		free_page((unsigned long)buf);
+	}
+
+	range_zfree(range);
+
+	if (ret) {
+		range->purged = ASHMEM_WAS_PURGED;
+		ashmem_stat_add(ASHMEM_STAT_PURGED, nr);
+		return;
+	}
+
+	lru_add(range);
+	ashmem_stat_add(ASHMEM_STAT_RESTORED, nr);
+}
+
+#else	/* CONFIG_ASHMEM_COMPRESS */
+
+#define ashmem_stat_add(idx, val)	do { } while (0)
+
+static inline int zpool_full(void)
+{
+	return 0;
+}
+
+static inline void range_zfree(struct ashmem_range *range)
+{
+}
+
+static inline int range_compress(struct ashmem_range *range)
+{
+	return -EINVAL;
+}
+
+static inline void range_restore(struct ashmem_area *asma,
+				 struct ashmem_range *range)
+{
+}
+
+#endif	/* CONFIG_ASHMEM_COMPRESS */
+
+/*
+ * range_first - returns the lowest range of 'asma' ending at or after
+ * page 'pgstart', NULL if there is none. Following ranges are reached
+ * with range_next().
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma,
+					size_t pgstart)
+{
+	struct rb_node *node = asma->unpinned.rb_node;
+	struct ashmem_range *range, *found = NULL;
+
+	while (node) {
+		range = rb_entry(node, struct ashmem_range, node);
+		if (range_before_page(range, pgstart)) {
+			node = node->rb_right;
+		} else {
+			found = range;
+			node = node->rb_left;
+		}
+	}
+
+	return found;
+}
+
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *node = rb_next(&range->node);
+
+	return node ? rb_entry(node, struct ashmem_range, node) : NULL;
+}
+
+static void range_insert(struct ashmem_area *asma, struct ashmem_range *range)
+{
+	struct rb_node **p = &asma->unpinned.rb_node;
+	struct rb_node *parent = NULL;
+	struct ashmem_range *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ashmem_range, node);
+		if (range->pgstart < entry->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&range->node, parent, p);
+	rb_insert_color(&range->node, &asma->unpinned);
 }
 
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
 	struct ashmem_range *range;
@@ -143,7 +504,7 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	range_insert(asma, range);
 
 	if (range_on_lru(range))
 		lru_add(range);
@@ -153,16 +514,17 @@ static int range_alloc(struct ashmem_area *asma,
 
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
+	rb_erase(&range->node, &range->asma->unpinned);
 	if (range_on_lru(range))
 		lru_del(range);
+	range_zfree(range);
 	kmem_cache_free(ashmem_range_cachep, range);
 }
 
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -172,8 +534,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -189,7 +554,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
+	asma->unpinned = RB_ROOT;
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -200,13 +566,13 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *node;
 
-	if (!mutex_trylock(&ashmem_mutex))
-		return -1;
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	/* waits for the shrinker, which finds the area through its ranges */
+	mutex_lock(&asma->mutex);
+	while ((node = rb_first(&asma->unpinned)))
+		range_del(rb_entry(node, struct ashmem_range, node));
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -221,7 +587,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -242,7 +608,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -251,7 +617,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -272,7 +638,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -289,7 +655,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -333,10 +699,137 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	asma->vm_start = vma->vm_start;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * lru_isolate - takes up to ASHMEM_SHRINK_BATCH of the least recently
+ * unpinned ranges, totalling about 'nr_to_scan' pages, off LRU 'list'.
+ * They all belong to the returned area, which is locked, and are stored
+ * in 'batch', 'nr' being set to their number.
+ *
+ * Areas are locked with mutex_trylock() since the lock ordering is the
+ * other way around; busy ones are skipped. Returns NULL if no area
+ * could be locked among the first ASHMEM_SHRINK_SCAN ranges.
+ */
+static struct ashmem_area *lru_isolate(struct list_head *list,
+				       struct ashmem_range **batch, int *nr,
+				       int nr_to_scan)
+{
+	struct ashmem_range *range, *next;
+	struct ashmem_area *asma = NULL;
+	int scanned = 0;
+
+	*nr = 0;
+
+	spin_lock(&ashmem_lru_lock);
+	list_for_each_entry_safe(range, next, list, lru) {
+		if (++scanned > ASHMEM_SHRINK_SCAN)
+			break;
+
+		if (!asma) {
+			if (!mutex_trylock(&range->asma->mutex))
+				continue;
+			asma = range->asma;
+		} else if (range->asma != asma) {
+			continue;
+		}
+
+		__lru_del(range);
+		batch[(*nr)++] = range;
+
+		nr_to_scan -= range_size(range);
+		if (*nr == ASHMEM_SHRINK_BATCH || nr_to_scan <= 0)
+			break;
+	}
+	spin_unlock(&ashmem_lru_lock);
+
+	return asma;
+}
+
+/*
+ * range_evict - frees the pages of isolated 'range', keeping a compressed
+ * copy if 'compress' is set and that works. Already compressed ranges are
+ * purged.
+ *
+ * Caller must hold asma->mutex.
+ */
+static void range_evict(struct ashmem_range *range, bool compress)
+{
+	struct inode *inode = range->asma->file->f_dentry->d_inode;
+	loff_t start = range->pgstart * PAGE_SIZE;
+	loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+
+	if (range_compressed(range)) {
+		range_zfree(range);
+		range->purged = ASHMEM_WAS_PURGED;
+		ashmem_stat_add(ASHMEM_STAT_PURGED, range_size(range));
+		return;
+	}
+
+	if (!compress || range_compress(range)) {
+		range->purged = ASHMEM_WAS_PURGED;
+		ashmem_stat_add(ASHMEM_STAT_PURGED, range_size(range));
+	}
+
+	vmtruncate_range(inode, start, end);
+
+	if (range_compressed(range))
+		zlru_add(range);
+}
+
+/*
+ * shrink_batch - evicts one batch of ranges from LRU 'list', returning
+ * the number of pages they spanned, or 0 if no batch could be taken.
+ */
+static int shrink_batch(struct list_head *list, int nr_to_scan, bool compress)
+{
+	struct ashmem_range *batch[ASHMEM_SHRINK_BATCH];
+	struct ashmem_area *asma;
+	int i, nr, freed = 0;
+
+	asma = lru_isolate(list, batch, &nr, nr_to_scan);
+	if (!asma)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		freed += range_size(batch[i]);
+		range_evict(batch[i], compress);
+	}
+	mutex_unlock(&asma->mutex);
+
+	return freed;
+}
+
+/*
+ * __ashmem_shrink - evicts about 'nr_to_scan' pages, compressing them
+ * first if 'compress' is set. Uncompressed ranges go first, compressed
+ * ones are only purged once those are exhausted, or to make room in a
+ * full pool.
+ */
+static void __ashmem_shrink(int nr_to_scan, bool compress)
+{
+	int freed;
+
+	while (nr_to_scan > 0) {
+		if (compress && zpool_full())
+			shrink_batch(&ashmem_zlru_list, nr_to_scan, false);
+
+		freed = shrink_batch(&ashmem_lru_list, nr_to_scan, compress);
+		if (!freed)
+			break;
+		nr_to_scan -= freed;
+	}
+
+	while (nr_to_scan > 0) {
+		freed = shrink_batch(&ashmem_zlru_list, nr_to_scan, false);
+		if (!freed)
+			break;
+		nr_to_scan -= freed;
+	}
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -349,36 +842,20 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise until we hit 'nr_to_scan' pages freed.
+ * Ranges are taken off the LRU in batches belonging to the same area, see
+ * lru_isolate(), and truncated holding only that area's lock.
  */
 static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
-
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
 		return -1;
-	if (!nr_to_scan)
-		return lru_count;
-
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+	if (nr_to_scan)
+		__ashmem_shrink(nr_to_scan, true);
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
-	}
-	mutex_unlock(&ashmem_mutex);
-
-	return lru_count;
+	return lru_count + zlru_count;
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -390,7 +867,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -405,7 +882,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -413,7 +890,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -427,7 +904,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -436,7 +913,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -453,7 +930,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -462,16 +939,19 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
+	size_t end;
+
+	for (range = range_first(asma, pgstart); range; range = next) {
+		next = range_next(range);
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
 		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
+		if (range->pgstart > pgend)
 			break;
 
 		/*
@@ -490,6 +970,8 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 		 *    create a new range for the other side.
 		 */
 		if (page_range_in_range(range, pgstart, pgend)) {
+			if (range_compressed(range))
+				range_restore(asma, range);
 			ret |= range->purged;
 
 			/* Case #1: Easy. Just nuke the whole thing. */
@@ -512,12 +994,13 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 
 			/*
 			 * Case #4: We eat a chunk out of the middle. A bit
-			 * more complicated, we allocate a new range for the
-			 * second half and adjust the first chunk's endpoint.
+			 * more complicated, we adjust the first chunk's
+			 * endpoint and allocate a new range for the second
+			 * half.
 			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+			end = range->pgend;
 			range_shrink(range, range->pgstart, pgstart - 1);
+			range_alloc(asma, range->purged, pgend + 1, end);
 			break;
 		}
 	}
@@ -528,59 +1011,52 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
+	for (range = range_first(asma, pgstart); range; range = next) {
+		next = range_next(range);
+
+		/* short circuit: no more overlapping ranges */
+		if (range->pgstart > pgend)
 			break;
 
 		/*
 		 * The user can ask us to unpin pages that are already entirely
-		 * or partially pinned. We handle those two cases here.
+		 * or partially unpinned. We handle those two cases here.
 		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+		if (range_compressed(range))
+			range_restore(asma, range);
+		pgstart = min_t(size_t, range->pgstart, pgstart),
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		range_del(range);
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, purged, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
-	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
+	struct ashmem_range *range = range_first(asma, pgstart);
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
-	}
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
 
-	return ret;
+	return ASHMEM_IS_PINNED;
 }
 
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
@@ -612,7 +1088,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -626,7 +1102,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -678,7 +1154,7 @@ static int ashmem_flush_cache_range(struct ashmem_area *asma)
 	unsigned long addr;
 	unsigned int size, result = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	size = asma->size;
 	addr = asma->vm_start;
@@ -703,7 +1179,7 @@ static int ashmem_flush_cache_range(struct ashmem_area *asma)
 	mb();
 #endif
 done:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return 0;
 }
 
@@ -744,7 +1220,7 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
 			ret = ashmem_shrink(&ashmem_shrinker, 0, GFP_KERNEL);
-			ashmem_shrink(&ashmem_shrinker, ret, GFP_KERNEL);
+			__ashmem_shrink(ret, false);
 		}
 		break;
 	case ASHMEM_CACHE_FLUSH_RANGE:
@@ -825,6 +1301,154 @@ static struct miscdevice ashmem_misc = {
 	.fops = &ashmem_fops,
 };
 
+#ifdef CONFIG_ASHMEM_COMPRESS
+
+#ifdef CONFIG_SYSFS
+
+#define ASHMEM_STAT_ATTR(_name, _idx)					\
+static ssize_t _name##_show(struct kobject *kobj,			\
+			struct kobj_attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%ld\n",					\
+		       atomic_long_read(&ashmem_stats[_idx]));		\
+}									\
+static struct kobj_attribute _name##_attr = __ATTR_RO(_name)
+
+ASHMEM_STAT_ATTR(compressed_pages, ASHMEM_STAT_COMPRESSED);
+ASHMEM_STAT_ATTR(compr_data_size, ASHMEM_STAT_COMPR_SIZE);
+ASHMEM_STAT_ATTR(restored_pages, ASHMEM_STAT_RESTORED);
+ASHMEM_STAT_ATTR(purged_pages, ASHMEM_STAT_PURGED);
+ASHMEM_STAT_ATTR(compress_fails, ASHMEM_STAT_COMPRESS_FAILS);
+
+static ssize_t compress_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", ashmem_compress);
+}
+
+/*
+ * Turning compression off leaves already compressed ranges alone, they
+ * are restored or purged as usual.
+ */
+static ssize_t compress_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret || val > 1)
+		return -EINVAL;
+
+	ashmem_compress = val;
+
+	return len;
+}
+static struct kobj_attribute compress_attr =
+	__ATTR(compress, 0644, compress_show, compress_store);
+
+static ssize_t max_pool_percent_show(struct kobject *kobj,
+			struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ashmem_max_pool_percent);
+}
+
+static ssize_t max_pool_percent_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret || val > 100)
+		return -EINVAL;
+
+	ashmem_max_pool_percent = val;
+
+	return len;
+}
+static struct kobj_attribute max_pool_percent_attr =
+	__ATTR(max_pool_percent, 0644, max_pool_percent_show,
+		max_pool_percent_store);
+
+static struct attribute *ashmem_attrs[] = {
+	&compressed_pages_attr.attr,
+	&compr_data_size_attr.attr,
+	&restored_pages_attr.attr,
+	&purged_pages_attr.attr,
+	&compress_fails_attr.attr,
+	&compress_attr.attr,
+	&max_pool_percent_attr.attr,
+	NULL,
+};
+
+static struct attribute_group ashmem_attr_group = {
+	.attrs = ashmem_attrs,
+};
+
+static void __init ashmem_sysfs_init(void)
+{
+	struct kobject *kobj;
+
+	kobj = kobject_create_and_add("ashmem", mm_kobj);
+	if (!kobj || sysfs_create_group(kobj, &ashmem_attr_group))
+		printk(KERN_ERR "ashmem: failed to create sysfs group\n");
+}
+#else
+static inline void ashmem_sysfs_init(void)
+{
+}
+#endif	/* CONFIG_SYSFS */
+
+static void ashmem_compress_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(ashmem_tfm, cpu))
+			crypto_free_comp(per_cpu(ashmem_tfm, cpu));
+		per_cpu(ashmem_tfm, cpu) = NULL;
+		free_pages((unsigned long)per_cpu(ashmem_zbuffer, cpu), 1);
+		per_cpu(ashmem_zbuffer, cpu) = NULL;
+	}
+}
+
+/*
+ * Runs after the compressors have registered with the crypto API, which
+ * happens after ashmem_init() as crypto/ links after mm/.
+ */
+static int __init ashmem_compress_init(void)
+{
+	struct crypto_comp *tfm;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp("lzo", 0, 0);
+		if (IS_ERR(tfm))
+			goto fail;
+		per_cpu(ashmem_tfm, cpu) = tfm;
+
+		/* lzo may expand incompressible data */
+		per_cpu(ashmem_zbuffer, cpu) =
+			(void *)__get_free_pages(GFP_KERNEL, 1);
+		if (!per_cpu(ashmem_zbuffer, cpu))
+			goto fail;
+	}
+
+	ashmem_compress = 1;
+	ashmem_sysfs_init();
+
+	return 0;
+
+fail:
+	printk(KERN_ERR "ashmem: failed to set up compression\n");
+	ashmem_compress_free();
+	return -ENOMEM;
+}
+late_initcall(ashmem_compress_init);
+
+#endif	/* CONFIG_ASHMEM_COMPRESS */
+
 static int __init ashmem_init(void)
 {
 	int ret;
@@ -3,7 +3,12 @@
 
 extern int bench_sched_messaging(int argc, const char **argv, const char *prefix);
 extern int bench_sched_pipe(int argc, const char **argv, const char *prefix);
+extern int bench_sched_binder(int argc, const char **argv, const char *prefix);
+extern int bench_logger_write(int argc, const char **argv, const char *prefix);
 extern int bench_mem_memcpy(int argc, const char **argv, const char *prefix __used);
+extern int bench_mem_cleancache(int argc, const char **argv, const char *prefix);
+extern int bench_fs_metadata(int argc, const char **argv, const char *prefix);
+extern int bench_fs_mount(int argc, const char **argv, const char *prefix);
 
 #define BENCH_FORMAT_DEFAULT_STR	"default"
 #define BENCH_FORMAT_DEFAULT		0
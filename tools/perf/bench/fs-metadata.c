@@ -0,0 +1,310 @@
+/*
+ *
+ * fs-metadata.c
+ *
+ * metadata: Benchmark for namespace and read scaling under a writer
+ *
+ * A directory of small files is created, then a number of reader tasks
+ * repeatedly list it, look up names that are not in the dentry cache and
+ * read files back after dropping them from the page cache, while one
+ * more task keeps writing and syncing a large file on the same
+ * filesystem. On filesystems that serialize everything behind a single
+ * lock (yaffs2 on NAND) the readers stall behind the writer.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define LOOPS_DEFAULT 1000
+static int loops = LOOPS_DEFAULT;
+static int nr_tasks = 2;
+static int nr_files = 100;
+static int write_kb = 16384;
+static const char *dir = ".";
+
+static const struct option options[] = {
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of rounds done by each reader"),
+	OPT_INTEGER('t', "tasks", &nr_tasks,
+		    "Specify number of reader tasks"),
+	OPT_INTEGER('f', "files", &nr_files,
+		    "Specify number of files in the directory"),
+	OPT_INTEGER('w', "write", &write_kb,
+		    "Specify size of the writer's file in KB, 0 for no writer"),
+	OPT_STRING('d', "dir", &dir, "path",
+		   "Specify a directory on the filesystem to test"),
+	OPT_END()
+};
+
+static const char * const bench_fs_metadata_usage[] = {
+	"perf bench fs metadata <options>",
+	NULL
+};
+
+#define FILE_SIZE 4096
+#define BUF_SIZE (64 * 1024)
+
+/* longer than the names yaffs2 keeps in RAM */
+#define FILE_NAME "%s/perf-metadata-file-%05d"
+
+static char *base;
+
+static void metadata_cleanup(void)
+{
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < nr_files; i++) {
+		snprintf(path, sizeof(path), FILE_NAME, base, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/perf-metadata-big", base);
+	unlink(path);
+	rmdir(base);
+}
+
+/* returns -1 rather than exiting, so "perf bench all" can go on */
+static int metadata_prepare(char *buf)
+{
+	char path[PATH_MAX];
+	int fd, i;
+
+	if (mkdir(base, 0700) < 0) {
+		fprintf(stderr, "Failed to create %s: %s\n",
+			base, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < nr_files; i++) {
+		snprintf(path, sizeof(path), FILE_NAME, base, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+			fprintf(stderr, "Failed to create %s: %s\n",
+				path, strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			metadata_cleanup();
+			return -1;
+		}
+		/* only clean pages can be dropped from the page cache */
+		fsync(fd);
+		close(fd);
+	}
+	return 0;
+}
+
+static void metadata_writer(char *buf)
+{
+	char path[PATH_MAX];
+	long long left;
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/perf-metadata-big", base);
+
+	/* killed by the parent once the readers are done */
+	for (;;) {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to create %s: %s\n",
+				path, strerror(errno));
+			exit(1);
+		}
+		for (left = (long long)write_kb * 1024; left > 0; left -= ret) {
+			ret = write(fd, buf, left < BUF_SIZE ? left : BUF_SIZE);
+			if (ret <= 0) {
+				fprintf(stderr, "Failed to write %s: %s\n",
+					path, strerror(errno));
+				exit(1);
+			}
+		}
+		fsync(fd);
+		close(fd);
+	}
+}
+
+static void metadata_reader(int task, char *buf)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct dirent *de;
+	DIR *d;
+	int fd, i, n;
+
+	srand(getpid());
+
+	for (i = 0; i < loops; i++) {
+		/* readdir always reaches the filesystem */
+		d = opendir(base);
+		if (!d) {
+			fprintf(stderr, "Failed to open %s: %s\n",
+				base, strerror(errno));
+			exit(1);
+		}
+		for (n = 0; (de = readdir(d)); n++)
+			;
+		closedir(d);
+		if (n < nr_files + 2) {
+			fprintf(stderr, "Listed %d of %d files in %s\n",
+				n - 2, nr_files, base);
+			exit(1);
+		}
+
+		/* a new name every time, so the dentry cache can't answer */
+		snprintf(path, sizeof(path), "%s/missing-%d-%d",
+			 base, task, i);
+		if (!stat(path, &st) || errno != ENOENT) {
+			fprintf(stderr, "Unexpected stat result for %s\n",
+				path);
+			exit(1);
+		}
+
+		snprintf(path, sizeof(path), FILE_NAME, base,
+			 rand() % nr_files);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to open %s: %s\n",
+				path, strerror(errno));
+			exit(1);
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		if (read(fd, buf, FILE_SIZE) != FILE_SIZE) {
+			fprintf(stderr, "Failed to read %s: %s\n",
+				path, strerror(errno));
+			exit(1);
+		}
+		close(fd);
+	}
+	exit(0);
+}
+
+int bench_fs_metadata(int argc, const char **argv,
+		      const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	unsigned long long result_usec = 0;
+	unsigned long long total;
+	int wait_stat, i, ret = 0;
+	pid_t writer = 0;
+	pid_t *pids;
+	char *buf;
+
+	argc = parse_options(argc, argv, options,
+			     bench_fs_metadata_usage, 0);
+
+	if (loops <= 0 || nr_tasks <= 0 || nr_files <= 0 || write_kb < 0) {
+		usage_with_options(bench_fs_metadata_usage, options);
+		exit(1);
+	}
+
+	base = malloc(PATH_MAX);
+	assert(base);
+	snprintf(base, PATH_MAX, "%s/perf-metadata.%d", dir, getpid());
+
+	buf = malloc(BUF_SIZE);
+	assert(buf);
+	memset(buf, 'x', BUF_SIZE);
+
+	if (metadata_prepare(buf) < 0) {
+		free(buf);
+		free(base);
+		return 1;
+	}
+
+	if (write_kb) {
+		writer = fork();
+		assert(writer >= 0);
+		if (!writer)
+			metadata_writer(buf);
+	}
+
+	pids = calloc(nr_tasks, sizeof(pid_t));
+	assert(pids);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_tasks; i++) {
+		pids[i] = fork();
+		assert(pids[i] >= 0);
+		if (!pids[i])
+			metadata_reader(i, buf);
+	}
+
+	for (i = 0; i < nr_tasks; i++) {
+		if (waitpid(pids[i], &wait_stat, 0) != pids[i] ||
+		    !WIFEXITED(wait_stat) || WEXITSTATUS(wait_stat))
+			ret = 1;
+	}
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	if (writer) {
+		kill(writer, SIGKILL);
+		waitpid(writer, &wait_stat, 0);
+	}
+
+	metadata_cleanup();
+	free(pids);
+	free(buf);
+	free(base);
+
+	if (ret)
+		return ret;
+
+	/* one readdir, one lookup and one read per round */
+	total = (unsigned long long)loops * nr_tasks;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d readers did %d rounds over %d files, %s\n\n",
+		       nr_tasks, loops, nr_files,
+		       write_kb ? "with a writer" : "without a writer");
+
+		result_usec = diff.tv_sec * 1000000;
+		result_usec += diff.tv_usec;
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec/1000));
+
+		printf(" %14lf usecs/round\n",
+		       (double)result_usec / (double)total);
+		printf(" %14d rounds/sec\n",
+		       (int)((double)total /
+			     ((double)result_usec / (double)1000000)));
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec / 1000));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ *
+ * fs-mount.c
+ *
+ * mount: Benchmark for mount time of a flash filesystem
+ *
+ * The device is mounted and unmounted over and over, once restoring
+ * from the checkpoint written at the last unmount and once with
+ * "no-checkpoint-read", which makes yaffs2 rebuild its state by scanning
+ * the flash the way it has to after an unclean shutdown. The device can
+ * be filled with files first, so there is something to scan.
+ *
+ * Needs root, and destroys nothing but the files it creates.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define LOOPS_DEFAULT 10
+static int loops = LOOPS_DEFAULT;
+static int nr_files;
+static int file_kb = 256;
+static const char *device;
+static const char *mnt_dir;
+static const char *fstype = "yaffs2";
+static const char *mnt_opts = "";
+
+static const struct option options[] = {
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of mounts of each kind"),
+	OPT_STRING('D', "device", &device, "path",
+		   "Specify the block device to mount (e.g. /dev/mtdblock3)"),
+	OPT_STRING('m', "mnt", &mnt_dir, "path",
+		   "Specify the directory to mount it on"),
+	OPT_STRING('t', "type", &fstype, "fstype",
+		   "Specify the filesystem type"),
+	OPT_STRING('o', "options", &mnt_opts, "opts",
+		   "Specify extra mount options (e.g. summary)"),
+	OPT_INTEGER('f', "files", &nr_files,
+		    "Specify number of files to create before measuring"),
+	OPT_INTEGER('s', "size", &file_kb,
+		    "Specify size of each created file in KB"),
+	OPT_END()
+};
+
+static const char * const bench_fs_mount_usage[] = {
+	"perf bench fs mount -D <device> -m <dir> <options>",
+	NULL
+};
+
+#define BUF_SIZE (64 * 1024)
+#define FILE_NAME "%s/perf-mount-file-%05d"
+
+/* failures return -1 rather than exiting, so "perf bench all" can go on */
+static int do_mount(const char *opts)
+{
+	if (mount(device, mnt_dir, fstype, 0, opts) < 0) {
+		fprintf(stderr, "Failed to mount %s on %s with \"%s\": %s\n",
+			device, mnt_dir, opts, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int do_umount(void)
+{
+	if (umount(mnt_dir) < 0) {
+		fprintf(stderr, "Failed to unmount %s: %s\n",
+			mnt_dir, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void mount_cleanup(const char *opts)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (do_mount(opts) < 0)
+		return;
+	for (i = 0; i < nr_files; i++) {
+		snprintf(path, sizeof(path), FILE_NAME, mnt_dir, i);
+		unlink(path);
+	}
+	do_umount();
+}
+
+static int mount_populate(const char *opts)
+{
+	char path[PATH_MAX];
+	long long left;
+	ssize_t ret;
+	char *buf;
+	int fd, i;
+
+	buf = malloc(BUF_SIZE);
+	assert(buf);
+	memset(buf, 'x', BUF_SIZE);
+
+	if (do_mount(opts) < 0)
+		goto out_free;
+	for (i = 0; i < nr_files; i++) {
+		snprintf(path, sizeof(path), FILE_NAME, mnt_dir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to create %s: %s\n",
+				path, strerror(errno));
+			goto out_umount;
+		}
+		for (left = (long long)file_kb * 1024; left > 0; left -= ret) {
+			ret = write(fd, buf, left < BUF_SIZE ? left : BUF_SIZE);
+			if (ret <= 0) {
+				fprintf(stderr, "Failed to write %s: %s\n",
+					path, strerror(errno));
+				close(fd);
+				goto out_umount;
+			}
+		}
+		close(fd);
+	}
+	if (do_umount() < 0)
+		goto out_free;
+
+	free(buf);
+	return 0;
+
+out_umount:
+	do_umount();
+	mount_cleanup(opts);
+out_free:
+	free(buf);
+	return -1;
+}
+
+/* Average time of one mount(2) call with the given options, in usecs */
+static double mount_time(const char *opts)
+{
+	struct timeval start, stop, diff;
+	unsigned long long total = 0;
+	int i;
+
+	for (i = 0; i < loops; i++) {
+		gettimeofday(&start, NULL);
+		if (do_mount(opts) < 0)
+			return -1;
+		gettimeofday(&stop, NULL);
+		if (do_umount() < 0)
+			return -1;
+
+		timersub(&stop, &start, &diff);
+		total += diff.tv_sec * 1000000ULL + diff.tv_usec;
+	}
+
+	return (double)total / (double)loops;
+}
+
+int bench_fs_mount(int argc, const char **argv,
+		   const char *prefix __used)
+{
+	char scan_opts[256];
+	double checkpoint_usec, scan_usec;
+
+	argc = parse_options(argc, argv, options,
+			     bench_fs_mount_usage, 0);
+
+	if (loops <= 0 || nr_files < 0 || file_kb <= 0) {
+		usage_with_options(bench_fs_mount_usage, options);
+		exit(1);
+	}
+
+	/* "perf bench all" has no device to offer, skip rather than exit */
+	if (!device || !mnt_dir) {
+		fprintf(stderr, "No device or mount point given (-D, -m), "
+			"skipping\n");
+		return 1;
+	}
+
+	snprintf(scan_opts, sizeof(scan_opts), "%s%sno-checkpoint-read",
+		 mnt_opts, *mnt_opts ? "," : "");
+
+	if (nr_files && mount_populate(mnt_opts) < 0)
+		return 1;
+
+	checkpoint_usec = mount_time(mnt_opts);
+	scan_usec = checkpoint_usec < 0 ? -1 : mount_time(scan_opts);
+
+	if (nr_files)
+		mount_cleanup(mnt_opts);
+
+	if (checkpoint_usec < 0 || scan_usec < 0)
+		return 1;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d mounts of %s each way, %d files of %d KB\n\n",
+		       loops, device, nr_files, file_kb);
+
+		printf(" %14lf usecs/mount from checkpoint\n",
+		       checkpoint_usec);
+		printf(" %14lf usecs/mount by scanning\n", scan_usec);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lf %lf\n", checkpoint_usec, scan_usec);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
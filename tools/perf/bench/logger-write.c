@@ -0,0 +1,174 @@
+/*
+ *
+ * logger-write.c
+ *
+ * write: Benchmark for write throughput of the Android logger
+ *
+ * A number of tasks write entries formatted like liblog's (priority,
+ * tag, message) to one of the /dev/log devices as fast as they can.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define LOOPS_DEFAULT 100000
+static int loops = LOOPS_DEFAULT;
+static int nr_tasks = 1;
+static int size = 64;
+static const char *device = "/dev/log/main";
+static const char tag_name[] = "perf";
+
+static const struct option options[] = {
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of entries written by each task"),
+	OPT_INTEGER('t', "tasks", &nr_tasks,
+		    "Specify number of writing tasks"),
+	OPT_INTEGER('s', "size", &size,
+		    "Specify message size in bytes"),
+	OPT_STRING('d', "device", &device, "path",
+		   "Specify the log device to write to"),
+	OPT_END()
+};
+
+static const char * const bench_logger_write_usage[] = {
+	"perf bench logger write <options>",
+	NULL
+};
+
+static void logger_writer(int fd, char *msg)
+{
+	static char prio = 3;	/* ANDROID_LOG_DEBUG */
+	struct iovec vec[3];
+	int i;
+
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = (void *)tag_name;
+	vec[1].iov_len = sizeof(tag_name);
+	vec[2].iov_base = msg;
+	vec[2].iov_len = size;
+
+	for (i = 0; i < loops; i++) {
+		if (writev(fd, vec, 3) < 0) {
+			fprintf(stderr, "Failed to write to %s: %s\n",
+				device, strerror(errno));
+			exit(1);
+		}
+	}
+	exit(0);
+}
+
+int bench_logger_write(int argc, const char **argv,
+		       const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	unsigned long long result_usec = 0;
+	unsigned long long total;
+	int wait_stat, fd, i, ret = 0;
+	pid_t *pids;
+	char *msg;
+
+	argc = parse_options(argc, argv, options,
+			     bench_logger_write_usage, 0);
+
+	if (loops <= 0 || nr_tasks <= 0 || size <= 0) {
+		usage_with_options(bench_logger_write_usage, options);
+		exit(1);
+	}
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n",
+			device, strerror(errno));
+		return 1;
+	}
+
+	msg = malloc(size);
+	assert(msg);
+	memset(msg, 'x', size - 1);
+	msg[size - 1] = '\0';
+
+	pids = calloc(nr_tasks, sizeof(pid_t));
+	assert(pids);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_tasks; i++) {
+		pids[i] = fork();
+		assert(pids[i] >= 0);
+		if (!pids[i])
+			logger_writer(fd, msg);
+	}
+
+	for (i = 0; i < nr_tasks; i++) {
+		if (waitpid(pids[i], &wait_stat, 0) != pids[i] ||
+		    !WIFEXITED(wait_stat) || WEXITSTATUS(wait_stat))
+			ret = 1;
+	}
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	close(fd);
+	free(pids);
+	free(msg);
+
+	if (ret)
+		return ret;
+
+	total = (unsigned long long)loops * nr_tasks;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d tasks wrote %llu entries of %d bytes to %s\n\n",
+		       nr_tasks, total, size, device);
+
+		result_usec = diff.tv_sec * 1000000;
+		result_usec += diff.tv_usec;
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec/1000));
+
+		printf(" %14lf usecs/op\n",
+		       (double)result_usec / (double)total);
+		printf(" %14d ops/sec\n",
+		       (int)((double)total /
+			     ((double)result_usec / (double)1000000)));
+		printf(" %14lf MB/sec\n",
+		       (double)total * (size + 1 + sizeof(tag_name)) /
+		       ((double)result_usec / (double)1000000) /
+		       (1024 * 1024));
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec / 1000));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
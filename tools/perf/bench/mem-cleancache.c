@@ -0,0 +1,231 @@
+/*
+ *
+ * mem-cleancache.c
+ *
+ * cleancache: Benchmark for cleancache put/get scaling
+ *
+ * Each task writes a private file on a filesystem mounted with cleancache
+ * enabled, then repeatedly drops its pages from the page cache with
+ * POSIX_FADV_DONTNEED (a cleancache put per page) and reads the file back
+ * (a cleancache get per page). Running it with an increasing number of
+ * tasks shows how well the cleancache backend scales.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define LOOPS_DEFAULT 100
+static int loops = LOOPS_DEFAULT;
+static int nr_tasks = 1;
+static int size_kb = 4096;
+static const char *dir = ".";
+static long page_size;
+
+static const struct option options[] = {
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of put/get rounds done by each task"),
+	OPT_INTEGER('t', "tasks", &nr_tasks,
+		    "Specify number of tasks"),
+	OPT_INTEGER('s', "size", &size_kb,
+		    "Specify size of each task's file in KB"),
+	OPT_STRING('d', "dir", &dir, "path",
+		   "Specify a directory on a cleancache enabled filesystem"),
+	OPT_END()
+};
+
+static const char * const bench_mem_cleancache_usage[] = {
+	"perf bench mem cleancache <options>",
+	NULL
+};
+
+#define BUF_SIZE (64 * 1024)
+
+static void cleancache_prepare(const char *path, char *buf)
+{
+	long long left = (long long)size_kb * 1024;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create %s: %s\n",
+			path, strerror(errno));
+		exit(1);
+	}
+	while (left > 0) {
+		ret = write(fd, buf, left < BUF_SIZE ? left : BUF_SIZE);
+		if (ret <= 0) {
+			fprintf(stderr, "Failed to write %s: %s\n",
+				path, strerror(errno));
+			exit(1);
+		}
+		left -= ret;
+	}
+	/* only clean pages are handed to cleancache */
+	if (fsync(fd) < 0) {
+		fprintf(stderr, "Failed to sync %s: %s\n",
+			path, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+}
+
+static void cleancache_worker(const char *path, char *buf)
+{
+	ssize_t ret;
+	int fd, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n",
+			path, strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < loops; i++) {
+		if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)) {
+			fprintf(stderr, "Failed to drop %s from page cache\n",
+				path);
+			exit(1);
+		}
+		if (lseek(fd, 0, SEEK_SET) < 0)
+			exit(1);
+		do {
+			ret = read(fd, buf, BUF_SIZE);
+		} while (ret > 0);
+		if (ret < 0) {
+			fprintf(stderr, "Failed to read %s: %s\n",
+				path, strerror(errno));
+			exit(1);
+		}
+	}
+	close(fd);
+	exit(0);
+}
+
+int bench_mem_cleancache(int argc, const char **argv,
+			 const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	unsigned long long result_usec = 0;
+	unsigned long long total;
+	int wait_stat, i, ret = 0;
+	char **paths;
+	pid_t *pids;
+	char *buf;
+
+	argc = parse_options(argc, argv, options,
+			     bench_mem_cleancache_usage, 0);
+
+	if (loops <= 0 || nr_tasks <= 0 || size_kb <= 0) {
+		usage_with_options(bench_mem_cleancache_usage, options);
+		exit(1);
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	buf = malloc(BUF_SIZE);
+	assert(buf);
+	memset(buf, 'x', BUF_SIZE);
+
+	paths = calloc(nr_tasks, sizeof(char *));
+	assert(paths);
+	for (i = 0; i < nr_tasks; i++) {
+		paths[i] = malloc(PATH_MAX);
+		assert(paths[i]);
+		snprintf(paths[i], PATH_MAX, "%s/perf-cleancache.%d.%d",
+			 dir, getpid(), i);
+		/* vary contents between files so nothing gets merged */
+		buf[0] = (char)i;
+		cleancache_prepare(paths[i], buf);
+	}
+
+	pids = calloc(nr_tasks, sizeof(pid_t));
+	assert(pids);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_tasks; i++) {
+		pids[i] = fork();
+		assert(pids[i] >= 0);
+		if (!pids[i])
+			cleancache_worker(paths[i], buf);
+	}
+
+	for (i = 0; i < nr_tasks; i++) {
+		if (waitpid(pids[i], &wait_stat, 0) != pids[i] ||
+		    !WIFEXITED(wait_stat) || WEXITSTATUS(wait_stat))
+			ret = 1;
+	}
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	for (i = 0; i < nr_tasks; i++) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	free(pids);
+	free(buf);
+
+	if (ret)
+		return ret;
+
+	/* one put and one get per page and round */
+	total = (unsigned long long)loops * nr_tasks *
+		((unsigned long long)size_kb * 1024 / page_size);
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d tasks did %d put/get rounds over %d KB each\n\n",
+		       nr_tasks, loops, size_kb);
+
+		result_usec = diff.tv_sec * 1000000;
+		result_usec += diff.tv_usec;
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec/1000));
+
+		printf(" %14lf usecs/page\n",
+		       (double)result_usec / (double)total);
+		printf(" %14d pages/sec\n",
+		       (int)((double)total /
+			     ((double)result_usec / (double)1000000)));
+		printf(" %14lf MB/sec\n",
+		       (double)total * page_size /
+		       ((double)result_usec / (double)1000000) /
+		       (1024 * 1024));
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec / 1000));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
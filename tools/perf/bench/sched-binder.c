@@ -0,0 +1,380 @@
+/*
+ *
+ * sched-binder.c
+ *
+ * binder: Benchmark for round trip latency of Android binder transactions
+ *
+ * A server task registers itself as the binder context manager and
+ * replies to every transaction sent to handle 0 by a client task.
+ * Optional CPU hogs can be started to measure the latency under load.
+ *
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "../builtin.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/*
+ * The binder interface lives in drivers/staging/android/binder.h, which
+ * is not exported to userspace. Only the parts used here are copied.
+ */
+struct binder_write_read {
+	signed long	write_size;
+	signed long	write_consumed;
+	unsigned long	write_buffer;
+	signed long	read_size;
+	signed long	read_consumed;
+	unsigned long	read_buffer;
+};
+
+struct binder_transaction_data {
+	union {
+		size_t	handle;
+		void	*ptr;
+	} target;
+	void		*cookie;
+	unsigned int	code;
+	unsigned int	flags;
+	pid_t		sender_pid;
+	uid_t		sender_euid;
+	size_t		data_size;
+	size_t		offsets_size;
+	union {
+		struct {
+			const void	*buffer;
+			const void	*offsets;
+		} ptr;
+		uint8_t	buf[8];
+	} data;
+};
+
+#define BINDER_WRITE_READ	_IOWR('b', 1, struct binder_write_read)
+#define BINDER_SET_CONTEXT_MGR	_IOW('b', 7, int)
+
+#define BR_ERROR		_IOR('r', 0, int)
+#define BR_TRANSACTION		_IOR('r', 2, struct binder_transaction_data)
+#define BR_REPLY		_IOR('r', 3, struct binder_transaction_data)
+#define BR_DEAD_REPLY		_IO('r', 5)
+#define BR_TRANSACTION_COMPLETE	_IO('r', 6)
+#define BR_NOOP			_IO('r', 12)
+#define BR_SPAWN_LOOPER		_IO('r', 13)
+#define BR_FAILED_REPLY		_IO('r', 17)
+
+#define BC_TRANSACTION		_IOW('c', 0, struct binder_transaction_data)
+#define BC_REPLY		_IOW('c', 1, struct binder_transaction_data)
+#define BC_FREE_BUFFER		_IOW('c', 3, int)
+#define BC_ENTER_LOOPER		_IO('c', 12)
+
+#define BINDER_MAP_SIZE		(128 * 1024)
+#define BINDER_CMD_SIZE		256
+
+#define LOOPS_DEFAULT 100000
+static int loops = LOOPS_DEFAULT;
+static int size = 32;
+static int load;
+
+static const struct option options[] = {
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of loops"),
+	OPT_INTEGER('s', "size", &size,
+		    "Specify payload size in bytes"),
+	OPT_INTEGER('L', "load", &load,
+		    "Specify number of CPU hog tasks running meanwhile"),
+	OPT_END()
+};
+
+static const char * const bench_sched_binder_usage[] = {
+	"perf bench sched binder <options>",
+	NULL
+};
+
+/* returns -1 rather than exiting, so "perf bench all" can go on */
+static int binder_open(void)
+{
+	void *map;
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open /dev/binder: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	map = mmap(NULL, BINDER_MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map /dev/binder: %s\n",
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Writes the commands in wbuf and reads back until a reply or
+ * transaction shows up. The received transaction is stored in txn.
+ * Returns 0 on failure.
+ */
+static uint32_t binder_call(int fd, void *wbuf, size_t wsize,
+			    struct binder_transaction_data *txn)
+{
+	struct binder_write_read bwr;
+	uint32_t rbuf[BINDER_CMD_SIZE / sizeof(uint32_t)];
+	uint32_t cmd;
+	char *ptr, *end;
+
+	bwr.write_size = wsize;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)wbuf;
+
+	for (;;) {
+		bwr.read_size = sizeof(rbuf);
+		bwr.read_consumed = 0;
+		bwr.read_buffer = (unsigned long)rbuf;
+
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "BINDER_WRITE_READ failed: %s\n",
+				strerror(errno));
+			return 0;
+		}
+		bwr.write_size = 0;
+
+		ptr = (char *)rbuf;
+		end = ptr + bwr.read_consumed;
+		while (ptr < end) {
+			cmd = *(uint32_t *)ptr;
+			ptr += sizeof(uint32_t);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(txn, ptr, sizeof(*txn));
+				return cmd;
+			default:
+				fprintf(stderr, "Unexpected binder return "
+					"0x%x\n", cmd);
+				return 0;
+			}
+		}
+	}
+}
+
+struct binder_cmd {
+	uint32_t cmd;
+	struct binder_transaction_data txn;
+} __attribute__((packed));
+
+struct binder_free_cmd {
+	uint32_t cmd;
+	const void *buffer;
+} __attribute__((packed));
+
+static void binder_server(int ready_fd)
+{
+	struct {
+		struct binder_free_cmd free;
+		struct binder_cmd reply;
+	} __attribute__((packed)) out;
+	struct binder_transaction_data txn;
+	uint32_t cmd = BC_ENTER_LOOPER;
+	int32_t status = 0;
+	int fd, i;
+
+	fd = binder_open();
+	if (fd < 0)
+		exit(1);
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		fprintf(stderr, "Failed to become binder context manager: %s"
+			" (is servicemanager running?)\n", strerror(errno));
+		exit(1);
+	}
+	if (write(ready_fd, &status, sizeof(status)) != sizeof(status))
+		exit(1);
+	close(ready_fd);
+
+	memset(&out, 0, sizeof(out));
+	out.free.cmd = BC_FREE_BUFFER;
+	out.reply.cmd = BC_REPLY;
+	out.reply.txn.data_size = sizeof(status);
+	out.reply.txn.data.ptr.buffer = &status;
+
+	if (binder_call(fd, &cmd, sizeof(cmd), &txn) != BR_TRANSACTION)
+		exit(1);
+	for (i = 1; i <= loops; i++) {
+		out.free.buffer = txn.data.ptr.buffer;
+		/* the final reply only needs to go out, nothing comes back */
+		if (i == loops) {
+			struct binder_write_read bwr;
+
+			memset(&bwr, 0, sizeof(bwr));
+			bwr.write_size = sizeof(out);
+			bwr.write_buffer = (unsigned long)&out;
+			if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+				exit(1);
+			break;
+		}
+		if (binder_call(fd, &out, sizeof(out), &txn) != BR_TRANSACTION)
+			exit(1);
+	}
+	exit(0);
+}
+
+static int binder_client(int fd, void *payload)
+{
+	struct {
+		struct binder_free_cmd free;
+		struct binder_cmd call;
+	} __attribute__((packed)) out;
+	struct binder_transaction_data txn;
+	int i;
+
+	memset(&out, 0, sizeof(out));
+	out.call.cmd = BC_TRANSACTION;
+	out.call.txn.target.handle = 0;
+	out.call.txn.data_size = size;
+	out.call.txn.data.ptr.buffer = payload;
+
+	/* the first call has no reply buffer to free yet */
+	if (binder_call(fd, &out.call, sizeof(out.call), &txn) != BR_REPLY)
+		return -1;
+
+	out.free.cmd = BC_FREE_BUFFER;
+	for (i = 1; i < loops; i++) {
+		out.free.buffer = txn.data.ptr.buffer;
+		if (binder_call(fd, &out, sizeof(out), &txn) != BR_REPLY)
+			return -1;
+	}
+	return 0;
+}
+
+int bench_sched_binder(int argc, const char **argv,
+		       const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	unsigned long long result_usec = 0;
+	int ready[2], status, ret, fd, i;
+	int wait_stat;
+	pid_t pid, retpid, *hogs;
+	void *payload;
+
+	argc = parse_options(argc, argv, options,
+			     bench_sched_binder_usage, 0);
+
+	if (loops <= 0 || size < 0 || load < 0) {
+		usage_with_options(bench_sched_binder_usage, options);
+		exit(1);
+	}
+
+	assert(!pipe(ready));
+
+	pid = fork();
+	assert(pid >= 0);
+	if (!pid) {
+		close(ready[0]);
+		binder_server(ready[1]);
+	}
+	close(ready[1]);
+	/* no binder driver or no context manager: skip, don't abort all */
+	if (read(ready[0], &status, sizeof(status)) != sizeof(status)) {
+		close(ready[0]);
+		waitpid(pid, &wait_stat, 0);
+		return 1;
+	}
+	close(ready[0]);
+
+	hogs = calloc(load, sizeof(pid_t));
+	assert(!load || hogs);
+	for (i = 0; i < load; i++) {
+		hogs[i] = fork();
+		assert(hogs[i] >= 0);
+		if (!hogs[i])
+			for (;;)
+				;
+	}
+
+	payload = calloc(1, size ? size : 1);
+	assert(payload);
+	fd = binder_open();
+
+	gettimeofday(&start, NULL);
+	ret = fd < 0 ? -1 : binder_client(fd, payload);
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+	if (fd >= 0)
+		close(fd);
+
+	for (i = 0; i < load; i++) {
+		kill(hogs[i], SIGKILL);
+		waitpid(hogs[i], &wait_stat, 0);
+	}
+	free(hogs);
+	free(payload);
+
+	/* the server waits for transactions that will never come */
+	if (ret)
+		kill(pid, SIGKILL);
+	retpid = waitpid(pid, &wait_stat, 0);
+	assert(retpid == pid);
+	if (ret)
+		return 1;
+	assert(WIFEXITED(wait_stat));
+	ret = WEXITSTATUS(wait_stat);
+	if (ret)
+		return ret;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# Executed %d binder transactions of %d bytes"
+		       " with %d hog tasks\n\n", loops, size, load);
+
+		result_usec = diff.tv_sec * 1000000;
+		result_usec += diff.tv_usec;
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec/1000));
+
+		printf(" %14lf usecs/op\n",
+		       (double)result_usec / (double)loops);
+		printf(" %14d ops/sec\n",
+		       (int)((double)loops /
+			     ((double)result_usec / (double)1000000)));
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec / 1000));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
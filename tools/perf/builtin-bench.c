@@ -42,6 +42,9 @@ static struct bench_suite sched_suites[] = {
 	{ "pipe",
 	  "Flood of communication over pipe() between two processes",
 	  bench_sched_pipe      },
+	{ "binder",
+	  "Round trip of Android binder transactions between two processes",
+	  bench_sched_binder    },
 	suite_all,
 	{ NULL,
 	  NULL,
@@ -52,12 +55,38 @@ static struct bench_suite mem_suites[] = {
 	{ "memcpy",
 	  "Simple memory copy in various ways",
 	  bench_mem_memcpy },
+	{ "cleancache",
+	  "Parallel cleancache put/get through the page cache",
+	  bench_mem_cleancache },
 	suite_all,
 	{ NULL,
 	  NULL,
 	  NULL             }
 };
 
+static struct bench_suite fs_suites[] = {
+	{ "metadata",
+	  "Parallel readdir, lookup and read next to a streaming writer",
+	  bench_fs_metadata },
+	{ "mount",
+	  "Mount time from checkpoint and by scanning the flash",
+	  bench_fs_mount },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL              }
+};
+
+static struct bench_suite logger_suites[] = {
+	{ "write",
+	  "Flood of writes to an Android log device from several tasks",
+	  bench_logger_write },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL               }
+};
+
 struct bench_subsys {
 	const char *name;
 	const char *summary;
@@ -71,6 +100,12 @@ static struct bench_subsys subsystems[] = {
 	{ "mem",
 	  "memory access performance",
 	  mem_suites },
+	{ "fs",
+	  "filesystem concurrency",
+	  fs_suites },
+	{ "logger",
+	  "Android logger",
+	  logger_suites },
 	{ "all",		/* sentinel: easy for help */
 	  "test all subsystem (pseudo subsystem)",
 	  NULL },